@@ -0,0 +1,73 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+@class LOCMSFileDB;
+
+/// The name of the compact CVS format, as sent to the server in the cvsformat request parameter.
+extern NSString * const LOCMSClientVisibleSetCompactFormat;
+
+/**
+ * An encoder for the compact client visible set format.
+ * The client visible set (CVS) lists the ID and version of every file currently visible to the
+ * client. In the compact format, entries are written in file ID order; each file ID is front
+ * coded against the previous ID, and each distinct version string is written once and then
+ * referenced by index. The encoded entries are zlib compressed as they are appended, so only
+ * the compressed output is held in memory. The uncompressed format is:
+ *
+ *      cvs     = "LCV1" entry*
+ *      entry   = varint(shared) varint(length) suffix version
+ *      version = varint(0) varint(length) bytes    ; a new version, appended to the version table
+ *              | varint(n)                         ; the nth version in the version table
+ *
+ * Where varints are unsigned LEB128 values, shared is the number of leading bytes the ID has in
+ * common with the previous ID, suffix is the remaining bytes of the ID, and all strings are UTF-8.
+ */
+@interface LOCMSClientVisibleSetEncoder : NSObject
+
+/// The number of entries appended to the set.
+@property (nonatomic, assign, readonly) NSUInteger entryCount;
+
+/// Append a file to the set. Files should be appended in file ID order.
+- (void)appendFileID:(NSString *)fileID version:(NSString *)version;
+/// Complete the set and return its compressed encoding.
+- (NSData *)finish;
+
+@end
+
+/// Functions for building and reading client visible sets in the compact format.
+@interface LOCMSClientVisibleSet : NSObject
+
+/**
+ * Build the compact client visible set for a fileset category.
+ * If the category name is nil then the set returned is for the entire file database.
+ * File records are read one at a time from a DB cursor and encoded as they are read.
+ * Returns nil if the file DB can't be read.
+ */
++ (NSData *)compactCVSForCategory:(NSString *)category inFileDB:(LOCMSFileDB *)fileDB;
+/**
+ * Enumerate the entries of a compact client visible set.
+ * Returns NO if the set's encoding is invalid.
+ */
++ (BOOL)enumerateCompactCVS:(NSData *)cvs usingBlock:(void(^)(NSString *fileID, NSString *version, BOOL *stop))block;
+/**
+ * Convert a compact client visible set to a JSON object mapping file IDs to versions; the format
+ * accepted by servers without support for compact sets.
+ * Returns nil if the set's encoding is invalid.
+ */
++ (NSString *)JSONForCompactCVS:(NSData *)cvs;
+
+@end
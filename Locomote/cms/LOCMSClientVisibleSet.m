@@ -0,0 +1,280 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LOCMSClientVisibleSet.h"
+#import "LOCMSFileDB.h"
+#import "SCLogger.h"
+#import <zlib.h>
+
+// The magic bytes at the start of an uncompressed compact set.
+#define CompactCVSMagic         ("LCV1")
+#define CompactCVSMagicLength   (4)
+// The amount of encoded entry data buffered before being passed to the compressor.
+#define EncodeBufferSize        (16 * 1024)
+// The size of the chunks compressed output is written in.
+#define CompressChunkSize       (16 * 1024)
+
+NSString * const LOCMSClientVisibleSetCompactFormat = @"lcv1";
+
+static SCLogger *Logger;
+
+/// Append an unsigned LEB128 varint to a buffer.
+static void AppendVarint(NSMutableData *data, NSUInteger value) {
+    uint8_t bytes[10];
+    NSUInteger length = 0;
+    do {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        bytes[length++] = value ? (byte | 0x80) : byte;
+    } while (value);
+    [data appendBytes:bytes length:length];
+}
+
+/// Read an unsigned LEB128 varint from a buffer. Returns NO if the buffer ends before the varint.
+static BOOL ReadVarint(const uint8_t *bytes, NSUInteger length, NSUInteger *offset, NSUInteger *value) {
+    NSUInteger result = 0;
+    NSUInteger shift = 0;
+    while (*offset < length && shift < 64) {
+        uint8_t byte = bytes[(*offset)++];
+        result |= (NSUInteger)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return YES;
+        }
+        shift += 7;
+    }
+    return NO;
+}
+
+@interface LOCMSClientVisibleSetEncoder () {
+    z_stream _zs;
+    /// Encoded entry data waiting to be compressed.
+    NSMutableData *_pending;
+    /// Compressed output.
+    NSMutableData *_output;
+    /// The UTF-8 bytes of the previous file ID.
+    NSData *_previousID;
+    /// Indexes of the versions written so far, keyed by version.
+    NSMutableDictionary<NSString *, NSNumber *> *_versions;
+    BOOL _finished;
+}
+
+/// Pass pending entry data to the compressor, using the specified zlib flush mode.
+- (void)compressPending:(int)flush;
+
+@end
+
+@implementation LOCMSClientVisibleSetEncoder
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        memset(&_zs, 0, sizeof(_zs));
+        deflateInit(&_zs, Z_BEST_COMPRESSION);
+        _pending = [[NSMutableData alloc] initWithCapacity:EncodeBufferSize];
+        _output = [NSMutableData new];
+        _previousID = [NSData data];
+        _versions = [NSMutableDictionary new];
+        [_pending appendBytes:CompactCVSMagic length:CompactCVSMagicLength];
+    }
+    return self;
+}
+
+- (void)appendFileID:(NSString *)fileID version:(NSString *)version {
+    NSData *idBytes = [fileID dataUsingEncoding:NSUTF8StringEncoding];
+    // Count the bytes shared with the previous ID.
+    const uint8_t *current = [idBytes bytes], *previous = [_previousID bytes];
+    NSUInteger limit = MIN([idBytes length], [_previousID length]);
+    NSUInteger shared = 0;
+    while (shared < limit && current[shared] == previous[shared]) {
+        shared++;
+    }
+    AppendVarint(_pending, shared);
+    AppendVarint(_pending, [idBytes length] - shared);
+    [_pending appendBytes:current + shared length:[idBytes length] - shared];
+    _previousID = idBytes;
+    // Write the version, or a reference to it if already written.
+    version = version ?: @"";
+    NSNumber *index = _versions[version];
+    if (index) {
+        AppendVarint(_pending, [index unsignedIntegerValue]);
+    }
+    else {
+        NSData *versionBytes = [version dataUsingEncoding:NSUTF8StringEncoding];
+        AppendVarint(_pending, 0);
+        AppendVarint(_pending, [versionBytes length]);
+        [_pending appendData:versionBytes];
+        _versions[version] = @([_versions count] + 1);
+    }
+    _entryCount++;
+    if ([_pending length] >= EncodeBufferSize) {
+        [self compressPending:Z_NO_FLUSH];
+    }
+}
+
+- (NSData *)finish {
+    if (!_finished) {
+        [self compressPending:Z_FINISH];
+        deflateEnd(&_zs);
+        _finished = YES;
+    }
+    return _output;
+}
+
+- (void)dealloc {
+    if (!_finished) {
+        deflateEnd(&_zs);
+    }
+}
+
+#pragma mark - Private
+
+- (void)compressPending:(int)flush {
+    uint8_t chunk[CompressChunkSize];
+    _zs.next_in = (Bytef *)[_pending bytes];
+    _zs.avail_in = (uInt)[_pending length];
+    int rc;
+    do {
+        _zs.next_out = chunk;
+        _zs.avail_out = CompressChunkSize;
+        rc = deflate(&_zs, flush);
+        [_output appendBytes:chunk length:CompressChunkSize - _zs.avail_out];
+    } while (_zs.avail_out == 0 || (flush == Z_FINISH && rc == Z_OK));
+    [_pending setLength:0];
+}
+
+@end
+
+@implementation LOCMSClientVisibleSet
+
++ (void)initialize {
+    Logger = [[SCLogger alloc] initWithTag:@"LOCMSClientVisibleSet"];
+}
+
++ (NSData *)compactCVSForCategory:(NSString *)category inFileDB:(LOCMSFileDB *)fileDB {
+    NSString *filesTable = fileDB.filesTable;
+    NSString *sql;
+    NSArray *params;
+    if (category) {
+        sql = [NSString stringWithFormat:@"SELECT id, version FROM %@ WHERE category=? ORDER BY id", filesTable];
+        params = @[ category ];
+    }
+    else {
+        sql = [NSString stringWithFormat:@"SELECT id, version FROM %@ ORDER BY id", filesTable];
+        params = @[];
+    }
+    LOCMSClientVisibleSetEncoder *encoder = [LOCMSClientVisibleSetEncoder new];
+    BOOL ok = [fileDB enumerateQuery:sql withParams:params usingBlock:^(NSDictionary *record, BOOL *stop) {
+        [encoder appendFileID:[record[@"id"] description] version:[record[@"version"] description]];
+    }];
+    NSData *cvs = [encoder finish];
+    return ok ? cvs : nil;
+}
+
++ (BOOL)enumerateCompactCVS:(NSData *)cvs usingBlock:(void(^)(NSString *fileID, NSString *version, BOOL *stop))block {
+    // Decompress the set. The uncompressed set is a small fraction of the size of the
+    // equivalent JSON, as IDs are front coded and versions are only written once.
+    NSMutableData *data = [NSMutableData new];
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) {
+        return NO;
+    }
+    uint8_t chunk[CompressChunkSize];
+    zs.next_in = (Bytef *)[cvs bytes];
+    zs.avail_in = (uInt)[cvs length];
+    int rc;
+    do {
+        zs.next_out = chunk;
+        zs.avail_out = CompressChunkSize;
+        rc = inflate(&zs, Z_NO_FLUSH);
+        [data appendBytes:chunk length:CompressChunkSize - zs.avail_out];
+    } while (rc == Z_OK);
+    inflateEnd(&zs);
+    if (rc != Z_STREAM_END) {
+        [Logger error:@"Invalid compact CVS: %s", zs.msg ?: "truncated data"];
+        return NO;
+    }
+
+    const uint8_t *bytes = [data bytes];
+    NSUInteger length = [data length];
+    if (length < CompactCVSMagicLength || memcmp(bytes, CompactCVSMagic, CompactCVSMagicLength) != 0) {
+        [Logger error:@"Invalid compact CVS: bad header"];
+        return NO;
+    }
+    NSUInteger offset = CompactCVSMagicLength;
+    NSMutableData *fileID = [NSMutableData new];
+    NSMutableArray<NSString *> *versions = [NSMutableArray new];
+    BOOL stop = NO;
+    while (offset < length && !stop) {
+        NSUInteger shared, suffixLength, versionRef;
+        if (!(ReadVarint(bytes, length, &offset, &shared)
+              && ReadVarint(bytes, length, &offset, &suffixLength)
+              && shared <= [fileID length]
+              && suffixLength <= length - offset)) {
+            [Logger error:@"Invalid compact CVS: bad file ID at offset %lu", (unsigned long)offset];
+            return NO;
+        }
+        [fileID setLength:shared];
+        [fileID appendBytes:bytes + offset length:suffixLength];
+        offset += suffixLength;
+        if (!ReadVarint(bytes, length, &offset, &versionRef)) {
+            [Logger error:@"Invalid compact CVS: bad version at offset %lu", (unsigned long)offset];
+            return NO;
+        }
+        NSString *version;
+        if (versionRef == 0) {
+            NSUInteger versionLength;
+            if (!(ReadVarint(bytes, length, &offset, &versionLength) && versionLength <= length - offset)) {
+                [Logger error:@"Invalid compact CVS: bad version at offset %lu", (unsigned long)offset];
+                return NO;
+            }
+            version = [[NSString alloc] initWithBytes:bytes + offset length:versionLength encoding:NSUTF8StringEncoding] ?: @"";
+            offset += versionLength;
+            [versions addObject:version];
+        }
+        else if (versionRef <= [versions count]) {
+            version = versions[versionRef - 1];
+        }
+        else {
+            [Logger error:@"Invalid compact CVS: bad version reference at offset %lu", (unsigned long)offset];
+            return NO;
+        }
+        @autoreleasepool {
+            NSString *fileIDString = [[NSString alloc] initWithData:fileID encoding:NSUTF8StringEncoding] ?: @"";
+            block(fileIDString, version, &stop);
+        }
+    }
+    return YES;
+}
+
++ (NSString *)JSONForCompactCVS:(NSData *)cvs {
+    NSMutableString *json = [NSMutableString new];
+    [json appendString:@"{"];
+    __block NSString *separator = @"";
+    BOOL ok = [self enumerateCompactCVS:cvs usingBlock:^(NSString *fileID, NSString *version, BOOL *stop) {
+        [json appendString:separator];
+        [json appendString:@"\""];
+        [json appendString:fileID];
+        [json appendString:@"\":\""];
+        [json appendString:version];
+        [json appendString:@"\""];
+        separator = @",";
+    }];
+    [json appendString:@"}"];
+    return ok ? json : nil;
+}
+
+@end
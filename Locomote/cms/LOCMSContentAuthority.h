@@ -57,8 +57,19 @@
 @property (nonatomic, strong) LOCMSSettings *settings;
 /// Path settings for locally cached content.
 @property (nonatomic, strong) LOLocalCachePaths *localCachePaths;
-/// Interval between content refreshes; in minutes.
+/**
+ * Minimum interval between content refreshes; in minutes. Defaults to 1.
+ * Repositories are refreshed by their refresh scheduler, which backs off towards the maximum
+ * interval whilst content is unchanged; set to 0 to disable scheduled refreshes.
+ */
 @property (nonatomic, assign) float refreshInterval;
+/// Maximum interval between content refreshes; in minutes. Defaults to 30.
+@property (nonatomic, assign) float maxRefreshInterval;
+/**
+ * Whether repositories long-poll the server's notifications.api endpoint, and refresh as soon as
+ * new content is committed. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL refreshNotifications;
 /// An optional URL handler.
 @property (nonatomic, strong) id<SCURIHandler> uriHandler;
 
@@ -24,6 +24,86 @@
 #import "SCResource.h"
 #import "NSDictionary+SC.h"
 
+// The size of the chunks that file data is read and sent in.
+#define FileChunkSize   (64 * 1024)
+
+/// The result of parsing a byte range request header.
+typedef NS_ENUM(NSInteger, LOByteRangeResult) {
+    /// The header can't be used; the full content should be returned.
+    LOByteRangeIgnored,
+    /// The header specifies a range within the content.
+    LOByteRangeSatisfiable,
+    /// The header specifies a range outside of the content.
+    LOByteRangeUnsatisfiable
+};
+
+/**
+ * Parse a Range header for content of the specified size.
+ * Only single byte ranges (bytes=first-last, bytes=first- or bytes=-suffix) are supported.
+ * If the range is satisfiable then the first and last byte positions are returned.
+ */
+static LOByteRangeResult ParseByteRange(NSString *header, unsigned long long size, unsigned long long *first, unsigned long long *last) {
+    NSString *spec = [header stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+    if (![[spec lowercaseString] hasPrefix:@"bytes="]) {
+        return LOByteRangeIgnored;
+    }
+    spec = [spec substringFromIndex:6];
+    if ([spec rangeOfString:@","].location != NSNotFound) {
+        return LOByteRangeIgnored;
+    }
+    NSArray *parts = [spec componentsSeparatedByString:@"-"];
+    if ([parts count] != 2) {
+        return LOByteRangeIgnored;
+    }
+    NSString *firstPart = [parts[0] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+    NSString *lastPart  = [parts[1] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+    unsigned long long firstPos, lastPos;
+    if ([firstPart length] == 0) {
+        // Suffix range, i.e. the last N bytes.
+        if (![[NSScanner scannerWithString:lastPart] scanUnsignedLongLong:&lastPos]) {
+            return LOByteRangeIgnored;
+        }
+        if (lastPos == 0 || size == 0) {
+            return LOByteRangeUnsatisfiable;
+        }
+        firstPos = size > lastPos ? size - lastPos : 0;
+        lastPos = size - 1;
+    }
+    else {
+        if (![[NSScanner scannerWithString:firstPart] scanUnsignedLongLong:&firstPos]) {
+            return LOByteRangeIgnored;
+        }
+        if ([lastPart length] == 0) {
+            lastPos = size - 1;
+        }
+        else if (![[NSScanner scannerWithString:lastPart] scanUnsignedLongLong:&lastPos] || lastPos < firstPos) {
+            return LOByteRangeIgnored;
+        }
+        if (firstPos >= size) {
+            return LOByteRangeUnsatisfiable;
+        }
+        lastPos = MIN(lastPos, size - 1);
+    }
+    *first = firstPos;
+    *last = lastPos;
+    return LOByteRangeSatisfiable;
+}
+
+/// Format a date as an HTTP date, e.g. for a Last-Modified header.
+static NSString *FormatHTTPDate(NSDate *date) {
+    static NSDateFormatter *formatter;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        formatter = [NSDateFormatter new];
+        formatter.locale = [NSLocale localeWithLocaleIdentifier:@"en_US_POSIX"];
+        formatter.timeZone = [NSTimeZone timeZoneWithAbbreviation:@"GMT"];
+        formatter.dateFormat = @"EEE, dd MMM yyyy HH:mm:ss 'GMT'";
+    });
+    @synchronized (formatter) {
+        return [formatter stringFromDate:date];
+    }
+}
+
 @interface LOCMSContentRequest : NSObject <LOContentRequest>
 
 - (id)initWithAuthority:(LOCMSContentAuthority *)authority path:(NSString *)path parameters:(NSDictionary *)parameters;
@@ -47,6 +127,8 @@
 
 @interface LOCMSContentAuthority ()
 
+/// Find the repository mounted under the longest base path matching the specified path.
+- (LOCMSRepository *)repositoryForPath:(NSString *)path;
 /// Write a content reponse for the specified path.
 - (void)writeResponse:(id<LOContentResponse>)response
               forPath:(NSString *)path
@@ -64,8 +146,9 @@
         _liveResponses = [NSMutableSet new];
         _dispatcher    = [[LORequestDispatcher alloc] initWithHost:self];
         _repositories  = @{};
-        // By default, refresh every minute.
+        // By default, refresh every minute, backing off to every 30 minutes whilst content is unchanged.
         _refreshInterval = 1.0f;
+        _maxRefreshInterval = 30.0f;
     }
     return self;
 }
@@ -80,7 +163,7 @@
     // Generate a list of repo keys ordered longest to shortest, before generating a request
     // handler mapping for each repository based on its base path. (Keys are ordered longest
     // first so that more specific repo paths take precedence over less specific paths).
-    NSArray *keys = [_repositories keysSortedByValueUsingComparator:^NSComparisonResult(NSString *key1, NSString *key2) {
+    NSArray *keys = [[_repositories allKeys] sortedArrayUsingComparator:^NSComparisonResult(NSString *key1, NSString *key2) {
         NSUInteger len1 = [key1 length], len2 = [key2 length];
         return (len1 < len2) ? NSOrderedDescending : ((len1 > len2) ? NSOrderedAscending : NSOrderedSame);
     }];
@@ -113,11 +196,15 @@
     }
     // Schedule content refreshes.
     if (_refreshInterval > 0) {
-        [NSTimer scheduledTimerWithTimeInterval:(_refreshInterval * 60.0f)
-                                         target:self
-                                       selector:@selector(syncContent)
-                                       userInfo:nil
-                                        repeats:YES];
+        for (LOCMSRepository *repository in [_repositories allValues]) {
+            LOCMSRefreshScheduler *scheduler = repository.refreshScheduler;
+            scheduler.minInterval = _refreshInterval * 60.0f;
+            scheduler.maxInterval = MAX(_maxRefreshInterval, _refreshInterval) * 60.0f;
+            if (_refreshNotifications) {
+                scheduler.notificationURL = repository.cms.notificationsURL;
+            }
+            [scheduler start];
+        }
     }
     
     return [self syncContent];
@@ -159,12 +246,18 @@
 }
 
 - (BOOL)hasContentForPath:(NSString *)path parameters:(NSDictionary *)parameters {
-    // (TODO: Find the LOCMSRepository handling the path and delegate to it)
+    LOCMSRepository *repository = [self repositoryForPath:path];
+    if (repository) {
+        return [repository hasContentForPath:[repository repositoryPathForPath:path] parameters:parameters];
+    }
     return NO;
 }
 
 - (NSString *)localCacheLocationOfPath:(NSString *)path parameters:(NSDictionary *)parameters {
-    // (TODO: Find the LOCMSRepository handling the path and delegate to it)
+    LOCMSRepository *repository = [self repositoryForPath:path];
+    if (repository) {
+        return [repository localCacheLocationOfPath:[repository repositoryPathForPath:path] parameters:parameters];
+    }
     return nil;
 }
 
@@ -186,6 +279,13 @@
     [_dispatcher dispatchRequest:request response:response];
 }
 
+- (LOCMSRepository *)repositoryForPath:(NSString *)path {
+    // Repository mappings are ordered longest base path first, so the dispatcher's match
+    // is the repository with the longest matching base path.
+    id handler = [_dispatcher mappingForPath:path parameters:nil].handler;
+    return [handler isKindOfClass:[LOCMSRepository class]] ? handler : nil;
+}
+
 - (QPromise *)syncContent {
     NSMutableArray *promises = [NSMutableArray new];
     for (id key in _repositories) {
@@ -233,7 +333,7 @@
         [client URLProtocol:_protocol didReceiveResponse:response cacheStoragePolicy:policy];
         [client URLProtocol:_protocol didLoadData:data];
         [client URLProtocolDidFinishLoading:_protocol];
-        [_liveResponses removeObject:self];
+        [_liveResponses removeObject:_protocol];
     }
 }
 
@@ -283,8 +383,89 @@
 }
 
 - (void)respondWithFileData:(NSString *)filepath mimeType:(NSString *)mimeType cachePolicy:(NSURLCacheStoragePolicy)cachePolicy {
-    NSData *data = [NSData dataWithContentsOfFile:filepath];
-    [self respondWithData:data mimeType:mimeType cachePolicy:cachePolicy];
+    if (![_liveResponses containsObject:_protocol]) {
+        return;
+    }
+    NSFileHandle *fileHandle = [NSFileHandle fileHandleForReadingAtPath:filepath];
+    if (!fileHandle) {
+        [self respondWithError:makePathNotFoundResponseError(filepath)];
+        return;
+    }
+    @try {
+        NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:filepath error:nil];
+        unsigned long long fileSize = [attributes fileSize];
+        NSDate *modified = [attributes fileModificationDate] ?: [NSDate dateWithTimeIntervalSince1970:0];
+        // The entity tag identifies the file version by its size and modification time.
+        NSString *etag = [NSString stringWithFormat:@"\"%llx-%llx\"", fileSize, (unsigned long long)[modified timeIntervalSince1970]];
+        NSString *lastModified = FormatHTTPDate(modified);
+        NSMutableDictionary *headers = [NSMutableDictionary new];
+        headers[@"Content-Type"]  = mimeType ?: @"application/octet-stream";
+        headers[@"Accept-Ranges"] = @"bytes";
+        headers[@"ETag"]          = etag;
+        headers[@"Last-Modified"] = lastModified;
+        // Check for a range request; the range is only applied if any If-Range validator matches
+        // the current file version, otherwise the full file is returned.
+        NSInteger statusCode = 200;
+        unsigned long long first = 0, last = fileSize - 1;
+        NSURLRequest *request = _protocol.request;
+        NSString *range = [request valueForHTTPHeaderField:@"Range"];
+        NSString *ifRange = [request valueForHTTPHeaderField:@"If-Range"];
+        if (range && (!ifRange || [ifRange isEqualToString:etag] || [ifRange isEqualToString:lastModified])) {
+            switch (ParseByteRange(range, fileSize, &first, &last)) {
+                case LOByteRangeSatisfiable:
+                    statusCode = 206;
+                    headers[@"Content-Range"] = [NSString stringWithFormat:@"bytes %llu-%llu/%llu", first, last, fileSize];
+                    break;
+                case LOByteRangeUnsatisfiable:
+                    statusCode = 416;
+                    headers[@"Content-Range"] = [NSString stringWithFormat:@"bytes */%llu", fileSize];
+                    break;
+                default:
+                    // Unsupported range (e.g. multiple ranges); return the full file.
+                    first = 0;
+                    last = fileSize - 1;
+                    break;
+            }
+        }
+        unsigned long long remaining = (statusCode == 416 || fileSize == 0) ? 0 : last - first + 1;
+        headers[@"Content-Length"] = [NSString stringWithFormat:@"%llu", remaining];
+        NSHTTPURLResponse *response = [[NSHTTPURLResponse alloc] initWithURL:request.URL
+                                                                  statusCode:statusCode
+                                                                 HTTPVersion:@"HTTP/1.1"
+                                                                headerFields:headers];
+        // A partial or unsatisfiable range response mustn't be cached as the whole resource.
+        if (statusCode != 200) {
+            cachePolicy = NSURLCacheStorageNotAllowed;
+        }
+        id<NSURLProtocolClient> client = _protocol.client;
+        [client URLProtocol:_protocol didReceiveResponse:response cacheStoragePolicy:cachePolicy];
+        // Stream the requested bytes to the client in fixed size chunks, so that memory use
+        // doesn't depend on the file or range size. Stop sending if the request is cancelled.
+        if (remaining > 0) {
+            [fileHandle seekToFileOffset:first];
+        }
+        while (remaining > 0 && [_liveResponses containsObject:_protocol]) {
+            @autoreleasepool {
+                NSData *chunk = [fileHandle readDataOfLength:(NSUInteger)MIN(remaining, (unsigned long long)FileChunkSize)];
+                if ([chunk length] == 0) {
+                    break;
+                }
+                remaining -= [chunk length];
+                [client URLProtocol:_protocol didLoadData:chunk];
+            }
+        }
+        [self done];
+    }
+    @catch (NSException *exception) {
+        // File read failed.
+        NSError *error = [NSError errorWithDomain:NSURLErrorDomain
+                                             code:NSURLErrorCannotOpenFile
+                                         userInfo:@{ NSLocalizedDescriptionKey: [exception reason] ?: filepath }];
+        [self respondWithError:error];
+    }
+    @finally {
+        [fileHandle closeFile];
+    }
 }
 
 @end
@@ -333,7 +514,9 @@
 }
 
 - (void)respondWithFileData:(NSString *)filepath mimeType:(NSString *)mimeType cachePolicy:(NSURLCacheStoragePolicy)cachePolicy {
-    NSData *data = [NSData dataWithContentsOfFile:filepath];
+    // The resource data is returned as a single object, so map the file into memory rather
+    // than copying it; pages are only read in as the data is accessed.
+    NSData *data = [NSData dataWithContentsOfFile:filepath options:NSDataReadingMappedIfSafe error:nil];
     [self respondWithData:data mimeType:mimeType cachePolicy:cachePolicy];
 }
 
@@ -0,0 +1,56 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+@class LOCMSFileDB;
+
+/**
+ * A size budget for a repository's content cache.
+ * Files in evictable filesets (i.e. filesets with a 'content' cache policy) are tracked by
+ * their last access time; when the total size of the cached files exceeds the budget, the least
+ * recently used files are deleted until the total is below the low-water mark. Evicted files
+ * are downloaded again if requested. Files in app-cached filesets are never evicted.
+ * Access times are buffered in memory and written to the file DB's fileaccess table in batches,
+ * so recording an access doesn't require a DB write. Buffered access times which haven't been
+ * written when the app exits are lost, in which case the file's previous access time is used.
+ * Files with no recorded access time are ordered by the time they were cached.
+ */
+@interface LOCMSContentCacheBudget : NSObject
+
+- (id)initWithFileDB:(LOCMSFileDB *)fileDB;
+
+/// The maximum size of the content cache, in bytes; 0 for no limit. Defaults to 256MB.
+@property (nonatomic, assign) unsigned long long maxSize;
+/// The fraction of the maximum size the cache is reduced to when the budget is exceeded. Defaults to 0.75.
+@property (nonatomic, assign) double lowWaterMark;
+/// The minimum time between budget checks, in seconds. Defaults to 5 minutes.
+@property (nonatomic, assign) NSTimeInterval checkInterval;
+/// The total number of files evicted.
+@property (atomic, assign, readonly) NSUInteger evictedFileCount;
+/// The total size of the files evicted, in bytes.
+@property (atomic, assign, readonly) unsigned long long evictedBytes;
+
+/// Record an access to a cached file.
+- (void)recordAccessToFile:(NSString *)path inFileset:(NSString *)category;
+/// Write any buffered access times to the file DB.
+- (void)flushAccessTimes;
+/**
+ * Check the cache size against the budget in the background, and evict files if over budget.
+ * Checks are made no more often than the check interval, unless force is YES.
+ */
+- (void)checkBudget:(BOOL)force;
+
+@end
@@ -0,0 +1,321 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LOCMSContentCacheBudget.h"
+#import "LOCMSFileDB.h"
+#import "LOCMSFileset.h"
+#import "SCLogger.h"
+
+#define DefaultMaxSize          (256ULL * 1024 * 1024)
+#define DefaultLowWaterMark     (0.75)
+#define DefaultCheckInterval    (5 * 60)
+// The delay before buffered access times are written to the file DB, in seconds.
+#define FlushDelay              (30.0)
+// The number of buffered access times which causes them to be written immediately.
+#define MaxBufferedAccesses     (500)
+// The number of rows written or deleted by each fileaccess table statement.
+#define AccessBatchSize         (200)
+
+static SCLogger *Logger;
+
+/// A file in the content cache.
+@interface LOCMSCachedFile : NSObject
+
+/// The fileset category.
+@property (nonatomic, strong) NSString *category;
+/// The file path, relative to the fileset's cache directory.
+@property (nonatomic, strong) NSString *path;
+/// The full path to the cached file.
+@property (nonatomic, strong) NSString *cachePath;
+/// The file size, in bytes.
+@property (nonatomic, assign) unsigned long long size;
+/// The time the file was last used, as seconds since the epoch.
+@property (nonatomic, assign) NSTimeInterval lastUsed;
+
+@end
+
+@implementation LOCMSCachedFile
+@end
+
+@interface LOCMSContentCacheBudget () {
+    __weak LOCMSFileDB *_fileDB;
+    /// A serial, low priority queue for writing access times and evicting files.
+    dispatch_queue_t _queue;
+    /// Buffered access times, keyed by fileset category and then by file path.
+    NSMutableDictionary<NSString *, NSMutableDictionary<NSString *, NSNumber *> *> *_accesses;
+    /// The number of buffered access times.
+    NSUInteger _bufferedCount;
+    /// A flag indicating that a write of buffered access times is scheduled.
+    BOOL _flushScheduled;
+    /// A flag indicating that a budget check is scheduled or in progress.
+    BOOL _checkScheduled;
+    /// The time of the last budget check.
+    NSDate *_lastCheck;
+}
+
+@property (atomic, assign, readwrite) NSUInteger evictedFileCount;
+@property (atomic, assign, readwrite) unsigned long long evictedBytes;
+
+/// Write a set of access times to the fileaccess table.
+- (void)writeAccessTimes:(NSDictionary<NSString *, NSDictionary<NSString *, NSNumber *> *> *)accesses;
+/// Delete a list of cached files' rows from the fileaccess table.
+- (void)deleteAccessTimesOfFiles:(NSArray<LOCMSCachedFile *> *)files;
+/// Evict least recently used files until the cache is within budget.
+- (void)enforceBudget;
+
+@end
+
+@implementation LOCMSContentCacheBudget
+
++ (void)initialize {
+    Logger = [[SCLogger alloc] initWithTag:@"LOCMSContentCacheBudget"];
+}
+
+- (id)initWithFileDB:(LOCMSFileDB *)fileDB {
+    self = [super init];
+    if (self) {
+        _fileDB = fileDB;
+        _maxSize = DefaultMaxSize;
+        _lowWaterMark = DefaultLowWaterMark;
+        _checkInterval = DefaultCheckInterval;
+        _accesses = [NSMutableDictionary new];
+        _queue = dispatch_queue_create("LOCMSContentCacheBudget", DISPATCH_QUEUE_SERIAL);
+        dispatch_set_target_queue(_queue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+    }
+    return self;
+}
+
+- (void)recordAccessToFile:(NSString *)path inFileset:(NSString *)category {
+    if (!(path && category)) {
+        return;
+    }
+    NSNumber *now = @([[NSDate date] timeIntervalSince1970]);
+    @synchronized (self) {
+        NSMutableDictionary *accesses = _accesses[category];
+        if (!accesses) {
+            accesses = [NSMutableDictionary new];
+            _accesses[category] = accesses;
+        }
+        NSString *key = [LOCMSFileDB normalizedPath:path];
+        if (!accesses[key]) {
+            _bufferedCount++;
+        }
+        accesses[key] = now;
+        if (_bufferedCount >= MaxBufferedAccesses) {
+            dispatch_async(_queue, ^{
+                [self flushAccessTimes];
+            });
+        }
+        else if (!_flushScheduled) {
+            _flushScheduled = YES;
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(FlushDelay * NSEC_PER_SEC)), _queue, ^{
+                [self flushAccessTimes];
+            });
+        }
+    }
+}
+
+- (void)flushAccessTimes {
+    NSDictionary *accesses;
+    @synchronized (self) {
+        _flushScheduled = NO;
+        if (_bufferedCount == 0) {
+            return;
+        }
+        accesses = _accesses;
+        _accesses = [NSMutableDictionary new];
+        _bufferedCount = 0;
+    }
+    [self writeAccessTimes:accesses];
+}
+
+- (void)checkBudget:(BOOL)force {
+    @synchronized (self) {
+        if (_maxSize == 0 || _checkScheduled) {
+            return;
+        }
+        if (!force && _lastCheck && -[_lastCheck timeIntervalSinceNow] < _checkInterval) {
+            return;
+        }
+        _checkScheduled = YES;
+    }
+    dispatch_async(_queue, ^{
+        [self enforceBudget];
+        @synchronized (self) {
+            self->_checkScheduled = NO;
+            self->_lastCheck = [NSDate date];
+        }
+    });
+}
+
+#pragma mark - Private
+
+- (void)writeAccessTimes:(NSDictionary<NSString *, NSDictionary<NSString *, NSNumber *> *> *)accesses {
+    LOCMSFileDB *fileDB = _fileDB;
+    NSMutableArray *params = [NSMutableArray new];
+    NSMutableArray *rows = [NSMutableArray new];
+    __block BOOL ok = YES;
+    void (^writeBatch)(void) = ^() {
+        NSString *sql = [NSString stringWithFormat:@"INSERT OR REPLACE INTO fileaccess (category, path, atime) VALUES %@",
+                         [rows componentsJoinedByString:@","]];
+        ok &= [fileDB performUpdate:sql withParams:params];
+        [params removeAllObjects];
+        [rows removeAllObjects];
+    };
+    // Write all batches in a single transaction; the file DB serializes it with the writes of
+    // content operations running on other threads.
+    BOOL committed = [fileDB performTransaction:^BOOL {
+        for (NSString *category in accesses) {
+            NSDictionary *times = accesses[category];
+            for (NSString *path in times) {
+                [params addObjectsFromArray:@[ category, path, times[path] ]];
+                [rows addObject:@"(?,?,?)"];
+                if ([rows count] == AccessBatchSize) {
+                    writeBatch();
+                }
+            }
+        }
+        if ([rows count] > 0) {
+            writeBatch();
+        }
+        return ok;
+    }];
+    if (!committed) {
+        [Logger warn:@"Unable to write file access times"];
+    }
+}
+
+- (void)deleteAccessTimesOfFiles:(NSArray<LOCMSCachedFile *> *)files {
+    LOCMSFileDB *fileDB = _fileDB;
+    NSUInteger count = [files count];
+    if (count == 0) {
+        return;
+    }
+    BOOL committed = [fileDB performTransaction:^BOOL {
+        BOOL ok = YES;
+        for (NSUInteger i = 0; i < count && ok; i += AccessBatchSize) {
+            NSMutableArray *params = [NSMutableArray new];
+            NSMutableArray *terms = [NSMutableArray new];
+            for (NSUInteger j = i; j < MIN(i + AccessBatchSize, count); j++) {
+                [params addObjectsFromArray:@[ files[j].category, files[j].path ]];
+                [terms addObject:@"(category=? AND path=?)"];
+            }
+            NSString *sql = [NSString stringWithFormat:@"DELETE FROM fileaccess WHERE %@", [terms componentsJoinedByString:@" OR "]];
+            ok = [fileDB performUpdate:sql withParams:params];
+        }
+        return ok;
+    }];
+    if (!committed) {
+        [Logger warn:@"Unable to delete file access times"];
+    }
+}
+
+- (void)enforceBudget {
+    LOCMSFileDB *fileDB = _fileDB;
+    if (!fileDB || _maxSize == 0) {
+        return;
+    }
+    [self flushAccessTimes];
+
+    // List the files in all evictable filesets. A file's last use defaults to the time it was
+    // written to the cache.
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSMutableDictionary<NSString *, NSMutableDictionary<NSString *, LOCMSCachedFile *> *> *filesByCategory = [NSMutableDictionary new];
+    NSMutableArray<LOCMSCachedFile *> *files = [NSMutableArray new];
+    unsigned long long totalSize = 0;
+    for (NSString *category in fileDB.filesets) {
+        LOCMSFileset *fileset = fileDB.filesets[category];
+        if (!fileset.evictable) {
+            continue;
+        }
+        NSString *cachePath = [fileDB cacheLocationForFileset:category];
+        NSDirectoryEnumerator *enumerator = [fileManager enumeratorAtPath:cachePath];
+        if (!enumerator) {
+            continue;
+        }
+        NSMutableDictionary *categoryFiles = [NSMutableDictionary new];
+        for (NSString *subpath in enumerator) {
+            @autoreleasepool {
+                NSDictionary *attributes = enumerator.fileAttributes;
+                if (![NSFileTypeRegular isEqualToString:attributes.fileType]) {
+                    continue;
+                }
+                LOCMSCachedFile *file = [LOCMSCachedFile new];
+                file.category = category;
+                file.path = [LOCMSFileDB normalizedPath:subpath];
+                file.cachePath = [cachePath stringByAppendingPathComponent:subpath];
+                file.size = attributes.fileSize;
+                file.lastUsed = [attributes.fileModificationDate timeIntervalSince1970];
+                categoryFiles[file.path] = file;
+                [files addObject:file];
+                totalSize += file.size;
+            }
+        }
+        filesByCategory[category] = categoryFiles;
+    }
+    if (totalSize <= _maxSize) {
+        return;
+    }
+
+    // Apply recorded access times, and find the records of files which are no longer cached.
+    NSMutableArray<LOCMSCachedFile *> *stale = [NSMutableArray new];
+    BOOL ok = [fileDB enumerateQuery:@"SELECT category, path, atime FROM fileaccess" withParams:@[] usingBlock:^(NSDictionary *record, BOOL *stop) {
+        NSString *category = record[@"category"], *path = record[@"path"];
+        if (!(category && path)) {
+            return;
+        }
+        LOCMSCachedFile *file = filesByCategory[category][path];
+        if (file) {
+            file.lastUsed = MAX(file.lastUsed, [record[@"atime"] doubleValue]);
+        }
+        else {
+            LOCMSCachedFile *missing = [LOCMSCachedFile new];
+            missing.category = category;
+            missing.path = path;
+            [stale addObject:missing];
+        }
+    }];
+    if (!ok) {
+        // Evict by cache time only.
+        [Logger warn:@"Unable to read file access times"];
+    }
+
+    // Evict least recently used files until the cache is below the low-water mark.
+    [files sortUsingComparator:^NSComparisonResult(LOCMSCachedFile *a, LOCMSCachedFile *b) {
+        return a.lastUsed < b.lastUsed ? NSOrderedAscending : (a.lastUsed > b.lastUsed ? NSOrderedDescending : NSOrderedSame);
+    }];
+    unsigned long long target = (unsigned long long)(_maxSize * _lowWaterMark);
+    unsigned long long evictedBytes = 0;
+    NSMutableArray<LOCMSCachedFile *> *evicted = [NSMutableArray new];
+    for (LOCMSCachedFile *file in files) {
+        if (totalSize <= target) {
+            break;
+        }
+        if (unlink([file.cachePath fileSystemRepresentation]) == 0) {
+            totalSize -= file.size;
+            evictedBytes += file.size;
+            [evicted addObject:file];
+        }
+    }
+    [stale addObjectsFromArray:evicted];
+    [self deleteAccessTimesOfFiles:stale];
+    self.evictedFileCount += [evicted count];
+    self.evictedBytes += evictedBytes;
+    if ([evicted count] > 0) {
+        [Logger info:@"Evicted %lu files, %llu bytes", (unsigned long)[evicted count], evictedBytes];
+    }
+}
+
+@end
@@ -0,0 +1,59 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * A block called when a download completes.
+ * The content path is the location of the downloaded file, and is nil if the download failed.
+ */
+typedef void (^LOCMSDownloadCompletion)(NSString *contentPath, NSError *error);
+
+/**
+ * A block which performs a download.
+ * The block must call the done block exactly once, with the download result.
+ */
+typedef void (^LOCMSDownloadBlock)(LOCMSDownloadCompletion done);
+
+/**
+ * A registry of in-flight file downloads.
+ * Coalesces concurrent requests for the same file into a single download: the first request
+ * for a key starts the download, and any requests made for the same key whilst the download
+ * is in progress wait on it. The download result - success, failure or cancellation - is then
+ * passed to every waiting request. Once a download completes its key is removed from the
+ * registry, so a later request for the same key will start a new download.
+ * All methods are thread safe.
+ */
+@interface LOCMSDownloadRegistry : NSObject
+
+/// The number of downloads currently in progress.
+@property (nonatomic, assign, readonly) NSUInteger activeCount;
+/// The number of requests which have waited on a download started by an earlier request.
+@property (nonatomic, assign, readonly) NSUInteger coalescedCount;
+
+/**
+ * Request a download.
+ * If no download is in progress for the key then the download block is called to start one;
+ * otherwise the request waits on the in-progress download. The completion block is called
+ * once the download completes. If the key is nil then the download is made without being
+ * coalesced with any other request.
+ */
+- (void)downloadWithKey:(NSString *)key
+             usingBlock:(LOCMSDownloadBlock)download
+             completion:(LOCMSDownloadCompletion)completion;
+/// Test whether a download is in progress for a key.
+- (BOOL)isDownloadingKey:(NSString *)key;
+
+@end
@@ -0,0 +1,104 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LOCMSDownloadRegistry.h"
+#import "SCLogger.h"
+
+static SCLogger *Logger;
+
+@interface LOCMSDownloadRegistry () {
+    /// Lists of completion blocks waiting on in-flight downloads, keyed by download key.
+    NSMutableDictionary<NSString *, NSMutableArray<LOCMSDownloadCompletion> *> *_waiters;
+}
+
+/// Complete a download, and pass its result to all waiting requests.
+- (void)completeDownloadWithKey:(NSString *)key contentPath:(NSString *)contentPath error:(NSError *)error;
+
+@end
+
+@implementation LOCMSDownloadRegistry
+
++ (void)initialize {
+    Logger = [[SCLogger alloc] initWithTag:@"LOCMSDownloadRegistry"];
+}
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        _waiters = [NSMutableDictionary new];
+    }
+    return self;
+}
+
+- (NSUInteger)activeCount {
+    @synchronized (self) {
+        return [_waiters count];
+    }
+}
+
+- (void)downloadWithKey:(NSString *)key
+             usingBlock:(LOCMSDownloadBlock)download
+             completion:(LOCMSDownloadCompletion)completion {
+    if (!key) {
+        // Downloads without a key can't be coalesced, so make the download directly.
+        [Logger warn:@"Download requested without a key"];
+        download(completion);
+        return;
+    }
+    @synchronized (self) {
+        NSMutableArray *waiters = _waiters[key];
+        if (waiters) {
+            // Download already in progress, wait for its result.
+            [waiters addObject:[completion copy]];
+            _coalescedCount++;
+            return;
+        }
+        _waiters[key] = [NSMutableArray arrayWithObject:[completion copy]];
+    }
+    // Start the download outside of the lock, as the download block may complete synchronously.
+    __block BOOL done = NO;
+    download(^(NSString *contentPath, NSError *error) {
+        @synchronized (self) {
+            if (done) {
+                [Logger warn:@"Download %@ completed more than once", key];
+                return;
+            }
+            done = YES;
+        }
+        [self completeDownloadWithKey:key contentPath:contentPath error:error];
+    });
+}
+
+- (BOOL)isDownloadingKey:(NSString *)key {
+    @synchronized (self) {
+        return _waiters[key] != nil;
+    }
+}
+
+#pragma mark - Private
+
+- (void)completeDownloadWithKey:(NSString *)key contentPath:(NSString *)contentPath error:(NSError *)error {
+    NSArray *waiters;
+    @synchronized (self) {
+        waiters = _waiters[key];
+        [_waiters removeObjectForKey:key];
+    }
+    // Notify waiters outside of the lock, so that a waiter can request a new download of the same key.
+    for (LOCMSDownloadCompletion completion in waiters) {
+        completion(contentPath, error);
+    }
+}
+
+@end
@@ -20,6 +20,7 @@
 #import "SCIOCTypeInspectable.h"
 
 @class LOCMSRepository;
+@class LOCMSContentCacheBudget;
 
 @interface LOCMSFileDB : SCDB <SCIOCTypeInspectable>
 
@@ -29,16 +30,105 @@
 @property (nonatomic, strong) NSDictionary *filesets;
 /// The name of the files table. Defaults to 'files'.
 @property (nonatomic, strong) NSString *filesTable;
+/// The maximum number of compiled statements held for hot-path queries. Defaults to 32.
+@property (nonatomic, assign) NSUInteger statementCacheSize;
+/**
+ * The file DB's generation number.
+ * The generation is incremented each time a set of updates to the file DB is completed, and
+ * can be used to tag data derived from the file DB, so that the data can be discarded once
+ * the DB has changed.
+ */
+@property (atomic, assign, readonly) NSUInteger generation;
+/**
+ * The name of the full-text search index on the pages table's title and content columns.
+ * The index is an FTS5 external content table whose rowids match the pages table rowids;
+ * it is kept up to date by triggers on the pages table, so is always in step with the
+ * committed page content. Nil if the index isn't available (e.g. if the SQLite build
+ * doesn't include FTS5).
+ */
+@property (nonatomic, strong, readonly) NSString *searchIndexTable;
+/// The size budget for cached files in evictable filesets; shared by all instances of the file DB.
+@property (nonatomic, strong, readonly) LOCMSContentCacheBudget *cacheBudget;
 
 - (id)initWithRepository:(LOCMSRepository *)repository;
 - (id)initWithCMSFileDB:(LOCMSFileDB *)cmsFileDB;
 
+/**
+ * Increment the file DB's generation number.
+ * Should be called after every committed update to the file DB.
+ */
+- (void)incrementGeneration;
+/**
+ * Perform a set of updates to the file DB within a single transaction.
+ * All of the file DB's writes are serialized: the transaction holds the file DB's write lock until
+ * it is committed or rolled back, and updates made by other threads wait on the lock, so they are
+ * never included in the transaction. The block returns NO to roll back the transaction. Returns YES
+ * if the transaction was committed; a transaction which fails to commit is rolled back.
+ */
+- (BOOL)performTransaction:(BOOL (^)(void))block;
 /**
  * Prune ORM related values after applying updates to the database.
  * Deletes records in related tables where the version value (as specified in the table's
  * schema) doesn't match the version value on the source table.
  */
 - (BOOL)pruneRelatedValues;
+/**
+ * Upsert a batch of records into a table.
+ * Records which specify a value (possibly null) for every column in the table's schema
+ * are written using a single delete and a single multi-row insert statement per batch;
+ * any other records are upserted individually. Columns with a format in the table
+ * schema (e.g. {fileid}:{key}) are generated if not specified in a record.
+ */
+- (BOOL)upsertValueBatch:(NSArray<NSDictionary *> *)batch intoTable:(NSString *)table;
+/**
+ * Return the directory part of a file path, as stored in the files table's 'dir' column.
+ * The files table has two derived columns which index the file hierarchy: 'dir', the path
+ * of the directory containing the file, without a trailing slash (so files in the root
+ * directory have an empty dir); and 'depth', the number of slashes in the file path. Both
+ * columns are maintained by triggers on the files table and are not part of its schema.
+ */
+- (NSString *)directoryOfPath:(NSString *)path;
+/**
+ * Return the depth of a file path, as stored in the files table's 'depth' column.
+ */
+- (NSInteger)depthOfPath:(NSString *)path;
+/**
+ * Normalize a file path for comparison with the paths stored in the files table, by removing
+ * any leading slash; e.g. when comparing with paths relative to a fileset's cache directory.
+ */
++ (NSString *)normalizedPath:(NSString *)path;
+/**
+ * Perform a query using a cached compiled statement.
+ * Intended for small queries which are executed frequently with different parameters; the
+ * SQL should therefore be a constant string, with all variable values passed as parameters.
+ * The query is executed on a separate read-only connection, so doesn't see uncommitted
+ * changes made within a transaction. Null column values are omitted from result records.
+ */
+- (NSArray *)performCachedQuery:(NSString *)sql withParams:(NSArray *)params;
+/**
+ * Perform a query and pass each result record to a block as it's read.
+ * Intended for queries with large results which are processed one record at a time; when the
+ * statement cache is available, records are read using a cursor on its read-only connection
+ * and so the full result is never held in memory. Set stop to YES to end the query early.
+ * Returns NO if the query fails.
+ */
+- (BOOL)enumerateQuery:(NSString *)sql withParams:(NSArray *)params usingBlock:(void(^)(NSDictionary *record, BOOL *stop))block;
+/**
+ * Return the ID of the file with the specified path, or nil if no such file exists.
+ */
+- (NSString *)fileIDForPath:(NSString *)path;
+/**
+ * Test whether a file with the specified path exists.
+ */
+- (BOOL)hasFileWithPath:(NSString *)path;
+/**
+ * Read the record of the file with the specified path.
+ */
+- (NSDictionary *)fileRecordForPath:(NSString *)path;
+/**
+ * Read the record of the file with the specified ID.
+ */
+- (NSDictionary *)fileRecordForID:(NSString *)fileID;
 /**
  * Return the path of the cache location for files of the specified fileset category.
  * Returns nil if the fileset category isn't locally cachable.
@@ -67,18 +157,22 @@
 /**
  * Update a file record after a file download to indicate that the file is now locally cached.
  * The main purpose of this is to change a packaged file's status to 'published'.
+ * Increments the file DB's generation.
  */
 - (void)markFileAsDownloaded:(NSString *)filePath;
 /**
  * Insert a DB reset record for the specified category with the specified client visible set.
+ * The set is stored in the compact format; see LOCMSClientVisibleSet.
  */
-- (void)insertResetCVS:(NSString *)cvs forCategory:(NSString *)category;
+- (void)insertResetCVS:(NSData *)cvs forCategory:(NSString *)category;
 /**
- * Read the reset CVS for a fileset category.
+ * Read the reset CVS for a fileset category, in the compact format.
+ * Returns nil if there is no reset record for the category, or if the record was written in
+ * an earlier format.
  */
-- (NSString *)getResetCVSForCategory:(NSString *)category;
+- (NSData *)getResetCVSForCategory:(NSString *)category;
 /**
- * Return a list of any in-progress file DB resets.
+ * Return a list of any in-progress file DB resets; each record gives the fileset category.
  */
 - (NSArray *)getInProgressResetRecords;
 /**
@@ -89,6 +183,25 @@
  * Delete all reset records from the database.
  */
 - (void)deleteAllResetRecords;
+/**
+ * Read the download progress record for a fileset category.
+ * Returns nil if no download of the fileset is in progress.
+ */
+- (NSDictionary *)getFilesetDownloadRecordForCategory:(NSString *)category;
+/**
+ * Record the progress of a fileset download.
+ * The request identifies the download request; the validator is the ETag or last modified time
+ * of the downloaded content. The length is -1 if the full content length isn't known.
+ */
+- (void)updateFilesetDownloadRecordForCategory:(NSString *)category
+                                       request:(NSString *)request
+                                     validator:(NSString *)validator
+                                      received:(long long)received
+                                        length:(long long)length;
+/**
+ * Delete a fileset's download progress record.
+ */
+- (void)deleteFilesetDownloadRecordForCategory:(NSString *)category;
 /// Return a new instance of this database.
 - (LOCMSFileDB *)newInstance;
 
@@ -17,22 +17,108 @@
 //
 
 #import "LOCMSFileDB.h"
+#import "LOCMSContentCacheBudget.h"
 #import "LOCMSFileset.h"
 #import "LOCMSRepository.h"
+#import "LOCMSStatementCache.h"
+#import "SCLogger.h"
 
-@interface LOCMSFileDB ()
+// The maximum number of SQL parameters in a single statement (SQLITE_MAX_VARIABLE_NUMBER).
+#define MaxSQLParams            (999)
+// The maximum number of records in a single multi-row insert.
+#define MaxRecordsPerStatement  (200)
+// The time a write waits on a locked database before failing, in milliseconds.
+#define BusyTimeout                 (5000)
+// The default number of compiled statements held by the statement cache.
+#define DefaultStatementCacheSize   (32)
+// The table indexed for full-text search, and the name of its search index.
+#define SearchTable                 (@"pages")
+#define SearchIndexTable            (@"pages_fts")
 
+static SCLogger *Logger;
+
+@interface LOCMSFileDB () {
+    /// Serializes writes to the database; shared by all instances of the file DB.
+    NSRecursiveLock *_writeLock;
+    /// A read-only connection used for hot-path queries.
+    LOCMSStatementCache *_statementCache;
+    /// Hot-path SQL on the files table; rebuilt when the files table name changes.
+    NSString *_sqlFileIDByPath;
+    NSString *_sqlFileByPath;
+    NSString *_sqlFileByID;
+    NSString *_sqlCacheLocationByPath;
+    NSString *_sqlMarkFileAsDownloaded;
+}
+
+/// Configure the database connection for use alongside the statement cache's read-only connection.
+- (void)configureConnection;
 /// Create tables needed for DB resets, if not already in place.
 - (void)createDBResetTables;
+/// Create tables needed to track fileset download progress, if not already in place.
+- (void)createFilesetDownloadTables;
+/// Create tables needed to track cached file access times, if not already in place.
+- (void)createFileAccessTables;
+/// Add the derived hierarchy columns to the files table, if not already in place.
+- (void)createHierarchyColumns;
+/// Create the full-text search index and its triggers, if not already in place.
+- (void)createSearchIndex;
+/// Open the statement cache on the database file.
+- (void)openStatementCache;
+/// Return the cache location for a file with the specified path, fileset category and status.
+- (NSString *)cacheLocationForFile:(NSString *)filePath inFileset:(NSString *)category status:(NSString *)status;
+/// Write a batch of complete records to a table, using the specified column names.
+- (BOOL)replaceRecords:(NSArray<NSDictionary *> *)records inTable:(NSString *)table columns:(NSArray *)columns;
 
 @end
 
+/// Generate a formatted column value by replacing {name} placeholders with record values.
+static id FormatColumnValue(NSString *format, NSDictionary *values) {
+    NSMutableString *result = [NSMutableString new];
+    NSScanner *scanner = [NSScanner scannerWithString:format];
+    scanner.charactersToBeSkipped = nil;
+    while (![scanner isAtEnd]) {
+        NSString *text = nil, *name = nil;
+        if ([scanner scanUpToString:@"{" intoString:&text]) {
+            [result appendString:text];
+        }
+        if ([scanner scanString:@"{" intoString:nil]) {
+            [scanner scanUpToString:@"}" intoString:&name];
+            [scanner scanString:@"}" intoString:nil];
+            id value = name ? values[name] : nil;
+            if (value == nil || value == [NSNull null]) {
+                // Can't generate the value if a placeholder value is missing.
+                return nil;
+            }
+            [result appendString:[value description]];
+        }
+    }
+    return result;
+}
+
+/// Serialize a structured column value (i.e. a dictionary or array) as a JSON string.
+static id JSONColumnValue(id value) {
+    NSError *error = nil;
+    NSData *data = [NSJSONSerialization dataWithJSONObject:value options:0 error:&error];
+    if (!data) {
+        [Logger warn:@"Unable to serialize column value as JSON: %@", error];
+        return [NSNull null];
+    }
+    return [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
+}
+
 @implementation LOCMSFileDB
 
++ (void)initialize {
+    Logger = [[SCLogger alloc] initWithTag:@"LOCMSFileDB"];
+}
+
 - (id)initWithRepository:(LOCMSRepository *)repository {
     self = [super init];
     self.repository = repository;
     self.filesTable = @"files";
+    self.statementCacheSize = DefaultStatementCacheSize;
+    _writeLock = [NSRecursiveLock new];
+    _cacheBudget = [[LOCMSContentCacheBudget alloc] initWithFileDB:self];
     return self;
 }
 
@@ -41,9 +127,49 @@
     self.repository = cmsFileDB.repository;
     self.filesTable = cmsFileDB.filesTable;
     self.filesets = cmsFileDB.filesets;
+    self.statementCacheSize = cmsFileDB.statementCacheSize;
+    _writeLock = cmsFileDB->_writeLock;
+    _cacheBudget = cmsFileDB.cacheBudget;
     return self;
 }
 
+- (void)setFilesTable:(NSString *)filesTable {
+    _filesTable = filesTable;
+    _sqlFileIDByPath = [NSString stringWithFormat:@"SELECT id FROM %@ WHERE path=?", filesTable];
+    _sqlFileByPath = [NSString stringWithFormat:@"SELECT * FROM %@ WHERE path=?", filesTable];
+    _sqlFileByID = [NSString stringWithFormat:@"SELECT * FROM %@ WHERE id=?", filesTable];
+    _sqlCacheLocationByPath = [NSString stringWithFormat:@"SELECT category, status FROM %@ WHERE path=?", filesTable];
+    _sqlMarkFileAsDownloaded = [NSString stringWithFormat:@"UPDATE %@ SET status='published' WHERE path=?", filesTable];
+}
+
+- (void)incrementGeneration {
+    @synchronized (self) {
+        _generation++;
+    }
+}
+
+- (BOOL)performTransaction:(BOOL (^)(void))block {
+    [_writeLock lock];
+    BOOL ok = [self beginTransaction];
+    if (ok) {
+        ok = block();
+        if (ok) {
+            ok = [self commitTransaction];
+            if (!ok) {
+                [Logger error:@"Failed to commit transaction"];
+            }
+        }
+        if (!ok) {
+            [self rollbackTransaction];
+        }
+    }
+    else {
+        [Logger error:@"Failed to begin transaction"];
+    }
+    [_writeLock unlock];
+    return ok;
+}
+
 - (BOOL)pruneRelatedValues {
     BOOL ok = YES;
     // Read column names on source table.
@@ -114,6 +240,150 @@
     return ok;
 }
 
+- (BOOL)upsertValueBatch:(NSArray<NSDictionary *> *)batch intoTable:(NSString *)table {
+    NSDictionary *columns = self.tables[table][@"columns"];
+    NSString *idColumn = [self getColumnWithTag:@"id" fromTable:table];
+    if (!columns || !idColumn) {
+        // Table schema not known; upsert each record individually.
+        BOOL ok = YES;
+        for (NSDictionary *values in batch) {
+            ok &= [self upsertValues:values intoTable:table];
+        }
+        return ok;
+    }
+    NSArray *columnNames = [columns allKeys];
+    NSMutableArray *complete = [NSMutableArray new];
+    BOOL ok = YES;
+    for (NSDictionary *record in batch) {
+        NSDictionary *values = record;
+        // Generate any missing formatted column values.
+        for (NSString *name in columnNames) {
+            NSString *format = columns[name][@"format"];
+            if (format && values[name] == nil) {
+                id value = FormatColumnValue(format, values);
+                if (value) {
+                    NSMutableDictionary *mvalues = [values mutableCopy];
+                    mvalues[name] = value;
+                    values = mvalues;
+                }
+            }
+        }
+        // Check whether the record specifies every column; note that this is the normal case
+        // for records in the updates feed.
+        BOOL isComplete = YES;
+        for (NSString *name in columnNames) {
+            if (values[name] == nil) {
+                isComplete = NO;
+                break;
+            }
+        }
+        if (isComplete) {
+            [complete addObject:values];
+        }
+        else {
+            // Partial records are upserted individually so that unspecified column values
+            // are preserved.
+            ok &= [self upsertValues:values intoTable:table];
+        }
+    }
+    // Write complete records in chunks small enough to fit the SQL parameter limit.
+    NSUInteger chunkSize = MAX(1, MIN(MaxRecordsPerStatement, MaxSQLParams / [columnNames count]));
+    for (NSUInteger i = 0; i < [complete count] && ok; i += chunkSize) {
+        NSRange range = NSMakeRange(i, MIN(chunkSize, [complete count] - i));
+        ok = [self replaceRecords:[complete subarrayWithRange:range] inTable:table columns:columnNames];
+    }
+    return ok;
+}
+
+- (NSString *)directoryOfPath:(NSString *)path {
+    // Note that this must give the same result as the SQL expression used by createHierarchyColumns.
+    NSRange range = [path rangeOfString:@"/" options:NSBackwardsSearch];
+    if (range.location == NSNotFound) {
+        return @"";
+    }
+    NSString *dir = [path substringToIndex:range.location];
+    while ([dir hasSuffix:@"/"]) {
+        dir = [dir substringToIndex:[dir length] - 1];
+    }
+    return dir;
+}
+
+- (NSInteger)depthOfPath:(NSString *)path {
+    return [[path componentsSeparatedByString:@"/"] count] - 1;
+}
+
++ (NSString *)normalizedPath:(NSString *)path {
+    return [path hasPrefix:@"/"] ? [path substringFromIndex:1] : path;
+}
+
+- (NSArray *)performCachedQuery:(NSString *)sql withParams:(NSArray *)params {
+    if (_statementCache) {
+        NSError *error = nil;
+        NSArray *result = [_statementCache performQuery:sql withParams:params error:&error];
+        if (result) {
+            return result;
+        }
+        [Logger warn:@"Cached query failed, using standard query: %@", error];
+    }
+    return [self performQuery:sql withParams:params];
+}
+
+- (BOOL)enumerateQuery:(NSString *)sql withParams:(NSArray *)params usingBlock:(void(^)(NSDictionary *record, BOOL *stop))block {
+    __block BOOL started = NO;
+    if (_statementCache) {
+        NSError *error = nil;
+        BOOL ok = [_statementCache enumerateQuery:sql withParams:params usingBlock:^(NSDictionary *record, BOOL *stop) {
+            started = YES;
+            block(record, stop);
+        } error:&error];
+        // Only fall back to a standard query if no records have been passed to the block yet.
+        if (ok || started) {
+            if (!ok) {
+                [Logger error:@"Query enumeration failed: %@", error];
+            }
+            return ok;
+        }
+        [Logger warn:@"Cached query failed, using standard query: %@", error];
+    }
+    NSArray *rs = [self performQuery:sql withParams:params];
+    BOOL stop = NO;
+    for (NSDictionary *record in rs) {
+        block(record, &stop);
+        if (stop) {
+            break;
+        }
+    }
+    return YES;
+}
+
+- (NSString *)fileIDForPath:(NSString *)path {
+    if (_statementCache) {
+        NSError *error = nil;
+        NSArray *row = [_statementCache readFirstRowOfQuery:_sqlFileIDByPath withParams:@[ path ] error:&error];
+        if (row) {
+            id fileID = [row count] > 0 ? row[0] : nil;
+            return fileID == [NSNull null] ? nil : [fileID description];
+        }
+        [Logger warn:@"Cached query failed, using standard query: %@", error];
+    }
+    NSArray *rs = [self performQuery:_sqlFileIDByPath withParams:@[ path ]];
+    return [rs count] > 0 ? [rs[0][@"id"] description] : nil;
+}
+
+- (BOOL)hasFileWithPath:(NSString *)path {
+    return [self fileIDForPath:path] != nil;
+}
+
+- (NSDictionary *)fileRecordForPath:(NSString *)path {
+    NSArray *rs = [self performCachedQuery:_sqlFileByPath withParams:@[ path ]];
+    return [rs count] > 0 ? rs[0] : nil;
+}
+
+- (NSDictionary *)fileRecordForID:(NSString *)fileID {
+    NSArray *rs = [self performCachedQuery:_sqlFileByID withParams:@[ fileID ]];
+    return [rs count] > 0 ? rs[0] : nil;
+}
+
 - (NSString *)cacheLocationForFileset:(NSString *)category {
     NSString *path = nil;
     LOCMSFileset *fileset = _filesets[category];
@@ -132,48 +402,63 @@
 }
 
 - (NSString *)cacheLocationForFileRecord:(NSDictionary *)fileRecord {
-    NSString *path = nil;
-    NSString *status = fileRecord[@"status"];
-    NSString *category = fileRecord[@"category"];
-    if ([@"packaged" isEqualToString:status]) {
-        // Packaged content is distributed with the app, under a folder with the content authority name.
-        path = _repository.localCachePaths.packagedContentPath;
-        path = [path stringByAppendingPathComponent:category];
-        path = [path stringByAppendingPathComponent:fileRecord[@"path"]];
-    }
-    else {
-        path = [self cacheLocationForFile:fileRecord[@"path"] inFileset:category];
-    }
-    return path;
+    return [self cacheLocationForFile:fileRecord[@"path"] inFileset:fileRecord[@"category"] status:fileRecord[@"status"]];
 }
 
 - (NSString *)cacheLocationForFile:(NSString *)filePath {
-    NSString *sql = [NSString stringWithFormat:@"SELECT * FROM %@ WHERE path=?", _filesTable];
-    NSArray *rs = [self performQuery:sql withParams:@[ filePath ]];
-    return [rs count] > 0 ? [self cacheLocationForFileRecord:rs[0]] : nil;
+    // This is the most frequently used lookup, so only read the columns needed to resolve
+    // the cache location.
+    NSArray *row = nil;
+    if (_statementCache) {
+        NSError *error = nil;
+        row = [_statementCache readFirstRowOfQuery:_sqlCacheLocationByPath withParams:@[ filePath ] error:&error];
+        if (!row) {
+            [Logger warn:@"Cached query failed, using standard query: %@", error];
+        }
+    }
+    if (!row) {
+        NSArray *rs = [self performQuery:_sqlCacheLocationByPath withParams:@[ filePath ]];
+        if ([rs count] == 0) {
+            return nil;
+        }
+        NSDictionary *record = rs[0];
+        return [self cacheLocationForFile:filePath inFileset:record[@"category"] status:record[@"status"]];
+    }
+    if ([row count] == 0) {
+        return nil;
+    }
+    id category = row[0], status = row[1];
+    return [self cacheLocationForFile:filePath
+                            inFileset:(category == [NSNull null] ? nil : category)
+                               status:(status == [NSNull null] ? nil : status)];
 }
 
 - (void)markFileAsDownloaded:(NSString *)filePath {
-    NSString *sql = [NSString stringWithFormat:@"UPDATE %@ SET status='published' WHERE path=?", _filesTable];
-    [self performUpdate:sql withParams:@[ filePath ]];
+    [self performUpdate:_sqlMarkFileAsDownloaded withParams:@[ filePath ]];
+    [self incrementGeneration];
 }
 
-- (void)insertResetCVS:(NSString *)cvs forCategory:(NSString *)category {
+- (void)insertResetCVS:(NSData *)cvs forCategory:(NSString *)category {
     [self performUpdate:@"INSERT INTO dbresets (category, cvs) VALUES (?,?)" withParams:@[ category, cvs ]];
 }
 
-- (NSString *)getResetCVSForCategory:(NSString *)category {
-    NSString *cvs = nil;
+- (NSData *)getResetCVSForCategory:(NSString *)category {
+    NSData *cvs = nil;
     NSArray *rs = [self performQuery:@"SELECT cvs FROM dbresets WHERE category=?" withParams:@[ category ]];
     if ([rs count] > 0) {
         NSDictionary *record = rs[0];
-        cvs = record[@"cvs"];
+        // Records written by earlier versions hold a JSON string; these are ignored, so that
+        // the fileset is downloaded in full instead.
+        id value = record[@"cvs"];
+        if ([value isKindOfClass:[NSData class]]) {
+            cvs = value;
+        }
     }
     return cvs;
 }
 
 - (NSArray *)getInProgressResetRecords {
-    return [self performQuery:@"SELECT category, cvs FROM dbresets" withParams:@[]];
+    return [self performQuery:@"SELECT category FROM dbresets" withParams:@[]];
 }
 
 - (void)deleteResetRecordForCategory:(NSString *)category {
@@ -184,6 +469,25 @@
     [self performUpdate:@"DELETE FROM dbresets WHERE 1=1" withParams:@[]];
 }
 
+- (NSDictionary *)getFilesetDownloadRecordForCategory:(NSString *)category {
+    NSArray *rs = [self performQuery:@"SELECT category, request, validator, received, length FROM filesetdownloads WHERE category=?"
+                          withParams:@[ category ]];
+    return [rs count] > 0 ? rs[0] : nil;
+}
+
+- (void)updateFilesetDownloadRecordForCategory:(NSString *)category
+                                       request:(NSString *)request
+                                     validator:(NSString *)validator
+                                      received:(long long)received
+                                        length:(long long)length {
+    NSString *sql = @"INSERT OR REPLACE INTO filesetdownloads (category, request, validator, received, length) VALUES (?,?,?,?,?)";
+    [self performUpdate:sql withParams:@[ category, request, validator ?: [NSNull null], @(received), @(length) ]];
+}
+
+- (void)deleteFilesetDownloadRecordForCategory:(NSString *)category {
+    [self performUpdate:@"DELETE FROM filesetdownloads WHERE category=?" withParams:@[ category ]];
+}
+
 - (LOCMSFileDB *)newInstance {
     LOCMSFileDB *db = [[LOCMSFileDB alloc] initWithCMSFileDB:self];
     [db startService];
@@ -200,15 +504,222 @@
 
 #pragma mark - Overrides
 
+- (BOOL)performUpdate:(NSString *)sql withParams:(NSArray *)params {
+    // Wait for any transaction in progress on another thread; updates made within a transaction
+    // on this thread already hold the lock.
+    [_writeLock lock];
+    BOOL ok = [super performUpdate:sql withParams:params];
+    [_writeLock unlock];
+    return ok;
+}
+
 - (void)startService {
     [super startService];
+    [self configureConnection];
     [self createDBResetTables];
+    [self createFilesetDownloadTables];
+    [self createFileAccessTables];
+    [self createHierarchyColumns];
+    [self createSearchIndex];
+    [self openStatementCache];
 }
 
 #pragma mark - Private
 
+- (void)configureConnection {
+    // In WAL mode, readers on the statement cache's connection don't block commits on this
+    // connection (and vice versa); the mode is persistent, so only needs setting once per database.
+    NSArray *rs = [self performQuery:@"PRAGMA journal_mode=WAL" withParams:@[]];
+    NSString *mode = [rs count] > 0 ? [rs[0][@"journal_mode"] description] : nil;
+    if (![@"wal" isEqualToString:mode]) {
+        // E.g. for an in-memory database.
+        [Logger warn:@"Unable to use WAL journal mode, journal mode is %@", mode];
+    }
+    // Wait on the database lock instead of failing immediately, e.g. when a commit needs to
+    // checkpoint the WAL whilst a long query is in progress.
+    NSString *sql = [NSString stringWithFormat:@"PRAGMA busy_timeout=%d", BusyTimeout];
+    [self performQuery:sql withParams:@[]];
+}
+
 - (void)createDBResetTables {
-    [self performUpdate:@"CREATE TABLE IF NOT EXISTS dbresets (category TEXT, cvs TEXT)" withParams:@[]];
+    [self performUpdate:@"CREATE TABLE IF NOT EXISTS dbresets (category TEXT, cvs BLOB)" withParams:@[]];
+}
+
+- (void)createFilesetDownloadTables {
+    NSString *sql = @"CREATE TABLE IF NOT EXISTS filesetdownloads "
+                     "(category TEXT PRIMARY KEY, request TEXT, validator TEXT, received INTEGER, length INTEGER)";
+    [self performUpdate:sql withParams:@[]];
+}
+
+- (void)createFileAccessTables {
+    NSString *sql = @"CREATE TABLE IF NOT EXISTS fileaccess "
+                     "(category TEXT, path TEXT, atime REAL, PRIMARY KEY (category, path))";
+    [self performUpdate:sql withParams:@[]];
+}
+
+- (void)createHierarchyColumns {
+    // The dir and depth columns are added outside of the table schema, so that records in the
+    // updates feed (which don't include them) are still complete records; see upsertValueBatch:.
+    NSString *sql = [NSString stringWithFormat:@"PRAGMA table_info(%@)", _filesTable];
+    NSArray *rs = [self performQuery:sql withParams:@[]];
+    if ([rs count] == 0) {
+        // Files table not found.
+        return;
+    }
+    NSMutableSet *columnNames = [NSMutableSet new];
+    for (NSDictionary *record in rs) {
+        [columnNames addObject:record[@"name"]];
+    }
+    // SQL expressions deriving dir and depth from path. The dir expression strips all trailing
+    // characters which aren't a slash, and then the trailing slashes.
+    NSString *dirExpr = @"rtrim(rtrim(path, replace(path, '/', '')), '/')";
+    NSString *depthExpr = @"(length(path) - length(replace(path, '/', '')))";
+    NSMutableArray *statements = [NSMutableArray new];
+    BOOL backfill = NO;
+    if (![columnNames containsObject:@"dir"]) {
+        [statements addObject:[NSString stringWithFormat:@"ALTER TABLE %@ ADD COLUMN dir TEXT", _filesTable]];
+        backfill = YES;
+    }
+    if (![columnNames containsObject:@"depth"]) {
+        [statements addObject:[NSString stringWithFormat:@"ALTER TABLE %@ ADD COLUMN depth INTEGER", _filesTable]];
+        backfill = YES;
+    }
+    NSString *update = [NSString stringWithFormat:@"UPDATE %@ SET dir = %@, depth = %@", _filesTable, dirExpr, depthExpr];
+    [statements addObjectsFromArray:@[
+        [NSString stringWithFormat:@"CREATE TRIGGER IF NOT EXISTS %@_hierarchy_ai AFTER INSERT ON %@ BEGIN %@ WHERE rowid = new.rowid; END",
+            _filesTable, _filesTable, update],
+        [NSString stringWithFormat:@"CREATE TRIGGER IF NOT EXISTS %@_hierarchy_au AFTER UPDATE OF path ON %@ BEGIN %@ WHERE rowid = new.rowid; END",
+            _filesTable, _filesTable, update],
+        // Siblings and descendents are selected by dir; children by depth and a dir range.
+        [NSString stringWithFormat:@"CREATE INDEX IF NOT EXISTS %@_dir ON %@ (dir)", _filesTable, _filesTable],
+        [NSString stringWithFormat:@"CREATE INDEX IF NOT EXISTS %@_depth_dir ON %@ (depth, dir)", _filesTable, _filesTable]
+    ]];
+    if (backfill) {
+        [statements addObject:update];
+    }
+    [self performTransaction:^BOOL {
+        for (NSString *statement in statements) {
+            if (![self performUpdate:statement withParams:@[]]) {
+                [Logger error:@"Failed to create file hierarchy index: %@", statement];
+                return NO;
+            }
+        }
+        return YES;
+    }];
+}
+
+- (void)createSearchIndex {
+    _searchIndexTable = nil;
+    NSDictionary *columns = self.tables[SearchTable][@"columns"];
+    if (!(columns[@"title"] && columns[@"content"])) {
+        return;
+    }
+    // Pages are written using INSERT OR REPLACE by some update paths; recursive triggers are
+    // needed for the implicit delete of the replaced row to fire the index's delete trigger.
+    [self performUpdate:@"PRAGMA recursive_triggers = ON" withParams:@[]];
+    // Check whether the index and all of its triggers are in place. The triggers will be
+    // missing if the pages table has been recreated after a schema update.
+    NSString *sql = [NSString stringWithFormat:@"SELECT count(*) AS count FROM sqlite_master WHERE name IN ('%@','%@_ai','%@_ad','%@_au')",
+                        SearchIndexTable, SearchIndexTable, SearchIndexTable, SearchIndexTable];
+    NSArray *rs = [self performQuery:sql withParams:@[]];
+    if ([rs count] > 0 && [rs[0][@"count"] integerValue] == 4) {
+        _searchIndexTable = SearchIndexTable;
+        return;
+    }
+    NSArray *statements = @[
+        [NSString stringWithFormat:@"CREATE VIRTUAL TABLE IF NOT EXISTS %@ USING fts5(title, content, content='%@', content_rowid='rowid', tokenize='unicode61 remove_diacritics 1')",
+            SearchIndexTable, SearchTable],
+        [NSString stringWithFormat:@"CREATE TRIGGER IF NOT EXISTS %@_ai AFTER INSERT ON %@ BEGIN "
+                                    "INSERT INTO %@ (rowid, title, content) VALUES (new.rowid, new.title, new.content); END",
+            SearchIndexTable, SearchTable, SearchIndexTable],
+        [NSString stringWithFormat:@"CREATE TRIGGER IF NOT EXISTS %@_ad AFTER DELETE ON %@ BEGIN "
+                                    "INSERT INTO %@ (%@, rowid, title, content) VALUES ('delete', old.rowid, old.title, old.content); END",
+            SearchIndexTable, SearchTable, SearchIndexTable, SearchIndexTable],
+        [NSString stringWithFormat:@"CREATE TRIGGER IF NOT EXISTS %@_au AFTER UPDATE ON %@ BEGIN "
+                                    "INSERT INTO %@ (%@, rowid, title, content) VALUES ('delete', old.rowid, old.title, old.content); "
+                                    "INSERT INTO %@ (rowid, title, content) VALUES (new.rowid, new.title, new.content); END",
+            SearchIndexTable, SearchTable, SearchIndexTable, SearchIndexTable, SearchIndexTable],
+        // Index any page content already in the database.
+        [NSString stringWithFormat:@"INSERT INTO %@ (%@) VALUES ('rebuild')", SearchIndexTable, SearchIndexTable]
+    ];
+    BOOL ok = [self performTransaction:^BOOL {
+        for (NSString *statement in statements) {
+            if (![self performUpdate:statement withParams:@[]]) {
+                // FTS5 not available; searches will fall back to table scans.
+                [Logger warn:@"Unable to create full-text search index"];
+                return NO;
+            }
+        }
+        return YES;
+    }];
+    if (ok) {
+        _searchIndexTable = SearchIndexTable;
+    }
+}
+
+- (void)openStatementCache {
+    [_statementCache close];
+    _statementCache = nil;
+    // Find the location of the database file. Hot-path queries fall back to the standard
+    // query path if the location can't be found (e.g. for an in-memory database).
+    NSString *dbPath = nil;
+    NSArray *rs = [self performQuery:@"PRAGMA database_list" withParams:@[]];
+    for (NSDictionary *record in rs) {
+        if ([@"main" isEqualToString:record[@"name"]]) {
+            dbPath = record[@"file"];
+            break;
+        }
+    }
+    if ([dbPath length] > 0) {
+        _statementCache = [[LOCMSStatementCache alloc] initWithDBPath:dbPath capacity:_statementCacheSize];
+        if (![_statementCache open]) {
+            _statementCache = nil;
+        }
+    }
+}
+
+- (NSString *)cacheLocationForFile:(NSString *)filePath inFileset:(NSString *)category status:(NSString *)status {
+    if ([@"packaged" isEqualToString:status]) {
+        // Packaged content is distributed with the app, under a folder with the content authority name.
+        NSString *path = _repository.localCachePaths.packagedContentPath;
+        path = [path stringByAppendingPathComponent:category];
+        return [path stringByAppendingPathComponent:filePath];
+    }
+    return [self cacheLocationForFile:filePath inFileset:category];
+}
+
+- (BOOL)replaceRecords:(NSArray<NSDictionary *> *)records inTable:(NSString *)table columns:(NSArray *)columns {
+    NSString *idColumn = [self getColumnWithTag:@"id" fromTable:table];
+    NSMutableArray *ids = [NSMutableArray new];
+    NSMutableArray *idPlaceholders = [NSMutableArray new];
+    NSMutableArray *rowPlaceholders = [NSMutableArray new];
+    NSMutableArray *params = [NSMutableArray new];
+    NSMutableArray *placeholders = [NSMutableArray new];
+    for (NSUInteger i = 0; i < [columns count]; i++) {
+        [placeholders addObject:@"?"];
+    }
+    NSString *rowPlaceholder = [NSString stringWithFormat:@"(%@)", [placeholders componentsJoinedByString:@","]];
+    for (NSDictionary *record in records) {
+        [ids addObject:record[idColumn]];
+        [idPlaceholders addObject:@"?"];
+        [rowPlaceholders addObject:rowPlaceholder];
+        for (NSString *column in columns) {
+            id value = record[column];
+            if ([value isKindOfClass:[NSDictionary class]] || [value isKindOfClass:[NSArray class]]) {
+                value = JSONColumnValue(value);
+            }
+            [params addObject:value];
+        }
+    }
+    // Delete any existing versions of the records, then insert the new versions.
+    NSString *sql = [NSString stringWithFormat:@"DELETE FROM %@ WHERE %@ IN (%@)",
+                        table, idColumn, [idPlaceholders componentsJoinedByString:@","]];
+    if (![self performUpdate:sql withParams:ids]) {
+        return NO;
+    }
+    sql = [NSString stringWithFormat:@"INSERT INTO %@ (%@) VALUES %@",
+              table, [columns componentsJoinedByString:@","], [rowPlaceholders componentsJoinedByString:@","]];
+    return [self performUpdate:sql withParams:params];
 }
 
 @end
@@ -17,18 +17,39 @@
 //
 
 #import "LOCMSFileHandler.h"
+#import "LOCMSContentCacheBudget.h"
 #import "LOMIMETypes.h"
 #import "GRMustache.h"
 #import "SCLogger.h"
 
+// The prefix of the download registry keys of revalidation cache downloads.
+#define RevalidationKeyPrefix   (@"revalidate:")
+// The prefix of the download registry keys of downloads of non-cachable files.
+#define UncachedKeyPrefix       (@"uncached:")
+
 static SCLogger *Logger;
 
+/// Return a file record's version, i.e. the ID of the commit which last modified the file.
+static NSString *FileVersion(NSDictionary *record) {
+    id version = record[@"version"];
+    // The version is mapped to the commit record by the file DB's ORM.
+    if ([version isKindOfClass:[NSDictionary class]]) {
+        version = version[@"id"];
+    }
+    return [version description];
+}
+
 @interface LOCMSFileHandler ()
 
 /// Render a page's content.
 - (NSString *)renderPageContent:(NSDictionary *)record;
 /// Write a file's content to a response.
 - (void)writeFileContent:(NSDictionary *)record toResponse:(id<LOContentResponse>)response;
+/// Write the content of a file in a non-cachable fileset to a response, using the revalidation cache.
+- (void)writeFileContent:(NSDictionary *)record
+                mimeType:(NSString *)mimeType
+   fromRevalidationCache:(LOCMSRevalidationCache *)revalidationCache
+              toResponse:(id<LOContentResponse>)response;
 
 @end
 
@@ -107,42 +128,21 @@ static SCLogger *Logger;
 }
 
 - (NSString *)renderPageContent:(NSDictionary *)record {
-    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSTimeInterval start = [LOMetrics now];
     NSDictionary *page = record[@"page"];
     NSString *pageType = page[@"type"];
     NSString *pageHTML;
-    // Resolve the client template to use to render the post.
-    // TODO: Note that the following code assumes the page templates are avaiable in the app
-    // cache; consider whether to instead load templates via the content: URL.
-    NSString *templateFilename = [NSString stringWithFormat:@"templates/page-%@.html", pageType];
-    NSString *templatePath = [self.fileDB cacheLocationForFile:templateFilename];
-    if (!(templatePath && [fileManager fileExistsAtPath:templatePath])) {
-        templatePath = [self.fileDB cacheLocationForFile:@"templates/page.html"];
-        if (!(templatePath && [fileManager fileExistsAtPath:templatePath])) {
-            [Logger warn:@"Client template not found for page type %@", pageType];
-            templatePath = nil;
-        }
+    NSError *error = nil;
+    // Resolve the compiled client template to use to render the post.
+    GRMustacheTemplate *template = [_repository.templateRepository pageTemplateForType:pageType error:&error];
+    if (template) {
+        pageHTML = [template renderObject:page error:&error];
     }
-    // If template found then use to render the page content.
-    if (templatePath) {
-        NSError *error;
-        // Load the template and render the post.
-        NSString *template = [NSString stringWithContentsOfFile:templatePath
-                                                       encoding:NSUTF8StringEncoding
-                                                          error:&error];
-        if (!error) {
-            // TODO: Investigate using template repositories to load templates
-            // https://github.com/groue/GRMustache/blob/master/Guides/template_repositories.md
-            // as they should allow partials to be used within templates, whilst supporting the two
-            // use cases of loading templates from file (i.e. for full post html) or evaluating
-            // a template from a string (i.e. for post content only).
-            pageHTML = [GRMustacheTemplate renderObject:page
-                                             fromString:template
-                                                  error:&error];
-        }
-        if (error) {
-            [Logger error:@"Rendering %@: %@", templatePath, error];
-        }
+    else if (!error) {
+        [Logger warn:@"Client template not found for page type %@", pageType];
+    }
+    if (error) {
+        [Logger error:@"Rendering page of type %@: %@", pageType, error];
     }
     // If no page content yet then just wrap what we have in <html> tags.
     if (!pageHTML) {
@@ -150,6 +150,7 @@ static SCLogger *Logger;
         NSString *pageContent = page[@"content"];
         pageHTML = [NSString stringWithFormat:@"<html>%@</html>", pageContent];
     }
+    [self.metrics recordDurationSince:start inHistogram:@"render.time"];
     return pageHTML;
 }
 
@@ -171,75 +172,86 @@ static SCLogger *Logger;
     NSString *cachePath = [self.fileDB cacheLocationForFileRecord:record];
     // Check if a local copy of the file exists in the cache.
     if (cachable && [[NSFileManager defaultManager] fileExistsAtPath:cachePath]) {
+        [self.metrics incrementCounter:@"filecache.hit"];
+        if (fileset.evictable) {
+            [self.fileDB.cacheBudget recordAccessToFile:path inFileset:category];
+        }
         // Local copy found, respond with contents.
         [response respondWithFileData:cachePath
                              mimeType:mimeType
                           cachePolicy:NSURLCacheStorageNotAllowed];
         return;
     }
-    // Read the file's server-side URL.
-    NSString *url = [_repository.cms urlForFile:path];
+    // Content from non-cachable filesets is served from the revalidation cache, if enabled.
+    LOCMSRevalidationCache *revalidationCache = _repository.revalidationCache;
+    if (!cachable && revalidationCache) {
+        [self writeFileContent:record mimeType:mimeType fromRevalidationCache:revalidationCache toResponse:response];
+        return;
+    }
+    [self.metrics incrementCounter:@"filecache.miss"];
     // Read the cache location for downloaded content (note that the cacheLocationForFileRecord:
     // may return a path to the app bundle if the content was packaged).
     cachePath = [self.fileDB cacheLocationForFile:path inFileset:category];
-    // No local copy found, download from server.
-    SCHTTPClient *httpClient = _repository.httpClient;
-    [httpClient getFile:url]
-    .then((id)^(SCHTTPClientResponse *httpResponse) {
-        NSString *downloadPath = [httpResponse.downloadLocation path];
-        NSError *error = nil;
-        // If cachable then move file to cache.
-        if (cachable) {
-            NSFileManager *fileManager = [NSFileManager defaultManager];
-            if ([fileManager fileExistsAtPath:cachePath]) {
-                // Remove any file already at the target location.
-                [fileManager removeItemAtPath:cachePath error:&error];
-            }
-            else {
-                // Ensure that the target directory exists.
-                NSString *cacheDir = [cachePath stringByDeletingLastPathComponent];
-                [fileManager createDirectoryAtPath:cacheDir
-                       withIntermediateDirectories:YES
-                                        attributes:nil
-                                             error:&error];
-            }
-            if (!error) {
-                // Move the file to the cache location.
-                [fileManager moveItemAtPath:downloadPath
-                                     toPath:cachePath
-                                      error:&error];
-            }
-            if (!error) {
-                // Update the file's cache status.
-                [self.fileDB markFileAsDownloaded:path];
-            }
-        }
+    // No local copy found, download from server. Concurrent requests for the same file share a
+    // single download, so that only one download writes to the cache location. Non-cachable
+    // filesets have no cache location, so their downloads are keyed by file path and version.
+    NSString *downloadKey = cachePath;
+    if (!cachable) {
+        downloadKey = [NSString stringWithFormat:@"%@%@@%@", UncachedKeyPrefix, path, FileVersion(record)];
+    }
+    [_repository.downloads downloadWithKey:downloadKey
+                                usingBlock:^(LOCMSDownloadCompletion done) {
+        [self->_repository downloadFile:path toCachePath:(cachable ? cachePath : nil) completion:done];
+    }
+                                completion:^(NSString *contentPath, NSError *error) {
         if (error) {
             [response respondWithError:error];
         }
         else {
+            if (fileset.evictable) {
+                // The file may have been evicted; record the access and check the cache is still within budget.
+                LOCMSContentCacheBudget *cacheBudget = self.fileDB.cacheBudget;
+                [cacheBudget recordAccessToFile:path inFileset:category];
+                [cacheBudget checkBudget:NO];
+            }
             // Respond with file contents.
-            NSString *contentPath = cachable ? cachePath : downloadPath;
             [response respondWithFileData:contentPath
                                  mimeType:mimeType
                               cachePolicy:NSURLCacheStorageNotAllowed];
         }
-        return nil;
-    })
-    .fail(^(id err) {
-        // HTTP request failed, package error and send to response.
-        NSError *error;
-        if ([err isKindOfClass:[NSError class]]) {
-            error = (NSError *)err;
+    }];
+}
+
+- (void)writeFileContent:(NSDictionary *)record
+                mimeType:(NSString *)mimeType
+   fromRevalidationCache:(LOCMSRevalidationCache *)revalidationCache
+              toResponse:(id<LOContentResponse>)response {
+    NSString *path = record[@"path"];
+    NSString *version = FileVersion(record);
+    // Serve the stored content without contacting the server if the file is unchanged.
+    NSString *contentPath = [revalidationCache contentPathForFile:path version:version];
+    if (contentPath) {
+        [response respondWithFileData:contentPath
+                             mimeType:mimeType
+                          cachePolicy:NSURLCacheStorageNotAllowed];
+        return;
+    }
+    // Otherwise revalidate or download the content; concurrent requests share a single request.
+    NSString *url = [_repository.cms urlForFile:path];
+    [_repository.downloads downloadWithKey:[RevalidationKeyPrefix stringByAppendingString:path]
+                                usingBlock:^(LOCMSDownloadCompletion done) {
+        [revalidationCache fetchFile:path fromURL:url version:version completion:done];
+    }
+                                completion:^(NSString *contentPath, NSError *error) {
+        if (error) {
+            [response respondWithError:error];
         }
         else {
-            NSString *description = [err description];
-            error = [NSError errorWithDomain:NSURLErrorDomain
-                                        code:NSURLErrorResourceUnavailable
-                                    userInfo:@{ NSLocalizedDescriptionKey: description }];
+            [response respondWithFileData:contentPath
+                                 mimeType:mimeType
+                              cachePolicy:NSURLCacheStorageNotAllowed];
         }
-        [response respondWithError:error];
-    });
+    }];
 }
 
 @end
@@ -22,6 +22,9 @@
 
 /**
  * A request handler for file list requests.
+ * File relations (siblings, children and descendents) are selected using the file DB's
+ * hierarchy columns. Results can be ordered using the _orderBy parameter, and paginated
+ * using the _limit and _offset parameters.
  */
 @interface LOCMSFileListHandler : LOCMSRequestHandler
 
@@ -19,6 +19,27 @@
 #import "LOCMSFileListHandler.h"
 #import "LOContentAuthority.h"
 
+@interface LOCMSFileListHandler ()
+
+/**
+ * Return the names of the ORM mappings referenced by a list of SQL fragments.
+ * Returns nil if any referenced mapping isn't an object mapping, because such mappings
+ * can't be joined without changing the number of result rows.
+ */
+- (NSSet *)objectMappingsReferencedBy:(NSArray *)fragments;
+/**
+ * Select the IDs of matching files, with ordering and pagination applied in the query.
+ * Object mappings referenced by the where or order by clauses are joined to the source table.
+ */
+- (NSArray *)selectFileIDsWhere:(NSString *)where
+                         values:(NSArray *)values
+                       mappings:(NSSet *)mappings
+                        orderBy:(NSString *)orderBy
+                          limit:(NSInteger)limit
+                         offset:(NSInteger)offset;
+
+@end
+
 @implementation LOCMSFileListHandler
 
 - (void)handleRequest:(id<LOContentRequest>)request response:(id<LOContentResponse>)response {
@@ -26,6 +47,7 @@
     NSMutableArray *wheres = [NSMutableArray new];
     NSMutableArray *values = [NSMutableArray new];
     NSArray *mappings = @[];
+    NSString *source = self.fileDB.orm.source;
 
     // A reference file ID.
     NSString *fileID = request.pathParameters[@"id"];
@@ -35,12 +57,14 @@
     NSString *relation = request.pathParameters[@"relation"];
     // An order by clause.
     NSString *orderBy  = request.parameters[@"_orderBy"];
-    // Reference file path.
-    NSString *refPath = @"";
+    // Optional pagination of the result.
+    NSInteger limit  = [request.parameters[@"_limit"] integerValue];
+    NSInteger offset = [request.parameters[@"_offset"] integerValue];
     
     // If a file ID is specified then read a reference file path from the file record.
     if (fileID) {
         // Read the file path.
+        NSString *refPath;
         NSDictionary *row = [self readFileRecordByID:fileID];
         if (row) {
             category = (NSString *)row[@"category"];
@@ -55,11 +79,43 @@
         if ([@"pages" isEqualToString:category] && !orderBy) {
             orderBy = @"page.sort";
         }
-        // Get the path to the directory containing the reference file.
-        refPath = [refPath stringByDeletingLastPathComponent];
-        // Add a where clause to filter by path.
-        [wheres addObject:[NSString stringWithFormat:@"%@.path LIKE ?", self.fileDB.orm.source]];
-        [values addObject:[NSString stringWithFormat:@"%@%%", refPath]];
+        // Get the path to the directory containing the reference file. The dir of files in the
+        // root directory is empty, and every file is below the root directory.
+        NSString *refDir = [self.fileDB directoryOfPath:refPath];
+        BOOL isRootDir = [refDir length] == 0;
+        // Files below the reference directory have a dir within this range.
+        NSString *lowerDir = [refDir stringByAppendingString:@"/"];
+        NSString *upperDir = [refDir stringByAppendingString:@"0"]; // '0' is the character after '/'.
+        // Add a where clause to filter by relation, using the file DB's hierarchy index.
+        if ([@"siblings" isEqualToString:relation]) {
+            // Files are siblings if they share the same directory as the reference file.
+            [wheres addObject:[NSString stringWithFormat:@"%@.dir = ?", source]];
+            [values addObject:refDir];
+        }
+        else if ([@"children" isEqualToString:relation]) {
+            // Files are children if they are in an immediate subdirectory of the reference
+            // file's directory.
+            [wheres addObject:[NSString stringWithFormat:@"%@.depth = ?", source]];
+            [values addObject:[NSNumber numberWithInteger:[self.fileDB depthOfPath:refPath] + 1]];
+            if (!isRootDir) {
+                [wheres addObject:[NSString stringWithFormat:@"%@.dir >= ? AND %@.dir < ?", source, source]];
+                [values addObject:lowerDir];
+                [values addObject:upperDir];
+            }
+        }
+        else if (!isRootDir) {
+            // Files are descendents if they are in the reference file's directory or any of its
+            // subdirectories; so every file is a descendent of a file in the root directory.
+            [wheres addObject:[NSString stringWithFormat:@"(%@.dir = ? OR (%@.dir >= ? AND %@.dir < ?))", source, source, source]];
+            [values addObject:refDir];
+            [values addObject:lowerDir];
+            [values addObject:upperDir];
+        }
+        if (relation && ![@"children" isEqualToString:relation]) {
+            // Reference file can't be its own sibling or descendent.
+            [wheres addObject:[NSString stringWithFormat:@"%@.id != ?", source]];
+            [values addObject:fileID];
+        }
     }
     
     // If category specified then include fileset bindings.
@@ -71,7 +127,7 @@
             return;
         }
         // Note that category field is qualifed by source table name.
-        [wheres addObject:[NSString stringWithFormat:@"%@.category = ?", self.fileDB.orm.source]];
+        [wheres addObject:[NSString stringWithFormat:@"%@.category = ?", source]];
         [values addObject:category];
         mappings = fileset.mappings;
     }
@@ -91,52 +147,119 @@
     // Join the wheres into a single where clause.
     NSString *where = [wheres componentsJoinedByString:@" AND "];
     // Execute query.
-    NSArray *result = [self.fileDB.orm selectWhere:where values:values mappings:mappings orderBy:orderBy];
-    
-    // Apply relation filter.
-    if ([@"siblings" isEqualToString:relation]) {
-        result = [result filteredArrayUsingPredicate:[NSPredicate predicateWithBlock:^BOOL(id item, NSDictionary *bindings) {
-            NSDictionary *row = (NSDictionary *)item;
-            id rowID = row[@"id"];
-            if ([fileID isEqualToString:rowID]) {
-                // Reference file can't be its own sibling.
-                return NO;
+    NSArray *result = nil;
+    if (limit > 0 || offset > 0) {
+        // When the result is paginated, first select the IDs of the requested page of files
+        // using a query on the source table (so that LIMIT isn't affected by the multiple
+        // rows produced by some mappings) and then read the full records for those IDs.
+        NSArray *fragments = orderBy ? [wheres arrayByAddingObject:orderBy] : wheres;
+        NSSet *joins = [self objectMappingsReferencedBy:fragments];
+        if (joins) {
+            NSArray *ids = [self selectFileIDsWhere:where
+                                             values:values
+                                           mappings:joins
+                                            orderBy:orderBy
+                                              limit:limit
+                                             offset:offset];
+            NSMutableArray *placeholders = [NSMutableArray new];
+            for (NSUInteger i = 0; i < [ids count]; i++) {
+                [placeholders addObject:@"?"];
             }
-            NSString *itemPath = (NSString *)row[@"path"];
-            NSString *itemDir  = [itemPath stringByDeletingLastPathComponent];
-            // File is a sibling if it shares the same reference path (i.e. directory) as the reference file.
-            return [refPath isEqualToString:itemDir];
-        }]];
-    }
-    else if ([@"children" isEqualToString:relation]) {
-        result = [result filteredArrayUsingPredicate:[NSPredicate predicateWithBlock:^BOOL(id item, NSDictionary *bindings) {
-            NSDictionary *row  = (NSDictionary *)item;
-            NSString *itemPath = (NSString *)row[@"path"];
-            NSString *gpDir    = [[itemPath stringByDeletingLastPathComponent] stringByDeletingLastPathComponent];
-            // File is a child if the path of its grand-parent directory is the same as the reference path.
-            return [refPath isEqualToString:gpDir];
-        }]];
-    }
-    else if ([@"descendents" isEqualToString:relation]) {
-        // Filter out the reference file from the result.
-        result = [result filteredArrayUsingPredicate:[NSPredicate predicateWithBlock:^BOOL(id item, NSDictionary *bindings) {
-            NSDictionary *row = (NSDictionary *)item;
-            id rowID = row[@"id"];
-            if ([fileID isEqualToString:rowID]) {
-                // Reference file can't be its own descendent.
-                return NO;
+            NSString *idWhere = [NSString stringWithFormat:@"%@.id IN (%@)", source, [placeholders componentsJoinedByString:@","]];
+            NSArray *records = [ids count] > 0
+                ? [self.fileDB.orm selectWhere:idWhere values:ids mappings:mappings]
+                : @[];
+            // Return the records in the order of the ID query.
+            NSMutableDictionary *recordsByID = [NSMutableDictionary new];
+            for (NSDictionary *record in records) {
+                recordsByID[[record[@"id"] description]] = record;
+            }
+            NSMutableArray *ordered = [NSMutableArray new];
+            for (id recordID in ids) {
+                NSDictionary *record = recordsByID[[recordID description]];
+                if (record) {
+                    [ordered addObject:record];
+                }
+            }
+            result = ordered;
+        }
+        else {
+            // The query references a mapping which can't be used in the ID query, so select
+            // all matching records and paginate the result.
+            result = [self.fileDB.orm selectWhere:where values:values mappings:mappings orderBy:orderBy];
+            NSUInteger start = MIN((NSUInteger)offset, [result count]);
+            NSUInteger length = [result count] - start;
+            if (limit > 0) {
+                length = MIN((NSUInteger)limit, length);
             }
-            /*
-            NSString *itemPath = (NSString *)row[@"path"];
-            // File is a descendent if its path has the reference path as a prefix.
-            return [itemPath hasPrefix:refPath];
-            */
-            return YES;
-        }]];
+            result = [result subarrayWithRange:NSMakeRange(start, length)];
+        }
+    }
+    else {
+        result = [self.fileDB.orm selectWhere:where values:values mappings:mappings orderBy:orderBy];
     }
     
     // Return the result.
     [response respondWithJSONData:result cachePolicy:NSURLCacheStorageNotAllowed];
 }
 
+#pragma mark - Private
+
+- (NSSet *)objectMappingsReferencedBy:(NSArray *)fragments {
+    NSString *source = self.fileDB.orm.source;
+    NSDictionary *ormMappings = self.fileDB.orm.mappings;
+    NSMutableSet *names = [NSMutableSet new];
+    NSRegularExpression *re = [NSRegularExpression regularExpressionWithPattern:@"([A-Za-z_][A-Za-z0-9_]*)\\."
+                                                                        options:0
+                                                                          error:nil];
+    for (NSString *fragment in fragments) {
+        NSArray *matches = [re matchesInString:fragment options:0 range:NSMakeRange(0, [fragment length])];
+        for (NSTextCheckingResult *match in matches) {
+            NSString *name = [fragment substringWithRange:[match rangeAtIndex:1]];
+            if ([name isEqualToString:source]) {
+                continue;
+            }
+            SCDBORMMapping *mapping = ormMappings[name];
+            if (![mapping isObjectMapping]) {
+                return nil;
+            }
+            [names addObject:name];
+        }
+    }
+    return names;
+}
+
+- (NSArray *)selectFileIDsWhere:(NSString *)where
+                         values:(NSArray *)values
+                       mappings:(NSSet *)mappings
+                        orderBy:(NSString *)orderBy
+                          limit:(NSInteger)limit
+                         offset:(NSInteger)offset {
+    NSString *source = self.fileDB.orm.source;
+    NSString *idColumn = [self.fileDB getColumnWithTag:@"id" fromTable:source];
+    NSMutableString *sql = [NSMutableString stringWithFormat:@"SELECT %@.%@ AS id FROM %@", source, idColumn, source];
+    for (NSString *name in mappings) {
+        // Object mappings share the source record's ID.
+        SCDBORMMapping *mapping = self.fileDB.orm.mappings[name];
+        NSString *midColumn = [self.fileDB getColumnWithTag:@"id" fromTable:mapping.table];
+        [sql appendFormat:@" LEFT OUTER JOIN %@ AS %@ ON %@.%@ = %@.%@", mapping.table, name, name, midColumn, source, idColumn];
+    }
+    if ([where length] > 0) {
+        [sql appendFormat:@" WHERE %@", where];
+    }
+    if (orderBy) {
+        [sql appendFormat:@" ORDER BY %@", orderBy];
+    }
+    [sql appendFormat:@" LIMIT %ld OFFSET %ld", (long)(limit > 0 ? limit : -1), (long)offset];
+    NSArray *rs = [self.fileDB performQuery:sql withParams:values];
+    NSMutableArray *ids = [NSMutableArray new];
+    for (NSDictionary *record in rs) {
+        id recordID = record[@"id"];
+        if (recordID) {
+            [ids addObject:recordID];
+        }
+    }
+    return ids;
+}
+
 @end
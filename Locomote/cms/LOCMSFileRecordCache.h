@@ -0,0 +1,62 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * An in-memory LRU cache of file records read from the file DB.
+ * Each cached record is tagged with the file DB generation it was read under; a record
+ * is only returned for a lookup made under the same generation, so any update to the file
+ * DB (which increments its generation) invalidates all previously cached records without
+ * needing to track which records have changed. Lookups which found no record can also be
+ * cached.
+ * All methods are thread safe.
+ */
+@interface LOCMSFileRecordCache : NSObject
+
+/// Initialize the cache with the maximum number of records to hold.
+- (id)initWithCapacity:(NSUInteger)capacity;
+
+/// The maximum number of records held by the cache.
+@property (nonatomic, assign, readonly) NSUInteger capacity;
+/// The number of records currently held by the cache.
+@property (nonatomic, assign, readonly) NSUInteger count;
+/// An estimate of the memory used by cached records, in bytes.
+@property (nonatomic, assign, readonly) NSUInteger estimatedSize;
+/// The number of lookups which found a current record.
+@property (nonatomic, assign, readonly) NSUInteger hits;
+/// The number of lookups which didn't find a current record.
+@property (nonatomic, assign, readonly) NSUInteger misses;
+/// The proportion of lookups which found a current record.
+@property (nonatomic, assign, readonly) double hitRate;
+
+/**
+ * Lookup a record in the cache.
+ * Returns YES if a record was cached under the key in the specified generation; the
+ * record is returned via the record pointer, and is nil if the cached lookup found no
+ * record. Returns NO on a cache miss.
+ */
+- (BOOL)lookupRecordForKey:(NSString *)key generation:(NSUInteger)generation record:(NSDictionary **)record;
+/**
+ * Add a record to the cache.
+ * The record may be nil, to record that no record exists for the key.
+ */
+- (void)setRecord:(NSDictionary *)record forKey:(NSString *)key generation:(NSUInteger)generation;
+/// Remove all records from the cache.
+- (void)removeAllRecords;
+/// Reset the hit and miss counts.
+- (void)resetStatistics;
+
+@end
@@ -0,0 +1,207 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LOCMSFileRecordCache.h"
+
+// Estimated fixed overhead of a cache entry and of each object within a record, in bytes.
+#define EntryOverhead   (128)
+#define ObjectOverhead  (32)
+
+/// A cache entry; entries form a doubly linked list in least to most recently used order.
+@interface LOCMSFileRecordCacheEntry : NSObject
+
+@property (nonatomic, strong) NSString *key;
+@property (nonatomic, strong) NSDictionary *record;
+@property (nonatomic, assign) NSUInteger generation;
+@property (nonatomic, assign) NSUInteger size;
+@property (nonatomic, weak) LOCMSFileRecordCacheEntry *prev;
+@property (nonatomic, strong) LOCMSFileRecordCacheEntry *next;
+
+@end
+
+@implementation LOCMSFileRecordCacheEntry
+@end
+
+/// Estimate the memory used by a record value.
+static NSUInteger EstimateSize(id value) {
+    NSUInteger size = ObjectOverhead;
+    if ([value isKindOfClass:[NSString class]]) {
+        size += [(NSString *)value length] * sizeof(unichar);
+    }
+    else if ([value isKindOfClass:[NSData class]]) {
+        size += [(NSData *)value length];
+    }
+    else if ([value isKindOfClass:[NSDictionary class]]) {
+        for (id key in (NSDictionary *)value) {
+            size += EstimateSize(key) + EstimateSize(((NSDictionary *)value)[key]);
+        }
+    }
+    else if ([value isKindOfClass:[NSArray class]]) {
+        for (id item in (NSArray *)value) {
+            size += EstimateSize(item);
+        }
+    }
+    return size;
+}
+
+@interface LOCMSFileRecordCache () {
+    NSMutableDictionary<NSString *, LOCMSFileRecordCacheEntry *> *_entries;
+    /// The least recently used entry.
+    LOCMSFileRecordCacheEntry *_head;
+    /// The most recently used entry.
+    __weak LOCMSFileRecordCacheEntry *_tail;
+}
+
+/// Remove an entry from the cache.
+- (void)removeEntry:(LOCMSFileRecordCacheEntry *)entry;
+/// Append an entry to the most recently used end of the list.
+- (void)appendEntry:(LOCMSFileRecordCacheEntry *)entry;
+
+@end
+
+@implementation LOCMSFileRecordCache
+
+- (id)initWithCapacity:(NSUInteger)capacity {
+    self = [super init];
+    if (self) {
+        _capacity = MAX(1, capacity);
+        _entries = [NSMutableDictionary new];
+    }
+    return self;
+}
+
+- (NSUInteger)count {
+    @synchronized (self) {
+        return [_entries count];
+    }
+}
+
+- (double)hitRate {
+    @synchronized (self) {
+        NSUInteger lookups = _hits + _misses;
+        return lookups > 0 ? (double)_hits / (double)lookups : 0.0;
+    }
+}
+
+- (BOOL)lookupRecordForKey:(NSString *)key generation:(NSUInteger)generation record:(NSDictionary **)record {
+    @synchronized (self) {
+        LOCMSFileRecordCacheEntry *entry = _entries[key];
+        if (entry && entry.generation != generation) {
+            // Entry is stale; the file DB has been updated since it was read.
+            [self removeEntry:entry];
+            entry = nil;
+        }
+        if (!entry) {
+            _misses++;
+            return NO;
+        }
+        _hits++;
+        // Move the entry to the most recently used position.
+        if (entry != _tail) {
+            [self removeEntry:entry];
+            [self appendEntry:entry];
+        }
+        if (record) {
+            *record = entry.record;
+        }
+        return YES;
+    }
+}
+
+- (void)setRecord:(NSDictionary *)record forKey:(NSString *)key generation:(NSUInteger)generation {
+    LOCMSFileRecordCacheEntry *entry = [LOCMSFileRecordCacheEntry new];
+    entry.key = key;
+    // Copy the record so that it can't be modified once cached.
+    entry.record = [record copy];
+    entry.generation = generation;
+    entry.size = EntryOverhead + EstimateSize(key) + (record ? EstimateSize(record) : 0);
+    @synchronized (self) {
+        LOCMSFileRecordCacheEntry *existing = _entries[key];
+        if (existing) {
+            [self removeEntry:existing];
+        }
+        while ([_entries count] >= _capacity && _head) {
+            // Evict the least recently used entry.
+            [self removeEntry:_head];
+        }
+        [self appendEntry:entry];
+    }
+}
+
+- (void)removeAllRecords {
+    @synchronized (self) {
+        [_entries removeAllObjects];
+        // Unlink entries one at a time, to avoid deep recursion when releasing a long list.
+        while (_head) {
+            LOCMSFileRecordCacheEntry *next = _head.next;
+            _head.next = nil;
+            _head = next;
+        }
+        _tail = nil;
+        _estimatedSize = 0;
+    }
+}
+
+- (void)resetStatistics {
+    @synchronized (self) {
+        _hits = 0;
+        _misses = 0;
+    }
+}
+
+- (void)dealloc {
+    [self removeAllRecords];
+}
+
+#pragma mark - Private
+
+- (void)removeEntry:(LOCMSFileRecordCacheEntry *)removed {
+    // Hold a strong reference, as the list may hold the only other reference to the entry.
+    LOCMSFileRecordCacheEntry *entry = removed;
+    LOCMSFileRecordCacheEntry *prev = entry.prev, *next = entry.next;
+    if (prev) {
+        prev.next = next;
+    }
+    else {
+        _head = next;
+    }
+    if (next) {
+        next.prev = prev;
+    }
+    else {
+        _tail = prev;
+    }
+    entry.prev = nil;
+    entry.next = nil;
+    [_entries removeObjectForKey:entry.key];
+    _estimatedSize -= entry.size;
+}
+
+- (void)appendEntry:(LOCMSFileRecordCacheEntry *)entry {
+    LOCMSFileRecordCacheEntry *tail = _tail;
+    entry.prev = tail;
+    entry.next = nil;
+    if (tail) {
+        tail.next = entry;
+    }
+    else {
+        _head = entry;
+    }
+    _tail = entry;
+    _entries[entry.key] = entry;
+    _estimatedSize += entry.size;
+}
+
+@end
@@ -41,6 +41,11 @@
 @property (nonatomic, strong) NSString *category;
 /** A flag indicating whether a fileset's content should be downloaded and cached. */
 @property (nonatomic, assign) BOOL cachable;
+/**
+ * A flag indicating whether a fileset's cached content may be evicted to keep the content cache
+ * within its size budget. Only content-cached filesets are evictable; see LOCMSContentCacheBudget.
+ */
+@property (nonatomic, assign, readonly) BOOL evictable;
 
 /// Get the path of the cache location for this fileset.
 - (NSString *)cachePath:(LOCMSRepository *)repository;
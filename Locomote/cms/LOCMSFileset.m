@@ -26,6 +26,7 @@
 - (void)setCache:(NSString *)cache {
     _cache = cache;
     _cachable = ([@"content" isEqualToString:cache] || [@"app" isEqualToString:cache]);
+    _evictable = [@"content" isEqualToString:cache];
 }
 
 - (NSString *)cachePath:(LOCMSRepository *)repository {
@@ -0,0 +1,116 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "LOHTTPAuthenticationManager.h"
+#import "LOCMSFileDB.h"
+#import "Q.h"
+
+/// The result of a fileset download.
+@interface LOCMSFilesetDownload : NSObject
+
+/// The fileset category.
+@property (nonatomic, strong, readonly) NSString *category;
+/// The HTTP status code of the download response; 200 for a resumed download.
+@property (nonatomic, assign, readonly) NSInteger statusCode;
+/// The staging directory the fileset zip was extracted to; nil if the response had no content.
+@property (nonatomic, strong, readonly) NSString *stagedPath;
+/// The number of bytes received from the server by the download; excludes data received before the download was resumed.
+@property (nonatomic, assign, readonly) long long bytesReceived;
+/**
+ * Flag indicating that the download stopped before completing, because its yield block asked
+ * it to. The download's progress is kept, so that it resumes when the same request is repeated.
+ */
+@property (nonatomic, assign, readonly) BOOL yielded;
+
+@end
+
+/**
+ * A downloader for fileset zip archives which can resume interrupted downloads.
+ * Fileset zips are extracted as they're received into a per-fileset staging directory under the
+ * staging path, and the download's progress - the archive offset of the last fully extracted
+ * entry - is recorded in the file DB's filesetdownloads table. When a download of the same
+ * fileset request is next attempted - either by an automatic retry after a network error, or by
+ * a later refresh after the app was suspended or restarted - the download resumes from that
+ * offset using a HTTP Range request. An If-Range validator ensures that the partial data is
+ * discarded if the fileset content has changed on the server.
+ * Archives which can't be extracted as a stream are instead written to a partial download file,
+ * which is resumed in the same way and then unzipped into the staging directory once complete.
+ * Staged files are moved into the fileset's cache directory by installDownload:, and any staged
+ * data is kept until the downloader is notified that the downloaded fileset has been processed.
+ */
+@interface LOCMSFilesetDownloader : NSObject <NSURLSessionDataDelegate>
+
+- (id)initWithFileDB:(LOCMSFileDB *)fileDB authenticationManager:(LOHTTPAuthenticationManager *)authManager;
+
+/// A path for storing partial downloads. Defaults to the system temporary directory.
+@property (nonatomic, strong) NSString *stagingPath;
+/// The number of times to attempt a download before failing. Defaults to 3.
+@property (nonatomic, assign) NSInteger maxAttempts;
+/// The number of fileset downloads currently in progress, including any waiting to retry.
+@property (atomic, assign, readonly) NSUInteger activeCount;
+
+/**
+ * Download a fileset.
+ * The request is identified by its method, URL and body, together with the fileset commit being
+ * downloaded; a previous partial download is only resumed if made for an identical request.
+ * The fileset zip is only extracted if the extract flag is YES; otherwise its content is discarded.
+ * The returned promise resolves to a LOCMSFilesetDownload instance.
+ */
+- (QPromise *)downloadFileset:(NSString *)category
+                      fromURL:(NSString *)url
+                       method:(NSString *)method
+                         data:(NSDictionary *)data
+                       commit:(NSString *)commit
+                      extract:(BOOL)extract;
+/**
+ * Download a fileset, yielding to other work when requested.
+ * As downloadFileset:fromURL:method:data:commit:extract:, but the yield block is tested as
+ * content is received; if it returns YES, then the download stops and its promise resolves
+ * to a download with the yielded flag set. Downloads whose content is discarded don't yield,
+ * as they can't be resumed.
+ */
+- (QPromise *)downloadFileset:(NSString *)category
+                      fromURL:(NSString *)url
+                       method:(NSString *)method
+                         data:(NSDictionary *)data
+                       commit:(NSString *)commit
+                      extract:(BOOL)extract
+                   yieldBlock:(BOOL (^)(void))yieldBlock;
+/**
+ * Move a downloaded fileset's staged files to the fileset's cache directory.
+ * If replacingContents is YES then the download contains the full fileset, and the staging
+ * directory is atomically swapped with the cache directory; otherwise the download only
+ * contains updated files, and each staged file atomically replaces the cached file at the
+ * same path.
+ */
+- (BOOL)installDownload:(LOCMSFilesetDownload *)download
+                 atPath:(NSString *)cachePath
+      replacingContents:(BOOL)replacingContents
+                  error:(NSError **)error;
+/**
+ * Notify the downloader that a downloaded fileset has been processed.
+ * Deletes any staged data and the fileset's download progress record.
+ */
+- (void)completeDownloadOfFileset:(NSString *)category;
+/**
+ * Return the paths of staged data which no longer belongs to a resumable download.
+ * This includes replaced fileset content awaiting deletion, and partial downloads and staging
+ * directories for which there is no download progress record. Only data last modified before
+ * the cutoff date is returned, so that data for a download which is just starting is kept.
+ */
+- (NSArray<NSString *> *)orphanedStagingPathsModifiedBefore:(NSDate *)cutoff;
+
+@end
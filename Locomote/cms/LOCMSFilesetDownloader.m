@@ -0,0 +1,727 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LOCMSFilesetDownloader.h"
+#import "LOCMSZipArchiveExtractor.h"
+#import "LOCMSZipStreamExtractor.h"
+#import "LODigest.h"
+#import "SCLogger.h"
+
+// The name of the staging sub-directory partial downloads are written to.
+#define DownloadsDirName        (@"downloads")
+// The name of the staging sub-directory fileset zips are extracted to.
+#define FilesetsDirName         (@"filesets")
+// The name of the staging sub-directory replaced fileset content is moved to before deletion.
+#define TrashDirName            (@"trash")
+// A suffix added to the request key of downloads which are written to a partial download file.
+#define SpoolKeySuffix          (@" spool")
+// The file extension of partial downloads.
+#define PartialFileExtension    (@"part")
+// The number of bytes received between each update of a download's progress record.
+#define ProgressRecordInterval  (1024 * 1024)
+// The delay before the first retry of a failed download, in seconds; doubled on each later retry.
+#define RetryDelay              (2.0)
+// The default number of download attempts.
+#define DefaultMaxAttempts      (3)
+
+static SCLogger *Logger;
+
+@interface LOCMSFilesetDownload ()
+
+- (id)initWithCategory:(NSString *)category
+            statusCode:(NSInteger)statusCode
+            stagedPath:(NSString *)stagedPath
+         bytesReceived:(long long)bytesReceived;
+
+@property (nonatomic, assign, readwrite) BOOL yielded;
+
+@end
+
+/// The state of an in-progress fileset download.
+@interface LOCMSFilesetDownloadState : NSObject
+
+/// The fileset category.
+@property (nonatomic, strong) NSString *category;
+/// The download request, without any range headers.
+@property (nonatomic, strong) NSURLRequest *request;
+/// A key identifying the download request.
+@property (nonatomic, strong) NSString *requestKey;
+/// A flag indicating whether to extract the fileset zip.
+@property (nonatomic, assign) BOOL extract;
+/// A flag indicating that the fileset zip is written to a partial download file, rather than extracted as a stream.
+@property (nonatomic, assign) BOOL spool;
+/// The location of the partial download file.
+@property (nonatomic, strong) NSString *path;
+/// The staging directory the fileset zip is extracted to.
+@property (nonatomic, strong) NSString *stagedPath;
+/// A promise resolved once the download completes.
+@property (nonatomic, strong) QPromise *promise;
+/// The number of download attempts made so far.
+@property (nonatomic, assign) NSInteger attempts;
+/// The response status code.
+@property (nonatomic, assign) NSInteger statusCode;
+/// The content validator; the response ETag or last modified time.
+@property (nonatomic, strong) NSString *validator;
+/// The archive offset the current attempt's response data starts at.
+@property (nonatomic, assign) long long offset;
+/// The number of bytes of the archive received, including any received by previous attempts.
+@property (nonatomic, assign) long long received;
+/// The number of response bytes received by all attempts of this download.
+@property (nonatomic, assign) long long transferred;
+/// The progress value when the progress record was last updated.
+@property (nonatomic, assign) long long recorded;
+/// The full content length; -1 if unknown.
+@property (nonatomic, assign) long long length;
+/// The extractor the response data is written to, when extracting as a stream.
+@property (nonatomic, strong) LOCMSZipStreamExtractor *extractor;
+/// A handle for writing to the partial download file, when not extracting as a stream.
+@property (nonatomic, strong) NSFileHandle *fileHandle;
+/// An error which caused the download attempt to be abandoned.
+@property (nonatomic, strong) NSError *failure;
+/// A flag indicating that the download should be restarted from the beginning.
+@property (nonatomic, assign) BOOL restart;
+/// A block which returns YES when the download should stop and yield to other work.
+@property (nonatomic, copy) BOOL (^yieldBlock)(void);
+/// A flag indicating that the download was stopped by its yield block.
+@property (nonatomic, assign) BOOL yielded;
+
+@end
+
+@interface LOCMSFilesetDownloader () {
+    __weak LOCMSFileDB *_fileDB;
+    __weak LOHTTPAuthenticationManager *_authManager;
+    /// The session used to perform downloads.
+    NSURLSession *_session;
+    /// In-progress downloads, keyed by task identifier.
+    NSMutableDictionary<NSNumber *, LOCMSFilesetDownloadState *> *_downloads;
+    /// The number of downloads whose promise is still pending.
+    NSUInteger _activeCount;
+}
+
+/// Start or resume a download.
+- (void)startDownload:(LOCMSFilesetDownloadState *)download;
+/// Finish a download attempt, and either retry, resolve or reject the download.
+- (void)finishDownload:(LOCMSFilesetDownloadState *)download error:(NSError *)error;
+/// Prepare to receive a download's content.
+- (BOOL)openDownload:(LOCMSFilesetDownloadState *)download;
+/// Write received content data to a download's extractor or partial download file.
+- (BOOL)writeData:(NSData *)data toDownload:(LOCMSFilesetDownloadState *)download;
+/// Complete the extraction of a download's content into its staging directory.
+- (BOOL)closeDownload:(LOCMSFilesetDownloadState *)download;
+/// Record a download's progress in the file DB.
+- (void)recordProgressOfDownload:(LOCMSFilesetDownloadState *)download;
+/// Discard any partial data for a download.
+- (void)discardPartialDownload:(LOCMSFilesetDownloadState *)download;
+/// Return the location of the partial download file for a fileset.
+- (NSString *)partialDownloadPathForFileset:(NSString *)category;
+/// Return the staging directory for a fileset.
+- (NSString *)stagedPathForFileset:(NSString *)category;
+
+@end
+
+/// Encode a dictionary of request parameters as a URL query string.
+static NSString *EncodeParameters(NSDictionary *data) {
+    static NSCharacterSet *allowedChars;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSMutableCharacterSet *chars = [[NSCharacterSet alphanumericCharacterSet] mutableCopy];
+        [chars addCharactersInString:@"-._~"];
+        allowedChars = chars;
+    });
+    NSMutableArray *params = [NSMutableArray new];
+    // Sort the parameter names, so that the same parameters always produce the same request.
+    for (NSString *name in [[data allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+        NSString *value = [data[name] description];
+        [params addObject:[NSString stringWithFormat:@"%@=%@",
+                           [name stringByAddingPercentEncodingWithAllowedCharacters:allowedChars],
+                           [value stringByAddingPercentEncodingWithAllowedCharacters:allowedChars]]];
+    }
+    return [params componentsJoinedByString:@"&"];
+}
+
+/// Parse the start offset and full length from a Content-Range header. Returns NO if the header is invalid.
+static BOOL ParseContentRange(NSString *header, long long *start, long long *length) {
+    // Header format is "bytes start-end/length", where length may be "*".
+    NSScanner *scanner = [NSScanner scannerWithString:header ?: @""];
+    long long end;
+    if (!([scanner scanString:@"bytes" intoString:nil]
+          && [scanner scanLongLong:start]
+          && [scanner scanString:@"-" intoString:nil]
+          && [scanner scanLongLong:&end]
+          && [scanner scanString:@"/" intoString:nil])) {
+        return NO;
+    }
+    if (![scanner scanLongLong:length]) {
+        *length = -1;
+    }
+    return YES;
+}
+
+@implementation LOCMSFilesetDownload
+
+- (id)initWithCategory:(NSString *)category
+            statusCode:(NSInteger)statusCode
+            stagedPath:(NSString *)stagedPath
+         bytesReceived:(long long)bytesReceived {
+    self = [super init];
+    if (self) {
+        _category = category;
+        _statusCode = statusCode;
+        _stagedPath = stagedPath;
+        _bytesReceived = bytesReceived;
+    }
+    return self;
+}
+
+@end
+
+@implementation LOCMSFilesetDownloadState
+@end
+
+@implementation LOCMSFilesetDownloader
+
++ (void)initialize {
+    Logger = [[SCLogger alloc] initWithTag:@"LOCMSFilesetDownloader"];
+}
+
+- (id)initWithFileDB:(LOCMSFileDB *)fileDB authenticationManager:(LOHTTPAuthenticationManager *)authManager {
+    self = [super init];
+    if (self) {
+        _fileDB = fileDB;
+        _authManager = authManager;
+        _maxAttempts = DefaultMaxAttempts;
+        _downloads = [NSMutableDictionary new];
+        NSOperationQueue *delegateQueue = [NSOperationQueue new];
+        delegateQueue.maxConcurrentOperationCount = 1;
+        _session = [NSURLSession sessionWithConfiguration:[NSURLSessionConfiguration defaultSessionConfiguration]
+                                                 delegate:self
+                                            delegateQueue:delegateQueue];
+    }
+    return self;
+}
+
+- (QPromise *)downloadFileset:(NSString *)category
+                      fromURL:(NSString *)url
+                       method:(NSString *)method
+                         data:(NSDictionary *)data
+                       commit:(NSString *)commit
+                      extract:(BOOL)extract {
+    return [self downloadFileset:category fromURL:url method:method data:data commit:commit extract:extract yieldBlock:nil];
+}
+
+- (QPromise *)downloadFileset:(NSString *)category
+                      fromURL:(NSString *)url
+                       method:(NSString *)method
+                         data:(NSDictionary *)data
+                       commit:(NSString *)commit
+                      extract:(BOOL)extract
+                   yieldBlock:(BOOL (^)(void))yieldBlock {
+    NSString *params = EncodeParameters(data ?: @{});
+    NSData *body = nil;
+    if ([@"GET" isEqualToString:method]) {
+        if ([params length] > 0) {
+            NSString *separator = [url rangeOfString:@"?"].location == NSNotFound ? @"?" : @"&";
+            url = [NSString stringWithFormat:@"%@%@%@", url, separator, params];
+        }
+    }
+    else {
+        body = [params dataUsingEncoding:NSUTF8StringEncoding];
+    }
+    NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:[NSURL URLWithString:url]];
+    request.HTTPMethod = method;
+    if (body) {
+        request.HTTPBody = body;
+        [request setValue:@"application/x-www-form-urlencoded" forHTTPHeaderField:@"Content-Type"];
+    }
+    // Fileset zips are already compressed; requesting the identity encoding ensures that byte
+    // ranges refer to the zip file data.
+    [request setValue:@"identity" forHTTPHeaderField:@"Accept-Encoding"];
+
+    LOCMSFilesetDownloadState *download = [LOCMSFilesetDownloadState new];
+    download.category = category;
+    download.request = request;
+    // A partial download can only be resumed by an identical request for the same fileset commit.
+    download.requestKey = [NSString stringWithFormat:@"%@ %@ %@ %@",
+                           method, url, commit ?: @"-", body ? [LODigest sha1HexDigestOfData:body] : @"-"];
+    download.extract = extract;
+    download.yieldBlock = yieldBlock;
+    download.path = [self partialDownloadPathForFileset:category];
+    download.stagedPath = [self stagedPathForFileset:category];
+    download.promise = [QPromise new];
+    @synchronized (self) {
+        _activeCount++;
+    }
+    [self startDownload:download];
+    return download.promise;
+}
+
+- (BOOL)installDownload:(LOCMSFilesetDownload *)download
+                 atPath:(NSString *)cachePath
+      replacingContents:(BOOL)replacingContents
+                  error:(NSError **)error {
+    NSString *stagedPath = download.stagedPath;
+    if (!(stagedPath && cachePath)) {
+        return YES;
+    }
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    [fileManager createDirectoryAtPath:[cachePath stringByDeletingLastPathComponent]
+           withIntermediateDirectories:YES
+                            attributes:nil
+                                 error:nil];
+    if (replacingContents) {
+        if (![fileManager fileExistsAtPath:cachePath]) {
+            return [fileManager moveItemAtPath:stagedPath toPath:cachePath error:error];
+        }
+        // Swap the staging and cache directories in a single operation, so that readers see either
+        // the old or the new fileset but never a mix of both; the staging directory then holds the
+        // old fileset content, which is deleted in the background.
+        NSString *stagingPath = _stagingPath ?: NSTemporaryDirectory();
+        NSString *trashPath = [[stagingPath stringByAppendingPathComponent:TrashDirName]
+                               stringByAppendingPathComponent:[[NSUUID UUID] UUIDString]];
+        [fileManager createDirectoryAtPath:[trashPath stringByDeletingLastPathComponent]
+               withIntermediateDirectories:YES
+                                attributes:nil
+                                     error:nil];
+        int swapped = -1;
+#ifdef __APPLE__
+        if (@available(iOS 10.0, *)) {
+            swapped = renamex_np([stagedPath fileSystemRepresentation], [cachePath fileSystemRepresentation], RENAME_SWAP);
+        }
+#endif
+        if (swapped == 0) {
+            [fileManager moveItemAtPath:stagedPath toPath:trashPath error:nil];
+        }
+        else {
+            // Swap not supported by the file system; move the old content out of the way first.
+            if (![fileManager moveItemAtPath:cachePath toPath:trashPath error:error]) {
+                return NO;
+            }
+            if (![fileManager moveItemAtPath:stagedPath toPath:cachePath error:error]) {
+                // Restore the old content.
+                [fileManager moveItemAtPath:trashPath toPath:cachePath error:nil];
+                return NO;
+            }
+        }
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+            [[NSFileManager defaultManager] removeItemAtPath:trashPath error:nil];
+        });
+        return YES;
+    }
+    // Move each updated file over the cached file; rename() replaces the target atomically.
+    NSArray *subpaths = [fileManager subpathsOfDirectoryAtPath:stagedPath error:error];
+    if (!subpaths) {
+        return NO;
+    }
+    for (NSString *subpath in subpaths) {
+        NSString *fromPath = [stagedPath stringByAppendingPathComponent:subpath];
+        NSString *toPath = [cachePath stringByAppendingPathComponent:subpath];
+        BOOL isDir = NO;
+        if ([fileManager fileExistsAtPath:fromPath isDirectory:&isDir] && isDir) {
+            [fileManager createDirectoryAtPath:toPath withIntermediateDirectories:YES attributes:nil error:nil];
+            continue;
+        }
+        [fileManager createDirectoryAtPath:[toPath stringByDeletingLastPathComponent]
+               withIntermediateDirectories:YES
+                                attributes:nil
+                                     error:nil];
+        if (rename([fromPath fileSystemRepresentation], [toPath fileSystemRepresentation]) != 0) {
+            if (error) {
+                *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+            }
+            return NO;
+        }
+    }
+    return YES;
+}
+
+- (void)completeDownloadOfFileset:(NSString *)category {
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    [fileManager removeItemAtPath:[self partialDownloadPathForFileset:category] error:nil];
+    [fileManager removeItemAtPath:[self stagedPathForFileset:category] error:nil];
+    [_fileDB deleteFilesetDownloadRecordForCategory:category];
+}
+
+- (NSUInteger)activeCount {
+    @synchronized (self) {
+        return _activeCount;
+    }
+}
+
+- (NSArray<NSString *> *)orphanedStagingPathsModifiedBefore:(NSDate *)cutoff {
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSString *stagingPath = _stagingPath ?: NSTemporaryDirectory();
+    NSMutableArray *paths = [NSMutableArray new];
+    // Returns YES if the item at a path was last modified before the cutoff.
+    BOOL (^isStale)(NSString *) = ^(NSString *path) {
+        NSDate *modified = [[fileManager attributesOfItemAtPath:path error:nil] fileModificationDate];
+        return (BOOL)(modified && [modified compare:cutoff] == NSOrderedAscending);
+    };
+    // Anything in the trash is no longer needed.
+    NSString *trashPath = [stagingPath stringByAppendingPathComponent:TrashDirName];
+    for (NSString *name in [fileManager contentsOfDirectoryAtPath:trashPath error:nil]) {
+        NSString *path = [trashPath stringByAppendingPathComponent:name];
+        if (isStale(path)) {
+            [paths addObject:path];
+        }
+    }
+    // Partial downloads and staging directories are kept for as long as their fileset has a
+    // download progress record; a record is written before any data is received.
+    NSString *downloadsPath = [stagingPath stringByAppendingPathComponent:DownloadsDirName];
+    for (NSString *name in [fileManager contentsOfDirectoryAtPath:downloadsPath error:nil]) {
+        NSString *category = [[name stringByDeletingPathExtension] stringByDeletingPathExtension];
+        NSString *path = [downloadsPath stringByAppendingPathComponent:name];
+        if (![_fileDB getFilesetDownloadRecordForCategory:category] && isStale(path)) {
+            [paths addObject:path];
+        }
+    }
+    NSString *filesetsPath = [stagingPath stringByAppendingPathComponent:FilesetsDirName];
+    for (NSString *category in [fileManager contentsOfDirectoryAtPath:filesetsPath error:nil]) {
+        NSString *path = [filesetsPath stringByAppendingPathComponent:category];
+        if (![_fileDB getFilesetDownloadRecordForCategory:category] && isStale(path)) {
+            [paths addObject:path];
+        }
+    }
+    return paths;
+}
+
+#pragma mark - NSURLSessionDataDelegate
+
+- (void)URLSession:(NSURLSession *)session
+          dataTask:(NSURLSessionDataTask *)dataTask
+didReceiveResponse:(NSURLResponse *)response
+ completionHandler:(void (^)(NSURLSessionResponseDisposition))completionHandler {
+    LOCMSFilesetDownloadState *download = _downloads[@(dataTask.taskIdentifier)];
+    NSHTTPURLResponse *httpResponse = (NSHTTPURLResponse *)response;
+    NSDictionary *headers = httpResponse.allHeaderFields;
+    NSInteger statusCode = httpResponse.statusCode;
+    download.statusCode = statusCode;
+    if (statusCode == 206) {
+        // Partial content; check that the range starts where the previous attempt finished.
+        long long start, length;
+        if (!ParseContentRange(headers[@"Content-Range"], &start, &length) || start != download.offset) {
+            [Logger warn:@"Unexpected content range for fileset %@, restarting download", download.category];
+            download.restart = YES;
+            completionHandler(NSURLSessionResponseCancel);
+            return;
+        }
+        download.length = length;
+    }
+    else if (statusCode == 200) {
+        // Full content; the server either doesn't support ranges, or the content has changed.
+        if (download.offset > 0) {
+            [self discardPartialDownload:download];
+        }
+        download.length = response.expectedContentLength;
+    }
+    if ((statusCode == 200 || statusCode == 206) && download.extract) {
+        download.received = download.offset;
+        download.validator = headers[@"ETag"] ?: headers[@"Last-Modified"];
+        if (![self openDownload:download]) {
+            completionHandler(NSURLSessionResponseCancel);
+            return;
+        }
+        [self recordProgressOfDownload:download];
+    }
+    completionHandler(NSURLSessionResponseAllow);
+}
+
+- (void)URLSession:(NSURLSession *)session dataTask:(NSURLSessionDataTask *)dataTask didReceiveData:(NSData *)data {
+    LOCMSFilesetDownloadState *download = _downloads[@(dataTask.taskIdentifier)];
+    download.received += [data length];
+    download.transferred += [data length];
+    if (!(download.extractor || download.fileHandle)) {
+        // Content not needed.
+        return;
+    }
+    if (![self writeData:data toDownload:download]) {
+        [dataTask cancel];
+        return;
+    }
+    long long progress = download.spool ? download.received : download.extractor.boundaryOffset;
+    if (progress - download.recorded >= ProgressRecordInterval) {
+        [self recordProgressOfDownload:download];
+    }
+    if (!download.yielded && download.yieldBlock && download.yieldBlock()) {
+        // Stop at this checkpoint; progress is recorded as the attempt finishes, so the download
+        // resumes from here when next requested.
+        download.yielded = YES;
+        [dataTask cancel];
+    }
+}
+
+#pragma mark - NSURLSessionTaskDelegate
+
+- (void)URLSession:(NSURLSession *)session
+              task:(NSURLSessionTask *)task
+didReceiveChallenge:(NSURLAuthenticationChallenge *)challenge
+ completionHandler:(void (^)(NSURLSessionAuthChallengeDisposition, NSURLCredential *))completionHandler {
+    // Authenticate fileset requests in the same way as other CMS server requests.
+    LOHTTPAuthenticationManager *authManager = _authManager;
+    if (authManager) {
+        [authManager URLSession:session task:task didReceiveChallenge:challenge completionHandler:completionHandler];
+    }
+    else {
+        completionHandler(NSURLSessionAuthChallengePerformDefaultHandling, nil);
+    }
+}
+
+- (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task didCompleteWithError:(NSError *)error {
+    NSNumber *taskID = @(task.taskIdentifier);
+    LOCMSFilesetDownloadState *download = _downloads[taskID];
+    [_downloads removeObjectForKey:taskID];
+    [self finishDownload:download error:error];
+}
+
+#pragma mark - Private
+
+- (void)startDownload:(LOCMSFilesetDownloadState *)download {
+    download.attempts++;
+    download.restart = NO;
+    download.failure = nil;
+    download.statusCode = 0;
+    download.offset = 0;
+    download.received = 0;
+    download.length = -1;
+    download.validator = nil;
+
+    // Check for a partial download made by an identical request.
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSDictionary *record = [_fileDB getFilesetDownloadRecordForCategory:download.category];
+    NSString *recordedKey = record[@"request"];
+    if (download.extract && [download.requestKey isEqualToString:recordedKey]
+        && [fileManager fileExistsAtPath:download.stagedPath]) {
+        // Resume extraction from the end of the last fully extracted entry.
+        download.spool = NO;
+        download.offset = [record[@"received"] longLongValue];
+    }
+    else if (download.extract && [[download.requestKey stringByAppendingString:SpoolKeySuffix] isEqualToString:recordedKey]
+             && [fileManager fileExistsAtPath:download.path]) {
+        // Resume from the end of the partial download file; the file may be longer than the last
+        // recorded progress, but data is only ever appended so everything in it is valid.
+        download.spool = YES;
+        download.offset = (long long)[[fileManager attributesOfItemAtPath:download.path error:nil] fileSize];
+    }
+    else if (record) {
+        [self discardPartialDownload:download];
+    }
+    if (download.offset > 0) {
+        id validator = record[@"validator"];
+        download.validator = [validator isKindOfClass:[NSString class]] ? validator : nil;
+    }
+
+    NSMutableURLRequest *request = [download.request mutableCopy];
+    if (download.offset > 0) {
+        [request setValue:[NSString stringWithFormat:@"bytes=%lld-", download.offset] forHTTPHeaderField:@"Range"];
+        if (download.validator) {
+            // If the content has changed then the server will return it in full.
+            [request setValue:download.validator forHTTPHeaderField:@"If-Range"];
+        }
+    }
+    NSURLSessionDataTask *task = [_session dataTaskWithRequest:request];
+    [_session.delegateQueue addOperationWithBlock:^{
+        self->_downloads[@(task.taskIdentifier)] = download;
+        [task resume];
+    }];
+}
+
+- (void)finishDownload:(LOCMSFilesetDownloadState *)download error:(NSError *)error {
+    NSInteger statusCode = download.statusCode;
+    BOOL hasContent = (statusCode == 200 || statusCode == 206);
+    if (!error && hasContent && download.length >= 0 && download.received != download.length) {
+        error = [NSError errorWithDomain:NSURLErrorDomain
+                                    code:NSURLErrorNetworkConnectionLost
+                                userInfo:@{ NSLocalizedDescriptionKey: @"Incomplete fileset download" }];
+    }
+    if (!error && hasContent && download.extract && ![self closeDownload:download]) {
+        error = download.failure;
+    }
+    // Record final progress, so that an interrupted download can be resumed later.
+    if (hasContent && download.extract && !download.restart) {
+        [self recordProgressOfDownload:download];
+    }
+    download.extractor = nil;
+    [download.fileHandle closeFile];
+    download.fileHandle = nil;
+    if (statusCode == 416) {
+        // Requested range not satisfiable; the partial download can't be resumed.
+        download.restart = YES;
+    }
+    if (download.restart) {
+        [self discardPartialDownload:download];
+        error = nil;
+    }
+    else if (download.yielded && [NSURLErrorDomain isEqualToString:error.domain] && error.code == NSURLErrorCancelled) {
+        @synchronized (self) {
+            _activeCount--;
+        }
+        LOCMSFilesetDownload *result = [[LOCMSFilesetDownload alloc] initWithCategory:download.category
+                                                                           statusCode:statusCode
+                                                                           stagedPath:nil
+                                                                        bytesReceived:download.transferred];
+        result.yielded = YES;
+        [download.promise resolve:result];
+        return;
+    }
+    BOOL retry = download.restart
+        || (error && [NSURLErrorDomain isEqualToString:error.domain] && error.code != NSURLErrorCancelled);
+    if (retry && download.attempts < _maxAttempts) {
+        NSTimeInterval delay = download.restart ? 0 : RetryDelay * (1 << (download.attempts - 1));
+        [Logger warn:@"Fileset %@ download failed (%@), retrying in %.0fs", download.category, error ?: download.failure, delay];
+        dispatch_time_t when = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC));
+        dispatch_after(when, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            [self startDownload:download];
+        });
+        return;
+    }
+    @synchronized (self) {
+        _activeCount--;
+    }
+    if (error || download.restart) {
+        [download.promise reject:error ?: download.failure ?: @"Fileset download could not be resumed"];
+        return;
+    }
+    NSString *stagedPath = (hasContent && download.extract) ? download.stagedPath : nil;
+    LOCMSFilesetDownload *result = [[LOCMSFilesetDownload alloc] initWithCategory:download.category
+                                                                       statusCode:(hasContent ? 200 : statusCode)
+                                                                       stagedPath:stagedPath
+                                                                    bytesReceived:download.transferred];
+    [download.promise resolve:result];
+}
+
+- (BOOL)openDownload:(LOCMSFilesetDownloadState *)download {
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    if (!download.spool && download.offset == 0) {
+        // Starting a new extraction; remove anything left over from a previous download.
+        [fileManager removeItemAtPath:download.stagedPath error:nil];
+    }
+    NSString *dir = download.spool ? [download.path stringByDeletingLastPathComponent] : download.stagedPath;
+    [fileManager createDirectoryAtPath:dir withIntermediateDirectories:YES attributes:nil error:nil];
+    if (download.spool) {
+        if (![fileManager fileExistsAtPath:download.path]) {
+            [fileManager createFileAtPath:download.path contents:nil attributes:nil];
+        }
+        download.fileHandle = [NSFileHandle fileHandleForWritingAtPath:download.path];
+        [download.fileHandle truncateFileAtOffset:download.offset];
+        return download.fileHandle != nil;
+    }
+    download.extractor = [[LOCMSZipStreamExtractor alloc] initWithDestinationPath:download.stagedPath
+                                                                           offset:download.offset];
+    return YES;
+}
+
+- (BOOL)writeData:(NSData *)data toDownload:(LOCMSFilesetDownloadState *)download {
+    if (download.fileHandle) {
+        @try {
+            [download.fileHandle writeData:data];
+        }
+        @catch (NSException *exception) {
+            // Usually a full disk; abandon the attempt, keeping the data already written.
+            [Logger error:@"Writing fileset %@ download: %@", download.category, exception];
+            download.fileHandle = nil;
+            return NO;
+        }
+        return YES;
+    }
+    NSError *error = nil;
+    if ([download.extractor appendData:data error:&error]) {
+        return YES;
+    }
+    download.failure = error;
+    if (error.code == LOCMSZipStreamErrorUnsupported) {
+        // Archive can't be extracted as a stream, so download it to file and unzip it once complete.
+        [Logger warn:@"Fileset %@ can't be extracted as a stream (%@), downloading to file", download.category, error];
+        download.spool = YES;
+        download.restart = YES;
+    }
+    else if (error.code == LOCMSZipStreamErrorInvalid) {
+        // Corrupt data; discard everything and start again.
+        download.restart = YES;
+    }
+    else {
+        // Write error, e.g. a full disk; keep what has been extracted so far.
+        [Logger error:@"Extracting fileset %@: %@", download.category, error];
+    }
+    download.extractor = nil;
+    return NO;
+}
+
+- (BOOL)closeDownload:(LOCMSFilesetDownloadState *)download {
+    if (!download.spool) {
+        NSError *error = nil;
+        if (![download.extractor finish:&error]) {
+            download.failure = error;
+            download.restart = YES;
+            return NO;
+        }
+        return YES;
+    }
+    // Unzip the partial download file, now complete, into the staging directory.
+    [download.fileHandle closeFile];
+    download.fileHandle = nil;
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    [fileManager removeItemAtPath:download.stagedPath error:nil];
+    // The archive is complete, so its entries can be extracted in parallel.
+    LOCMSZipArchiveExtractor *extractor = [[LOCMSZipArchiveExtractor alloc] initWithArchivePath:download.path];
+    NSError *error = nil;
+    if (![extractor extractToPath:download.stagedPath error:&error]) {
+        [Logger error:@"Extracting fileset %@: %@", download.category, error];
+        download.failure = error;
+        if (error.code == LOCMSZipStreamErrorInvalid) {
+            download.restart = YES;
+        }
+        return NO;
+    }
+    [fileManager removeItemAtPath:download.path error:nil];
+    return YES;
+}
+
+- (void)recordProgressOfDownload:(LOCMSFilesetDownloadState *)download {
+    // When extracting as a stream, progress is the end of the last fully extracted entry, as
+    // extraction can only be resumed from an entry boundary.
+    long long progress = download.spool ? download.received : download.extractor.boundaryOffset;
+    if (!download.spool && !download.extractor) {
+        progress = download.recorded;
+    }
+    NSString *key = download.spool ? [download.requestKey stringByAppendingString:SpoolKeySuffix] : download.requestKey;
+    [_fileDB updateFilesetDownloadRecordForCategory:download.category
+                                            request:key
+                                          validator:download.validator
+                                           received:progress
+                                             length:download.length];
+    download.recorded = progress;
+}
+
+- (void)discardPartialDownload:(LOCMSFilesetDownloadState *)download {
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    [fileManager removeItemAtPath:download.path error:nil];
+    [fileManager removeItemAtPath:download.stagedPath error:nil];
+    [_fileDB deleteFilesetDownloadRecordForCategory:download.category];
+    download.offset = 0;
+    download.recorded = 0;
+    download.validator = nil;
+}
+
+- (NSString *)partialDownloadPathForFileset:(NSString *)category {
+    NSString *stagingPath = _stagingPath ?: NSTemporaryDirectory();
+    NSString *filename = [[category stringByAppendingPathExtension:@"zip"] stringByAppendingPathExtension:PartialFileExtension];
+    return [[stagingPath stringByAppendingPathComponent:DownloadsDirName] stringByAppendingPathComponent:filename];
+}
+
+- (NSString *)stagedPathForFileset:(NSString *)category {
+    NSString *stagingPath = _stagingPath ?: NSTemporaryDirectory();
+    return [[stagingPath stringByAppendingPathComponent:FilesetsDirName] stringByAppendingPathComponent:category];
+}
+
+@end
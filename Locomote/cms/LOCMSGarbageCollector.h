@@ -0,0 +1,90 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "LOCMSFileDB.h"
+#import "LOCMSFilesetDownloader.h"
+#import "Q.h"
+
+/// A report of the work done by a garbage collection.
+@interface LOCMSGarbageCollectionReport : NSObject
+
+/// The number of files deleted because their file record was deleted.
+@property (nonatomic, assign, readonly) NSUInteger deletedFileCount;
+/// The number of unreferenced files and staging items deleted by an orphan sweep.
+@property (nonatomic, assign, readonly) NSUInteger orphanCount;
+/// The total size of the deleted files, in bytes.
+@property (nonatomic, assign, readonly) unsigned long long reclaimedBytes;
+/// The time taken to complete the collection, including any pauses, in seconds.
+@property (nonatomic, assign, readonly) NSTimeInterval elapsedTime;
+
+@end
+
+/**
+ * A garbage collector for cached fileset content.
+ * Deleting cached files can take a significant amount of time after large updates, so the
+ * collector only does the minimum necessary on the calling thread - reading and deleting the
+ * file DB's deleted file records - and deletes the files themselves in batches on a low priority
+ * background queue. Batches are separated by a short delay to limit the collector's IO rate,
+ * and the collector pauses whilst its yield block reports that higher priority work (e.g. a
+ * content download) is in progress.
+ * The collector also sweeps fileset cache directories for files which are no longer referenced
+ * by the file DB - e.g. files left behind by interrupted moves - and the staging area for data
+ * left by abandoned downloads. Sweeps are performed when requested, but no more often than the
+ * sweep interval.
+ */
+@interface LOCMSGarbageCollector : NSObject
+
+- (id)initWithFileDB:(LOCMSFileDB *)fileDB filesetDownloader:(LOCMSFilesetDownloader *)filesetDownloader;
+
+/// The number of files deleted in each batch. Defaults to 50.
+@property (nonatomic, assign) NSUInteger batchSize;
+/// The delay between batches, in seconds. Defaults to 0.05.
+@property (nonatomic, assign) NSTimeInterval batchDelay;
+/// The minimum time between orphan sweeps, in seconds. Defaults to one day.
+@property (nonatomic, assign) NSTimeInterval sweepInterval;
+/**
+ * The minimum age of an unreferenced file before it is considered an orphan, in seconds.
+ * Files written by downloads which complete during a sweep are newer than this, and so are
+ * never mistaken for orphans. Defaults to one hour.
+ */
+@property (nonatomic, assign) NSTimeInterval orphanAge;
+/**
+ * A block which returns YES when higher priority work is in progress.
+ * The collector pauses before each batch whilst the block returns YES, up to a limit, so that
+ * a long running download can't stop collection indefinitely.
+ */
+@property (nonatomic, copy) BOOL (^yieldBlock)(void);
+/// The report of the most recently completed collection.
+@property (atomic, strong, readonly) LOCMSGarbageCollectionReport *lastReport;
+/// Whether an orphan sweep is due.
+@property (nonatomic, assign, readonly) BOOL sweepDue;
+
+/**
+ * Collect the files of all file records marked as deleted.
+ * The deleted records are removed from the file DB before this method returns; the files
+ * themselves are deleted in the background. Should be called from an operation with access
+ * to the file DB. The returned promise resolves to a LOCMSGarbageCollectionReport once all
+ * of the files have been deleted.
+ */
+- (QPromise *)collectDeletedFiles;
+/**
+ * Sweep the fileset cache directories and the staging area for orphaned files, in the
+ * background. The returned promise resolves to a LOCMSGarbageCollectionReport once all
+ * orphans have been deleted.
+ */
+- (QPromise *)sweepOrphans;
+
+@end
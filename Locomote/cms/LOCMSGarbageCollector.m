@@ -0,0 +1,327 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LOCMSGarbageCollector.h"
+#import "SCLogger.h"
+#import <sys/stat.h>
+
+#define DefaultBatchSize        (50)
+#define DefaultBatchDelay       (0.05)
+#define DefaultSweepInterval    (24 * 60 * 60)
+#define DefaultOrphanAge        (60 * 60)
+// The delay before checking again whether to continue, when yielding to higher priority work.
+#define YieldDelay              (0.5)
+// The maximum number of times a batch yields before it is run regardless.
+#define MaxYields               (60)
+
+static SCLogger *Logger;
+
+@interface LOCMSGarbageCollectionReport ()
+
+@property (nonatomic, assign, readwrite) NSUInteger deletedFileCount;
+@property (nonatomic, assign, readwrite) NSUInteger orphanCount;
+@property (nonatomic, assign, readwrite) unsigned long long reclaimedBytes;
+@property (nonatomic, assign, readwrite) NSTimeInterval elapsedTime;
+/// The time the collection started.
+@property (nonatomic, strong) NSDate *startTime;
+
+@end
+
+@interface LOCMSGarbageCollector () {
+    __weak LOCMSFileDB *_fileDB;
+    __weak LOCMSFilesetDownloader *_filesetDownloader;
+    /// A serial, low priority queue which files are deleted on.
+    dispatch_queue_t _queue;
+    /// The time of the last orphan sweep.
+    NSDate *_lastSweep;
+}
+
+@property (atomic, strong, readwrite) LOCMSGarbageCollectionReport *lastReport;
+
+/**
+ * Delete the records of deleted files, and return the cache paths of their files.
+ * The file paths of the deleted records are returned in _filePaths_, in the same order.
+ */
+- (NSArray<NSString *> *)removeDeletedFileRecords:(NSArray<NSString *> **)filePaths;
+/// Return the paths of all orphaned files in fileset cache directories and the staging area.
+- (NSArray<NSString *> *)findOrphans;
+/**
+ * Delete a list of paths, in batches starting from the specified index.
+ * Each batch is scheduled on the collector's queue after the previous batch completes.
+ * When _filePaths_ is provided, a path is skipped if a live file record has since been
+ * written for its file path.
+ */
+- (void)deletePaths:(NSArray<NSString *> *)paths
+          filePaths:(NSArray<NSString *> *)filePaths
+          fromIndex:(NSUInteger)index
+             yields:(NSUInteger)yields
+            orphans:(BOOL)orphans
+             report:(LOCMSGarbageCollectionReport *)report
+            promise:(QPromise *)promise;
+/// Test whether a live (i.e. not deleted) file record exists for a file path.
+- (BOOL)isLiveFilePath:(NSString *)filePath;
+/**
+ * Delete a file or directory, unless it was modified after the specified time.
+ * Returns NO if nothing was deleted; otherwise returns the bytes reclaimed.
+ */
+- (BOOL)deleteItemAtPath:(NSString *)path
+          modifiedBefore:(NSDate *)time
+          reclaimedBytes:(unsigned long long *)bytes;
+
+@end
+
+@implementation LOCMSGarbageCollectionReport
+@end
+
+@implementation LOCMSGarbageCollector
+
++ (void)initialize {
+    Logger = [[SCLogger alloc] initWithTag:@"LOCMSGarbageCollector"];
+}
+
+- (id)initWithFileDB:(LOCMSFileDB *)fileDB filesetDownloader:(LOCMSFilesetDownloader *)filesetDownloader {
+    self = [super init];
+    if (self) {
+        _fileDB = fileDB;
+        _filesetDownloader = filesetDownloader;
+        _batchSize = DefaultBatchSize;
+        _batchDelay = DefaultBatchDelay;
+        _sweepInterval = DefaultSweepInterval;
+        _orphanAge = DefaultOrphanAge;
+        _queue = dispatch_queue_create("LOCMSGarbageCollector", DISPATCH_QUEUE_SERIAL);
+        dispatch_set_target_queue(_queue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+    }
+    return self;
+}
+
+- (BOOL)sweepDue {
+    @synchronized (self) {
+        return _lastSweep == nil || -[_lastSweep timeIntervalSinceNow] >= _sweepInterval;
+    }
+}
+
+- (QPromise *)collectDeletedFiles {
+    LOCMSGarbageCollectionReport *report = [LOCMSGarbageCollectionReport new];
+    report.startTime = [NSDate date];
+    NSArray *filePaths = nil;
+    NSArray *paths = [self removeDeletedFileRecords:&filePaths];
+    QPromise *promise = [QPromise new];
+    dispatch_async(_queue, ^{
+        [self deletePaths:paths filePaths:filePaths fromIndex:0 yields:0 orphans:NO report:report promise:promise];
+    });
+    return promise;
+}
+
+- (QPromise *)sweepOrphans {
+    @synchronized (self) {
+        _lastSweep = [NSDate date];
+    }
+    LOCMSGarbageCollectionReport *report = [LOCMSGarbageCollectionReport new];
+    report.startTime = [NSDate date];
+    QPromise *promise = [QPromise new];
+    dispatch_async(_queue, ^{
+        NSArray *paths = [self findOrphans];
+        [self deletePaths:paths filePaths:nil fromIndex:0 yields:0 orphans:YES report:report promise:promise];
+    });
+    return promise;
+}
+
+#pragma mark - Private
+
+- (NSArray<NSString *> *)removeDeletedFileRecords:(NSArray<NSString *> **)filePaths {
+    LOCMSFileDB *fileDB = _fileDB;
+    NSString *filesTable = fileDB.filesTable;
+    NSMutableArray *paths = [NSMutableArray new];
+    NSMutableArray *recordPaths = [NSMutableArray new];
+    // Read and delete the records in the same transaction, so that a record marked as deleted
+    // between the two statements isn't removed without its file being collected. The query
+    // runs on the transaction's connection, rather than the read-only connection.
+    BOOL ok = [fileDB performTransaction:^BOOL{
+        // Skip any deleted file whose path has been reused by a new file record.
+        NSString *sql = [NSString stringWithFormat:@"SELECT path, category, status FROM %@ f WHERE status='deleted' "
+                         "AND NOT EXISTS (SELECT 1 FROM %@ g WHERE g.path=f.path AND IFNULL(g.status,'')!='deleted')",
+                         filesTable, filesTable];
+        NSArray *records = [fileDB performQuery:sql withParams:@[]];
+        if (!records) {
+            return NO;
+        }
+        for (NSDictionary *record in records) {
+            NSString *path = [fileDB cacheLocationForFileRecord:record];
+            id filePath = record[@"path"];
+            if (path && [filePath isKindOfClass:[NSString class]]) {
+                [paths addObject:path];
+                [recordPaths addObject:filePath];
+            }
+        }
+        sql = [NSString stringWithFormat:@"DELETE FROM %@ WHERE status='deleted'", filesTable];
+        return [fileDB performUpdate:sql withParams:@[]];
+    }];
+    if (!ok) {
+        [Logger warn:@"Unable to remove deleted file records"];
+        *filePaths = @[];
+        return @[];
+    }
+    [fileDB incrementGeneration];
+    *filePaths = recordPaths;
+    return paths;
+}
+
+- (NSArray<NSString *> *)findOrphans {
+    LOCMSFileDB *fileDB = _fileDB;
+    NSDate *cutoff = [NSDate dateWithTimeIntervalSinceNow:-_orphanAge];
+    NSMutableArray *orphans = [NSMutableArray new];
+    NSString *sql = [NSString stringWithFormat:@"SELECT path FROM %@ WHERE category=?", fileDB.filesTable];
+    for (NSString *category in [fileDB.filesets allKeys]) {
+        NSString *cachePath = [fileDB cacheLocationForFileset:category];
+        if (!cachePath) {
+            continue;
+        }
+        NSDirectoryEnumerator *files = [[NSFileManager defaultManager] enumeratorAtPath:cachePath];
+        if (!files) {
+            continue;
+        }
+        // Read the paths of all files in the fileset. Files added after this point are newer
+        // than the cutoff, so aren't treated as orphans.
+        NSMutableSet *referenced = [NSMutableSet new];
+        BOOL ok = [fileDB enumerateQuery:sql withParams:@[ category ] usingBlock:^(NSDictionary *record, BOOL *stop) {
+            id path = record[@"path"];
+            if ([path isKindOfClass:[NSString class]]) {
+                [referenced addObject:[LOCMSFileDB normalizedPath:path]];
+            }
+        }];
+        if (!ok) {
+            // Without a complete list of referenced files, every file would look like an orphan.
+            [Logger warn:@"Unable to read files for fileset %@, skipping orphan sweep", category];
+            continue;
+        }
+        for (NSString *subpath in files) {
+            @autoreleasepool {
+                NSDictionary *attributes = files.fileAttributes;
+                if (![NSFileTypeRegular isEqualToString:attributes.fileType]) {
+                    continue;
+                }
+                if ([attributes.fileModificationDate compare:cutoff] != NSOrderedAscending) {
+                    continue;
+                }
+                if (![referenced containsObject:[LOCMSFileDB normalizedPath:subpath]]) {
+                    [orphans addObject:[cachePath stringByAppendingPathComponent:subpath]];
+                }
+            }
+        }
+    }
+    NSArray *staged = [_filesetDownloader orphanedStagingPathsModifiedBefore:cutoff];
+    if (staged) {
+        [orphans addObjectsFromArray:staged];
+    }
+    return orphans;
+}
+
+- (void)deletePaths:(NSArray<NSString *> *)paths
+          filePaths:(NSArray<NSString *> *)filePaths
+          fromIndex:(NSUInteger)index
+             yields:(NSUInteger)yields
+            orphans:(BOOL)orphans
+             report:(LOCMSGarbageCollectionReport *)report
+            promise:(QPromise *)promise {
+    NSUInteger count = [paths count];
+    BOOL (^yieldBlock)(void) = _yieldBlock;
+    if (index < count && yields < MaxYields && yieldBlock && yieldBlock()) {
+        // Higher priority work is in progress; check again later.
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(YieldDelay * NSEC_PER_SEC)), _queue, ^{
+            [self deletePaths:paths filePaths:filePaths fromIndex:index yields:(yields + 1) orphans:orphans report:report promise:promise];
+        });
+        return;
+    }
+    NSUInteger end = MIN(index + MAX(_batchSize, 1), count);
+    for (NSUInteger i = index; i < end; i++) {
+        @autoreleasepool {
+            // Deletion may have been delayed by yielding, in which time a refresh or fileset
+            // install may have reused the path; don't delete files which are live again.
+            if (filePaths && [self isLiveFilePath:filePaths[i]]) {
+                continue;
+            }
+            unsigned long long bytes = 0;
+            if ([self deleteItemAtPath:paths[i] modifiedBefore:report.startTime reclaimedBytes:&bytes]) {
+                if (orphans) {
+                    report.orphanCount++;
+                }
+                else {
+                    report.deletedFileCount++;
+                }
+                report.reclaimedBytes += bytes;
+            }
+        }
+    }
+    if (end < count) {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(_batchDelay * NSEC_PER_SEC)), _queue, ^{
+            [self deletePaths:paths filePaths:filePaths fromIndex:end yields:0 orphans:orphans report:report promise:promise];
+        });
+        return;
+    }
+    report.elapsedTime = -[report.startTime timeIntervalSinceNow];
+    if (orphans && report.orphanCount > 0) {
+        [Logger info:@"Swept %lu orphaned files, reclaimed %llu bytes in %.2fs",
+            (unsigned long)report.orphanCount, report.reclaimedBytes, report.elapsedTime];
+    }
+    else if (!orphans && report.deletedFileCount > 0) {
+        [Logger info:@"Deleted %lu files, reclaimed %llu bytes in %.2fs",
+            (unsigned long)report.deletedFileCount, report.reclaimedBytes, report.elapsedTime];
+    }
+    self.lastReport = report;
+    [promise resolve:report];
+}
+
+- (BOOL)isLiveFilePath:(NSString *)filePath {
+    LOCMSFileDB *fileDB = _fileDB;
+    NSString *sql = [NSString stringWithFormat:@"SELECT 1 FROM %@ WHERE path=? AND IFNULL(status,'')!='deleted' LIMIT 1",
+                     fileDB.filesTable];
+    NSArray *rs = [fileDB performCachedQuery:sql withParams:@[ filePath ]];
+    // If the file DB can't be read then assume the path is live, and leave the file for the orphan sweep.
+    return rs == nil || [rs count] > 0;
+}
+
+- (BOOL)deleteItemAtPath:(NSString *)path
+          modifiedBefore:(NSDate *)time
+          reclaimedBytes:(unsigned long long *)bytes {
+    struct stat info;
+    if (lstat([path fileSystemRepresentation], &info) != 0) {
+        return NO;
+    }
+    if (time && info.st_mtime >= (time_t)[time timeIntervalSince1970]) {
+        // The file was written after collection started, so belongs to newer content.
+        return NO;
+    }
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    if (S_ISDIR(info.st_mode)) {
+        // A staging directory; count the size of its contents before deleting it.
+        unsigned long long size = 0;
+        NSDirectoryEnumerator *files = [fileManager enumeratorAtPath:path];
+        while ([files nextObject]) {
+            size += files.fileAttributes.fileSize;
+        }
+        if (![fileManager removeItemAtPath:path error:nil]) {
+            return NO;
+        }
+        *bytes = size;
+        return YES;
+    }
+    if (unlink([path fileSystemRepresentation]) != 0) {
+        return NO;
+    }
+    *bytes = (unsigned long long)info.st_size;
+    return YES;
+}
+
+@end
@@ -0,0 +1,29 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "LOCMSRequestHandler.h"
+
+/**
+ * A request handler which returns a snapshot of the repository's runtime metrics as JSON.
+ * Before the snapshot is taken, gauges are updated with the current state of the repository's
+ * downloads, content cache budget, prefetcher and garbage collector. Metrics are reset after
+ * the snapshot is taken if the request has a 'reset=true' parameter.
+ */
+@interface LOCMSMetricsHandler : LOCMSRequestHandler {
+    __weak LOCMSRepository *_repository;
+}
+
+@end
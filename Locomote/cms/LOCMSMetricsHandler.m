@@ -0,0 +1,55 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LOCMSMetricsHandler.h"
+#import "LOCMSContentCacheBudget.h"
+
+@implementation LOCMSMetricsHandler
+
+- (id)initWithRepository:(LOCMSRepository *)repository {
+    self = [super initWithRepository:repository];
+    if (self) {
+        _repository = repository;
+    }
+    return self;
+}
+
+- (void)handleRequest:(id<LOContentRequest>)request response:(id<LOContentResponse>)response {
+    LOCMSRepository *repository = _repository;
+    LOMetrics *metrics = self.metrics;
+    // Copy the counts maintained by other components into gauges.
+    LOCMSDownloadRegistry *downloads = repository.downloads;
+    [metrics setGauge:@"downloads.active" value:downloads.activeCount];
+    [metrics setGauge:@"downloads.coalesced" value:downloads.coalescedCount];
+    LOCMSContentCacheBudget *cacheBudget = self.fileDB.cacheBudget;
+    [metrics setGauge:@"filecache.evicted.files" value:cacheBudget.evictedFileCount];
+    [metrics setGauge:@"filecache.evicted.bytes" value:cacheBudget.evictedBytes];
+    LOCMSPrefetcher *prefetcher = repository.ops.prefetcher;
+    [metrics setGauge:@"prefetch.files" value:prefetcher.prefetchedFileCount];
+    [metrics setGauge:@"prefetch.bytes" value:prefetcher.prefetchedBytes];
+    LOCMSGarbageCollectionReport *report = repository.ops.garbageCollector.lastReport;
+    if (report) {
+        [metrics setGauge:@"gc.last.files" value:(report.deletedFileCount + report.orphanCount)];
+        [metrics setGauge:@"gc.last.bytes" value:report.reclaimedBytes];
+        [metrics setGauge:@"gc.last.time" value:(report.elapsedTime * 1000.0)];
+    }
+    NSDictionary *snapshot = [metrics snapshot];
+    if ([@"true" isEqualToString:request.parameters[@"reset"]]) {
+        [metrics reset];
+    }
+    [response respondWithJSONData:snapshot cachePolicy:NSURLCacheStorageNotAllowed];
+}
+
+@end
@@ -19,16 +19,36 @@
 #import "LOOperationQueue.h"
 #import "LOHTTPAuthenticationManager.h"
 #import "LOCMSFileDB.h"
+#import "LOCMSFilesetDownloader.h"
+#import "LOCMSGarbageCollector.h"
+#import "LOCMSPrefetcher.h"
 #import "LOCMSSettings.h"
 #import "SCHTTPClient.h"
 #import "SCService.h"
 #import "Q.h"
 
+/// The outcome of a content refresh.
+typedef NS_ENUM(NSInteger, LOCMSRefreshStatus) {
+    /// No refresh has completed.
+    LOCMSRefreshStatusNone,
+    /// The refresh applied updates to the file DB.
+    LOCMSRefreshStatusUpdated,
+    /// The server had no updates.
+    LOCMSRefreshStatusNotModified,
+    /// The refresh failed, e.g. because the server couldn't be reached.
+    LOCMSRefreshStatusFailed
+};
+
 /**
  * An operation protocol for interacting with the Locomote CMS API.
  * The protocol is composed of a number of different asynchronous operations for downloading
  * updates from the Locomote server and managing the DB and local cache state.
- * All operations are executed sequentially on a background queue.
+ * Operations are executed on a background queue; operations which update the file DB are
+ * executed one at a time, but downloads of different filesets may execute concurrently.
+ * Fileset resets are queued at interactive priority and file GC at background priority; fileset
+ * downloads yield to waiting interactive operations, and resume once they have started.
+ * Refreshes request the updates feed conditionally, using the entity tag of the last feed
+ * applied, so that the server can respond with 304 Not Modified when there are no updates.
  */
 @interface LOCMSOperationProtocol : NSObject <SCService> {
     /// A queue for executing operations.
@@ -41,10 +61,27 @@
     __weak SCHTTPClient *_httpClient;
     /// A HTTP authentication manager.
     __weak LOHTTPAuthenticationManager *_authManager;
-    /// A pending deferred promise for the currently executing operation.
-    QPromise *_promise;
 }
 
+/// A downloader for fileset zips; interrupted fileset downloads are resumed on the next attempt.
+@property (nonatomic, strong, readonly) LOCMSFilesetDownloader *filesetDownloader;
+/// A garbage collector for deleted and orphaned cached files.
+@property (nonatomic, strong, readonly) LOCMSGarbageCollector *garbageCollector;
+/// A prefetcher for files referenced by pages updated by a refresh; optional.
+@property (nonatomic, strong) LOCMSPrefetcher *prefetcher;
+
+/// The maximum number of operations that may execute concurrently. Defaults to 4.
+@property (nonatomic, assign) NSInteger maxConcurrentOperations;
+/**
+ * Optional metrics to record operation activity in; shared with the operation queue.
+ * Records the number of records applied by each refresh in the 'refresh.rows' histogram, the
+ * number of refreshes with no updates in the 'refresh.notModified' counter, and the bytes
+ * downloaded for each fileset in a 'fileset.bytes.<category>' counter.
+ */
+@property (nonatomic, strong) LOMetrics *metrics;
+/// The outcome of the most recently completed refresh.
+@property (atomic, assign, readonly) LOCMSRefreshStatus lastRefreshStatus;
+
 - (id)initWithFileDB:(LOCMSFileDB *)fileDB
             settings:(LOCMSSettings *)settings
           httpClient:(SCHTTPClient *)httpClient
@@ -52,7 +89,12 @@ authenticationManager:(LOHTTPAuthenticationManager *)authManager;
 
 /// Perform a content refresh.
 - (QPromise *)refresh;
-/// Perform a fileset reset.
+/// Perform a fileset reset, ahead of any routine queued operations.
 - (QPromise *)resetFileset:(NSString *)category;
+/**
+ * Return the ID of the latest commit in the file DB, or nil if the file DB has no commits.
+ * Only committed updates are seen, and the read doesn't wait on updates in progress.
+ */
+- (NSString *)latestCommit;
 
 @end
@@ -16,16 +16,55 @@
 //
 
 #import "LOCMSOperationProtocol.h"
-#import "SCFileIO.h"
+#import "LOCMSUpdatesFeedReader.h"
+#import "LOCMSClientVisibleSet.h"
+#import "LOCMSContentCacheBudget.h"
+#import "LOCMSFileset.h"
+#import "SCLogger.h"
+#import "LOHTTPUtils.h"
 
 #define URLEncode(s)        ([s stringByAddingPercentEncodingWithAllowedCharacters:[NSCharacterSet URLHostAllowedCharacterSet]])
 #define AcceptMIMETypes     (@"application/msgpack, application/json;q=0.9, */*;q=0.8")
 #define AcceptEncodings     (@"gzip")
 
+// Names of the resources used by operations; see LOOperationQueueItem.
+#define DBResource                              (@"db")
+#define FilesetResource(category)               ([NSString stringWithFormat:@"fileset:%@", category])
+
+// The number of feed records written to the file DB per batch.
+#define UpdatesBatchSize    (200)
+
 #define QualifiedCommandName(protocol, name)    ([NSString stringWithFormat:@"%@.%@", protocol.commandPrefix, name ])
 #define MakeFollowOn(name,args)                 (@{ @"name": name, @"args": args })
 
-@interface LOCMSOperationProtocol ()
+static SCLogger *Logger;
+
+/// A response to an updates feed request.
+@interface LOCMSUpdatesResponse : NSObject
+
+/// The HTTP response.
+@property (nonatomic, strong) NSHTTPURLResponse *httpResponse;
+/// The response body.
+@property (nonatomic, strong) NSData *data;
+
+@end
+
+@interface LOCMSOperationProtocol () {
+    /// A URL session for updates feed requests.
+    NSURLSession *_updatesSession;
+    /// The entity tag of the last updates feed applied to the file DB.
+    NSString *_updatesETag;
+}
+
+@property (atomic, assign, readwrite) LOCMSRefreshStatus lastRefreshStatus;
+
+/**
+ * Request the updates feed.
+ * The request is made conditional on the feed having changed since the last feed applied, so
+ * the server can respond with a 304 status when there are no updates. Resolves to an updates
+ * response whatever the status; rejected if the request fails.
+ */
+- (QPromise *)getUpdates:(NSString *)url params:(NSDictionary *)params;
 
 - (LOOperationBlock)opRefresh;
 - (LOOperationBlock)opReset;
@@ -33,20 +72,52 @@
 - (LOOperationBlock)opFileGC;
 - (LOOperationBlock)opDownloadFilesetWithCategory:(NSString *)category since:(id)since; // TODO since can be == [NSNull null]
 /**
- * Build a JSON document describing the client visible set for a fileset category.
+ * Build the client visible set for a fileset category, in the compact format.
  * If the category name is nil then the set returned is for the entire file database.
- * The client visible set describes what files are currently visible to the Locomote client.
- * The JSON document is an object with a "cvs" property whose value is an array of ( file ID,
- * file version ) tuples.
+ * The client visible set describes what files are currently visible to the Locomote client,
+ * as a list of ( file ID, file version ) tuples; see LOCMSClientVisibleSet.
  * The CVS is used by the server during a file db reset to work out what file updates the
  * client needs to see.
  */
-- (NSString *)buildClientVisibleSetForCategory:(NSString *)category;
+- (NSData *)buildClientVisibleSetForCategory:(NSString *)category;
+/**
+ * Return the request parameters for sending a client visible set to the server.
+ * The set is sent base64 encoded in the compact format if the server supports it, otherwise
+ * it's converted to JSON.
+ */
+- (NSDictionary *)requestParamsForClientVisibleSet:(NSData *)cvs;
+/// Read the latest commit of a fileset; used to identify the fileset content being downloaded.
+- (NSString *)latestCommitForFileset:(NSString *)category;
+/**
+ * Apply the updates in an updates feed to the file DB.
+ * Records are decoded from the feed one at a time and written to the DB in batches, within
+ * the current DB transaction. The optional row block is called with each record as it's read.
+ * Returns NO if the feed couldn't be read, or if its records couldn't be written.
+ */
+- (BOOL)applyUpdatesFeed:(LOCMSUpdatesFeedReader *)reader rowBlock:(LOCMSUpdatesFeedRowBlock)rowBlock;
+/// Package an operation needing exclusive access to the file DB as a queue item.
+- (LOOperationQueueItem *)dbOperation:(LOOperationBlock)operation opID:(NSString *)opID;
+/// Package an operation that updates a fileset's cached content as a queue item.
+- (LOOperationQueueItem *)filesetOperation:(LOOperationBlock)operation category:(NSString *)category opID:(NSString *)opID;
+/// Package a housekeeping operation which shares the file DB as a background priority queue item.
+- (LOOperationQueueItem *)backgroundOperation:(LOOperationBlock)operation;
+/**
+ * Return a block which tests whether the operation currently being invoked should yield.
+ * Must be called whilst the operation block is executing synchronously.
+ */
+- (BOOL (^)(void))yieldBlockForCurrentOperation;
+
+@end
 
+@implementation LOCMSUpdatesResponse
 @end
 
 @implementation LOCMSOperationProtocol
 
++ (void)initialize {
+    Logger = [[SCLogger alloc] initWithTag:@"LOCMSOperationProtocol"];
+}
+
 - (id)initWithFileDB:(LOCMSFileDB *)fileDB
             settings:(LOCMSSettings *)settings
           httpClient:(SCHTTPClient *)httpClient
@@ -54,23 +125,59 @@ authenticationManager:(LOHTTPAuthenticationManager *)authManager {
     self = [super init];
     if (self) {
         _opQueue = [LOOperationQueue new];
+        // The updates feed is requested conditionally, so responses aren't cached by the URL
+        // loading system; the auth manager answers authentication challenges, as for the
+        // HTTP client.
+        NSURLSessionConfiguration *configuration = [NSURLSessionConfiguration defaultSessionConfiguration];
+        configuration.URLCache = nil;
+        configuration.requestCachePolicy = NSURLRequestReloadIgnoringLocalCacheData;
+        _updatesSession = [NSURLSession sessionWithConfiguration:configuration
+                                                        delegate:(id<NSURLSessionDelegate>)authManager
+                                                   delegateQueue:nil];
         _fileDB = fileDB;
         _settings = settings;
         _httpClient = httpClient;
         _authManager = authManager;
+        _filesetDownloader = [[LOCMSFilesetDownloader alloc] initWithFileDB:fileDB authenticationManager:authManager];
+        _garbageCollector = [[LOCMSGarbageCollector alloc] initWithFileDB:fileDB filesetDownloader:_filesetDownloader];
     }
     return self;
 }
 
 - (QPromise *)refresh {
     LOOperationBlock refresh = [self opRefresh];
-    return [_opQueue queueOperation:refresh opID:@"refresh"];
+    return [_opQueue queueItem:[self dbOperation:refresh opID:@"refresh"]];
 }
 
 - (QPromise *)resetFileset:(NSString *)category {
     LOOperationBlock reset = [self opResetFilesetWithCategory:category];
     NSString *opID = [NSString stringWithFormat:@"resetFileset:%@", category];
-    return [_opQueue queueOperation:reset opID:opID];
+    // Fileset resets are requested when content the user is waiting on has changed (e.g. after login),
+    // so are started ahead of routine work.
+    LOOperationQueueItem *item = [self filesetOperation:reset category:category opID:opID];
+    item.priority = LOOperationPriorityInteractive;
+    return [_opQueue queueItem:item];
+}
+
+- (NSString *)latestCommit {
+    NSArray *rs = [_fileDB performCachedQuery:@"SELECT id, max(date) FROM commits" withParams:@[]];
+    if ([rs count] > 0) {
+        return [rs[0][@"id"] description];
+    }
+    return nil;
+}
+
+- (NSInteger)maxConcurrentOperations {
+    return _opQueue.maxConcurrentOperations;
+}
+
+- (void)setMaxConcurrentOperations:(NSInteger)maxConcurrentOperations {
+    _opQueue.maxConcurrentOperations = maxConcurrentOperations;
+}
+
+- (void)setMetrics:(LOMetrics *)metrics {
+    _metrics = metrics;
+    _opQueue.metrics = metrics;
 }
 
 #pragma mark - SCService
@@ -85,7 +192,7 @@ authenticationManager:(LOHTTPAuthenticationManager *)authManager {
 
 - (LOOperationBlock)opRefresh {
     return ^() {
-        self->_promise = [QPromise new];
+        QPromise *promise = [QPromise new];
         
         NSString *updatesURL = [self->_settings updatesURL];
 
@@ -102,47 +209,51 @@ authenticationManager:(LOHTTPAuthenticationManager *)authManager {
         }
         
         // Read latest commit ID.
-        NSArray *rs = [self->_fileDB performQuery:@"SELECT id, max(date) FROM commits" withParams:@[]];
-        if ([rs count] > 0) {
-            // File DB contains previous commits, read latest commit ID and add as request parameter.
-            NSDictionary *record = rs[0];
-            commit = [record[@"id"] description];
+        commit = [self latestCommit];
+        if (commit) {
+            // File DB contains previous commits, add latest commit ID as request parameter.
             params[@"since"] = commit;
         }
         // Otherwise simply omit the 'since' parameter; the feed will return all records in the file DB.
 
-        // Specify accepts options.
-        NSDictionary *options = @{
-            SCHTTPClientRequestOptionAccept:            AcceptMIMETypes,
-            SCHTTPClientRequestOptionAcceptEncoding:    AcceptEncodings
-        };
         // Fetch updates from the server.
-        [self->_httpClient get:updatesURL data:params options:options]
-        .then((id)^(SCHTTPClientResponse *response) {
+        [self getUpdates:updatesURL params:params]
+        .then((id)^(LOCMSUpdatesResponse *response) {
         
             LOCMSFileDB *fileDB = self->_fileDB;
             
             // Check the response code.
             NSInteger responseCode = response.httpResponse.statusCode;
+            if (responseCode == 304) {
+                // Nothing has changed since the last feed applied.
+                [self.metrics incrementCounter:@"refresh.notModified"];
+                self.lastRefreshStatus = LOCMSRefreshStatusNotModified;
+                [promise resolve:@[]];
+                return nil;
+            }
             if (responseCode == 401) {
                 LOHTTPAuthenticationManager *authManager = self->_authManager;
                 [authManager removeCredentials];
-                [self->_promise resolve:@[]];
+                self.lastRefreshStatus = LOCMSRefreshStatusFailed;
+                [promise resolve:@[]];
                 return nil;
             }
             
             // LS-13: ACM group mismatch, perform a database reset.
             if (responseCode == 205) {
-                [self->_promise resolve:@[ [self opReset] ]];
+                self.lastRefreshStatus = LOCMSRefreshStatusUpdated;
+                [promise resolve:@[ [self dbOperation:[self opReset] opID:nil] ]];
                 return nil;
             }
             
-            // Read the updates data.
-            id updateData = [response parseData];
-            if ([updateData isKindOfClass:[NSString class]]) {
+            // Open a reader on the updates data; rows are decoded as they are applied.
+            LOCMSUpdatesFeedReader *reader = [[LOCMSUpdatesFeedReader alloc] initWithData:response.data
+                                                                                 mimeType:response.httpResponse.MIMEType];
+            if (reader.errorMessage) {
                 // Indicates a server error
-                NSLog(@"%@ %@", response.httpResponse.URL, updateData);
-                [self->_promise resolve:@[]];
+                NSLog(@"%@ %@", response.httpResponse.URL, reader.errorMessage);
+                self.lastRefreshStatus = LOCMSRefreshStatusFailed;
+                [promise resolve:@[]];
                 return nil;
             }
 
@@ -165,40 +276,39 @@ authenticationManager:(LOHTTPAuthenticationManager *)authManager {
             }
             else {
             */
-                // Write updates to database.
-                NSDictionary *updates = [updateData valueForKeyPath:@"db"];
-                if ([@0 isEqual:updates]) {
-                    // This can happen no updates to report from the server; replace updates
-                    // with an empty dictionary.
-                    updates = @{};
-                }
                 // A map of fileset category names to a 'since' commit value (may be null).
                 NSMutableDictionary *updatedCategories = [NSMutableDictionary new];
+                // The IDs of updated pages.
+                NSMutableArray *updatedPageIDs = [NSMutableArray new];
+                // The number of records in the feed.
+                __block NSUInteger rowCount = 0;
             
-                // Start a DB transaction.
-                [fileDB beginTransaction];
+                // A list of follow on commands.
+                NSMutableArray *followOns = [NSMutableArray new];
+                // Flag indicating whether the feed was read and written.
+                __block BOOL applied = NO;
+
+                // Apply the updates within a single transaction.
+                BOOL committed = [fileDB performTransaction:^BOOL {
             
-                // TODO filesets : previous / current / latest - need to work out details of operation.
-                // For example, following statement may not be needed if using current + latest to
-                // track downloaded version of filesets.
-                // But also note previous / current are fingerprints i.e. fileset definition fingerprints;
-                // whilst current / latest are commits.
-                // So now: fingerprint, preprint (previous fingerprint), current, latest
-                // Following statement becomes UPDATE filesets SET preprint=fingerprint
-                // As fileset categories are updated, the fileset's latest is updated to the current commit
-                // At end, issue fileset download for SELECT category FROM fileset WHERE latest != current OR fingerprint != preprint
+                    // TODO filesets : previous / current / latest - need to work out details of operation.
+                    // For example, following statement may not be needed if using current + latest to
+                    // track downloaded version of filesets.
+                    // But also note previous / current are fingerprints i.e. fileset definition fingerprints;
+                    // whilst current / latest are commits.
+                    // So now: fingerprint, preprint (previous fingerprint), current, latest
+                    // Following statement becomes UPDATE filesets SET preprint=fingerprint
+                    // As fileset categories are updated, the fileset's latest is updated to the current commit
+                    // At end, issue fileset download for SELECT category FROM fileset WHERE latest != current OR fingerprint != preprint
             
-                // Shift current fileset fingerprints to previous.
-                [fileDB performUpdate:@"UPDATE fingerprints SET preprint=fingerprint" withParams:@[]];
+                    // Shift current fileset fingerprints to previous.
+                    [fileDB performUpdate:@"UPDATE fingerprints SET preprint=fingerprint" withParams:@[]];
 
-                // Apply all downloaded updates to the database.
-                for (NSString *tableName in updates) {
-                    BOOL isFilesTable = [@"files" isEqualToString:tableName];
-                    NSArray *table = updates[tableName];
-                    for (NSDictionary *values in table) {
-                        [fileDB upsertValues:values intoTable:tableName];
+                    // Apply all downloaded updates to the database.
+                    applied = [self applyUpdatesFeed:reader rowBlock:^(NSString *tableName, NSDictionary *values) {
+                        rowCount++;
                         // If processing the files table then record the updated file category name.
-                        if (isFilesTable) {
+                        if ([@"files" isEqualToString:tableName]) {
                             NSString *category = values[@"category"];
                             NSString *status   = values[@"status"];
                             if (category != nil && ![@"deleted" isEqualToString:status]) {
@@ -210,43 +320,67 @@ authenticationManager:(LOHTTPAuthenticationManager *)authManager {
                                 }
                             }
                         }
+                        else if ([@"pages" isEqualToString:tableName]) {
+                            id pageID = values[@"id"];
+                            if (pageID) {
+                                [updatedPageIDs addObject:pageID];
+                            }
+                        }
+                    }];
+                    if (!applied) {
+                        return NO;
                     }
-                }
 
-                // Prune ORM related records.
-                [fileDB pruneRelatedValues];
+                    // Prune ORM related records.
+                    [fileDB pruneRelatedValues];
             
-                // A list of follow on commands.
-                NSMutableArray *followOns = [NSMutableArray new];
-
-                // Queue command to delete unused files.
-                [followOns addObject:[self opFileGC]];
-
-                // Read list of fileset names with modified fingerprints.
-                NSArray *rows = [fileDB performQuery:@"SELECT category FROM fingerprints WHERE current != latest" withParams:@[]];
-                for (NSDictionary *row in rows) {
-                    NSString *category = row[@"category"];
-                    if ([@"$group" isEqualToString:category]) {
-                        // The ACM group fingerprint entry - skip.
-                        continue;
+                    // Queue command to delete unused files.
+                    [followOns addObject:[self backgroundOperation:[self opFileGC]]];
+
+                    // Read list of fileset names with modified fingerprints.
+                    NSArray *rows = [fileDB performQuery:@"SELECT category FROM fingerprints WHERE current != latest" withParams:@[]];
+                    for (NSDictionary *row in rows) {
+                        NSString *category = row[@"category"];
+                        if ([@"$group" isEqualToString:category]) {
+                            // The ACM group fingerprint entry - skip.
+                            continue;
+                        }
+                        // Map the category name to null - this indicates that the category is updated,
+                        // but there is no 'since' parameter, so download a full update.
+                        updatedCategories[category] = [NSNull null];
                     }
-                    // Map the category name to null - this indicates that the category is updated,
-                    // but there is no 'since' parameter, so download a full update.
-                    updatedCategories[category] = [NSNull null];
-                }
             
-                // Queue downloads of updated category filesets.
-                for (id category in [updatedCategories keyEnumerator]) {
-                    id since = updatedCategories[category];
-                    // Get cache location for fileset; if nil then don't download the fileset.
-                    NSString *cacheLocation = [fileDB cacheLocationForFileset:category];
-                    if (cacheLocation) {
-                        [followOns addObject:[self opDownloadFilesetWithCategory:category since:since]];
+                    // Queue downloads of updated category filesets.
+                    for (id category in [updatedCategories keyEnumerator]) {
+                        id since = updatedCategories[category];
+                        // Get cache location for fileset; if nil then don't download the fileset.
+                        NSString *cacheLocation = [fileDB cacheLocationForFileset:category];
+                        if (cacheLocation) {
+                            LOOperationBlock download = [self opDownloadFilesetWithCategory:category since:since];
+                            [followOns addObject:[self filesetOperation:download category:category opID:nil]];
+                        }
                     }
+                    return YES;
+                }];
+                if (!committed) {
+                    NSString *msg = applied
+                        ? [NSString stringWithFormat:@"Failed to apply updates from %@", updatesURL]
+                        : [NSString stringWithFormat:@"Invalid updates data from %@", updatesURL];
+                    self.lastRefreshStatus = LOCMSRefreshStatusFailed;
+                    [promise reject:msg];
+                    return nil;
+                }
+                [fileDB incrementGeneration];
+                [self.metrics recordValue:rowCount inHistogram:@"refresh.rows"];
+                // Later requests are conditional on the feed having changed since this one.
+                @synchronized (self) {
+                    self->_updatesETag = [LOHTTPUtils valueForHeader:@"ETag" inResponse:response.httpResponse];
                 }
+                self.lastRefreshStatus = rowCount > 0 ? LOCMSRefreshStatusUpdated : LOCMSRefreshStatusNotModified;
 
-                // Commit the transaction.
-                [fileDB commitTransaction];
+                // Prefetch uncached files referenced by the updated pages, so that the pages don't
+                // wait on the network when first displayed.
+                [self.prefetcher prefetchAssetsOfPages:updatedPageIDs];
             
                 // QUESTIONS ABOUT THE CODE ABOVE
                 // 1. How does the code perform if the procedure above is interrupted before completion?
@@ -265,22 +399,55 @@ authenticationManager:(LOHTTPAuthenticationManager *)authManager {
             /* -- end of else after db version check
             }
             */
-            [self->_promise resolve:followOns];
+            [promise resolve:followOns];
             return nil;
         })
         .fail(^(id error) {
             NSString *msg = [NSString stringWithFormat:@"Updates download from %@ failed: %@", updatesURL, error ];
-            [self->_promise reject:msg];
+            self.lastRefreshStatus = LOCMSRefreshStatusFailed;
+            [promise reject:msg];
         });
         
         // Return deferred promise.
-        return self->_promise;
+        return promise;
     };
 }
 
+- (QPromise *)getUpdates:(NSString *)url params:(NSDictionary *)params {
+    QPromise *promise = [QPromise new];
+    NSURLComponents *components = [NSURLComponents componentsWithString:url];
+    NSMutableArray *queryItems = [NSMutableArray new];
+    // Sort the parameter names, so that the same parameters always produce the same request.
+    for (NSString *name in [[params allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+        [queryItems addObject:[NSURLQueryItem queryItemWithName:name value:[params[name] description]]];
+    }
+    components.queryItems = queryItems;
+    NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:components.URL];
+    // Note that the URL session adds its own Accept-Encoding header, and decodes gzipped responses.
+    [request setValue:AcceptMIMETypes forHTTPHeaderField:@"Accept"];
+    @synchronized (self) {
+        if (_updatesETag) {
+            [request setValue:_updatesETag forHTTPHeaderField:@"If-None-Match"];
+        }
+    }
+    NSURLSessionDataTask *task = [_updatesSession dataTaskWithRequest:request
+                                                    completionHandler:^(NSData *data, NSURLResponse *response, NSError *error) {
+        if (error || ![response isKindOfClass:[NSHTTPURLResponse class]]) {
+            [promise reject:error ?: @"Invalid updates response"];
+            return;
+        }
+        LOCMSUpdatesResponse *updates = [LOCMSUpdatesResponse new];
+        updates.httpResponse = (NSHTTPURLResponse *)response;
+        updates.data = data;
+        [promise resolve:updates];
+    }];
+    [task resume];
+    return promise;
+}
+
 - (LOOperationBlock)opReset {
     return ^() {
-        self->_promise = [QPromise new];
+        QPromise *promise = [QPromise new];
         
         NSString *updatesURL = [self->_settings updatesURL];
 
@@ -298,18 +465,21 @@ authenticationManager:(LOHTTPAuthenticationManager *)authManager {
             if ([@"$group" isEqualToString:category]) {
                 continue;
             }
-            NSString *cvs = [self buildClientVisibleSetForCategory:category];
-            [fileDB insertResetCVS:cvs forCategory:category];
+            NSData *cvs = [self buildClientVisibleSetForCategory:category];
+            if (cvs) {
+                [fileDB insertResetCVS:cvs forCategory:category];
+            }
         }
         
         // Read CVS for complete file DB
-        NSString *cvs = [self buildClientVisibleSetForCategory:nil];
+        NSData *cvs = [self buildClientVisibleSetForCategory:nil];
+        if (!cvs) {
+            [promise reject:@"Unable to read client visible set for reset"];
+            return promise;
+        }
         
         // Prepare URL, parameters and options for updates request.
-        NSDictionary *params = @{
-            @"secure":  IsSecure,
-            @"cvs":     cvs
-        };
+        NSDictionary *params = [self requestParamsForClientVisibleSet:cvs];
 
         NSDictionary *options = @{
             SCHTTPClientRequestOptionAccept:            AcceptMIMETypes,
@@ -325,52 +495,51 @@ authenticationManager:(LOHTTPAuthenticationManager *)authManager {
             if (responseCode == 401) {
                 LOHTTPAuthenticationManager *authManager = self->_authManager;
                 [authManager removeCredentials];
-                [self->_promise resolve:@[]];
+                [promise resolve:@[]];
                 return nil;
             }
         
-            // Read the updates data.
-            id updateData = [response parseData];
-            if ([updateData isKindOfClass:[NSString class]]) {
+            // Open a reader on the updates data; rows are decoded as they are applied.
+            LOCMSUpdatesFeedReader *reader = [[LOCMSUpdatesFeedReader alloc] initWithData:response.data
+                                                                                 mimeType:response.httpResponse.MIMEType];
+            if (reader.errorMessage) {
                 // Indicates a server error
-                NSLog(@"%@ %@", response.httpResponse.URL, updateData);
-                [self->_promise resolve:@[]];
+                NSLog(@"%@ %@", response.httpResponse.URL, reader.errorMessage);
+                [promise resolve:@[]];
                 return nil;
             }
         
-            // Write updates to database.
-            NSDictionary *updates = [updateData valueForKeyPath:@"db"];
-            if ([@0 isEqual:updates]) {
-                // This can happen no updates to report from the server; replace updates
-                // with an empty dictionary.
-                updates = @{};
-            }
-        
-            // Start a DB transaction.
-            [fileDB beginTransaction];
-        
-            // Shift current fileset fingerprints to previous.
-            [fileDB performUpdate:@"UPDATE fingerprints SET current=latest" withParams:@[]];
-
-            // Apply all downloaded updates to the database.
-            for (NSString *tableName in updates) {
-                NSArray *table = updates[tableName];
-                for (NSDictionary *values in table) {
-                    [fileDB upsertValues:values intoTable:tableName];
+            // Apply the updates within a single transaction.
+            __block BOOL applied = NO;
+            BOOL committed = [fileDB performTransaction:^BOOL {
+
+                // Shift current fileset fingerprints to previous.
+                [fileDB performUpdate:@"UPDATE fingerprints SET current=latest" withParams:@[]];
+
+                // Apply all downloaded updates to the database.
+                applied = [self applyUpdatesFeed:reader rowBlock:nil];
+                if (!applied) {
+                    return NO;
                 }
-            }
-        
-            // Prune ORM related records.
-            [fileDB pruneRelatedValues];
 
-            // Commit the transaction.
-            [fileDB commitTransaction];
+                // Prune ORM related records.
+                [fileDB pruneRelatedValues];
+                return YES;
+            }];
+            if (!committed) {
+                NSString *msg = applied
+                    ? [NSString stringWithFormat:@"Failed to apply reset data from %@", updatesURL]
+                    : [NSString stringWithFormat:@"Invalid reset data from %@", updatesURL];
+                [promise reject:msg];
+                return nil;
+            }
+            [fileDB incrementGeneration];
         
             // A list of follow on commands.
             NSMutableArray *followOns = [NSMutableArray new];
 
             // Queue command to delete unused files.
-            [followOns addObject:[self opFileGC]];
+            [followOns addObject:[self backgroundOperation:[self opFileGC]]];
         
             // Read list of fileset category names and queue fileset reset commands.
             // (Note that this is done after the updates, and not before, to ensure that any newly
@@ -382,94 +551,116 @@ authenticationManager:(LOHTTPAuthenticationManager *)authManager {
                     // The ACM group fingerprint entry - skip.
                     continue;
                 }
-                [followOns addObject:[self opResetFilesetWithCategory:category]];
+                LOOperationBlock reset = [self opResetFilesetWithCategory:category];
+                [followOns addObject:[self filesetOperation:reset category:category opID:nil]];
             }
         
-            [self->_promise resolve:followOns];
+            [promise resolve:followOns];
             return nil;
         })
         .fail(^(id error) {
             NSString *msg = [NSString stringWithFormat:@"Reset download from %@ failed: %@", updatesURL, error ];
-            [self->_promise reject:msg];
+            [promise reject:msg];
         });
         
         // Return deferred promise.
-        return self->_promise;
+        return promise;
     };
 }
 
 - (LOOperationBlock)opResetFilesetWithCategory:(NSString *)category {
     return ^() {
-        self->_promise = [QPromise new];
+        QPromise *promise = [QPromise new];
         
         LOCMSFileDB *fileDB = self->_fileDB;
         
-        NSString *cvs = [fileDB getResetCVSForCategory:category];
+        NSData *cvs = [fileDB getResetCVSForCategory:category];
         
         // If no CVS found then don't continue with this command, but issue a normal fileset
         // download command in its place.
         if (!cvs) {
-            [self->_promise resolve:@[ [self opDownloadFilesetWithCategory:category since:nil] ] ];
+            LOOperationBlock download = [self opDownloadFilesetWithCategory:category since:nil];
+            [promise resolve:@[ [self filesetOperation:download category:category opID:nil] ]];
         }
         else {
             // Otherwise continue with reset command.
             
             // Build the fileset URL and query parameters.
             NSString *filesetURL = [self->_settings urlForFileset:category];
-            NSDictionary *data = @{
-                @"cvs":     cvs,
-                @"secure":  IsSecure
-            };
+            NSDictionary *data = [self requestParamsForClientVisibleSet:cvs];
             
             // Download the fileset.
-            [self->_httpClient post:filesetURL data:data]
-            .then((id)^(SCHTTPClientResponse *response) {
-                NSInteger responseCode = response.httpResponse.statusCode;
-                if (responseCode == 200) {
-                    // Unzip downloaded file to content location.
-                    NSString *downloadPath = [response.downloadLocation path];
-                    NSString *cachePath = [fileDB cacheLocationForFileset:category];
-                    [SCFileIO unzipFileAtPath:downloadPath toPath:cachePath overwrite:YES];
+            LOCMSFilesetDownloader *downloader = self->_filesetDownloader;
+            NSString *commit = [self latestCommitForFileset:category];
+            NSString *cachePath = [fileDB cacheLocationForFileset:category];
+            [downloader downloadFileset:category
+                                fromURL:filesetURL
+                                 method:@"POST"
+                                   data:data
+                                 commit:commit
+                                extract:(cachePath != nil)
+                             yieldBlock:[self yieldBlockForCurrentOperation]]
+            .then((id)^(LOCMSFilesetDownload *download) {
+                if (download.yielded) {
+                    // Continue the reset once the higher priority work has started; the download
+                    // resumes from where it stopped.
+                    LOOperationBlock reset = [self opResetFilesetWithCategory:category];
+                    [promise resolve:@[ [self filesetOperation:reset category:category opID:nil] ]];
+                    return nil;
                 }
+                NSInteger responseCode = download.statusCode;
                 if (responseCode == 200 || responseCode == 204) {
-                    // Update the fileset's fingerprint and delete the fileset reset record
-                    [fileDB beginTransaction];
-                    [fileDB performUpdate:@"UPDATE fingerprints SET current=latest WHERE category=?" withParams:@[ category ]];
-                    [fileDB deleteResetRecordForCategory:category];
-                    [fileDB commitTransaction];
+                    // Update the fileset's fingerprint and delete the fileset reset record; the
+                    // extracted files are moved into the cache as part of the same transaction.
+                    __block NSError *error = nil;
+                    BOOL committed = [fileDB performTransaction:^BOOL {
+                        [fileDB performUpdate:@"UPDATE fingerprints SET current=latest WHERE category=?" withParams:@[ category ]];
+                        [fileDB deleteResetRecordForCategory:category];
+                        NSError *installError = nil;
+                        BOOL ok = [downloader installDownload:download atPath:cachePath replacingContents:NO error:&installError];
+                        error = installError;
+                        return ok;
+                    }];
+                    if (committed) {
+                        [fileDB incrementGeneration];
+                    }
+                    else {
+                        [downloader completeDownloadOfFileset:category];
+                        NSString *msg = [NSString stringWithFormat:@"Installing fileset %@ failed: %@", category, error];
+                        [promise reject:msg];
+                        return nil;
+                    }
                 }
+                // Discard any remaining staged data.
+                [downloader completeDownloadOfFileset:category];
                 // Resolve empty list - no follow-on commands.
-                [self->_promise resolve:@[]];
+                [promise resolve:@[]];
                 return nil;
             })
             .fail(^(id error) {
                 NSString *msg = [NSString stringWithFormat:@"Fileset reset from %@ failed: %@", filesetURL, error];
-                [self->_promise reject:msg];
+                [promise reject:msg];
             });
         }
         
         // Return deferred promise.
-        return self->_promise;
+        return promise;
     };
 }
 
 - (LOOperationBlock)opFileGC {
     return ^() {
-        LOCMSFileDB *fileDB = self->_fileDB;
+        LOCMSGarbageCollector *gc = self->_garbageCollector;
 
-        // Remove all files marked as deleted in the file DB.
-        NSFileManager *fileManager = [NSFileManager defaultManager];
-        NSArray *deleted = [fileDB performQuery:@"SELECT id, path FROM files WHERE status='deleted'" withParams:@[]];
-        for (NSDictionary *record in deleted) {
-            // Delete cached file, if exists.
-            NSString *path = [fileDB cacheLocationForFileRecord:record];
-            if (path && [fileManager fileExistsAtPath:path]) {
-                [fileManager removeItemAtPath:path error:nil];
-            }
+        // Remove the records of all files marked as deleted in the file DB. The files themselves
+        // are deleted in the background, so that operations queued behind this one (e.g. fileset
+        // downloads) aren't held up; the collector logs a report once they are deleted.
+        [gc collectDeletedFiles];
+
+        // Periodically sweep the cache for files no longer referenced by the file DB.
+        if (gc.sweepDue) {
+            [gc sweepOrphans];
         }
-        
-        // Delete obsolete records.
-        [fileDB performUpdate:@"DELETE FROM files WHERE status='deleted'" withParams:@[]];
 
         // Return empty command list.
         return [Q resolve:@[]];
@@ -481,7 +672,7 @@ authenticationManager:(LOHTTPAuthenticationManager *)authManager {
         since = nil;
     }
     return ^() {
-        self->_promise = [QPromise new];
+        QPromise *promise = [QPromise new];
         
         // Build the fileset URL and query parameters.
         NSString *filesetURL = [self->_settings urlForFileset:category];
@@ -492,50 +683,163 @@ authenticationManager:(LOHTTPAuthenticationManager *)authManager {
         }
         
         // Download the fileset.
-        [self->_httpClient getFile:filesetURL data:data]
-        .then((id)^(SCHTTPClientResponse *response) {
-            LOCMSFileDB *fileDB = self->_fileDB;
-            NSInteger responseCode = response.httpResponse.statusCode;
-            if (responseCode == 200) {
-                // Unzip downloaded file to content location.
-                NSString *downloadPath = [response.downloadLocation path];
-                NSString *cachePath = [fileDB cacheLocationForFileset:category];
-                [SCFileIO unzipFileAtPath:downloadPath toPath:cachePath overwrite:YES];
+        LOCMSFilesetDownloader *downloader = self->_filesetDownloader;
+        NSString *commit = [self latestCommitForFileset:category];
+        LOCMSFileDB *fileDB = self->_fileDB;
+        NSString *cachePath = [fileDB cacheLocationForFileset:category];
+        [downloader downloadFileset:category
+                            fromURL:filesetURL
+                             method:@"GET"
+                               data:data
+                             commit:commit
+                            extract:(cachePath != nil)
+                         yieldBlock:[self yieldBlockForCurrentOperation]]
+        .then((id)^(LOCMSFilesetDownload *download) {
+            [self.metrics incrementCounter:[@"fileset.bytes." stringByAppendingString:category] by:download.bytesReceived];
+            if (download.yielded) {
+                // Continue the download once the higher priority work has started; the download
+                // resumes from where it stopped.
+                LOOperationBlock continuation = [self opDownloadFilesetWithCategory:category since:since];
+                [promise resolve:@[ [self filesetOperation:continuation category:category opID:nil] ]];
+                return nil;
             }
+            NSInteger responseCode = download.statusCode;
             if (responseCode == 200 || responseCode == 204) {
-                // Update the fileset's fingerprint.
-                [fileDB performUpdate:@"UPDATE fingerprints SET current=latest WHERE category=?" withParams:@[ category ]];
+                // Update the fileset's fingerprint. The extracted files are moved into the cache as
+                // part of the same transaction; a download without a 'since' commit contains the full
+                // fileset, and so replaces the cache directory.
+                __block NSError *error = nil;
+                BOOL committed = [fileDB performTransaction:^BOOL {
+                    [fileDB performUpdate:@"UPDATE fingerprints SET current=latest WHERE category=?" withParams:@[ category ]];
+                    NSError *installError = nil;
+                    BOOL ok = [downloader installDownload:download atPath:cachePath replacingContents:(since == nil) error:&installError];
+                    error = installError;
+                    return ok;
+                }];
+                if (committed) {
+                    [fileDB incrementGeneration];
+                    LOCMSFileset *fileset = fileDB.filesets[category];
+                    if (fileset.evictable) {
+                        // The installed files may have taken the content cache over budget.
+                        [fileDB.cacheBudget checkBudget:YES];
+                    }
+                }
+                else {
+                    [downloader completeDownloadOfFileset:category];
+                    NSString *msg = [NSString stringWithFormat:@"Installing fileset %@ failed: %@", category, error];
+                    [promise reject:msg];
+                    return nil;
+                }
             }
+            // Discard any remaining staged data.
+            [downloader completeDownloadOfFileset:category];
             // Resolve empty list - no follow-on commands.
-            [self->_promise resolve:@[]];
+            [promise resolve:@[]];
             return nil;
         })
         .fail(^(id error) {
             NSString *msg = [NSString stringWithFormat:@"Fileset download from %@ failed: %@", filesetURL, error];
-            [self->_promise reject:msg];
+            [promise reject:msg];
         });
 
         // Return deferred promise.
-        return self->_promise;
+        return promise;
     };
 }
 
-- (NSString *)buildClientVisibleSetForCategory:(NSString *)category {
-
-    NSMutableString *json = [NSMutableString new];
-    [json appendString:@"{"];
-    NSString *separator = @"";
-    
-    NSArray *records = (category == nil)
-        ? [_fileDB performQuery:@"SELECT id, version FROM files ORDER BY id" withParams:@[]]
-        : [_fileDB performQuery:@"SELECT id, version FROM files WHERE category=? ORDER BY id" withParams:@[ category ]];
-    
-    for (NSDictionary *record in records) {
-        [json appendFormat:@"%@\"%@\":\"%@\"", separator, record[@"id"], record[@"version"]];
-        separator = @",";
+- (BOOL)applyUpdatesFeed:(LOCMSUpdatesFeedReader *)reader rowBlock:(LOCMSUpdatesFeedRowBlock)rowBlock {
+    LOCMSFileDB *fileDB = _fileDB;
+    // Records for the same table are contiguous in the feed, so accumulate records into a batch
+    // until either the batch is full or the table changes.
+    NSMutableArray *batch = [NSMutableArray new];
+    __block NSString *batchTable = nil;
+    // Set to NO if a batch fails to write; the rest of the feed is then skipped, and the
+    // failure returned, so that the transaction is rolled back.
+    __block BOOL batchOK = YES;
+    NSError *error = nil;
+    BOOL ok = [reader readRows:^(NSString *table, NSDictionary *values) {
+        if (!batchOK) {
+            return;
+        }
+        if (batchTable && (![batchTable isEqualToString:table] || [batch count] >= UpdatesBatchSize)) {
+            batchOK = [fileDB upsertValueBatch:batch intoTable:batchTable];
+            [batch removeAllObjects];
+            if (!batchOK) {
+                return;
+            }
+        }
+        batchTable = table;
+        [batch addObject:values];
+        if (rowBlock) {
+            rowBlock(table, values);
+        }
+    } error:&error];
+    if (ok && batchOK && [batch count] > 0) {
+        batchOK = [fileDB upsertValueBatch:batch intoTable:batchTable];
+    }
+    if (!ok) {
+        [Logger error:@"Reading updates feed: %@", error];
+    }
+    else if (!batchOK) {
+        [Logger error:@"Writing updates feed records to table %@ failed", batchTable];
+    }
+    return ok && batchOK;
+}
+
+- (LOOperationQueueItem *)dbOperation:(LOOperationBlock)operation opID:(NSString *)opID {
+    // Operations which apply updates to the file DB can't run concurrently with any other DB user.
+    return [[LOOperationQueueItem alloc] initWithOperation:operation
+                                                      opID:opID
+                                                 resources:@[ DBResource ]
+                                           sharedResources:@[]];
+}
+
+- (LOOperationQueueItem *)filesetOperation:(LOOperationBlock)operation category:(NSString *)category opID:(NSString *)opID {
+    // Fileset operations only make small updates to the file DB, and so can run concurrently with
+    // each other, providing they are for different fileset categories. Operations without a category
+    // (e.g. file GC) only share the file DB. Note that the file DB serializes their writes, so each
+    // operation's transaction only contains its own updates.
+    NSArray *resources = category ? @[ FilesetResource(category) ] : @[];
+    return [[LOOperationQueueItem alloc] initWithOperation:operation
+                                                      opID:opID
+                                                 resources:resources
+                                           sharedResources:@[ DBResource ]];
+}
+
+- (LOOperationQueueItem *)backgroundOperation:(LOOperationBlock)operation {
+    LOOperationQueueItem *item = [self filesetOperation:operation category:nil opID:nil];
+    item.priority = LOOperationPriorityBackground;
+    return item;
+}
+
+- (BOOL (^)(void))yieldBlockForCurrentOperation {
+    __weak LOOperationQueueItem *item = [LOOperationQueue currentItem];
+    return ^BOOL {
+        return [item shouldYield];
+    };
+}
+
+- (NSString *)latestCommitForFileset:(NSString *)category {
+    NSDictionary *record = [_fileDB readRecordWithID:category fromTable:@"fingerprints"];
+    id latest = record[@"latest"];
+    return [latest isKindOfClass:[NSString class]] ? latest : nil;
+}
+
+- (NSData *)buildClientVisibleSetForCategory:(NSString *)category {
+    return [LOCMSClientVisibleSet compactCVSForCategory:category inFileDB:_fileDB];
+}
+
+- (NSDictionary *)requestParamsForClientVisibleSet:(NSData *)cvs {
+    NSMutableDictionary *params = [NSMutableDictionary new];
+    params[@"secure"] = IsSecure;
+    if (_settings.compactCVS) {
+        params[@"cvs"] = [cvs base64EncodedStringWithOptions:0];
+        params[@"cvsformat"] = LOCMSClientVisibleSetCompactFormat;
+    }
+    else {
+        params[@"cvs"] = [LOCMSClientVisibleSet JSONForCompactCVS:cvs] ?: @"{}";
     }
-    [json appendString:@"}"];
-    return json;
+    return params;
 }
 
 @end
@@ -0,0 +1,59 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+@class LOCMSRepository;
+
+/**
+ * Prefetches the images and assets referenced by updated pages into the content cache.
+ * Page content is held in the file DB, but the files it references are normally only
+ * downloaded when a web view requests them, which puts a network round trip on the first
+ * render of a new page if a file isn't already cached (e.g. because it was evicted from the
+ * content cache). After a refresh, the prefetcher parses the content and image of each updated
+ * page for references to files in cachable filesets, and downloads any which aren't cached.
+ * Downloads are made through the repository's download registry, so a request made for a file
+ * whilst it's being prefetched waits on the prefetch rather than starting a second download.
+ * Prefetching is low priority: downloads are limited to a small number at a time, pause whilst
+ * the yield block reports that higher priority work is in progress, and stop once a pass has
+ * downloaded its byte budget.
+ */
+@interface LOCMSPrefetcher : NSObject
+
+- (id)initWithRepository:(LOCMSRepository *)repository;
+
+/// Whether prefetching is enabled. Defaults to YES.
+@property (nonatomic, assign) BOOL enabled;
+/// The maximum number of prefetch downloads in progress at once. Defaults to 2.
+@property (nonatomic, assign) NSUInteger maxConcurrentDownloads;
+/**
+ * The maximum number of bytes downloaded by a prefetch pass. Defaults to 10MB.
+ * A pass starts when pages are queued for prefetching and no pass is in progress; pages queued
+ * during a pass are added to it.
+ */
+@property (nonatomic, assign) unsigned long long byteBudget;
+/// A block which returns YES when higher priority work is in progress; new downloads wait whilst it does.
+@property (nonatomic, copy) BOOL (^yieldBlock)(void);
+/// The total number of files prefetched.
+@property (atomic, assign, readonly) NSUInteger prefetchedFileCount;
+/// The total size of the files prefetched, in bytes.
+@property (atomic, assign, readonly) unsigned long long prefetchedBytes;
+
+/// Prefetch the files referenced by a list of pages, in the background.
+- (void)prefetchAssetsOfPages:(NSArray<NSString *> *)pageIDs;
+/// Return the file references - src, href and poster attributes, and CSS url() values - in an HTML string.
++ (NSArray<NSString *> *)fileReferencesInHTML:(NSString *)html;
+
+@end
@@ -0,0 +1,344 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LOCMSPrefetcher.h"
+#import "LOCMSRepository.h"
+#import "LOCMSContentCacheBudget.h"
+#import "LOCMSFileset.h"
+#import "SCLogger.h"
+
+#define DefaultMaxConcurrentDownloads   (2)
+#define DefaultByteBudget               (10 * 1024 * 1024)
+// The number of IDs or paths in each file DB query.
+#define QueryBatchSize                  (400)
+// The delay before checking again whether to continue, when yielding to higher priority work.
+#define YieldDelay                      (0.5)
+// The maximum number of consecutive yields before the remainder of a pass is abandoned.
+#define MaxYields                       (120)
+
+static SCLogger *Logger;
+
+/// A file queued for prefetching.
+@interface LOCMSPrefetchItem : NSObject
+
+/// The file path.
+@property (nonatomic, strong) NSString *path;
+/// The file's fileset category.
+@property (nonatomic, strong) NSString *category;
+/// The file's cache location.
+@property (nonatomic, strong) NSString *cachePath;
+
+@end
+
+@implementation LOCMSPrefetchItem
+@end
+
+@interface LOCMSPrefetcher () {
+    __weak LOCMSRepository *_repository;
+    /// A serial, low priority queue; all pass state is only accessed on this queue.
+    dispatch_queue_t _queue;
+    /// Files waiting to be downloaded, in page order.
+    NSMutableArray<LOCMSPrefetchItem *> *_pending;
+    /// The cache paths of all files queued in the current pass.
+    NSMutableSet<NSString *> *_queued;
+    /// The number of downloads in progress.
+    NSUInteger _inFlight;
+    /// The number of bytes downloaded in the current pass.
+    unsigned long long _passBytes;
+    /// The number of consecutive yields.
+    NSUInteger _yields;
+    /// A flag indicating that the pass is waiting for higher priority work to finish.
+    BOOL _yielding;
+    /// A flag indicating that files in evictable filesets have been downloaded in the current pass.
+    BOOL _fetchedEvictable;
+}
+
+@property (atomic, assign, readwrite) NSUInteger prefetchedFileCount;
+@property (atomic, assign, readwrite) unsigned long long prefetchedBytes;
+
+/// Read the paths of the files referenced by a list of pages.
+- (NSOrderedSet<NSString *> *)referencedPathsOfPages:(NSArray<NSString *> *)pageIDs;
+/// Resolve a file reference in a page's content to a repository path; returns nil if the reference isn't to a repository file.
+- (NSString *)repositoryPathForReference:(NSString *)reference inPage:(NSString *)pagePath;
+/// Queue the uncached files, out of a list of paths, for download.
+- (void)queueUncachedFiles:(NSOrderedSet<NSString *> *)paths;
+/// Start pending downloads, up to the concurrency limit.
+- (void)startDownloads;
+/// Complete a download and start the next.
+- (void)completeDownloadOfItem:(LOCMSPrefetchItem *)item contentPath:(NSString *)contentPath;
+/// End the current pass.
+- (void)endPass;
+
+@end
+
+@implementation LOCMSPrefetcher
+
++ (void)initialize {
+    Logger = [[SCLogger alloc] initWithTag:@"LOCMSPrefetcher"];
+}
+
+- (id)initWithRepository:(LOCMSRepository *)repository {
+    self = [super init];
+    if (self) {
+        _repository = repository;
+        _enabled = YES;
+        _maxConcurrentDownloads = DefaultMaxConcurrentDownloads;
+        _byteBudget = DefaultByteBudget;
+        _pending = [NSMutableArray new];
+        _queued = [NSMutableSet new];
+        _queue = dispatch_queue_create("LOCMSPrefetcher", DISPATCH_QUEUE_SERIAL);
+        dispatch_set_target_queue(_queue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+    }
+    return self;
+}
+
+- (void)prefetchAssetsOfPages:(NSArray<NSString *> *)pageIDs {
+    if (!_enabled || [pageIDs count] == 0) {
+        return;
+    }
+    pageIDs = [pageIDs copy];
+    dispatch_async(_queue, ^{
+        NSOrderedSet *paths = [self referencedPathsOfPages:pageIDs];
+        [self queueUncachedFiles:paths];
+        [self startDownloads];
+    });
+}
+
++ (NSArray<NSString *> *)fileReferencesInHTML:(NSString *)html {
+    static NSRegularExpression *AttributeRefs, *StyleRefs;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        AttributeRefs = [NSRegularExpression regularExpressionWithPattern:@"\\b(?:src|href|poster|data-src)\\s*=\\s*(?:\"([^\"]*)\"|'([^']*)')"
+                                                                  options:NSRegularExpressionCaseInsensitive
+                                                                    error:nil];
+        StyleRefs = [NSRegularExpression regularExpressionWithPattern:@"url\\(\\s*(?:\"([^\"]*)\"|'([^']*)'|([^)\\s]*))\\s*\\)"
+                                                              options:NSRegularExpressionCaseInsensitive
+                                                                error:nil];
+    });
+    NSMutableArray *refs = [NSMutableArray new];
+    if (![html isKindOfClass:[NSString class]]) {
+        return refs;
+    }
+    NSRange range = NSMakeRange(0, [html length]);
+    for (NSRegularExpression *regex in @[ AttributeRefs, StyleRefs ]) {
+        [regex enumerateMatchesInString:html options:0 range:range usingBlock:^(NSTextCheckingResult *match, NSMatchingFlags flags, BOOL *stop) {
+            // The reference is in whichever capture group matched.
+            for (NSUInteger i = 1; i < match.numberOfRanges; i++) {
+                NSRange group = [match rangeAtIndex:i];
+                if (group.location != NSNotFound && group.length > 0) {
+                    [refs addObject:[html substringWithRange:group]];
+                    break;
+                }
+            }
+        }];
+    }
+    return refs;
+}
+
+#pragma mark - Private
+
+- (NSOrderedSet<NSString *> *)referencedPathsOfPages:(NSArray<NSString *> *)pageIDs {
+    LOCMSFileDB *fileDB = _repository.fileDB;
+    NSMutableOrderedSet *paths = [NSMutableOrderedSet new];
+    NSUInteger count = [pageIDs count];
+    for (NSUInteger i = 0; i < count; i += QueryBatchSize) {
+        NSArray *batch = [pageIDs subarrayWithRange:NSMakeRange(i, MIN(QueryBatchSize, count - i))];
+        NSMutableArray *placeholders = [NSMutableArray new];
+        for (NSUInteger j = 0; j < [batch count]; j++) {
+            [placeholders addObject:@"?"];
+        }
+        NSString *sql = [NSString stringWithFormat:@"SELECT f.path AS path, p.content AS content, p.image AS image "
+                         "FROM pages p, %@ f WHERE f.id=p.id AND p.id IN (%@)",
+                         fileDB.filesTable, [placeholders componentsJoinedByString:@","]];
+        [fileDB enumerateQuery:sql withParams:batch usingBlock:^(NSDictionary *record, BOOL *stop) {
+            NSString *pagePath = record[@"path"];
+            if (![pagePath isKindOfClass:[NSString class]]) {
+                return;
+            }
+            // The page image is listed first, as it's usually displayed first.
+            NSMutableArray *refs = [NSMutableArray new];
+            id image = record[@"image"];
+            if ([image isKindOfClass:[NSString class]]) {
+                [refs addObject:image];
+            }
+            [refs addObjectsFromArray:[LOCMSPrefetcher fileReferencesInHTML:record[@"content"]]];
+            for (NSString *ref in refs) {
+                NSString *path = [self repositoryPathForReference:ref inPage:pagePath];
+                if (path) {
+                    [paths addObject:path];
+                }
+            }
+        }];
+    }
+    return paths;
+}
+
+- (NSString *)repositoryPathForReference:(NSString *)reference inPage:(NSString *)pagePath {
+    reference = [reference stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
+    if ([reference length] == 0 || [reference hasPrefix:@"#"] || [reference hasPrefix:@"//"]) {
+        return nil;
+    }
+    // Pages are served under the repository's base path, so references are resolved against
+    // the page's full content path, and must then be within the base path.
+    NSCharacterSet *slash = [NSCharacterSet characterSetWithCharactersInString:@"/"];
+    NSString *basePath = [_repository.basePath stringByTrimmingCharactersInSet:slash];
+    basePath = [basePath length] > 0 ? [NSString stringWithFormat:@"/%@/", basePath] : @"/";
+    NSString *pageURLPath = [basePath stringByAppendingString:[pagePath stringByTrimmingCharactersInSet:slash]];
+    NSURL *pageURL = [NSURL fileURLWithPath:pageURLPath];
+    NSURL *url = [NSURL URLWithString:reference relativeToURL:pageURL];
+    if (!url) {
+        NSString *escaped = [reference stringByAddingPercentEncodingWithAllowedCharacters:[NSCharacterSet URLPathAllowedCharacterSet]];
+        url = [NSURL URLWithString:escaped relativeToURL:pageURL];
+    }
+    NSString *scheme = url.scheme;
+    if (!([@"file" isEqualToString:scheme] || [@"content" isEqualToString:scheme])) {
+        // An external URL, or a non-file reference such as a mailto: or data: URL.
+        return nil;
+    }
+    NSString *path = url.standardizedURL.path;
+    if (![path hasPrefix:basePath]) {
+        return nil;
+    }
+    return [@"/" stringByAppendingString:[path substringFromIndex:[basePath length]]];
+}
+
+- (void)queueUncachedFiles:(NSOrderedSet<NSString *> *)paths {
+    LOCMSFileDB *fileDB = _repository.fileDB;
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    // File DB paths may be stored with or without a leading slash, so query for both forms.
+    NSMutableArray *params = [NSMutableArray new];
+    NSMutableDictionary<NSString *, NSNumber *> *order = [NSMutableDictionary new];
+    for (NSString *path in paths) {
+        order[path] = @([order count]);
+        [params addObject:path];
+        [params addObject:[path substringFromIndex:1]];
+    }
+    NSMutableArray<LOCMSPrefetchItem *> *items = [NSMutableArray new];
+    NSUInteger count = [params count];
+    for (NSUInteger i = 0; i < count; i += QueryBatchSize) {
+        NSArray *batch = [params subarrayWithRange:NSMakeRange(i, MIN(QueryBatchSize, count - i))];
+        NSMutableArray *placeholders = [NSMutableArray new];
+        for (NSUInteger j = 0; j < [batch count]; j++) {
+            [placeholders addObject:@"?"];
+        }
+        NSString *sql = [NSString stringWithFormat:@"SELECT path, category, status FROM %@ WHERE path IN (%@)",
+                         fileDB.filesTable, [placeholders componentsJoinedByString:@","]];
+        [fileDB enumerateQuery:sql withParams:batch usingBlock:^(NSDictionary *record, BOOL *stop) {
+            NSString *path = record[@"path"], *category = record[@"category"];
+            LOCMSFileset *fileset = fileDB.filesets[category];
+            if (!fileset.cachable || [@"packaged" isEqualToString:record[@"status"]]) {
+                // Not cached, or distributed with the app.
+                return;
+            }
+            NSString *cachePath = [fileDB cacheLocationForFile:path inFileset:category];
+            if (!cachePath || [self->_queued containsObject:cachePath] || [fileManager fileExistsAtPath:cachePath]) {
+                return;
+            }
+            LOCMSPrefetchItem *item = [LOCMSPrefetchItem new];
+            item.path = path;
+            item.category = category;
+            item.cachePath = cachePath;
+            [items addObject:item];
+            [self->_queued addObject:cachePath];
+        }];
+    }
+    // Restore page order.
+    [items sortUsingComparator:^NSComparisonResult(LOCMSPrefetchItem *a, LOCMSPrefetchItem *b) {
+        NSString *pathA = [a.path hasPrefix:@"/"] ? a.path : [@"/" stringByAppendingString:a.path];
+        NSString *pathB = [b.path hasPrefix:@"/"] ? b.path : [@"/" stringByAppendingString:b.path];
+        return [order[pathA] compare:order[pathB]];
+    }];
+    [_pending addObjectsFromArray:items];
+}
+
+- (void)startDownloads {
+    LOCMSRepository *repository = _repository;
+    if (!repository) {
+        return;
+    }
+    LOCMSDownloadRegistry *downloads = repository.downloads;
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    while (!_yielding && [_pending count] > 0 && _inFlight < MAX(_maxConcurrentDownloads, 1)) {
+        if (_passBytes >= _byteBudget) {
+            [Logger warn:@"Prefetch byte budget reached; %lu files not prefetched", (unsigned long)[_pending count]];
+            [_pending removeAllObjects];
+            break;
+        }
+        BOOL (^yieldBlock)(void) = _yieldBlock;
+        if (yieldBlock && yieldBlock()) {
+            if (++_yields > MaxYields) {
+                [Logger warn:@"Prefetch abandoned after waiting for other downloads; %lu files not prefetched", (unsigned long)[_pending count]];
+                [_pending removeAllObjects];
+                break;
+            }
+            // Higher priority work is in progress; check again later.
+            _yielding = YES;
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(YieldDelay * NSEC_PER_SEC)), _queue, ^{
+                self->_yielding = NO;
+                [self startDownloads];
+            });
+            return;
+        }
+        _yields = 0;
+        LOCMSPrefetchItem *item = _pending[0];
+        [_pending removeObjectAtIndex:0];
+        // The file may have been cached by a fileset download or a content request since it was queued.
+        if ([fileManager fileExistsAtPath:item.cachePath] || [downloads isDownloadingKey:item.cachePath]) {
+            continue;
+        }
+        _inFlight++;
+        [downloads downloadWithKey:item.cachePath
+                        usingBlock:^(LOCMSDownloadCompletion done) {
+            [repository downloadFile:item.path toCachePath:item.cachePath completion:done];
+        }
+                        completion:^(NSString *contentPath, NSError *error) {
+            dispatch_async(self->_queue, ^{
+                [self completeDownloadOfItem:item contentPath:contentPath];
+            });
+        }];
+    }
+    if (_inFlight == 0 && [_pending count] == 0) {
+        [self endPass];
+    }
+}
+
+- (void)completeDownloadOfItem:(LOCMSPrefetchItem *)item contentPath:(NSString *)contentPath {
+    _inFlight--;
+    if (contentPath) {
+        NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:contentPath error:nil];
+        unsigned long long size = attributes.fileSize;
+        _passBytes += size;
+        self.prefetchedFileCount++;
+        self.prefetchedBytes += size;
+        LOCMSFileset *fileset = _repository.fileDB.filesets[item.category];
+        if (fileset.evictable) {
+            _fetchedEvictable = YES;
+        }
+    }
+    [self startDownloads];
+}
+
+- (void)endPass {
+    if (_fetchedEvictable) {
+        // Prefetched files may have taken the content cache over budget.
+        [_repository.fileDB.cacheBudget checkBudget:NO];
+    }
+    [_queued removeAllObjects];
+    _passBytes = 0;
+    _yields = 0;
+    _fetchedEvictable = NO;
+}
+
+@end
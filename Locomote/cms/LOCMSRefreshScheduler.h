@@ -0,0 +1,64 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "Q.h"
+
+@class LOCMSRepository;
+
+/**
+ * Schedules a repository's content refreshes.
+ * The interval between refreshes adapts to how often the repository's content changes: after a
+ * refresh which applies updates the interval returns to the minimum, whilst each refresh which
+ * finds no updates, or which fails, doubles the interval up to the maximum. Each delay is varied
+ * at random by the jitter proportion, so that the refreshes of different repositories and clients
+ * are spread out instead of all happening at the same moment.
+ * If a notification URL is set then the scheduler also long-polls it, and refreshes as soon as the
+ * server reports a new commit; whilst notifications are being received, scheduled refreshes are
+ * made at the maximum interval only, as a fallback. The notification request is a GET with 'since'
+ * (the file DB's latest commit), 'group' (the current ACM group) and 'timeout' (in seconds)
+ * parameters. The server should respond with a 200 status once its latest commit differs from
+ * 'since' or its ACM group differs from 'group', or with a 204 status after the timeout.
+ * All methods should be called on the main thread.
+ */
+@interface LOCMSRefreshScheduler : NSObject
+
+- (id)initWithRepository:(LOCMSRepository *)repository;
+
+/// The repository being refreshed.
+@property (nonatomic, weak, readonly) LOCMSRepository *repository;
+/// The minimum interval between refreshes, in seconds. Defaults to 60.
+@property (nonatomic, assign) NSTimeInterval minInterval;
+/// The maximum interval between refreshes, in seconds. Defaults to 30 minutes.
+@property (nonatomic, assign) NSTimeInterval maxInterval;
+/// The proportion, from 0 to 1, by which each delay is randomly varied. Defaults to 0.2.
+@property (nonatomic, assign) double jitter;
+/// An optional long-poll URL for change notifications.
+@property (nonatomic, strong) NSString *notificationURL;
+/// The time the server is asked to hold a notification request open for, in seconds. Defaults to 30.
+@property (nonatomic, assign) NSTimeInterval notificationTimeout;
+/// The current interval between refreshes, in seconds.
+@property (nonatomic, assign, readonly) NSTimeInterval interval;
+/// Whether the scheduler is running.
+@property (nonatomic, assign, readonly) BOOL running;
+
+/// Start scheduling refreshes; the first refresh is made after the minimum interval.
+- (void)start;
+/// Stop scheduling refreshes.
+- (void)stop;
+/// Refresh now, and return the refresh interval to the minimum.
+- (QPromise *)refreshNow;
+
+@end
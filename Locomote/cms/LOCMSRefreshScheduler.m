@@ -0,0 +1,282 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LOCMSRefreshScheduler.h"
+#import "LOCMSRepository.h"
+#import "SCLogger.h"
+
+#define DefaultMinInterval          (60.0)
+#define DefaultMaxInterval          (30.0 * 60.0)
+#define DefaultJitter               (0.2)
+#define DefaultNotificationTimeout  (30.0)
+// The factor the refresh interval is multiplied by after a refresh with no updates.
+#define BackoffFactor               (2.0)
+// The proportion of the notification timeout which a request must be held open for, for the
+// server to be considered to support long polling.
+#define MinPollProportion           (0.5)
+
+static SCLogger *Logger;
+
+@interface LOCMSRefreshScheduler () {
+    /// Incremented whenever a refresh is scheduled, so that earlier scheduled refreshes are ignored.
+    NSUInteger _timerGeneration;
+    /// Incremented when the scheduler is stopped, so that outstanding notification requests are ignored.
+    NSUInteger _pollGeneration;
+    /// Flag indicating that a notification request is outstanding.
+    BOOL _polling;
+    /// Flag indicating that the last notification request succeeded.
+    BOOL _notifying;
+    /// The delay before retrying a failed notification request, in seconds.
+    NSTimeInterval _pollRetryDelay;
+    /// The time the outstanding notification request was made.
+    NSTimeInterval _pollStartTime;
+    /// Flag indicating that a refresh in response to a notification is in progress.
+    BOOL _notifiedRefresh;
+}
+
+/// Vary a delay at random by the jitter proportion.
+- (NSTimeInterval)jitteredDelay:(NSTimeInterval)delay;
+/// Schedule the next refresh.
+- (void)scheduleRefreshAfter:(NSTimeInterval)delay;
+/// Make a refresh; the next refresh is scheduled once it completes.
+- (QPromise *)refresh;
+/// Adapt the refresh interval to a refresh's outcome, and schedule the next refresh.
+- (void)refreshCompletedWithStatus:(LOCMSRefreshStatus)status;
+/// Make a notification request, if none is outstanding.
+- (void)pollNotifications;
+/// Handle the response to a notification request.
+- (void)notificationReceivedWithStatus:(NSInteger)status generation:(NSUInteger)generation;
+/// Retry polling for notifications after a delay.
+- (void)pollNotificationsAfter:(NSTimeInterval)delay;
+
+@end
+
+@implementation LOCMSRefreshScheduler
+
++ (void)initialize {
+    Logger = [[SCLogger alloc] initWithTag:@"LOCMSRefreshScheduler"];
+}
+
+- (id)initWithRepository:(LOCMSRepository *)repository {
+    self = [super init];
+    if (self) {
+        _repository = repository;
+        _minInterval = DefaultMinInterval;
+        _maxInterval = DefaultMaxInterval;
+        _jitter = DefaultJitter;
+        _notificationTimeout = DefaultNotificationTimeout;
+        _interval = DefaultMinInterval;
+    }
+    return self;
+}
+
+- (void)start {
+    if (_running) {
+        return;
+    }
+    _running = YES;
+    _interval = _minInterval;
+    _pollRetryDelay = _minInterval;
+    [self scheduleRefreshAfter:[self jitteredDelay:_interval]];
+    [self pollNotifications];
+}
+
+- (void)stop {
+    _running = NO;
+    _notifying = NO;
+    _timerGeneration++;
+    _pollGeneration++;
+    _polling = NO;
+}
+
+- (QPromise *)refreshNow {
+    _interval = _minInterval;
+    return [self refresh];
+}
+
+#pragma mark - private
+
+- (NSTimeInterval)jitteredDelay:(NSTimeInterval)delay {
+    double random = (double)arc4random_uniform(UINT32_MAX) / (double)UINT32_MAX;
+    return delay * (1.0 + _jitter * (2.0 * random - 1.0));
+}
+
+- (void)scheduleRefreshAfter:(NSTimeInterval)delay {
+    NSUInteger generation = ++_timerGeneration;
+    __weak LOCMSRefreshScheduler *weakSelf = self;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+        LOCMSRefreshScheduler *scheduler = weakSelf;
+        if (scheduler && scheduler->_running && scheduler->_timerGeneration == generation) {
+            [scheduler refresh];
+        }
+    });
+}
+
+- (QPromise *)refresh {
+    LOCMSRepository *repository = _repository;
+    QPromise *promise = [repository syncContent];
+    promise.then((id)^(id result) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self refreshCompletedWithStatus:repository.ops.lastRefreshStatus];
+        });
+        return nil;
+    })
+    .fail(^(id error) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self refreshCompletedWithStatus:LOCMSRefreshStatusFailed];
+        });
+    });
+    return promise;
+}
+
+- (void)refreshCompletedWithStatus:(LOCMSRefreshStatus)status {
+    if (status == LOCMSRefreshStatusUpdated) {
+        _interval = _minInterval;
+    }
+    else {
+        _interval = MIN(_interval * BackoffFactor, _maxInterval);
+    }
+    [_repository.metrics setGauge:@"refresh.interval" value:_interval];
+    BOOL notified = _notifiedRefresh;
+    _notifiedRefresh = NO;
+    if (!_running) {
+        return;
+    }
+    if (notified && status != LOCMSRefreshStatusUpdated && status != LOCMSRefreshStatusFailed) {
+        // The server reported a change which the refresh didn't find, and will report it again
+        // straight away; fall back to scheduled refreshes, and poll again with backoff.
+        _notifying = NO;
+    }
+    // Whilst change notifications are being received, scheduled refreshes are only a fallback.
+    [self scheduleRefreshAfter:[self jitteredDelay:(_notifying ? _maxInterval : _interval)]];
+    if (!notified) {
+        // Polling continues independently of scheduled refreshes.
+        return;
+    }
+    // Resume polling for notifications once a notified change has been refreshed; otherwise wait
+    // before polling again, as the server will report the same change straight away.
+    switch (status) {
+        case LOCMSRefreshStatusUpdated:
+            _pollRetryDelay = _minInterval;
+            [self pollNotifications];
+            break;
+        case LOCMSRefreshStatusFailed:
+            [self pollNotificationsAfter:[self jitteredDelay:_interval]];
+            break;
+        default:
+            [self pollNotificationsAfter:[self jitteredDelay:_pollRetryDelay]];
+            _pollRetryDelay = MIN(_pollRetryDelay * BackoffFactor, _maxInterval);
+            break;
+    }
+}
+
+- (void)pollNotifications {
+    LOCMSRepository *repository = _repository;
+    if (!_running || _polling || !_notificationURL || !repository) {
+        return;
+    }
+    _polling = YES;
+    NSURLComponents *components = [NSURLComponents componentsWithString:_notificationURL];
+    NSMutableArray *queryItems = [NSMutableArray arrayWithArray:(components.queryItems ?: @[])];
+    NSString *since = [repository.ops latestCommit];
+    if (since) {
+        [queryItems addObject:[NSURLQueryItem queryItemWithName:@"since" value:since]];
+    }
+    // A change of ACM group is also notified, as it requires the repository to be reset. Note that
+    // this is read on the statement cache's connection, so doesn't wait on DB updates in progress.
+    NSArray *rs = [repository.fileDB performCachedQuery:@"SELECT current FROM fingerprints WHERE category=?"
+                                             withParams:@[ @"$group" ]];
+    NSString *group = [rs count] > 0 ? rs[0][@"current"] : nil;
+    if (group) {
+        [queryItems addObject:[NSURLQueryItem queryItemWithName:@"group" value:group]];
+    }
+    NSString *timeout = [NSString stringWithFormat:@"%ld", (long)_notificationTimeout];
+    [queryItems addObject:[NSURLQueryItem queryItemWithName:@"timeout" value:timeout]];
+    components.queryItems = queryItems;
+    NSUInteger generation = _pollGeneration;
+    _pollStartTime = [NSDate timeIntervalSinceReferenceDate];
+    [repository.httpClient get:[components.URL absoluteString]]
+    .then((id)^(SCHTTPClientResponse *response) {
+        NSInteger status = response.httpResponse.statusCode;
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self notificationReceivedWithStatus:status generation:generation];
+        });
+        return nil;
+    })
+    .fail(^(id error) {
+        [Logger warn:@"Notification request failed: %@", error];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self notificationReceivedWithStatus:0 generation:generation];
+        });
+    });
+}
+
+- (void)notificationReceivedWithStatus:(NSInteger)status generation:(NSUInteger)generation {
+    if (generation != _pollGeneration) {
+        // The scheduler was stopped whilst the request was outstanding.
+        return;
+    }
+    _polling = NO;
+    if (!_running) {
+        return;
+    }
+    switch (status) {
+        case 200:
+            // The server has a new commit; refresh now, and poll again once the refresh completes.
+            // The retry delay is reset once the refresh applies the change.
+            _notifying = YES;
+            _notifiedRefresh = YES;
+            [_repository.metrics incrementCounter:@"refresh.notifications"];
+            [self refreshNow];
+            break;
+        case 204:
+            if ([NSDate timeIntervalSinceReferenceDate] - _pollStartTime < _notificationTimeout * MinPollProportion) {
+                // The server (or a proxy) responded without holding the request open, so polling
+                // again straight away would make a request loop; fall back to scheduled refreshes,
+                // and poll again with backoff.
+                _notifying = NO;
+                [self pollNotificationsAfter:[self jitteredDelay:_pollRetryDelay]];
+                _pollRetryDelay = MIN(_pollRetryDelay * BackoffFactor, _maxInterval);
+                break;
+            }
+            // The request timed out without a change; poll again.
+            _notifying = YES;
+            _pollRetryDelay = _minInterval;
+            [self pollNotifications];
+            break;
+        default:
+            // Fall back to scheduled refreshes, and retry with backoff.
+            _notifying = NO;
+            [self pollNotificationsAfter:[self jitteredDelay:_pollRetryDelay]];
+            _pollRetryDelay = MIN(_pollRetryDelay * BackoffFactor, _maxInterval);
+            break;
+    }
+}
+
+- (void)pollNotificationsAfter:(NSTimeInterval)delay {
+    if (!_notificationURL) {
+        return;
+    }
+    NSUInteger generation = _pollGeneration;
+    __weak LOCMSRefreshScheduler *weakSelf = self;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+        LOCMSRefreshScheduler *scheduler = weakSelf;
+        if (scheduler && scheduler->_pollGeneration == generation) {
+            [scheduler pollNotifications];
+        }
+    });
+}
+
+@end
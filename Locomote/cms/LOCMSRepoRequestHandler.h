@@ -56,6 +56,8 @@
  * (TODO: Document fileset.api)
  * > search.api
  *      Perform a full-text search of page content.
+ * > metrics.api
+ *      Return the repository's runtime metrics; see LOMetrics.
  */
 @interface LOCMSRepoRequestHandler : NSObject <LORequestHandler, LORequestDispatcherHost> {
     /// A request dispatcher.
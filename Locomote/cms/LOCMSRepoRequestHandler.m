@@ -20,10 +20,17 @@
 #import "LOCMSFileListHandler.h"
 #import "LOCMSFileHandler.h"
 #import "LOCMSSearchHandler.h"
+#import "LOCMSMetricsHandler.h"
 #import "LOCMSRepository.h"
 
 #define RequestMapping(_path,_handler) ([[LORequestHandlerMapping alloc] initWithPath:_path handler:_handler])
 
+/// Wrap a handler so that its response times are recorded in the repository's metrics.
+static id<LORequestHandler> TimedHandler(id<LORequestHandler> handler, LOMetrics *metrics) {
+    NSString *histogram = [@"request.time." stringByAppendingString:NSStringFromClass([handler class])];
+    return [[LOTimedRequestHandler alloc] initWithHandler:handler metrics:metrics histogram:histogram];
+}
+
 @implementation LOCMSRepoRequestHandler
 
 @synthesize requestHandlers=_requestHandlers;
@@ -31,9 +38,11 @@
 - (id)initWithRepository:(LOCMSRepository *)repository {
     self = [super init];
     if (self) {
-        LOCMSFileHandler *fileHandler = [[LOCMSFileHandler alloc] initWithRepository:repository];
-        LOCMSFileListHandler *fileListHandler = [[LOCMSFileListHandler alloc] initWithRepository:repository];
-        LOCMSSearchHandler *searchHandler = [[LOCMSSearchHandler alloc] initWithRepository:repository];
+        LOMetrics *metrics = repository.metrics;
+        id<LORequestHandler> fileHandler = TimedHandler([[LOCMSFileHandler alloc] initWithRepository:repository], metrics);
+        id<LORequestHandler> fileListHandler = TimedHandler([[LOCMSFileListHandler alloc] initWithRepository:repository], metrics);
+        id<LORequestHandler> searchHandler = TimedHandler([[LOCMSSearchHandler alloc] initWithRepository:repository], metrics);
+        LOCMSMetricsHandler *metricsHandler = [[LOCMSMetricsHandler alloc] initWithRepository:repository];
         self.requestHandlers = @[
             // Read file contents.
             RequestMapping(@"file.api/{id}(/{mode:content})?", fileHandler ),
@@ -45,6 +54,8 @@
             RequestMapping(@"fileset.api/{category}", fileListHandler ),
             // Do a file search.
             RequestMapping(@"search.api", searchHandler ),
+            // Read runtime metrics.
+            RequestMapping(@"metrics.api", metricsHandler ),
             // Read a file by path.
             RequestMapping(@"**/*", fileHandler )
         ];
@@ -19,10 +19,16 @@
 #import <Foundation/Foundation.h>
 #import "LORequestDispatcher.h"
 #import "LOLocalCachePaths.h"
+#import "LOMetrics.h"
 #import "LOUserAccountManager.h"
+#import "LOCMSDownloadRegistry.h"
 #import "LOCMSFileDB.h"
+#import "LOCMSFileRecordCache.h"
 #import "LOCMSOperationProtocol.h"
+#import "LOCMSRefreshScheduler.h"
+#import "LOCMSRevalidationCache.h"
 #import "LOCMSSettings.h"
+#import "LOCMSTemplateRepository.h"
 #import "SCHTTPClient.h"
 #import "SCIOCObjectAware.h"
 #import "SCIOCContainerAware.h"
@@ -41,6 +47,12 @@
 @property (nonatomic, strong) NSString *basePath;
 /// The file database.
 @property (nonatomic, strong) LOCMSFileDB *fileDB;
+/// A cache of file records read from the file database by the repository's request handlers.
+@property (nonatomic, strong) LOCMSFileRecordCache *recordCache;
+/// A cache of compiled templates used to render page content.
+@property (nonatomic, strong) LOCMSTemplateRepository *templateRepository;
+/// A registry of in-flight file content downloads, used to coalesce requests for the same file.
+@property (nonatomic, strong) LOCMSDownloadRegistry *downloads;
 /// The HTTP client used for server requests.
 @property (nonatomic, strong) SCHTTPClient *httpClient;
 /// The user account manager to use to control repository access.
@@ -51,12 +63,24 @@
 @property (nonatomic, strong) LOCMSSettings *cms;
 /// The repository's operation protocol.
 @property (nonatomic, strong) LOCMSOperationProtocol *ops;
+/// The scheduler of the repository's content refreshes; started by the content authority.
+@property (nonatomic, strong, readonly) LOCMSRefreshScheduler *refreshScheduler;
+/**
+ * The maximum size, in bytes, of the cache of content from non-cachable filesets; see
+ * LOCMSRevalidationCache. Defaults to 0, i.e. no cache, so that content from non-cachable
+ * filesets is downloaded on every request. Must be set before setup completes.
+ */
+@property (nonatomic, assign) unsigned long long revalidationCacheSize;
+/// The cache of content from non-cachable filesets; nil unless a revalidation cache size is set.
+@property (nonatomic, strong, readonly) LOCMSRevalidationCache *revalidationCache;
 /// Repository content request handler.
 @property (nonatomic, strong) LOCMSRepoRequestHandler *requestHandler;
 /// The content authority this repository belongs to.
 @property (nonatomic, weak) LOCMSContentAuthority *authority;
 /// Path settings for locally cached content.
 @property (nonatomic, strong) LOLocalCachePaths *localCachePaths;
+/// Runtime metrics for the repository's content sync and request handling; also available at the metrics.api path.
+@property (nonatomic, strong, readonly) LOMetrics *metrics;
 
 /// Initialize a repository with the provided settings.
 - (id)initWithSettings:(LOCMSSettings *)settings;
@@ -66,5 +90,19 @@
 - (void)start;
 /// Synchronize the repository's content by downloading updates from the server.
 - (QPromise *)syncContent;
+/**
+ * Download a file's content from the server.
+ * The downloaded file is moved to the cache path, if specified. The completion block is called
+ * with the location of the downloaded content. Callers should make the request through the
+ * download registry, keyed by the file's cache path, so that concurrent downloads of the same
+ * file are coalesced.
+ */
+- (void)downloadFile:(NSString *)path toCachePath:(NSString *)cachePath completion:(LOCMSDownloadCompletion)completion;
+/// Convert an authority content path to a path within the repository, by removing the base path.
+- (NSString *)repositoryPathForPath:(NSString *)path;
+/// Test whether the repository has content for a repository path.
+- (BOOL)hasContentForPath:(NSString *)path parameters:(NSDictionary *)parameters;
+/// Return the location of locally cached content for a repository path.
+- (NSString *)localCacheLocationOfPath:(NSString *)path parameters:(NSDictionary *)parameters;
 
 @end
@@ -23,6 +23,10 @@
 #import "LOContentProvider.h"
 
 #define SDKPlatform (@"ios")
+// The default number of file records held by the record cache.
+#define RecordCacheCapacity (500)
+// The name of the revalidation cache's directory, within the content cache.
+#define RevalidationCacheDirName (@"~revalidation")
 
 @interface LOCMSRepository()
 
@@ -115,6 +119,11 @@
                                                      mappings:@[ @"version" ]]
         };
         
+        _recordCache = [[LOCMSFileRecordCache alloc] initWithCapacity:RecordCacheCapacity];
+        _templateRepository = [[LOCMSTemplateRepository alloc] initWithFileDB:_fileDB];
+        _downloads = [LOCMSDownloadRegistry new];
+        _metrics = [LOMetrics new];
+        
         self.requestHandler = [[LOCMSRepoRequestHandler alloc] initWithRepository:self];
     }
     return self;
@@ -144,10 +153,12 @@
     return [self syncContent];
 }
 
+- (NSString *)repositoryPathForPath:(NSString *)path {
+    return [path substringFromIndex:MIN([_basePath length], [path length])];
+}
+
 - (BOOL)hasContentForPath:(NSString *)path parameters:(NSDictionary *)parameters {
-    NSString *sql = [NSString stringWithFormat:@"SELECT id FROM %@ WHERE path=?", _fileDB.filesTable ];
-    NSArray *result = [_fileDB performQuery:sql withParams:@[ path ]];
-    return [result count];
+    return [_fileDB hasFileWithPath:path];
 }
 
 - (NSString *)localCacheLocationOfPath:(NSString *)path parameters:(NSDictionary *)parameters {
@@ -177,6 +188,29 @@
                                                  settings:_cms
                                                httpClient:_httpClient
                                     authenticationManager:authManager];
+    _ops.metrics = _metrics;
+    // Partial fileset downloads are kept in the staging area until complete.
+    _ops.filesetDownloader.stagingPath = _localCachePaths.stagingPath;
+    // Background file deletion pauses whilst content is being downloaded.
+    __weak LOCMSRepository *weakSelf = self;
+    __weak LOCMSFilesetDownloader *filesetDownloader = _ops.filesetDownloader;
+    _ops.garbageCollector.yieldBlock = ^BOOL {
+        return weakSelf.downloads.activeCount > 0 || filesetDownloader.activeCount > 0;
+    };
+    // Prefetching waits for fileset downloads, which may include the files being prefetched.
+    _ops.prefetcher = [[LOCMSPrefetcher alloc] initWithRepository:self];
+    _ops.prefetcher.yieldBlock = ^BOOL {
+        return filesetDownloader.activeCount > 0;
+    };
+    _refreshScheduler = [[LOCMSRefreshScheduler alloc] initWithRepository:self];
+    // Content from non-cachable filesets is optionally kept for reuse whilst unchanged.
+    if (_revalidationCacheSize > 0) {
+        NSString *path = [_localCachePaths.contentCachePath stringByAppendingPathComponent:RevalidationCacheDirName];
+        _revalidationCache = [[LOCMSRevalidationCache alloc] initWithPath:path
+                                                                  maxSize:_revalidationCacheSize
+                                                          sessionDelegate:(id<NSURLSessionDelegate>)authManager];
+        _revalidationCache.metrics = _metrics;
+    }
 
 }
 
@@ -207,12 +241,69 @@
     return [_ops refresh];
 }
 
+- (void)downloadFile:(NSString *)path toCachePath:(NSString *)cachePath completion:(LOCMSDownloadCompletion)completion {
+    // Read the file's server-side URL.
+    NSString *url = [_cms urlForFile:path];
+    [_httpClient getFile:url]
+    .then((id)^(SCHTTPClientResponse *httpResponse) {
+        NSString *downloadPath = [httpResponse.downloadLocation path];
+        NSError *error = nil;
+        // If cachable then move file to cache.
+        if (cachePath) {
+            NSFileManager *fileManager = [NSFileManager defaultManager];
+            if ([fileManager fileExistsAtPath:cachePath]) {
+                // Remove any file already at the target location.
+                [fileManager removeItemAtPath:cachePath error:&error];
+            }
+            else {
+                // Ensure that the target directory exists.
+                NSString *cacheDir = [cachePath stringByDeletingLastPathComponent];
+                [fileManager createDirectoryAtPath:cacheDir
+                       withIntermediateDirectories:YES
+                                        attributes:nil
+                                             error:&error];
+            }
+            if (!error) {
+                // Move the file to the cache location.
+                [fileManager moveItemAtPath:downloadPath
+                                     toPath:cachePath
+                                      error:&error];
+            }
+            if (!error) {
+                // Update the file's cache status.
+                [self->_fileDB markFileAsDownloaded:path];
+            }
+        }
+        if (error) {
+            completion(nil, error);
+        }
+        else {
+            completion(cachePath ?: downloadPath, nil);
+        }
+        return nil;
+    })
+    .fail(^(id err) {
+        // HTTP request failed (or was cancelled), package error and pass to all waiting requests.
+        NSError *error;
+        if ([err isKindOfClass:[NSError class]]) {
+            error = (NSError *)err;
+        }
+        else {
+            NSString *description = [err description];
+            error = [NSError errorWithDomain:NSURLErrorDomain
+                                        code:NSURLErrorResourceUnavailable
+                                    userInfo:@{ NSLocalizedDescriptionKey: description }];
+        }
+        completion(nil, error);
+    });
+}
+
 #pragma mark - LORequestHandler
 
 - (void)handleRequest:(id<LOContentRequest>)request response:(id<LOContentResponse>)response {
     // Strip the base path from the start of the request path before forwarding to
     // the registered request handlers.
-    request.path = [request.path substringFromIndex:[_basePath length]];
+    request.path = [self repositoryPathForPath:request.path];
     [_requestHandler handleRequest:request response:response];
 }
 
@@ -33,6 +33,10 @@
 @property (nonatomic, weak) LOCMSFileDB *fileDB;
 /// A map of filesets keyed by category name.
 @property (nonatomic, strong) NSDictionary<NSString *, LOCMSFileset *> *filesets;
+/// A cache of file records; records are read from the file DB if not in the cache.
+@property (nonatomic, strong) LOCMSFileRecordCache *recordCache;
+/// The repository's runtime metrics.
+@property (nonatomic, strong) LOMetrics *metrics;
 
 /// Read a file record by file ID.
 - (NSDictionary *)readFileRecordByID:(NSString *)fileID;
@@ -18,12 +18,21 @@
 
 #import "LOCMSRequestHandler.h"
 
+@interface LOCMSRequestHandler ()
+
+/// Query the file DB for a file record by file ID and with specified category bindings.
+- (NSDictionary *)queryFileRecordByID:(NSString *)fileID inCategory:(NSString *)category;
+
+@end
+
 @implementation LOCMSRequestHandler
 
 - (id)initWithRepository:(LOCMSRepository *)repository {
     self = [super init];
     self.fileDB = repository.fileDB;
     self.filesets = repository.filesets;
+    self.recordCache = repository.recordCache;
+    self.metrics = repository.metrics;
     return self;
 }
 
@@ -32,6 +41,22 @@
 }
 
 - (NSDictionary *)readFileRecordByID:(NSString *)fileID inCategory:(NSString *)category {
+    // Note that the generation must be read before the record, so that a record read while
+    // the DB is being updated is cached under the generation preceding the update.
+    NSUInteger generation = _fileDB.generation;
+    NSString *key = [NSString stringWithFormat:@"id:%@:%@", category ?: @"", fileID];
+    NSDictionary *record = nil;
+    if ([_recordCache lookupRecordForKey:key generation:generation record:&record]) {
+        [_metrics incrementCounter:@"recordcache.hit"];
+        return record;
+    }
+    [_metrics incrementCounter:@"recordcache.miss"];
+    record = [self queryFileRecordByID:fileID inCategory:category];
+    [_recordCache setRecord:record forKey:key generation:generation];
+    return record;
+}
+
+- (NSDictionary *)queryFileRecordByID:(NSString *)fileID inCategory:(NSString *)category {
 
     NSMutableArray *wheres = [NSMutableArray new];
     NSMutableArray *values = [NSMutableArray new];
@@ -63,17 +88,18 @@
 }
 
 - (NSDictionary *)readFileRecordByPath:(NSString *)path {
-    
-    NSString *where = [NSString stringWithFormat:@"%@.path = ?", _fileDB.orm.source];
-    NSArray *values = @[ path ];
-    
-    NSArray *result = [_fileDB.orm selectWhere:where values:values mappings:@[]];
-    if ([result count] > 0) {
-        return result[0];
+    NSUInteger generation = _fileDB.generation;
+    NSString *key = [@"path:" stringByAppendingString:path];
+    NSDictionary *record = nil;
+    if ([_recordCache lookupRecordForKey:key generation:generation record:&record]) {
+        [_metrics incrementCounter:@"recordcache.hit"];
+        return record;
     }
-    
-    // Record not found.
-    return nil;
+    [_metrics incrementCounter:@"recordcache.miss"];
+    // No mappings are needed, so read the record directly using the file DB's cached statement.
+    record = [_fileDB fileRecordForPath:path];
+    [_recordCache setRecord:record forKey:key generation:generation];
+    return record;
 }
 
 #pragma mark - LOCMSRequestHandler
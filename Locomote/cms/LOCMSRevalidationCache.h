@@ -0,0 +1,80 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "LOCMSDownloadRegistry.h"
+#import "LOMetrics.h"
+
+/**
+ * A bounded cache of the content of files in non-cachable filesets (i.e. filesets with a 'none'
+ * cache policy).
+ * Each file's content is stored together with the file's version, and the entity tag returned
+ * by the server. Whilst the file record's version is unchanged, the stored content is served
+ * without contacting the server. Once the version changes the content is revalidated with a
+ * conditional request; if the server responds 304 Not Modified the stored content is kept for
+ * the new version, otherwise it's replaced with the new content. Content isn't served from the
+ * cache if it can't be revalidated, so the fileset's policy that content always comes from the
+ * server is kept, apart from repeated requests for the same file version.
+ * When the total size of stored content exceeds the maximum size, the least recently used files
+ * are removed; the most recently stored file is always kept. The cache's index is written to its
+ * directory, so stored content is kept between app launches.
+ * All methods are thread safe.
+ */
+@interface LOCMSRevalidationCache : NSObject
+
+/**
+ * Initialize the cache.
+ * @param path              The directory the cache's content and index are stored in.
+ * @param maxSize           The maximum total size of stored content, in bytes.
+ * @param sessionDelegate   A delegate for the URL session used to download content, e.g. to
+ *                          answer authentication challenges.
+ */
+- (id)initWithPath:(NSString *)path maxSize:(unsigned long long)maxSize sessionDelegate:(id<NSURLSessionDelegate>)sessionDelegate;
+
+/// The directory the cache is stored in.
+@property (nonatomic, strong, readonly) NSString *path;
+/// The maximum total size of stored content, in bytes.
+@property (nonatomic, assign, readonly) unsigned long long maxSize;
+/// The total size of stored content, in bytes.
+@property (nonatomic, assign, readonly) unsigned long long size;
+/// The number of files stored.
+@property (nonatomic, assign, readonly) NSUInteger count;
+/**
+ * Optional metrics to record cache activity in.
+ * Counts requests served from the cache without contacting the server in the 'revalidation.hit'
+ * counter, requests revalidated by a 304 response in 'revalidation.notModified', and requests
+ * which downloaded new content in 'revalidation.miss'.
+ */
+@property (nonatomic, strong) LOMetrics *metrics;
+
+/**
+ * Return the location of a file's stored content, if stored for the specified version.
+ * Returns nil if no content is stored, or if it's stored for a different version.
+ */
+- (NSString *)contentPathForFile:(NSString *)path version:(NSString *)version;
+/**
+ * Fetch a file's content.
+ * If the file's content is stored for the specified version then it's returned immediately;
+ * otherwise it's requested from the URL, conditionally on any stored content's entity tag,
+ * and stored. The completion block is called with the location of the stored content.
+ */
+- (void)fetchFile:(NSString *)path
+          fromURL:(NSString *)url
+          version:(NSString *)version
+       completion:(LOCMSDownloadCompletion)completion;
+/// Remove all stored content.
+- (void)removeAllContent;
+
+@end
@@ -0,0 +1,378 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LOCMSRevalidationCache.h"
+#import "SCLogger.h"
+#import "LODigest.h"
+#import "LOHTTPUtils.h"
+
+// The name of the file the cache index is written to, within the cache directory.
+#define IndexFileName   (@"index.json")
+// The delay before writing the index after a revalidation, so that the writes of several
+// revalidations are coalesced.
+#define IndexWriteDelay (2.0)
+
+static SCLogger *Logger;
+
+/// Return the hex encoded SHA1 digest of a file path; used to name the file's stored content.
+static NSString *ContentFileName(NSString *path) {
+    return [LODigest sha1HexDigestOfData:[path dataUsingEncoding:NSUTF8StringEncoding]];
+}
+
+/// A stored file.
+@interface LOCMSRevalidationEntry : NSObject
+
+/// The file's path.
+@property (nonatomic, strong) NSString *path;
+/// The file version the content is stored for.
+@property (nonatomic, strong) NSString *version;
+/// The content's entity tag; may be nil.
+@property (nonatomic, strong) NSString *etag;
+/// The size of the stored content, in bytes.
+@property (nonatomic, assign) unsigned long long size;
+/// A counter value recording when the content was last used; higher values are more recent.
+@property (nonatomic, assign) NSUInteger lastAccess;
+
+/// Return a description of the entry for the cache index.
+- (NSDictionary *)indexRecord;
+/// Create an entry from a record in the cache index.
++ (LOCMSRevalidationEntry *)entryWithIndexRecord:(NSDictionary *)record;
+
+@end
+
+@interface LOCMSRevalidationCache () {
+    /// Stored files, keyed by path.
+    NSMutableDictionary<NSString *, LOCMSRevalidationEntry *> *_entries;
+    /// A counter used to order file accesses.
+    NSUInteger _accessCounter;
+    /// A URL session for content downloads.
+    NSURLSession *_session;
+    /// Flag indicating that an index write is scheduled.
+    BOOL _indexWriteScheduled;
+}
+
+/// Read the cache index, discarding entries whose content is missing.
+- (void)readIndex;
+/// Write the cache index. Must be called whilst synchronized on the cache.
+- (void)writeIndex;
+/**
+ * Schedule a write of the cache index, if none is already scheduled.
+ * Must be called whilst synchronized on the cache.
+ */
+- (void)scheduleIndexWrite;
+/// Return the location of a file's stored content.
+- (NSString *)contentLocationForFile:(NSString *)path;
+/**
+ * Record that a file's stored content is valid for a new version.
+ * Returns the location of the stored content, or nil if the content is no longer stored.
+ */
+- (NSString *)revalidateFile:(NSString *)path version:(NSString *)version;
+/// Store a file's downloaded content, and return its location.
+- (NSString *)storeFile:(NSString *)path
+           fromLocation:(NSURL *)location
+                version:(NSString *)version
+                   etag:(NSString *)etag
+                  error:(NSError **)error;
+/**
+ * Remove least recently used content until the cache is within its maximum size.
+ * The specified file isn't removed. Must be called whilst synchronized on the cache.
+ */
+- (void)evictContentKeepingFile:(NSString *)path;
+
+@end
+
+@implementation LOCMSRevalidationEntry
+
+- (NSDictionary *)indexRecord {
+    NSMutableDictionary *record = [NSMutableDictionary new];
+    record[@"path"] = _path;
+    record[@"version"] = _version;
+    record[@"etag"] = _etag;
+    record[@"size"] = @(_size);
+    record[@"access"] = @(_lastAccess);
+    return record;
+}
+
++ (LOCMSRevalidationEntry *)entryWithIndexRecord:(NSDictionary *)record {
+    id path = record[@"path"];
+    if (![path isKindOfClass:[NSString class]]) {
+        return nil;
+    }
+    LOCMSRevalidationEntry *entry = [LOCMSRevalidationEntry new];
+    entry.path = path;
+    entry.version = [record[@"version"] isKindOfClass:[NSString class]] ? record[@"version"] : nil;
+    entry.etag = [record[@"etag"] isKindOfClass:[NSString class]] ? record[@"etag"] : nil;
+    entry.size = [record[@"size"] unsignedLongLongValue];
+    entry.lastAccess = [record[@"access"] unsignedIntegerValue];
+    return entry;
+}
+
+@end
+
+@implementation LOCMSRevalidationCache
+
++ (void)initialize {
+    Logger = [[SCLogger alloc] initWithTag:@"LOCMSRevalidationCache"];
+}
+
+- (id)initWithPath:(NSString *)path maxSize:(unsigned long long)maxSize sessionDelegate:(id<NSURLSessionDelegate>)sessionDelegate {
+    self = [super init];
+    if (self) {
+        _path = path;
+        _maxSize = maxSize;
+        _entries = [NSMutableDictionary new];
+        // Responses are revalidated by the cache, so aren't cached by the URL loading system.
+        NSURLSessionConfiguration *configuration = [NSURLSessionConfiguration defaultSessionConfiguration];
+        configuration.URLCache = nil;
+        configuration.requestCachePolicy = NSURLRequestReloadIgnoringLocalCacheData;
+        _session = [NSURLSession sessionWithConfiguration:configuration delegate:sessionDelegate delegateQueue:nil];
+        [self readIndex];
+    }
+    return self;
+}
+
+- (NSUInteger)count {
+    @synchronized (self) {
+        return [_entries count];
+    }
+}
+
+- (NSString *)contentPathForFile:(NSString *)path version:(NSString *)version {
+    if (!version) {
+        // Content can't be served without revalidation if the file's version isn't known.
+        return nil;
+    }
+    @synchronized (self) {
+        LOCMSRevalidationEntry *entry = _entries[path];
+        if (![version isEqualToString:entry.version]) {
+            return nil;
+        }
+        entry.lastAccess = ++_accessCounter;
+    }
+    [_metrics incrementCounter:@"revalidation.hit"];
+    return [self contentLocationForFile:path];
+}
+
+- (void)fetchFile:(NSString *)path
+          fromURL:(NSString *)url
+          version:(NSString *)version
+       completion:(LOCMSDownloadCompletion)completion {
+    NSString *contentPath = [self contentPathForFile:path version:version];
+    if (contentPath) {
+        completion(contentPath, nil);
+        return;
+    }
+    NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:[NSURL URLWithString:url]];
+    @synchronized (self) {
+        NSString *etag = _entries[path].etag;
+        if (etag) {
+            [request setValue:etag forHTTPHeaderField:@"If-None-Match"];
+        }
+    }
+    NSURLSessionDownloadTask *task = [_session downloadTaskWithRequest:request
+                                                     completionHandler:^(NSURL *location, NSURLResponse *response, NSError *error) {
+        NSInteger status = 0;
+        if ([response isKindOfClass:[NSHTTPURLResponse class]]) {
+            status = ((NSHTTPURLResponse *)response).statusCode;
+        }
+        if (!error && status == 304) {
+            NSString *contentPath = [self revalidateFile:path version:version];
+            if (contentPath) {
+                [self->_metrics incrementCounter:@"revalidation.notModified"];
+                completion(contentPath, nil);
+            }
+            else {
+                // The stored content was removed whilst being revalidated; download it again.
+                [self fetchFile:path fromURL:url version:version completion:completion];
+            }
+            return;
+        }
+        if (!error && status != 200) {
+            NSString *description = [NSString stringWithFormat:@"HTTP status %ld downloading %@", (long)status, url];
+            error = [NSError errorWithDomain:NSURLErrorDomain
+                                        code:NSURLErrorResourceUnavailable
+                                    userInfo:@{ NSLocalizedDescriptionKey: description }];
+        }
+        if (error) {
+            completion(nil, error);
+            return;
+        }
+        [self->_metrics incrementCounter:@"revalidation.miss"];
+        // The downloaded file is deleted once this block returns, so is moved into the cache now.
+        NSError *storeError = nil;
+        NSString *contentPath = [self storeFile:path
+                                   fromLocation:location
+                                        version:version
+                                           etag:[LOHTTPUtils valueForHeader:@"ETag" inResponse:(NSHTTPURLResponse *)response]
+                                          error:&storeError];
+        completion(contentPath, storeError);
+    }];
+    [task resume];
+}
+
+- (void)removeAllContent {
+    @synchronized (self) {
+        [_entries removeAllObjects];
+        _size = 0;
+        _indexWriteScheduled = NO;
+        [[NSFileManager defaultManager] removeItemAtPath:_path error:nil];
+    }
+}
+
+#pragma mark - private
+
+- (void)readIndex {
+    NSData *data = [NSData dataWithContentsOfFile:[_path stringByAppendingPathComponent:IndexFileName]];
+    if (!data) {
+        return;
+    }
+    id records = [NSJSONSerialization JSONObjectWithData:data options:0 error:nil];
+    if (![records isKindOfClass:[NSArray class]]) {
+        [Logger warn:@"Invalid cache index in %@", _path];
+        return;
+    }
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    for (id record in records) {
+        LOCMSRevalidationEntry *entry = nil;
+        if ([record isKindOfClass:[NSDictionary class]]) {
+            entry = [LOCMSRevalidationEntry entryWithIndexRecord:record];
+        }
+        if (entry && [fileManager fileExistsAtPath:[self contentLocationForFile:entry.path]]) {
+            _entries[entry.path] = entry;
+            _size += entry.size;
+            _accessCounter = MAX(_accessCounter, entry.lastAccess);
+        }
+    }
+}
+
+- (void)writeIndex {
+    _indexWriteScheduled = NO;
+    NSMutableArray *records = [NSMutableArray new];
+    for (LOCMSRevalidationEntry *entry in [_entries allValues]) {
+        [records addObject:[entry indexRecord]];
+    }
+    NSData *data = [NSJSONSerialization dataWithJSONObject:records options:0 error:nil];
+    [data writeToFile:[_path stringByAppendingPathComponent:IndexFileName] atomically:YES];
+}
+
+- (void)scheduleIndexWrite {
+    if (_indexWriteScheduled) {
+        return;
+    }
+    _indexWriteScheduled = YES;
+    __weak LOCMSRevalidationCache *weakSelf = self;
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(IndexWriteDelay * NSEC_PER_SEC)), queue, ^{
+        LOCMSRevalidationCache *cache = weakSelf;
+        if (!cache) {
+            return;
+        }
+        @synchronized (cache) {
+            // Skip the write if the index was written in the meantime.
+            if (cache->_indexWriteScheduled) {
+                [cache writeIndex];
+            }
+        }
+    });
+}
+
+- (NSString *)contentLocationForFile:(NSString *)path {
+    return [_path stringByAppendingPathComponent:ContentFileName(path)];
+}
+
+- (NSString *)revalidateFile:(NSString *)path version:(NSString *)version {
+    @synchronized (self) {
+        LOCMSRevalidationEntry *entry = _entries[path];
+        if (!entry) {
+            return nil;
+        }
+        entry.version = version;
+        entry.lastAccess = ++_accessCounter;
+        // If the app exits before the write then the content is only revalidated again.
+        [self scheduleIndexWrite];
+    }
+    return [self contentLocationForFile:path];
+}
+
+- (NSString *)storeFile:(NSString *)path
+           fromLocation:(NSURL *)location
+                version:(NSString *)version
+                   etag:(NSString *)etag
+                  error:(NSError **)error {
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSString *contentPath = [self contentLocationForFile:path];
+    NSURL *contentURL = [NSURL fileURLWithPath:contentPath];
+    @synchronized (self) {
+        if (![fileManager createDirectoryAtPath:_path withIntermediateDirectories:YES attributes:nil error:error]) {
+            return nil;
+        }
+        // Replace any previous content in a single operation, so that it can't be read part written.
+        BOOL ok;
+        if ([fileManager fileExistsAtPath:contentPath]) {
+            ok = [fileManager replaceItemAtURL:contentURL
+                                 withItemAtURL:location
+                                backupItemName:nil
+                                       options:0
+                              resultingItemURL:nil
+                                         error:error];
+        }
+        else {
+            ok = [fileManager moveItemAtURL:location toURL:contentURL error:error];
+        }
+        if (!ok) {
+            return nil;
+        }
+        LOCMSRevalidationEntry *entry = _entries[path];
+        if (entry) {
+            _size -= entry.size;
+        }
+        else {
+            entry = [LOCMSRevalidationEntry new];
+            entry.path = path;
+            _entries[path] = entry;
+        }
+        entry.version = version;
+        entry.etag = etag;
+        entry.size = [[fileManager attributesOfItemAtPath:contentPath error:nil] fileSize];
+        entry.lastAccess = ++_accessCounter;
+        _size += entry.size;
+        [self evictContentKeepingFile:path];
+        [self writeIndex];
+    }
+    return contentPath;
+}
+
+- (void)evictContentKeepingFile:(NSString *)path {
+    if (_size <= _maxSize) {
+        return;
+    }
+    NSArray *entries = [[_entries allValues] sortedArrayUsingComparator:^NSComparisonResult(LOCMSRevalidationEntry *e1, LOCMSRevalidationEntry *e2) {
+        return e1.lastAccess < e2.lastAccess ? NSOrderedAscending : (e1.lastAccess > e2.lastAccess ? NSOrderedDescending : NSOrderedSame);
+    }];
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    for (LOCMSRevalidationEntry *entry in entries) {
+        if (_size <= _maxSize) {
+            break;
+        }
+        if ([entry.path isEqualToString:path]) {
+            continue;
+        }
+        [fileManager removeItemAtPath:[self contentLocationForFile:entry.path] error:nil];
+        [_entries removeObjectForKey:entry.path];
+        _size -= entry.size;
+    }
+}
+
+@end
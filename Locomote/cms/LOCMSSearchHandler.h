@@ -27,6 +27,10 @@
  * type whose content is stored within the file database. Specifically, the file
  * content must be stored in a table named 'pages' which has 'title' and 'content'
  * fields, and these names are currently hardcoded.
+ *
+ * Searches use the file DB's full-text index when available, with results ranked by
+ * relevance and each search term matched as a word prefix. If the index isn't available
+ * then the page table is scanned using LIKE comparisons, and results are unranked.
  */
 @interface LOCMSSearchHandler : LOCMSRequestHandler
 
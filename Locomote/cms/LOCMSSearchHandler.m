@@ -22,6 +22,20 @@
 
 #define PAGE_TABLE                  (@"pages")
 #define DEFAULT_SEACH_RESULT_LIMIT  (100);
+// Relative weights of title and content matches when ranking full-text search results.
+#define TITLE_RANK_WEIGHT           (10.0)
+#define CONTENT_RANK_WEIGHT         (1.0)
+
+@interface LOCMSSearchHandler ()
+
+/// Split search text into its whitespace separated tokens.
+- (NSArray *)tokenizeSearchText:(NSString *)text;
+/// Build an FTS5 match expression for the search text tokens and search mode.
+- (NSString *)matchExpressionForTokens:(NSArray *)tokens mode:(NSString *)mode;
+/// Build a where clause for a table scan search of the search text tokens.
+- (NSString *)likeClauseForTokens:(NSArray *)tokens mode:(NSString *)mode params:(NSMutableArray *)params;
+
+@end
 
 @implementation LOCMSSearchHandler
 
@@ -44,52 +58,30 @@
     // directory path as a prefix.
     NSString *scopeID = request.pathParameters[@"id"];
     
-    // Two main tables are the source table (e.g. 'files') and the page table (e.g. 'pages').
-    // Note that page table names are currently hardcoded.
-    NSArray *tables = @[ self.fileDB.orm.source, PAGE_TABLE ];
-    NSArray *wheres = @[ [NSString stringWithFormat:@"%@.id = %@.id", self.fileDB.orm.source, PAGE_TABLE ]];
-    
-    NSMutableArray *params = [NSMutableArray new];
-    NSString *term = [NSString stringWithFormat:@"%%%@%%", text];
-    if ([@"exact" isEqualToString:mode]) {
-        NSString * where = [NSString stringWithFormat:@"%@.title LIKE ? OR %@.content LIKE ?", PAGE_TABLE, PAGE_TABLE];
-        wheres = [wheres arrayByAddingObject:where];
-        [params addObject:term];
-        [params addObject:term];
+    if (!([@"exact" isEqualToString:mode] || [@"any" isEqualToString:mode])) {
+        mode = @"all";
     }
-    else {
-        NSMutableArray *terms = [NSMutableArray new];
-        NSArray *tokens = [term componentsSeparatedByString:@" "];
-        for (NSString *token in tokens) {
-            NSString *trimmedToken = [token stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
-            if ([trimmedToken length] > 0) {
-                NSString *term = [NSString stringWithFormat:@"(%@.title LIKE ? OR %@.content LIKE ?)", PAGE_TABLE, PAGE_TABLE];
-                [terms addObject:term];
-                NSString *param = [NSString stringWithFormat:@"%%%@%%", trimmedToken];
-                [params addObject:param];
-                [params addObject:param];
-            }
-        }
-        NSString *where;
-        if ([@"any" isEqualToString:mode]) {
-            where = [terms componentsJoinedByString:@" OR "];
-        }
-        else if ([@"all" isEqualToString:mode]) {
-            where = [terms componentsJoinedByString:@" AND "];
-        }
-        wheres = [wheres arrayByAddingObject:where];
+    NSString *source = self.fileDB.orm.source;
+    NSArray *tokens = [self tokenizeSearchText:text];
+    NSMutableArray *result = [NSMutableArray new];
+    if ([tokens count] == 0) {
+        // Nothing to search for.
+        [response respondWithJSONData:result cachePolicy:NSURLCacheStorageNotAllowed];
+        return;
     }
     
+    // Filter clauses on the source table (e.g. 'files') and the page table (e.g. 'pages').
+    // Note that page table names are currently hardcoded.
+    NSMutableArray *wheres = [NSMutableArray new];
+    NSMutableArray *filterParams = [NSMutableArray new];
+    
     if (types) {
-        NSArray *typeList = [types componentsSeparatedByString:@","];
-        NSString *typeClause;
-        if ([typeList count] == 1) {
-            typeClause = [NSString stringWithFormat:@"%@.type='%@'", PAGE_TABLE, [typeList firstObject]];
+        NSMutableArray *placeholders = [NSMutableArray new];
+        for (NSString *type in [types componentsSeparatedByString:@","]) {
+            [placeholders addObject:@"?"];
+            [filterParams addObject:type];
         }
-        else {
-            typeClause = [NSString stringWithFormat:@"%@.type IN ('%@')", PAGE_TABLE, [typeList componentsJoinedByString:@"','"]];
-        }
-        wheres = [wheres arrayByAddingObject:typeClause];
+        [wheres addObject:[NSString stringWithFormat:@"%@.type IN (%@)", PAGE_TABLE, [placeholders componentsJoinedByString:@","]]];
     }
     
     if (scopeID) {
@@ -103,22 +95,44 @@
             [response respondWithError:makePathNotFoundResponseError(request.path)];
             return;
         }
-        // Get the path of the directory containing the scoping file.
-        scopePath = [scopePath stringByDeletingLastPathComponent];
-        // Append a where clause to only include files whose path has the scope path
-        // as a prefix.
-        NSString *where = [NSString stringWithFormat:@" AND %@.path LIKE ?", self.fileDB.orm.source];
-        NSString *param = [NSString stringWithFormat:@"%%%@", scopePath];
-        wheres = [wheres arrayByAddingObject:where];
-        [params addObject:param];
+        // Get the path of the directory containing the scoping file, and only include files
+        // whose path has the directory path as a prefix. (A substring comparison is used rather
+        // than LIKE so that characters such as '_' in the path aren't treated as wildcards).
+        scopePath = [[scopePath stringByDeletingLastPathComponent] stringByAppendingString:@"/"];
+        [wheres addObject:[NSString stringWithFormat:@"substr(%@.path, 1, ?) = ?", source]];
+        [filterParams addObject:[NSNumber numberWithUnsignedInteger:[scopePath length]]];
+        [filterParams addObject:scopePath];
     }
     
-    NSString *where = [wheres componentsJoinedByString:@") AND ("];
-    NSString *_tables = [tables componentsJoinedByString:@","];
-    NSString *sql = [NSString stringWithFormat:@"SELECT %@.* FROM %@ WHERE (%@) LIMIT %ld", PAGE_TABLE, _tables, where, (long)_searchResultLimit];
+    NSString *sql;
+    NSMutableArray *params = [NSMutableArray new];
+    NSString *searchIndex = self.fileDB.searchIndexTable;
+    if (searchIndex) {
+        // Search using the full-text index, and rank results by relevance.
+        [wheres insertObject:[NSString stringWithFormat:@"%@ MATCH ?", searchIndex] atIndex:0];
+        [params addObject:[self matchExpressionForTokens:tokens mode:mode]];
+        [params addObjectsFromArray:filterParams];
+        sql = [NSString stringWithFormat:@"SELECT %@.* FROM %@ "
+                                          "INNER JOIN %@ ON %@.rowid = %@.rowid "
+                                          "INNER JOIN %@ ON %@.id = %@.id "
+                                          "WHERE %@ ORDER BY bm25(%@, %f, %f) LIMIT %ld",
+                  PAGE_TABLE, searchIndex,
+                  PAGE_TABLE, PAGE_TABLE, searchIndex,
+                  source, source, PAGE_TABLE,
+                  [wheres componentsJoinedByString:@" AND "], searchIndex, TITLE_RANK_WEIGHT, CONTENT_RANK_WEIGHT,
+                  (long)_searchResultLimit];
+    }
+    else {
+        // Full-text index not available; search by scanning the page table.
+        [wheres insertObject:[self likeClauseForTokens:tokens mode:mode params:params] atIndex:0];
+        [params addObjectsFromArray:filterParams];
+        sql = [NSString stringWithFormat:@"SELECT %@.* FROM %@ INNER JOIN %@ ON %@.id = %@.id WHERE (%@) LIMIT %ld",
+                  PAGE_TABLE, PAGE_TABLE, source, source, PAGE_TABLE,
+                  [wheres componentsJoinedByString:@") AND ("], (long)_searchResultLimit];
+    }
+    // The SQL varies with the search terms and filters, so isn't run as a cached statement.
     NSArray *rows = [self.fileDB performQuery:sql withParams:params];
     // Add search information to each result item.
-    NSMutableArray *result = [NSMutableArray new];
     NSDictionary *searchInfo = @{
         @"searchText": text,
         @"searchMode": mode
@@ -131,4 +145,51 @@
     [response respondWithJSONData:result cachePolicy:NSURLCacheStorageNotAllowed];
 }
 
+#pragma mark - Private
+
+- (NSArray *)tokenizeSearchText:(NSString *)text {
+    NSMutableArray *tokens = [NSMutableArray new];
+    NSCharacterSet *whitespace = [NSCharacterSet whitespaceAndNewlineCharacterSet];
+    for (NSString *token in [text componentsSeparatedByCharactersInSet:whitespace]) {
+        if ([token length] > 0) {
+            [tokens addObject:token];
+        }
+    }
+    return tokens;
+}
+
+- (NSString *)matchExpressionForTokens:(NSArray *)tokens mode:(NSString *)mode {
+    // Each token is quoted as an FTS5 string (so that search text can't inject query syntax)
+    // and marked as a prefix, so that partially typed words match.
+    NSMutableArray *terms = [NSMutableArray new];
+    for (NSString *token in tokens) {
+        NSString *quoted = [token stringByReplacingOccurrencesOfString:@"\"" withString:@"\"\""];
+        [terms addObject:[NSString stringWithFormat:@"\"%@\"", quoted]];
+    }
+    if ([@"exact" isEqualToString:mode]) {
+        // Match the tokens as a phrase, with the last token as a prefix.
+        return [NSString stringWithFormat:@"%@ *", [terms componentsJoinedByString:@" + "]];
+    }
+    NSString *separator = [@"any" isEqualToString:mode] ? @"* OR " : @"* ";
+    return [NSString stringWithFormat:@"%@*", [terms componentsJoinedByString:separator]];
+}
+
+- (NSString *)likeClauseForTokens:(NSArray *)tokens mode:(NSString *)mode params:(NSMutableArray *)params {
+    if ([@"exact" isEqualToString:mode]) {
+        NSString *term = [NSString stringWithFormat:@"%%%@%%", [tokens componentsJoinedByString:@" "]];
+        [params addObject:term];
+        [params addObject:term];
+        return [NSString stringWithFormat:@"%@.title LIKE ? OR %@.content LIKE ?", PAGE_TABLE, PAGE_TABLE];
+    }
+    NSMutableArray *terms = [NSMutableArray new];
+    for (NSString *token in tokens) {
+        [terms addObject:[NSString stringWithFormat:@"(%@.title LIKE ? OR %@.content LIKE ?)", PAGE_TABLE, PAGE_TABLE]];
+        NSString *param = [NSString stringWithFormat:@"%%%@%%", token];
+        [params addObject:param];
+        [params addObject:param];
+    }
+    NSString *separator = [@"any" isEqualToString:mode] ? @" OR " : @" AND ";
+    return [terms componentsJoinedByString:separator];
+}
+
 @end
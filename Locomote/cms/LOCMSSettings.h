@@ -38,10 +38,17 @@
 @property (nonatomic, strong) NSString *password;
 /// An authority name, derived from the settings values.
 @property (nonatomic, strong) NSString *authorityName;
+/**
+ * Whether the server accepts client visible sets in the compact format; see LOCMSClientVisibleSet.
+ * When NO, sets are converted to JSON before being sent. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL compactCVS;
 /// Return the URL for login authentication.
 @property (nonatomic, readonly) NSString *authenticationURL;
 /// Return the URL for the updates feed.
 @property (nonatomic, readonly) NSString *updatesURL;
+/// Return the URL for long-polling for change notifications; see LOCMSRefreshScheduler.
+@property (nonatomic, readonly) NSString *notificationsURL;
 
 /**
  * Initialize settings with a string reference.
@@ -81,7 +81,7 @@
     }
 
     // Allow additional properties to be specified in the ref URLs query string.
-    // (Currently just authRealm supported).
+    // (Currently authRealm and compactCVS are supported).
     NSArray *queryParams = [repoURL.query componentsSeparatedByString:@"&"];
     for (NSString *queryParam in queryParams) {
         NSArray *nameValuePair = [queryParam componentsSeparatedByString:@"="];
@@ -90,6 +90,9 @@
         if ([@"authRealm" isEqualToString:name]) {
             self.authRealm = value;
         }
+        else if ([@"compactCVS" isEqualToString:name]) {
+            self.compactCVS = [value boolValue];
+        }
     }
     
     return self;
@@ -140,6 +143,10 @@
     return [self urlForPath:[self pathForResource:@"updates.api" trailing:nil]];
 }
 
+- (NSString *)notificationsURL {
+    return [self urlForPath:[self pathForResource:@"notifications.api" trailing:nil]];
+}
+
 #pragma mark - Private methods
 
 // http://{host}/{apiroot}/{apiver}/path
@@ -0,0 +1,76 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * A read-only connection to a SQLite database with a cache of compiled statements.
+ * Statements are compiled once per distinct SQL string and then reset and re-bound on
+ * each subsequent use; the least recently used statement is finalized when the cache
+ * is full. The connection is intended for small, frequently repeated queries - all
+ * database writes should continue to go through the owning SCDB instance.
+ * All methods are thread safe; queries are serialized on the connection.
+ */
+@interface LOCMSStatementCache : NSObject
+
+/**
+ * Initialize the cache with the path to a database file and the maximum number of
+ * compiled statements to hold.
+ */
+- (id)initWithDBPath:(NSString *)dbPath capacity:(NSUInteger)capacity;
+
+/// The path to the database file.
+@property (nonatomic, strong, readonly) NSString *dbPath;
+/// The maximum number of compiled statements held by the cache.
+@property (nonatomic, assign, readonly) NSUInteger capacity;
+/// The number of compiled statements currently held by the cache.
+@property (nonatomic, assign, readonly) NSUInteger count;
+
+/**
+ * Open the database connection.
+ * Returns NO if the connection can't be opened. Connections are opened automatically by
+ * the query methods, so calling this method is only necessary to detect errors early.
+ */
+- (BOOL)open;
+/**
+ * Finalize all cached statements and close the database connection.
+ */
+- (void)close;
+/**
+ * Execute a query and return the result as an array of dictionaries keyed by column name.
+ * Null column values are omitted from the result dictionaries.
+ * Returns nil and sets the error if the query fails.
+ */
+- (NSArray<NSDictionary *> *)performQuery:(NSString *)sql withParams:(NSArray *)params error:(NSError **)error;
+/**
+ * Execute a query and return the column values of the first result row, in column order.
+ * Null column values are returned as NSNull. Returns an empty array if the query has no
+ * result; returns nil and sets the error if the query fails.
+ */
+- (NSArray *)readFirstRowOfQuery:(NSString *)sql withParams:(NSArray *)params error:(NSError **)error;
+/**
+ * Execute a query and pass each result record to a block as it's read, without loading the
+ * full result into memory. Records are dictionaries keyed by column name, as returned by
+ * performQuery:; the block can set stop to YES to end the query early.
+ * Queries from other threads wait until the enumeration completes; the block can itself make
+ * queries on the connection, including with the same SQL.
+ * Returns NO and sets the error if the query fails.
+ */
+- (BOOL)enumerateQuery:(NSString *)sql
+            withParams:(NSArray *)params
+            usingBlock:(void(^)(NSDictionary *record, BOOL *stop))block
+                 error:(NSError **)error;
+
+@end
@@ -0,0 +1,358 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LOCMSStatementCache.h"
+#import "SCLogger.h"
+#import <sqlite3.h>
+
+#define StatementCacheErrorDomain   (@"LOCMSStatementCache")
+// Time in ms to wait for a write lock held by another connection to be released.
+#define BusyTimeout                 (2000)
+
+static SCLogger *Logger;
+
+/// A compiled statement held by the cache.
+@interface LOCMSCachedStatement : NSObject {
+    @public
+    sqlite3_stmt *_stmt;
+    /// Flag indicating that the statement is checked out by a query in progress.
+    BOOL _inUse;
+}
+
+- (id)initWithStatement:(sqlite3_stmt *)stmt;
+- (void)finalizeStatement;
+
+@end
+
+@implementation LOCMSCachedStatement
+
+- (id)initWithStatement:(sqlite3_stmt *)stmt {
+    self = [super init];
+    if (self) {
+        _stmt = stmt;
+    }
+    return self;
+}
+
+- (void)finalizeStatement {
+    if (_stmt) {
+        sqlite3_finalize(_stmt);
+        _stmt = NULL;
+    }
+}
+
+- (void)dealloc {
+    [self finalizeStatement];
+}
+
+@end
+
+@interface LOCMSStatementCache () {
+    sqlite3 *_db;
+    /// Compiled statements, keyed by SQL string.
+    NSMutableDictionary<NSString *, LOCMSCachedStatement *> *_statements;
+    /// SQL strings of cached statements, in least to most recently used order.
+    NSMutableArray<NSString *> *_lru;
+}
+
+/**
+ * Check out a compiled statement for a SQL string, reset and ready to bind.
+ * If the cached statement is already checked out - i.e. by a query made from within an
+ * enumeration block - then a new statement is prepared, which isn't cached.
+ */
+- (LOCMSCachedStatement *)checkOutStatementForSQL:(NSString *)sql error:(NSError **)error;
+/// Execute a statement and pass each result row to a block; the block returns NO to stop.
+- (BOOL)executeSQL:(NSString *)sql withParams:(NSArray *)params rowBlock:(BOOL(^)(sqlite3_stmt *stmt))rowBlock error:(NSError **)error;
+/// Bind parameter values to a statement.
+- (BOOL)bindParams:(NSArray *)params toStatement:(sqlite3_stmt *)stmt;
+/// Read a column value from the current result row.
+- (id)valueOfColumn:(int)column inStatement:(sqlite3_stmt *)stmt;
+/// Make an error using the connection's current error message.
+- (NSError *)makeError:(NSString *)description;
+
+@end
+
+@implementation LOCMSStatementCache
+
++ (void)initialize {
+    Logger = [[SCLogger alloc] initWithTag:@"LOCMSStatementCache"];
+}
+
+- (id)initWithDBPath:(NSString *)dbPath capacity:(NSUInteger)capacity {
+    self = [super init];
+    if (self) {
+        _dbPath = dbPath;
+        _capacity = MAX(1, capacity);
+        _statements = [NSMutableDictionary new];
+        _lru = [NSMutableArray new];
+    }
+    return self;
+}
+
+- (NSUInteger)count {
+    @synchronized (self) {
+        return [_statements count];
+    }
+}
+
+- (BOOL)open {
+    @synchronized (self) {
+        if (_db) {
+            return YES;
+        }
+        // The connection is read-only; access to it is serialized by this class, so SQLite's
+        // own connection mutex isn't needed.
+        int flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX;
+        int rc = sqlite3_open_v2([_dbPath fileSystemRepresentation], &_db, flags, NULL);
+        if (rc != SQLITE_OK) {
+            [Logger error:@"Failed to open %@: %s", _dbPath, _db ? sqlite3_errmsg(_db) : "out of memory"];
+            sqlite3_close(_db);
+            _db = NULL;
+            return NO;
+        }
+        sqlite3_busy_timeout(_db, BusyTimeout);
+        return YES;
+    }
+}
+
+- (void)close {
+    @synchronized (self) {
+        for (LOCMSCachedStatement *statement in [_statements allValues]) {
+            [statement finalizeStatement];
+        }
+        [_statements removeAllObjects];
+        [_lru removeAllObjects];
+        if (_db) {
+            sqlite3_close(_db);
+            _db = NULL;
+        }
+    }
+}
+
+- (NSArray<NSDictionary *> *)performQuery:(NSString *)sql withParams:(NSArray *)params error:(NSError **)error {
+    NSMutableArray *result = [NSMutableArray new];
+    __block NSMutableArray *names = nil;
+    BOOL ok = [self executeSQL:sql withParams:params rowBlock:^BOOL(sqlite3_stmt *stmt) {
+        int columnCount = sqlite3_column_count(stmt);
+        if (!names) {
+            names = [NSMutableArray new];
+            for (int i = 0; i < columnCount; i++) {
+                [names addObject:[NSString stringWithUTF8String:sqlite3_column_name(stmt, i)]];
+            }
+        }
+        NSMutableDictionary *row = [NSMutableDictionary new];
+        for (int i = 0; i < columnCount; i++) {
+            id value = [self valueOfColumn:i inStatement:stmt];
+            if (value != [NSNull null]) {
+                row[names[i]] = value;
+            }
+        }
+        [result addObject:row];
+        return YES;
+    } error:error];
+    return ok ? result : nil;
+}
+
+- (NSArray *)readFirstRowOfQuery:(NSString *)sql withParams:(NSArray *)params error:(NSError **)error {
+    NSMutableArray *result = [NSMutableArray new];
+    BOOL ok = [self executeSQL:sql withParams:params rowBlock:^BOOL(sqlite3_stmt *stmt) {
+        int columnCount = sqlite3_column_count(stmt);
+        for (int i = 0; i < columnCount; i++) {
+            [result addObject:[self valueOfColumn:i inStatement:stmt]];
+        }
+        return NO;
+    } error:error];
+    return ok ? result : nil;
+}
+
+- (BOOL)enumerateQuery:(NSString *)sql
+            withParams:(NSArray *)params
+            usingBlock:(void(^)(NSDictionary *record, BOOL *stop))block
+                 error:(NSError **)error {
+    __block NSMutableArray *names = nil;
+    return [self executeSQL:sql withParams:params rowBlock:^BOOL(sqlite3_stmt *stmt) {
+        BOOL stop = NO;
+        @autoreleasepool {
+            int columnCount = sqlite3_column_count(stmt);
+            if (!names) {
+                names = [NSMutableArray new];
+                for (int i = 0; i < columnCount; i++) {
+                    [names addObject:[NSString stringWithUTF8String:sqlite3_column_name(stmt, i)]];
+                }
+            }
+            NSMutableDictionary *record = [NSMutableDictionary new];
+            for (int i = 0; i < columnCount; i++) {
+                id value = [self valueOfColumn:i inStatement:stmt];
+                if (value != [NSNull null]) {
+                    record[names[i]] = value;
+                }
+            }
+            block(record, &stop);
+        }
+        return !stop;
+    } error:error];
+}
+
+- (void)dealloc {
+    [self close];
+}
+
+#pragma mark - Private
+
+- (LOCMSCachedStatement *)checkOutStatementForSQL:(NSString *)sql error:(NSError **)error {
+    LOCMSCachedStatement *statement = _statements[sql];
+    if (statement && !statement->_inUse) {
+        // Move the statement to the most recently used position.
+        [_lru removeObject:sql];
+        [_lru addObject:sql];
+        sqlite3_reset(statement->_stmt);
+        sqlite3_clear_bindings(statement->_stmt);
+        statement->_inUse = YES;
+        return statement;
+    }
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(_db, [sql UTF8String], -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        if (error) {
+            *error = [self makeError:sql];
+        }
+        sqlite3_finalize(stmt);
+        return nil;
+    }
+    LOCMSCachedStatement *prepared = [[LOCMSCachedStatement alloc] initWithStatement:stmt];
+    prepared->_inUse = YES;
+    if (statement) {
+        // A re-entrant query; the new statement is finalized once the query completes.
+        return prepared;
+    }
+    if ([_lru count] >= _capacity) {
+        // Evict the least recently used statement. A statement still in use is finalized
+        // once its query releases it.
+        NSString *evicted = _lru[0];
+        LOCMSCachedStatement *evictedStatement = _statements[evicted];
+        [_lru removeObjectAtIndex:0];
+        [_statements removeObjectForKey:evicted];
+        if (!evictedStatement->_inUse) {
+            [evictedStatement finalizeStatement];
+        }
+    }
+    _statements[sql] = prepared;
+    [_lru addObject:sql];
+    return prepared;
+}
+
+- (BOOL)executeSQL:(NSString *)sql withParams:(NSArray *)params rowBlock:(BOOL(^)(sqlite3_stmt *stmt))rowBlock error:(NSError **)error {
+    @synchronized (self) {
+        if (![self open]) {
+            if (error) {
+                *error = [self makeError:@"Database not open"];
+            }
+            return NO;
+        }
+        // The statement is checked out whilst the row block runs, so that a query made from the
+        // block with the same SQL doesn't reset it.
+        LOCMSCachedStatement *statement = [self checkOutStatementForSQL:sql error:error];
+        if (!statement) {
+            return NO;
+        }
+        sqlite3_stmt *stmt = statement->_stmt;
+        if (![self bindParams:params toStatement:stmt]) {
+            if (error) {
+                *error = [self makeError:sql];
+            }
+            sqlite3_reset(stmt);
+            statement->_inUse = NO;
+            return NO;
+        }
+        BOOL ok = YES;
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            if (!rowBlock(stmt)) {
+                break;
+            }
+        }
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+            if (error) {
+                *error = [self makeError:sql];
+            }
+            ok = NO;
+        }
+        // Reset the statement so that it doesn't hold a read lock while idle in the cache.
+        sqlite3_reset(stmt);
+        statement->_inUse = NO;
+        return ok;
+    }
+}
+
+- (BOOL)bindParams:(NSArray *)params toStatement:(sqlite3_stmt *)stmt {
+    int idx = 1;
+    for (id param in params) {
+        int rc;
+        if ([param isKindOfClass:[NSString class]]) {
+            rc = sqlite3_bind_text(stmt, idx, [(NSString *)param UTF8String], -1, SQLITE_TRANSIENT);
+        }
+        else if ([param isKindOfClass:[NSNumber class]]) {
+            const char *type = [(NSNumber *)param objCType];
+            if (strcmp(type, @encode(double)) == 0 || strcmp(type, @encode(float)) == 0) {
+                rc = sqlite3_bind_double(stmt, idx, [(NSNumber *)param doubleValue]);
+            }
+            else {
+                rc = sqlite3_bind_int64(stmt, idx, [(NSNumber *)param longLongValue]);
+            }
+        }
+        else if ([param isKindOfClass:[NSData class]]) {
+            NSData *data = (NSData *)param;
+            rc = sqlite3_bind_blob(stmt, idx, [data bytes], (int)[data length], SQLITE_TRANSIENT);
+        }
+        else if (param == [NSNull null]) {
+            rc = sqlite3_bind_null(stmt, idx);
+        }
+        else {
+            rc = sqlite3_bind_text(stmt, idx, [[param description] UTF8String], -1, SQLITE_TRANSIENT);
+        }
+        if (rc != SQLITE_OK) {
+            return NO;
+        }
+        idx++;
+    }
+    return YES;
+}
+
+- (id)valueOfColumn:(int)column inStatement:(sqlite3_stmt *)stmt {
+    switch (sqlite3_column_type(stmt, column)) {
+        case SQLITE_INTEGER:
+            return [NSNumber numberWithLongLong:sqlite3_column_int64(stmt, column)];
+        case SQLITE_FLOAT:
+            return [NSNumber numberWithDouble:sqlite3_column_double(stmt, column)];
+        case SQLITE_TEXT:
+            return [NSString stringWithUTF8String:(const char *)sqlite3_column_text(stmt, column)];
+        case SQLITE_BLOB:
+            return [NSData dataWithBytes:sqlite3_column_blob(stmt, column) length:sqlite3_column_bytes(stmt, column)];
+        default:
+            return [NSNull null];
+    }
+}
+
+- (NSError *)makeError:(NSString *)description {
+    NSString *message = _db ? [NSString stringWithUTF8String:sqlite3_errmsg(_db)] : @"";
+    NSInteger code = _db ? sqlite3_errcode(_db) : SQLITE_CANTOPEN;
+    return [NSError errorWithDomain:StatementCacheErrorDomain
+                               code:code
+                           userInfo:@{
+                               NSLocalizedDescriptionKey: [NSString stringWithFormat:@"%@: %@", description, message]
+                           }];
+}
+
+@end
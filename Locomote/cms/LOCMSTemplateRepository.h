@@ -0,0 +1,52 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "GRMustache.h"
+
+@class LOCMSFileDB;
+
+/**
+ * A repository of compiled client templates.
+ * Templates are loaded from the locally cached copies of files in the file DB, and are
+ * compiled once and then reused until the 'templates' fileset changes. Compiled templates
+ * are identified by file path and file version, so a template whose file record has been
+ * updated is always recompiled.
+ * Templates may include partials; partial names are resolved relative to the directory
+ * of the including template, or relative to the repository root if the name starts with
+ * a slash. A .html extension is added to partial names without a file extension.
+ */
+@interface LOCMSTemplateRepository : NSObject <GRMustacheTemplateRepositoryDataSource>
+
+- (id)initWithFileDB:(LOCMSFileDB *)fileDB;
+
+/// The file DB templates are loaded from.
+@property (nonatomic, weak, readonly) LOCMSFileDB *fileDB;
+
+/**
+ * Return the compiled template at the specified file path.
+ * Returns nil if the template file isn't available, or can't be compiled.
+ */
+- (GRMustacheTemplate *)templateAtPath:(NSString *)path error:(NSError **)error;
+/**
+ * Return the template to use to render pages of the specified type.
+ * This is the template at templates/page-{type}.html if available, otherwise the default
+ * page template at templates/page.html. Returns nil if neither template is available.
+ */
+- (GRMustacheTemplate *)pageTemplateForType:(NSString *)pageType error:(NSError **)error;
+/// Discard all compiled templates.
+- (void)invalidate;
+
+@end
@@ -0,0 +1,182 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LOCMSTemplateRepository.h"
+#import "LOCMSFileDB.h"
+
+#define TemplatesCategory   (@"templates")
+#define TemplateExtension   (@"html")
+
+@interface LOCMSTemplateRepository () {
+    /// The GRMustache repository holding compiled templates, keyed by template ID.
+    GRMustacheTemplateRepository *_repository;
+    /// The file DB generation that resolved template IDs are valid for.
+    NSUInteger _generation;
+    /// The templates fileset fingerprint that compiled templates are valid for.
+    NSString *_fingerprint;
+    /// Resolved template IDs, keyed by template path; NSNull for templates not available.
+    NSMutableDictionary *_templateIDs;
+    /// Template file locations, keyed by template ID.
+    NSMutableDictionary *_templateLocations;
+    /// Resolved page template paths, keyed by page type; NSNull if no template is available.
+    NSMutableDictionary *_pageTemplatePaths;
+}
+
+/// Check whether the file DB has changed since templates were resolved, and discard any stale data.
+- (void)checkForUpdates;
+/// Return the ID of the template at a path; nil if the template isn't available.
+- (NSString *)templateIDForPath:(NSString *)path;
+/// Return the template path from a template ID.
+- (NSString *)pathFromTemplateID:(NSString *)templateID;
+
+@end
+
+@implementation LOCMSTemplateRepository
+
+- (id)initWithFileDB:(LOCMSFileDB *)fileDB {
+    self = [super init];
+    if (self) {
+        _fileDB = fileDB;
+        _templateIDs = [NSMutableDictionary new];
+        _templateLocations = [NSMutableDictionary new];
+        _pageTemplatePaths = [NSMutableDictionary new];
+        [self invalidate];
+    }
+    return self;
+}
+
+- (GRMustacheTemplate *)templateAtPath:(NSString *)path error:(NSError **)error {
+    @synchronized (self) {
+        [self checkForUpdates];
+        if (![self templateIDForPath:path]) {
+            return nil;
+        }
+        // The repository resolves the path to the template ID via the data source methods below,
+        // and returns the compiled template for the ID if it has one.
+        return [_repository templateNamed:path error:error];
+    }
+}
+
+- (GRMustacheTemplate *)pageTemplateForType:(NSString *)pageType error:(NSError **)error {
+    @synchronized (self) {
+        [self checkForUpdates];
+        NSString *key = pageType ?: @"";
+        id path = _pageTemplatePaths[key];
+        if (!path) {
+            NSString *typePath = [NSString stringWithFormat:@"templates/page-%@.html", pageType];
+            if ([self templateIDForPath:typePath]) {
+                path = typePath;
+            }
+            else if ([self templateIDForPath:@"templates/page.html"]) {
+                path = @"templates/page.html";
+            }
+            else {
+                path = [NSNull null];
+            }
+            _pageTemplatePaths[key] = path;
+        }
+        return path == [NSNull null] ? nil : [self templateAtPath:path error:error];
+    }
+}
+
+- (void)invalidate {
+    @synchronized (self) {
+        _repository = [GRMustacheTemplateRepository templateRepositoryWithDataSource:self];
+        _generation = _fileDB.generation;
+        _fingerprint = nil;
+        [_templateIDs removeAllObjects];
+        [_templateLocations removeAllObjects];
+        [_pageTemplatePaths removeAllObjects];
+    }
+}
+
+#pragma mark - GRMustacheTemplateRepositoryDataSource
+
+- (id<NSCopying>)templateRepository:(GRMustacheTemplateRepository *)templateRepository
+                 templateIDForName:(NSString *)name
+              relativeToTemplateID:(id)baseTemplateID {
+    NSString *path;
+    if ([name hasPrefix:@"/"] || !baseTemplateID) {
+        path = [name stringByTrimmingCharactersInSet:[NSCharacterSet characterSetWithCharactersInString:@"/"]];
+    }
+    else {
+        // Resolve partial names relative to the directory of the including template.
+        NSString *dir = [[self pathFromTemplateID:baseTemplateID] stringByDeletingLastPathComponent];
+        path = [dir stringByAppendingPathComponent:name];
+    }
+    if ([[path pathExtension] length] == 0) {
+        path = [path stringByAppendingPathExtension:TemplateExtension];
+    }
+    return [self templateIDForPath:path];
+}
+
+- (NSString *)templateRepository:(GRMustacheTemplateRepository *)templateRepository
+     templateStringForTemplateID:(id)templateID
+                           error:(NSError **)error {
+    NSString *location = _templateLocations[templateID];
+    if (!location) {
+        return nil;
+    }
+    return [NSString stringWithContentsOfFile:location encoding:NSUTF8StringEncoding error:error];
+}
+
+#pragma mark - Private
+
+- (void)checkForUpdates {
+    NSUInteger generation = _fileDB.generation;
+    if (generation == _generation) {
+        return;
+    }
+    // File DB has changed, so template files may have moved or been deleted.
+    _generation = generation;
+    [_templateIDs removeAllObjects];
+    [_pageTemplatePaths removeAllObjects];
+    // Compiled templates are discarded when the templates fileset changes.
+    NSArray *rs = [_fileDB performCachedQuery:@"SELECT fingerprint, current FROM fingerprints WHERE category=?"
+                                   withParams:@[ TemplatesCategory ]];
+    NSString *fingerprint = nil;
+    if ([rs count] > 0) {
+        fingerprint = [NSString stringWithFormat:@"%@:%@", rs[0][@"fingerprint"], rs[0][@"current"]];
+    }
+    if (!(fingerprint == _fingerprint || [fingerprint isEqualToString:_fingerprint])) {
+        _repository = [GRMustacheTemplateRepository templateRepositoryWithDataSource:self];
+        [_templateLocations removeAllObjects];
+        _fingerprint = fingerprint;
+    }
+}
+
+- (NSString *)templateIDForPath:(NSString *)path {
+    id templateID = _templateIDs[path];
+    if (!templateID) {
+        templateID = [NSNull null];
+        NSDictionary *record = [_fileDB fileRecordForPath:path];
+        NSString *location = record ? [_fileDB cacheLocationForFileRecord:record] : nil;
+        if (location && [[NSFileManager defaultManager] fileExistsAtPath:location]) {
+            // The template ID includes the file version, so that a template is recompiled
+            // whenever its file is updated.
+            templateID = [NSString stringWithFormat:@"%@#%@", path, record[@"version"]];
+            _templateLocations[templateID] = location;
+        }
+        _templateIDs[path] = templateID;
+    }
+    return templateID == [NSNull null] ? nil : templateID;
+}
+
+- (NSString *)pathFromTemplateID:(NSString *)templateID {
+    NSRange range = [templateID rangeOfString:@"#" options:NSBackwardsSearch];
+    return range.location == NSNotFound ? templateID : [templateID substringToIndex:range.location];
+}
+
+@end
@@ -0,0 +1,56 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+/// A block called with each row read from an updates feed.
+typedef void (^LOCMSUpdatesFeedRowBlock) (NSString *table, NSDictionary *values);
+
+/**
+ * A streaming reader for the Locomote updates feed.
+ * The updates feed is a msgpack or JSON encoded document in the form:
+ *
+ *      { "db": { "{table}": [ { row values... }, ... ], ... }, ... }
+ *
+ * Rather than decoding the whole document into an object tree before the updates are
+ * applied, the reader walks the encoded data and decodes one row at a time, passing
+ * each row to a callback block. Properties outside of 'db' are skipped over without
+ * being decoded. The memory needed to read a feed is therefore the size of the encoded
+ * feed plus a single row, however many rows the feed contains.
+ */
+@interface LOCMSUpdatesFeedReader : NSObject
+
+/**
+ * Initialize a reader with the feed data and its MIME type.
+ * The feed format is selected using the MIME type; if the MIME type isn't recognized
+ * then the format is detected from the first byte of the data.
+ */
+- (id)initWithData:(NSData *)data mimeType:(NSString *)mimeType;
+
+/**
+ * Read the feed, calling the block once for each row in the feed's 'db' property.
+ * Rows are reported in feed order; all rows of a table are reported together.
+ * Returns NO if the feed data can't be decoded, or if the feed doesn't contain an
+ * updates document (see errorMessage).
+ */
+- (BOOL)readRows:(LOCMSUpdatesFeedRowBlock)block error:(NSError **)error;
+
+/**
+ * A server error message.
+ * Set on initialization if the feed contains a plain string instead of an updates document.
+ */
+@property (nonatomic, strong, readonly) NSString *errorMessage;
+
+@end
@@ -0,0 +1,804 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LOCMSUpdatesFeedReader.h"
+
+#define ReaderErrorDomain   (@"LOCMSUpdatesFeedReader")
+/// The maximum container nesting depth supported by the decoders.
+#define MaxDepth            (64)
+
+/**
+ * A pull decoder over an encoded feed document.
+ * Containers are entered and then iterated; any value can be either decoded in full or
+ * skipped over without decoding.
+ */
+@protocol LOFeedDecoder <NSObject>
+
+/// Flag indicating that the decoder has encountered invalid data.
+@property (nonatomic, assign, readonly) BOOL failed;
+
+/// Test whether the next value is a map.
+- (BOOL)atMap;
+/// Test whether the next value is an array.
+- (BOOL)atArray;
+/// Test whether the next value is a string.
+- (BOOL)atString;
+/// Enter the map at the current position.
+- (BOOL)enterMap;
+/// Read the next key of the current map; returns NO, and leaves the map, when there are no more keys.
+- (BOOL)nextKey:(NSString **)key;
+/// Enter the array at the current position.
+- (BOOL)enterArray;
+/// Test whether the current array has another item; returns NO, and leaves the array, when there are no more items.
+- (BOOL)nextItem;
+/// Decode the next value in full.
+- (id)readValue;
+/// Skip over the next value without decoding it.
+- (BOOL)skipValue;
+
+@end
+
+#pragma mark - msgpack
+
+/// A msgpack decoder.
+@interface LOMsgPackFeedDecoder : NSObject <LOFeedDecoder> {
+    const uint8_t *_bytes;
+    NSUInteger _length;
+    NSUInteger _pos;
+    /// The number of items remaining in each entered container.
+    NSUInteger _remaining[MaxDepth];
+    NSInteger _depth;
+}
+
+@property (nonatomic, assign) BOOL failed;
+
+- (id)initWithData:(NSData *)data;
+
+@end
+
+// Read big-endian integers from the data, checking bounds first.
+#define Need(n)     if (_pos + (n) > _length) { _failed = YES; return 0; }
+
+@implementation LOMsgPackFeedDecoder
+
+- (id)initWithData:(NSData *)data {
+    self = [super init];
+    if (self) {
+        _bytes  = (const uint8_t *)[data bytes];
+        _length = [data length];
+        _pos    = 0;
+        _depth  = 0;
+    }
+    return self;
+}
+
+- (uint64_t)readUInt:(NSUInteger)size {
+    Need(size);
+    uint64_t value = 0;
+    for (NSUInteger i = 0; i < size; i++) {
+        value = (value << 8) | _bytes[_pos++];
+    }
+    return value;
+}
+
+- (uint8_t)peek {
+    return (_pos < _length) ? _bytes[_pos] : 0xc1; // 0xc1 is never used by msgpack.
+}
+
+- (BOOL)atMap {
+    uint8_t b = [self peek];
+    return (b >= 0x80 && b <= 0x8f) || b == 0xde || b == 0xdf;
+}
+
+- (BOOL)atArray {
+    uint8_t b = [self peek];
+    return (b >= 0x90 && b <= 0x9f) || b == 0xdc || b == 0xdd;
+}
+
+- (BOOL)atString {
+    uint8_t b = [self peek];
+    return (b >= 0xa0 && b <= 0xbf) || (b >= 0xd9 && b <= 0xdb);
+}
+
+- (BOOL)pushContainer:(NSUInteger)count {
+    if (_depth >= MaxDepth) {
+        _failed = YES;
+        return NO;
+    }
+    _remaining[_depth++] = count;
+    return YES;
+}
+
+- (BOOL)enterMap {
+    uint8_t b = (uint8_t)[self readUInt:1];
+    NSUInteger count;
+    if (b >= 0x80 && b <= 0x8f) {
+        count = b & 0x0f;
+    }
+    else if (b == 0xde) {
+        count = (NSUInteger)[self readUInt:2];
+    }
+    else if (b == 0xdf) {
+        count = (NSUInteger)[self readUInt:4];
+    }
+    else {
+        _failed = YES;
+        return NO;
+    }
+    return !_failed && [self pushContainer:count];
+}
+
+- (BOOL)nextKey:(NSString **)key {
+    if (_failed || _depth == 0) {
+        return NO;
+    }
+    if (_remaining[_depth - 1] == 0) {
+        _depth--;
+        return NO;
+    }
+    _remaining[_depth - 1]--;
+    id value = [self readValue];
+    *key = [value isKindOfClass:[NSString class]] ? value : [value description];
+    return !_failed;
+}
+
+- (BOOL)enterArray {
+    uint8_t b = (uint8_t)[self readUInt:1];
+    NSUInteger count;
+    if (b >= 0x90 && b <= 0x9f) {
+        count = b & 0x0f;
+    }
+    else if (b == 0xdc) {
+        count = (NSUInteger)[self readUInt:2];
+    }
+    else if (b == 0xdd) {
+        count = (NSUInteger)[self readUInt:4];
+    }
+    else {
+        _failed = YES;
+        return NO;
+    }
+    return !_failed && [self pushContainer:count];
+}
+
+- (BOOL)nextItem {
+    if (_failed || _depth == 0) {
+        return NO;
+    }
+    if (_remaining[_depth - 1] == 0) {
+        _depth--;
+        return NO;
+    }
+    _remaining[_depth - 1]--;
+    return YES;
+}
+
+/**
+ * Read the header of the next value.
+ * Returns the number of payload bytes following the header for scalar values; for
+ * containers, returns 0 and sets *items to the number of nested values.
+ */
+- (NSUInteger)readHeader:(NSUInteger *)items {
+    *items = 0;
+    uint8_t b = (uint8_t)[self readUInt:1];
+    if (_failed) {
+        return 0;
+    }
+    if (b <= 0x7f || b >= 0xe0 || b == 0xc0 || b == 0xc2 || b == 0xc3) {
+        return 0;
+    }
+    if (b >= 0x80 && b <= 0x8f) {
+        *items = (b & 0x0f) * 2;
+        return 0;
+    }
+    if (b >= 0x90 && b <= 0x9f) {
+        *items = b & 0x0f;
+        return 0;
+    }
+    if (b >= 0xa0 && b <= 0xbf) {
+        return b & 0x1f;
+    }
+    switch (b) {
+        case 0xc4: case 0xd9: return (NSUInteger)[self readUInt:1];
+        case 0xc5: case 0xda: return (NSUInteger)[self readUInt:2];
+        case 0xc6: case 0xdb: return (NSUInteger)[self readUInt:4];
+        case 0xc7: return (NSUInteger)[self readUInt:1] + 1;
+        case 0xc8: return (NSUInteger)[self readUInt:2] + 1;
+        case 0xc9: return (NSUInteger)[self readUInt:4] + 1;
+        case 0xca: return 4;
+        case 0xcb: return 8;
+        case 0xcc: case 0xd0: return 1;
+        case 0xcd: case 0xd1: return 2;
+        case 0xce: case 0xd2: return 4;
+        case 0xcf: case 0xd3: return 8;
+        case 0xd4: return 2;
+        case 0xd5: return 3;
+        case 0xd6: return 5;
+        case 0xd7: return 9;
+        case 0xd8: return 17;
+        case 0xdc: *items = (NSUInteger)[self readUInt:2]; return 0;
+        case 0xdd: *items = (NSUInteger)[self readUInt:4]; return 0;
+        case 0xde: *items = (NSUInteger)[self readUInt:2] * 2; return 0;
+        case 0xdf: *items = (NSUInteger)[self readUInt:4] * 2; return 0;
+    }
+    _failed = YES;
+    return 0;
+}
+
+- (BOOL)skipValue {
+    // Skip values iteratively by counting the number of values still to be skipped.
+    NSUInteger pending = 1;
+    while (pending > 0 && !_failed) {
+        pending--;
+        NSUInteger items;
+        NSUInteger size = [self readHeader:&items];
+        if (_pos + size > _length) {
+            _failed = YES;
+            break;
+        }
+        _pos += size;
+        pending += items;
+    }
+    return !_failed;
+}
+
+- (NSString *)readStringOfLength:(NSUInteger)length {
+    Need(length);
+    NSString *string = [[NSString alloc] initWithBytes:&_bytes[_pos] length:length encoding:NSUTF8StringEncoding];
+    _pos += length;
+    return string ? string : @"";
+}
+
+- (id)readValue {
+    if (_failed) {
+        return nil;
+    }
+    uint8_t b = [self peek];
+    if (b <= 0x7f) {
+        _pos++;
+        return [NSNumber numberWithInt:b];
+    }
+    if (b >= 0xe0) {
+        _pos++;
+        return [NSNumber numberWithInt:(int8_t)b];
+    }
+    if (b >= 0xa0 && b <= 0xbf) {
+        _pos++;
+        return [self readStringOfLength:(b & 0x1f)];
+    }
+    if ([self atMap]) {
+        if (![self enterMap]) {
+            return nil;
+        }
+        NSMutableDictionary *map = [NSMutableDictionary new];
+        NSString *key;
+        while ([self nextKey:&key]) {
+            id value = [self readValue];
+            if (_failed) {
+                return nil;
+            }
+            map[key] = value;
+        }
+        return _failed ? nil : map;
+    }
+    if ([self atArray]) {
+        if (![self enterArray]) {
+            return nil;
+        }
+        NSMutableArray *array = [NSMutableArray new];
+        while ([self nextItem]) {
+            id value = [self readValue];
+            if (_failed) {
+                return nil;
+            }
+            [array addObject:value];
+        }
+        return _failed ? nil : array;
+    }
+    _pos++;
+    switch (b) {
+        case 0xc0: return [NSNull null];
+        case 0xc2: return @NO;
+        case 0xc3: return @YES;
+        case 0xd9: return [self readStringOfLength:(NSUInteger)[self readUInt:1]];
+        case 0xda: return [self readStringOfLength:(NSUInteger)[self readUInt:2]];
+        case 0xdb: return [self readStringOfLength:(NSUInteger)[self readUInt:4]];
+        case 0xc4: case 0xc5: case 0xc6: {
+            NSUInteger length = (NSUInteger)[self readUInt:(b == 0xc4 ? 1 : (b == 0xc5 ? 2 : 4))];
+            Need(length);
+            NSData *data = [NSData dataWithBytes:&_bytes[_pos] length:length];
+            _pos += length;
+            return data;
+        }
+        case 0xca: {
+            uint32_t bits = (uint32_t)[self readUInt:4];
+            float value;
+            memcpy(&value, &bits, 4);
+            return [NSNumber numberWithFloat:value];
+        }
+        case 0xcb: {
+            uint64_t bits = [self readUInt:8];
+            double value;
+            memcpy(&value, &bits, 8);
+            return [NSNumber numberWithDouble:value];
+        }
+        case 0xcc: return [NSNumber numberWithUnsignedLongLong:[self readUInt:1]];
+        case 0xcd: return [NSNumber numberWithUnsignedLongLong:[self readUInt:2]];
+        case 0xce: return [NSNumber numberWithUnsignedLongLong:[self readUInt:4]];
+        case 0xcf: return [NSNumber numberWithUnsignedLongLong:[self readUInt:8]];
+        case 0xd0: return [NSNumber numberWithLongLong:(int8_t)[self readUInt:1]];
+        case 0xd1: return [NSNumber numberWithLongLong:(int16_t)[self readUInt:2]];
+        case 0xd2: return [NSNumber numberWithLongLong:(int32_t)[self readUInt:4]];
+        case 0xd3: return [NSNumber numberWithLongLong:(int64_t)[self readUInt:8]];
+    }
+    // Extension types aren't used by the feed; step back and skip the value.
+    _pos--;
+    [self skipValue];
+    return [NSNull null];
+}
+
+@end
+
+#pragma mark - JSON
+
+/// A JSON decoder.
+@interface LOJSONFeedDecoder : NSObject <LOFeedDecoder> {
+    const uint8_t *_bytes;
+    NSUInteger _length;
+    NSUInteger _pos;
+    /// Flags recording whether the first item of each entered container has been read.
+    BOOL _started[MaxDepth];
+    NSInteger _depth;
+}
+
+@property (nonatomic, assign) BOOL failed;
+
+- (id)initWithData:(NSData *)data;
+
+@end
+
+@implementation LOJSONFeedDecoder
+
+- (id)initWithData:(NSData *)data {
+    self = [super init];
+    if (self) {
+        _bytes  = (const uint8_t *)[data bytes];
+        _length = [data length];
+        _pos    = 0;
+        _depth  = 0;
+    }
+    return self;
+}
+
+- (uint8_t)peek {
+    while (_pos < _length) {
+        uint8_t b = _bytes[_pos];
+        if (b == ' ' || b == '\n' || b == '\r' || b == '\t') {
+            _pos++;
+        }
+        else {
+            return b;
+        }
+    }
+    return 0;
+}
+
+- (BOOL)expect:(uint8_t)b {
+    if ([self peek] == b) {
+        _pos++;
+        return YES;
+    }
+    _failed = YES;
+    return NO;
+}
+
+- (BOOL)atMap {
+    return [self peek] == '{';
+}
+
+- (BOOL)atArray {
+    return [self peek] == '[';
+}
+
+- (BOOL)atString {
+    return [self peek] == '"';
+}
+
+- (BOOL)enterContainer:(uint8_t)open {
+    if (_depth >= MaxDepth) {
+        _failed = YES;
+        return NO;
+    }
+    if (![self expect:open]) {
+        return NO;
+    }
+    _started[_depth++] = NO;
+    return YES;
+}
+
+/// Move to the next item of the current container; returns NO at the container's end.
+- (BOOL)nextInContainer:(uint8_t)close {
+    if (_failed || _depth == 0) {
+        return NO;
+    }
+    if ([self peek] == close) {
+        _pos++;
+        _depth--;
+        return NO;
+    }
+    if (_started[_depth - 1] && ![self expect:',']) {
+        return NO;
+    }
+    _started[_depth - 1] = YES;
+    return YES;
+}
+
+- (BOOL)enterMap {
+    return [self enterContainer:'{'];
+}
+
+- (BOOL)nextKey:(NSString **)key {
+    if (![self nextInContainer:'}']) {
+        return NO;
+    }
+    *key = [self readString];
+    return !_failed && [self expect:':'];
+}
+
+- (BOOL)enterArray {
+    return [self enterContainer:'['];
+}
+
+- (BOOL)nextItem {
+    return [self nextInContainer:']'];
+}
+
+- (BOOL)skipString {
+    _pos++; // Opening quote.
+    while (_pos < _length) {
+        uint8_t b = _bytes[_pos++];
+        if (b == '\\') {
+            _pos++;
+        }
+        else if (b == '"') {
+            return YES;
+        }
+    }
+    _failed = YES;
+    return NO;
+}
+
+- (BOOL)skipValue {
+    uint8_t b = [self peek];
+    if (b == '"') {
+        return [self skipString];
+    }
+    if (b == '{' || b == '[') {
+        // Skip nested containers by tracking the nesting depth; strings are skipped separately
+        // so that any brackets within them are ignored.
+        NSInteger depth = 0;
+        while (_pos < _length) {
+            b = _bytes[_pos];
+            if (b == '"') {
+                if (![self skipString]) {
+                    return NO;
+                }
+                continue;
+            }
+            _pos++;
+            if (b == '{' || b == '[') {
+                depth++;
+            }
+            else if (b == '}' || b == ']') {
+                if (--depth == 0) {
+                    return YES;
+                }
+            }
+        }
+        _failed = YES;
+        return NO;
+    }
+    // Skip a number or literal.
+    NSUInteger start = _pos;
+    while (_pos < _length) {
+        b = _bytes[_pos];
+        if (b == ',' || b == '}' || b == ']' || b == ' ' || b == '\n' || b == '\r' || b == '\t') {
+            break;
+        }
+        _pos++;
+    }
+    if (_pos == start) {
+        _failed = YES;
+    }
+    return !_failed;
+}
+
+- (unichar)readHex4 {
+    if (_pos + 4 > _length) {
+        _failed = YES;
+        return 0;
+    }
+    unichar value = 0;
+    for (NSInteger i = 0; i < 4; i++) {
+        uint8_t b = _bytes[_pos++];
+        value <<= 4;
+        if (b >= '0' && b <= '9')      value |= (b - '0');
+        else if (b >= 'a' && b <= 'f') value |= (b - 'a' + 10);
+        else if (b >= 'A' && b <= 'F') value |= (b - 'A' + 10);
+        else {
+            _failed = YES;
+            return 0;
+        }
+    }
+    return value;
+}
+
+- (NSString *)readString {
+    if (![self expect:'"']) {
+        return nil;
+    }
+    // Fast path: strings without escapes are decoded directly from the feed bytes.
+    NSUInteger start = _pos;
+    while (_pos < _length && _bytes[_pos] != '"' && _bytes[_pos] != '\\') {
+        _pos++;
+    }
+    if (_pos >= _length) {
+        _failed = YES;
+        return nil;
+    }
+    if (_bytes[_pos] == '"') {
+        NSString *string = [[NSString alloc] initWithBytes:&_bytes[start] length:(_pos - start) encoding:NSUTF8StringEncoding];
+        _pos++;
+        return string ? string : @"";
+    }
+    // Slow path: unescape the string.
+    NSMutableString *string = [[NSMutableString alloc] initWithBytes:&_bytes[start] length:(_pos - start) encoding:NSUTF8StringEncoding];
+    while (_pos < _length) {
+        uint8_t b = _bytes[_pos];
+        if (b == '"') {
+            _pos++;
+            return string;
+        }
+        if (b == '\\') {
+            if (_pos + 1 >= _length) {
+                break;
+            }
+            uint8_t e = _bytes[_pos + 1];
+            _pos += 2;
+            unichar c;
+            switch (e) {
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case 'u': c = [self readHex4]; break;
+                default:  c = e;
+            }
+            if (_failed) {
+                return nil;
+            }
+            // Note that surrogate pairs are appended as two separate UTF-16 units.
+            [string appendString:[NSString stringWithCharacters:&c length:1]];
+        }
+        else {
+            // Copy the run of unescaped bytes.
+            NSUInteger runStart = _pos;
+            while (_pos < _length && _bytes[_pos] != '"' && _bytes[_pos] != '\\') {
+                _pos++;
+            }
+            NSString *run = [[NSString alloc] initWithBytes:&_bytes[runStart] length:(_pos - runStart) encoding:NSUTF8StringEncoding];
+            if (run) {
+                [string appendString:run];
+            }
+        }
+    }
+    _failed = YES;
+    return nil;
+}
+
+- (id)readNumber {
+    NSUInteger start = _pos;
+    BOOL isFloat = NO;
+    while (_pos < _length) {
+        uint8_t b = _bytes[_pos];
+        if ((b >= '0' && b <= '9') || b == '-' || b == '+') {
+            _pos++;
+        }
+        else if (b == '.' || b == 'e' || b == 'E') {
+            isFloat = YES;
+            _pos++;
+        }
+        else {
+            break;
+        }
+    }
+    if (_pos == start) {
+        _failed = YES;
+        return nil;
+    }
+    char buffer[64];
+    NSUInteger length = MIN(_pos - start, sizeof(buffer) - 1);
+    memcpy(buffer, &_bytes[start], length);
+    buffer[length] = '\0';
+    if (isFloat) {
+        return [NSNumber numberWithDouble:strtod(buffer, NULL)];
+    }
+    return [NSNumber numberWithLongLong:strtoll(buffer, NULL, 10)];
+}
+
+- (BOOL)readLiteral:(const char *)literal {
+    NSUInteger length = strlen(literal);
+    if (_pos + length <= _length && memcmp(&_bytes[_pos], literal, length) == 0) {
+        _pos += length;
+        return YES;
+    }
+    _failed = YES;
+    return NO;
+}
+
+- (id)readValue {
+    uint8_t b = [self peek];
+    switch (b) {
+        case '"':
+            return [self readString];
+        case '{': {
+            if (![self enterMap]) {
+                return nil;
+            }
+            NSMutableDictionary *map = [NSMutableDictionary new];
+            NSString *key;
+            while ([self nextKey:&key]) {
+                id value = [self readValue];
+                if (_failed) {
+                    return nil;
+                }
+                map[key] = value;
+            }
+            return _failed ? nil : map;
+        }
+        case '[': {
+            if (![self enterArray]) {
+                return nil;
+            }
+            NSMutableArray *array = [NSMutableArray new];
+            while ([self nextItem]) {
+                id value = [self readValue];
+                if (_failed) {
+                    return nil;
+                }
+                [array addObject:value];
+            }
+            return _failed ? nil : array;
+        }
+        case 't':
+            return [self readLiteral:"true"] ? @YES : nil;
+        case 'f':
+            return [self readLiteral:"false"] ? @NO : nil;
+        case 'n':
+            return [self readLiteral:"null"] ? [NSNull null] : nil;
+    }
+    return [self readNumber];
+}
+
+@end
+
+#pragma mark - LOCMSUpdatesFeedReader
+
+@interface LOCMSUpdatesFeedReader () {
+    NSData *_data;
+    NSString *_mimeType;
+}
+
+/// Make a decoder for the feed data.
+- (id<LOFeedDecoder>)makeDecoder;
+/// Make a decode error.
+- (NSError *)makeError:(NSString *)description;
+
+@end
+
+@implementation LOCMSUpdatesFeedReader
+
+- (id)initWithData:(NSData *)data mimeType:(NSString *)mimeType {
+    self = [super init];
+    if (self) {
+        _data = data;
+        _mimeType = mimeType;
+        // A plain string in place of the updates document indicates a server error.
+        id<LOFeedDecoder> decoder = [self makeDecoder];
+        if ([decoder atString]) {
+            _errorMessage = [decoder readValue];
+        }
+    }
+    return self;
+}
+
+- (BOOL)readRows:(LOCMSUpdatesFeedRowBlock)block error:(NSError **)error {
+    if (_errorMessage) {
+        return NO;
+    }
+    id<LOFeedDecoder> decoder = [self makeDecoder];
+    if (![decoder atMap] || ![decoder enterMap]) {
+        if (error) {
+            *error = [self makeError:@"Updates feed isn't an object"];
+        }
+        return NO;
+    }
+    NSString *key;
+    while ([decoder nextKey:&key]) {
+        // Anything other than the 'db' property is skipped; note that a 'db' value which isn't
+        // an object (e.g. 0) indicates that there are no updates.
+        if (![@"db" isEqualToString:key] || ![decoder atMap]) {
+            [decoder skipValue];
+            continue;
+        }
+        [decoder enterMap];
+        NSString *table;
+        while ([decoder nextKey:&table]) {
+            if (![decoder atArray]) {
+                [decoder skipValue];
+                continue;
+            }
+            [decoder enterArray];
+            while ([decoder nextItem]) {
+                @autoreleasepool {
+                    id row = [decoder readValue];
+                    if ([row isKindOfClass:[NSDictionary class]]) {
+                        block(table, (NSDictionary *)row);
+                    }
+                }
+            }
+        }
+    }
+    if (decoder.failed) {
+        if (error) {
+            *error = [self makeError:@"Invalid updates feed data"];
+        }
+        return NO;
+    }
+    return YES;
+}
+
+#pragma mark - Private
+
+- (id<LOFeedDecoder>)makeDecoder {
+    if ([_mimeType rangeOfString:@"msgpack"].location != NSNotFound) {
+        return [[LOMsgPackFeedDecoder alloc] initWithData:_data];
+    }
+    if ([_mimeType rangeOfString:@"json"].location != NSNotFound) {
+        return [[LOJSONFeedDecoder alloc] initWithData:_data];
+    }
+    // Unrecognized MIME type: JSON documents start with an object or string (possibly after
+    // whitespace); anything else is assumed to be msgpack.
+    const uint8_t *bytes = (const uint8_t *)[_data bytes];
+    for (NSUInteger i = 0; i < [_data length]; i++) {
+        uint8_t b = bytes[i];
+        if (b == '{' || b == '"') {
+            return [[LOJSONFeedDecoder alloc] initWithData:_data];
+        }
+        if (!(b == ' ' || b == '\n' || b == '\r' || b == '\t')) {
+            break;
+        }
+    }
+    return [[LOMsgPackFeedDecoder alloc] initWithData:_data];
+}
+
+- (NSError *)makeError:(NSString *)description {
+    return [NSError errorWithDomain:ReaderErrorDomain
+                               code:0
+                           userInfo:@{ NSLocalizedDescriptionKey: description }];
+}
+
+@end
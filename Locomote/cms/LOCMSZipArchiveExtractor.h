@@ -0,0 +1,44 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "LOCMSZipStreamExtractor.h"
+
+/**
+ * An extractor for complete zip archive files which extracts entries in parallel.
+ * The archive's central directory is read first, and all directories needed by the archive's
+ * entries are created up front. Entries are then shared between a bounded pool of workers, each
+ * of which reads an entry's compressed data with a single read, inflates it, verifies its CRC
+ * and writes the file with a single write (entries larger than the worker buffer size are
+ * written in chunks).
+ * Errors are reported using the LOCMSZipStreamErrorDomain error domain and codes.
+ */
+@interface LOCMSZipArchiveExtractor : NSObject
+
+- (id)initWithArchivePath:(NSString *)archivePath;
+
+/// The path of the zip archive.
+@property (nonatomic, strong, readonly) NSString *archivePath;
+/// The maximum number of entries extracted concurrently. Defaults to the number of active processors.
+@property (nonatomic, assign) NSUInteger maxConcurrency;
+/// The number of entries extracted by the last extraction.
+@property (nonatomic, assign, readonly) NSUInteger entryCount;
+/// The total uncompressed size of the entries extracted by the last extraction, in bytes.
+@property (nonatomic, assign, readonly) unsigned long long extractedSize;
+
+/// Extract all entries in the archive to a directory.
+- (BOOL)extractToPath:(NSString *)destinationPath error:(NSError **)error;
+
+@end
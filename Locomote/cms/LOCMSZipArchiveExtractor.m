@@ -0,0 +1,467 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LOCMSZipArchiveExtractor.h"
+#import <fcntl.h>
+#import <stdatomic.h>
+#import <sys/stat.h>
+#import <unistd.h>
+#import <zlib.h>
+
+// Zip record signatures.
+#define CentralDirectorySignature   (0x02014b50)
+#define EndOfCentralDirSignature    (0x06054b50)
+#define LocalFileHeaderSignature    (0x04034b50)
+// Record sizes, excluding variable length fields.
+#define CentralDirectoryHeaderSize  (46)
+#define EndOfCentralDirSize         (22)
+#define LocalFileHeaderSize         (30)
+// The maximum length of the archive comment following the end of central directory record.
+#define MaxCommentLength            (0xFFFF)
+// Flags and compression methods.
+#define FlagEncrypted               (1 << 0)
+#define MethodStored                (0)
+#define MethodDeflated              (8)
+// The largest output buffer used by a worker; larger entries are inflated and written in chunks.
+#define MaxOutputBufferSize         (4 * 1024 * 1024)
+// The largest input buffer used by a worker; larger entries are read in chunks.
+#define MaxInputBufferSize          (256 * 1024)
+
+/// A central directory entry.
+typedef struct {
+    uint32_t method;
+    uint32_t crc;
+    uint32_t compressedSize;
+    uint32_t uncompressedSize;
+    uint32_t localHeaderOffset;
+    BOOL isDirectory;
+} LOCMSZipEntry;
+
+/// Per-worker buffers and inflate state, reused between entries.
+typedef struct {
+    uint8_t *input;
+    size_t inputSize;
+    uint8_t *output;
+    size_t outputSize;
+    z_stream zstream;
+    BOOL zstreamReady;
+} LOCMSZipWorker;
+
+/// Read a little-endian 16 bit value.
+static inline uint32_t ReadUInt16(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+}
+
+/// Read a little-endian 32 bit value.
+static inline uint32_t ReadUInt32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/// Read exactly length bytes from a file at an offset.
+static BOOL ReadFully(int fd, void *buffer, size_t length, off_t offset) {
+    uint8_t *p = buffer;
+    while (length > 0) {
+        ssize_t n = pread(fd, p, length, offset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return NO;
+        }
+        p += n;
+        length -= n;
+        offset += n;
+    }
+    return YES;
+}
+
+/// Write exactly length bytes to a file.
+static BOOL WriteFully(int fd, const void *buffer, size_t length) {
+    const uint8_t *p = buffer;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return NO;
+        }
+        p += n;
+        length -= n;
+    }
+    return YES;
+}
+
+/// Ensure that a worker buffer has at least the specified capacity.
+static BOOL EnsureCapacity(uint8_t **buffer, size_t *size, size_t capacity) {
+    if (*size >= capacity) {
+        return YES;
+    }
+    uint8_t *resized = realloc(*buffer, capacity);
+    if (!resized) {
+        return NO;
+    }
+    *buffer = resized;
+    *size = capacity;
+    return YES;
+}
+
+@interface LOCMSZipArchiveExtractor ()
+
+/// Read the archive's central directory. Returns the entry names, with entry details written to entries.
+- (NSArray<NSString *> *)readCentralDirectory:(int)fd entries:(NSMutableData *)entries error:(NSError **)error;
+/// Extract a single entry.
+- (BOOL)extractEntry:(const LOCMSZipEntry *)entry
+              toPath:(NSString *)path
+         fromArchive:(int)fd
+              worker:(LOCMSZipWorker *)worker
+               error:(NSError **)error;
+
+@end
+
+@implementation LOCMSZipArchiveExtractor
+
+- (id)initWithArchivePath:(NSString *)archivePath {
+    self = [super init];
+    if (self) {
+        _archivePath = archivePath;
+        _maxConcurrency = [[NSProcessInfo processInfo] activeProcessorCount];
+    }
+    return self;
+}
+
+- (BOOL)extractToPath:(NSString *)destinationPath error:(NSError **)error {
+    _entryCount = 0;
+    _extractedSize = 0;
+    int fd = open([_archivePath fileSystemRepresentation], O_RDONLY);
+    if (fd < 0) {
+        if (error) {
+            *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        }
+        return NO;
+    }
+    NSMutableData *entryData = [NSMutableData new];
+    NSArray<NSString *> *names = [self readCentralDirectory:fd entries:entryData error:error];
+    if (!names) {
+        close(fd);
+        return NO;
+    }
+    const LOCMSZipEntry *entries = [entryData bytes];
+    NSUInteger count = [names count];
+
+    // Create all directories up front, so that workers only need to create files.
+    NSMutableSet *dirs = [NSMutableSet new];
+    for (NSUInteger i = 0; i < count; i++) {
+        NSString *name = names[i];
+        NSString *dir = entries[i].isDirectory ? name : [name stringByDeletingLastPathComponent];
+        if ([dir length] > 0) {
+            [dirs addObject:dir];
+        }
+    }
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    [fileManager createDirectoryAtPath:destinationPath withIntermediateDirectories:YES attributes:nil error:nil];
+    // Sort so that parent directories are created before their children.
+    for (NSString *dir in [[dirs allObjects] sortedArrayUsingSelector:@selector(compare:)]) {
+        NSString *path = [destinationPath stringByAppendingPathComponent:dir];
+        [fileManager createDirectoryAtPath:path withIntermediateDirectories:YES attributes:nil error:nil];
+    }
+
+    // Share entries between workers; each worker takes the next unextracted entry until none remain.
+    NSUInteger workerCount = MAX(1, MIN(_maxConcurrency, count));
+    LOCMSZipWorker *workers = calloc(workerCount, sizeof(LOCMSZipWorker));
+    atomic_llong nextEntry = 0;
+    atomic_int failedCount = 0;
+    atomic_llong *next = &nextEntry;
+    atomic_int *failed = &failedCount;
+    __block NSError *firstError = nil;
+    NSObject *errorLock = [NSObject new];
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    // dispatch_apply blocks until all workers have finished.
+    dispatch_apply(workerCount, queue, ^(size_t w) {
+        LOCMSZipWorker *worker = &workers[w];
+        while (atomic_load(failed) == 0) {
+            long long i = atomic_fetch_add(next, 1);
+            if (i >= (long long)count) {
+                break;
+            }
+            if (entries[i].isDirectory) {
+                continue;
+            }
+            @autoreleasepool {
+                NSError *entryError = nil;
+                NSString *path = [destinationPath stringByAppendingPathComponent:names[i]];
+                if (![self extractEntry:&entries[i] toPath:path fromArchive:fd worker:worker error:&entryError]) {
+                    @synchronized (errorLock) {
+                        if (!firstError) {
+                            firstError = entryError;
+                        }
+                    }
+                    atomic_fetch_add(failed, 1);
+                }
+            }
+        }
+    });
+    for (NSUInteger w = 0; w < workerCount; w++) {
+        free(workers[w].input);
+        free(workers[w].output);
+        if (workers[w].zstreamReady) {
+            inflateEnd(&workers[w].zstream);
+        }
+    }
+    free(workers);
+    close(fd);
+
+    if (atomic_load(failed) > 0) {
+        if (error) {
+            *error = firstError;
+        }
+        return NO;
+    }
+    for (NSUInteger i = 0; i < count; i++) {
+        _extractedSize += entries[i].uncompressedSize;
+    }
+    _entryCount = count;
+    return YES;
+}
+
+#pragma mark - Private
+
+- (NSArray<NSString *> *)readCentralDirectory:(int)fd entries:(NSMutableData *)entries error:(NSError **)error {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < EndOfCentralDirSize) {
+        if (error) {
+            *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:@"Invalid zip archive"];
+        }
+        return nil;
+    }
+    // Find the end of central directory record by scanning back from the end of the file.
+    off_t tailSize = MIN(st.st_size, (off_t)(EndOfCentralDirSize + MaxCommentLength));
+    NSMutableData *tail = [NSMutableData dataWithLength:(NSUInteger)tailSize];
+    if (!ReadFully(fd, [tail mutableBytes], (size_t)tailSize, st.st_size - tailSize)) {
+        if (error) {
+            *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:@"Unable to read zip archive"];
+        }
+        return nil;
+    }
+    const uint8_t *t = [tail bytes];
+    const uint8_t *eocd = NULL;
+    for (off_t i = tailSize - EndOfCentralDirSize; i >= 0; i--) {
+        if (ReadUInt32(t + i) == EndOfCentralDirSignature) {
+            eocd = t + i;
+            break;
+        }
+    }
+    if (!eocd) {
+        if (error) {
+            *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:@"Zip end of central directory not found"];
+        }
+        return nil;
+    }
+    uint32_t entryCount = ReadUInt16(eocd + 10);
+    uint32_t dirSize    = ReadUInt32(eocd + 12);
+    uint32_t dirOffset  = ReadUInt32(eocd + 16);
+    if (entryCount == 0xFFFF || dirSize == 0xFFFFFFFF || dirOffset == 0xFFFFFFFF) {
+        if (error) {
+            *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorUnsupported description:@"Zip64 archives aren't supported"];
+        }
+        return nil;
+    }
+    if ((off_t)dirOffset + dirSize > st.st_size) {
+        if (error) {
+            *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:@"Invalid zip central directory"];
+        }
+        return nil;
+    }
+    NSMutableData *dir = [NSMutableData dataWithLength:dirSize];
+    if (!ReadFully(fd, [dir mutableBytes], dirSize, dirOffset)) {
+        if (error) {
+            *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:@"Unable to read zip central directory"];
+        }
+        return nil;
+    }
+    NSMutableArray *names = [NSMutableArray arrayWithCapacity:entryCount];
+    [entries setLength:entryCount * sizeof(LOCMSZipEntry)];
+    LOCMSZipEntry *entry = [entries mutableBytes];
+    const uint8_t *p = [dir bytes], *end = p + dirSize;
+    for (uint32_t i = 0; i < entryCount; i++, entry++) {
+        if (p + CentralDirectoryHeaderSize > end || ReadUInt32(p) != CentralDirectorySignature) {
+            if (error) {
+                *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:@"Invalid zip central directory entry"];
+            }
+            return nil;
+        }
+        uint32_t flags         = ReadUInt16(p + 8);
+        entry->method          = ReadUInt16(p + 10);
+        entry->crc             = ReadUInt32(p + 16);
+        entry->compressedSize  = ReadUInt32(p + 20);
+        entry->uncompressedSize = ReadUInt32(p + 24);
+        uint32_t nameLength    = ReadUInt16(p + 28);
+        uint32_t extraLength   = ReadUInt16(p + 30);
+        uint32_t commentLength = ReadUInt16(p + 32);
+        entry->localHeaderOffset = ReadUInt32(p + 42);
+        if (p + CentralDirectoryHeaderSize + nameLength > end) {
+            if (error) {
+                *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:@"Invalid zip central directory entry"];
+            }
+            return nil;
+        }
+        NSString *name = [[NSString alloc] initWithBytes:p + CentralDirectoryHeaderSize
+                                                  length:nameLength
+                                                encoding:NSUTF8StringEncoding];
+        NSString *unsupported = nil;
+        if (flags & FlagEncrypted) {
+            unsupported = @"Encrypted zip entries aren't supported";
+        }
+        else if (entry->method != MethodStored && entry->method != MethodDeflated) {
+            unsupported = @"Unsupported zip compression method";
+        }
+        else if (entry->compressedSize == 0xFFFFFFFF || entry->uncompressedSize == 0xFFFFFFFF) {
+            unsupported = @"Zip64 archives aren't supported";
+        }
+        if (unsupported) {
+            if (error) {
+                *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorUnsupported description:unsupported];
+            }
+            return nil;
+        }
+        // Reject names which would extract outside of the destination directory.
+        if (!name || [name hasPrefix:@"/"] || [[name pathComponents] containsObject:@".."]) {
+            if (error) {
+                *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:@"Invalid zip entry name"];
+            }
+            return nil;
+        }
+        entry->isDirectory = [name hasSuffix:@"/"];
+        [names addObject:name];
+        p += CentralDirectoryHeaderSize + nameLength + extraLength + commentLength;
+    }
+    return names;
+}
+
+- (BOOL)extractEntry:(const LOCMSZipEntry *)entry
+              toPath:(NSString *)path
+         fromArchive:(int)fd
+              worker:(LOCMSZipWorker *)worker
+               error:(NSError **)error {
+    // The local header's extra field may differ from the central directory's, so read the local
+    // header to find the start of the entry data.
+    uint8_t header[LocalFileHeaderSize];
+    if (!ReadFully(fd, header, LocalFileHeaderSize, entry->localHeaderOffset)
+        || ReadUInt32(header) != LocalFileHeaderSignature) {
+        *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:@"Invalid zip local file header"];
+        return NO;
+    }
+    off_t offset = (off_t)entry->localHeaderOffset + LocalFileHeaderSize
+                 + ReadUInt16(header + 26) + ReadUInt16(header + 28);
+    // Entry data is read in chunks through a fixed size input buffer, so memory use doesn't grow
+    // with the size of the entry.
+    size_t remaining = entry->compressedSize;
+    size_t inputSize = MAX(1, MIN(remaining, (size_t)MaxInputBufferSize));
+    if (!EnsureCapacity(&worker->input, &worker->inputSize, inputSize)) {
+        *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:@"Unable to read zip entry data"];
+        return NO;
+    }
+    int out = open([path fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        NSString *description = [NSString stringWithFormat:@"Unable to write %@", [path lastPathComponent]];
+        *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorWrite description:description];
+        return NO;
+    }
+    BOOL ok = YES;
+    BOOL readOK = YES;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    if (entry->method == MethodStored) {
+        while (ok && remaining > 0) {
+            size_t length = MIN(remaining, inputSize);
+            if (!ReadFully(fd, worker->input, length, offset)) {
+                readOK = NO;
+                break;
+            }
+            crc = crc32(crc, worker->input, (uInt)length);
+            ok = WriteFully(out, worker->input, length);
+            remaining -= length;
+            offset += length;
+        }
+    }
+    else {
+        // Inflate into a buffer large enough for the whole entry, up to the maximum buffer size.
+        size_t outputSize = MAX(1, MIN((size_t)entry->uncompressedSize, (size_t)MaxOutputBufferSize));
+        ok = EnsureCapacity(&worker->output, &worker->outputSize, outputSize);
+        z_stream *zs = &worker->zstream;
+        if (ok && !worker->zstreamReady) {
+            memset(zs, 0, sizeof(z_stream));
+            ok = worker->zstreamReady = (inflateInit2(zs, -MAX_WBITS) == Z_OK);
+        }
+        else if (ok) {
+            inflateReset(zs);
+        }
+        int result = Z_OK;
+        if (ok) {
+            zs->next_in = worker->input;
+            zs->avail_in = 0;
+            while (ok && result != Z_STREAM_END) {
+                if (zs->avail_in == 0) {
+                    if (remaining == 0) {
+                        // The entry data ended before the end of the compressed stream.
+                        break;
+                    }
+                    size_t length = MIN(remaining, inputSize);
+                    if (!ReadFully(fd, worker->input, length, offset)) {
+                        readOK = NO;
+                        break;
+                    }
+                    zs->next_in = worker->input;
+                    zs->avail_in = (uInt)length;
+                    remaining -= length;
+                    offset += length;
+                }
+                zs->next_out = worker->output;
+                zs->avail_out = (uInt)outputSize;
+                result = inflate(zs, Z_NO_FLUSH);
+                if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+                    break;
+                }
+                size_t length = outputSize - zs->avail_out;
+                crc = crc32(crc, worker->output, (uInt)length);
+                ok = WriteFully(out, worker->output, length);
+            }
+        }
+        if (ok && readOK && result != Z_STREAM_END) {
+            close(out);
+            NSString *description = [NSString stringWithFormat:@"Invalid compressed data in %@", [path lastPathComponent]];
+            *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:description];
+            return NO;
+        }
+    }
+    if (!readOK) {
+        close(out);
+        *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:@"Unable to read zip entry data"];
+        return NO;
+    }
+    close(out);
+    if (!ok) {
+        NSString *description = [NSString stringWithFormat:@"Unable to write %@", [path lastPathComponent]];
+        *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorWrite description:description];
+        return NO;
+    }
+    if ((uint32_t)crc != entry->crc) {
+        NSString *description = [NSString stringWithFormat:@"CRC check failed for %@", [path lastPathComponent]];
+        *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:description];
+        return NO;
+    }
+    return YES;
+}
+
+@end
@@ -0,0 +1,66 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+/// The error domain of zip stream extraction errors.
+extern NSString * const LOCMSZipStreamErrorDomain;
+
+/// Zip stream extraction error codes.
+typedef NS_ENUM(NSInteger, LOCMSZipStreamError) {
+    /// The archive uses a feature which can't be extracted as a stream; e.g. encryption, stored
+    /// entries without sizes in the local header, or an unrecognised data descriptor.
+    LOCMSZipStreamErrorUnsupported = 1,
+    /// The archive data is invalid, or an entry failed its CRC check.
+    LOCMSZipStreamErrorInvalid,
+    /// An extracted file couldn't be written.
+    LOCMSZipStreamErrorWrite
+};
+
+/**
+ * An extractor which decodes a zip archive as a stream, as its data is received.
+ * Entries are extracted using the local file headers which precede each entry's data, so that
+ * files can be written without first receiving the whole archive; extraction completes once the
+ * archive's central directory is reached. Each entry's CRC is checked as it's extracted.
+ * The extractor tracks the archive offset of the end of the last fully extracted entry, and an
+ * interrupted extraction can be continued by a new extractor starting at that offset.
+ */
+@interface LOCMSZipStreamExtractor : NSObject
+
+/**
+ * Initialize an extractor.
+ * @param path      The directory to extract files to.
+ * @param offset    The archive offset of the first data to be appended; must be an entry boundary.
+ */
+- (id)initWithDestinationPath:(NSString *)path offset:(long long)offset;
+
+/// The directory files are extracted to.
+@property (nonatomic, strong, readonly) NSString *destinationPath;
+/// The archive offset of the end of the last fully extracted entry.
+@property (nonatomic, assign, readonly) long long boundaryOffset;
+/// The number of entries extracted.
+@property (nonatomic, assign, readonly) NSUInteger entryCount;
+/// A flag indicating that all entries have been extracted.
+@property (nonatomic, assign, readonly) BOOL complete;
+
+/// Append archive data to the stream, and extract any entries it completes.
+- (BOOL)appendData:(NSData *)data error:(NSError **)error;
+/// Finish the stream. Returns NO if the archive is incomplete.
+- (BOOL)finish:(NSError **)error;
+
+/// Make a zip extraction error in the zip stream error domain.
++ (NSError *)errorWithCode:(LOCMSZipStreamError)code description:(NSString *)description;
+
+@end
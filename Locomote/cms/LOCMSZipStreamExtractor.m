@@ -0,0 +1,478 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LOCMSZipStreamExtractor.h"
+#import <zlib.h>
+
+// Zip record signatures.
+#define LocalFileHeaderSignature    (0x04034b50)
+#define DataDescriptorSignature     (0x08074b50)
+#define CentralDirectorySignature   (0x02014b50)
+#define EndOfCentralDirSignature    (0x06054b50)
+// Size of a local file header, excluding the file name and extra field.
+#define LocalFileHeaderSize         (30)
+// Local file header flags.
+#define FlagEncrypted               (1 << 0)
+#define FlagDataDescriptor          (1 << 3)
+// Compression methods.
+#define MethodStored                (0)
+#define MethodDeflated              (8)
+// The header ID of the zip64 extended information extra field.
+#define Zip64ExtraFieldID           (0x0001)
+// The value of a 32 bit size field whose value is in the zip64 extra field.
+#define Zip64SizeMarker             (0xFFFFFFFF)
+// Data descriptor sizes, excluding the optional signature.
+#define DataDescriptorSize          (12)
+#define Zip64DataDescriptorSize     (20)
+// The size of the buffer used to receive inflated data.
+#define InflateBufferSize           (64 * 1024)
+
+NSString * const LOCMSZipStreamErrorDomain = @"LOCMSZipStreamExtractor";
+
+/// Extractor states.
+typedef NS_ENUM(NSInteger, LOCMSZipStreamState) {
+    /// Expecting a local file header, or the central directory.
+    LOCMSZipStreamHeader,
+    /// Extracting an entry's data.
+    LOCMSZipStreamEntryData,
+    /// Expecting an entry's data descriptor.
+    LOCMSZipStreamDescriptor,
+    /// Central directory reached.
+    LOCMSZipStreamDone
+};
+
+/// Read a little-endian 16 bit value.
+static inline uint32_t ReadUInt16(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+}
+
+/// Read a little-endian 32 bit value.
+static inline uint32_t ReadUInt32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/// Read a little-endian 64 bit value.
+static inline uint64_t ReadUInt64(const uint8_t *p) {
+    return (uint64_t)ReadUInt32(p) | ((uint64_t)ReadUInt32(p + 4) << 32);
+}
+
+/// Find a field in a zip extra field block. Returns NULL if not found; otherwise returns the field data.
+static const uint8_t *FindExtraField(const uint8_t *extra, uint32_t extraLength, uint32_t headerID, uint32_t *dataLength) {
+    const uint8_t *end = extra + extraLength;
+    while (extra + 4 <= end) {
+        uint32_t fieldID     = ReadUInt16(extra);
+        uint32_t fieldLength = ReadUInt16(extra + 2);
+        if (extra + 4 + fieldLength > end) {
+            break;
+        }
+        if (fieldID == headerID) {
+            *dataLength = fieldLength;
+            return extra + 4;
+        }
+        extra += 4 + fieldLength;
+    }
+    return NULL;
+}
+
+@interface LOCMSZipStreamExtractor () {
+    /// Received data not yet consumed.
+    NSMutableData *_buffer;
+    /// The position of the first unconsumed byte in the buffer.
+    NSUInteger _position;
+    /// The archive offset of the start of the buffer.
+    long long _bufferOffset;
+    LOCMSZipStreamState _state;
+    /// The current entry's file name.
+    NSString *_entryName;
+    /// The current entry's flags and compression method.
+    uint32_t _entryFlags;
+    uint32_t _entryMethod;
+    /// The CRC of the current entry, as stated in its local header.
+    uint32_t _entryCRC;
+    /// Flag indicating that the current entry has a zip64 extra field, and so a zip64 data descriptor.
+    BOOL _entryZip64;
+    /// The CRC of the current entry's extracted data.
+    uLong _crc;
+    /// The number of compressed bytes remaining in the current entry; -1 if unknown.
+    long long _remaining;
+    /// The file the current entry is being written to; NULL for directory entries.
+    FILE *_file;
+    /// Inflate state of the current entry.
+    z_stream _zstream;
+    BOOL _inflating;
+    /// A buffer for receiving inflated data.
+    uint8_t *_inflateBuffer;
+}
+
+/// Parse a local file header. Returns NO on error; sets needsData if more data is needed.
+- (BOOL)readHeader:(BOOL *)needsData error:(NSError **)error;
+/// Extract entry data from the buffer. Returns NO on error; sets needsData if more data is needed.
+- (BOOL)readEntryData:(BOOL *)needsData error:(NSError **)error;
+/// Read an entry's data descriptor. Returns NO on error; sets needsData if more data is needed.
+- (BOOL)readDescriptor:(BOOL *)needsData error:(NSError **)error;
+/// Complete the current entry, checking its CRC against the expected value.
+- (BOOL)finishEntryWithCRC:(uint32_t)crc error:(NSError **)error;
+/// Write extracted data to the current entry's file.
+- (BOOL)writeBytes:(const uint8_t *)bytes length:(size_t)length error:(NSError **)error;
+/// Close the current entry's file and release any inflate state.
+- (void)closeEntry;
+
+@end
+
+@implementation LOCMSZipStreamExtractor
+
+- (id)initWithDestinationPath:(NSString *)path offset:(long long)offset {
+    self = [super init];
+    if (self) {
+        _destinationPath = path;
+        _boundaryOffset = offset;
+        _bufferOffset = offset;
+        _buffer = [NSMutableData new];
+        _state = LOCMSZipStreamHeader;
+        _inflateBuffer = malloc(InflateBufferSize);
+    }
+    return self;
+}
+
+- (BOOL)appendData:(NSData *)data error:(NSError **)error {
+    if (_state == LOCMSZipStreamDone) {
+        // Ignore the central directory and any data following it.
+        return YES;
+    }
+    [_buffer appendData:data];
+    BOOL needsData = NO, ok = YES;
+    while (ok && !needsData && _state != LOCMSZipStreamDone) {
+        switch (_state) {
+            case LOCMSZipStreamHeader:
+                ok = [self readHeader:&needsData error:error];
+                break;
+            case LOCMSZipStreamEntryData:
+                ok = [self readEntryData:&needsData error:error];
+                break;
+            case LOCMSZipStreamDescriptor:
+                ok = [self readDescriptor:&needsData error:error];
+                break;
+            default:
+                break;
+        }
+    }
+    // Discard consumed data.
+    if (_position > 0) {
+        [_buffer replaceBytesInRange:NSMakeRange(0, _position) withBytes:NULL length:0];
+        _bufferOffset += _position;
+        _position = 0;
+    }
+    if (!ok) {
+        [self closeEntry];
+    }
+    return ok;
+}
+
+- (BOOL)finish:(NSError **)error {
+    [self closeEntry];
+    if (_state != LOCMSZipStreamDone) {
+        if (error) {
+            *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:@"Incomplete zip archive"];
+        }
+        return NO;
+    }
+    return YES;
+}
+
+- (void)dealloc {
+    [self closeEntry];
+    free(_inflateBuffer);
+}
+
++ (NSError *)errorWithCode:(LOCMSZipStreamError)code description:(NSString *)description {
+    return [NSError errorWithDomain:LOCMSZipStreamErrorDomain
+                               code:code
+                           userInfo:@{ NSLocalizedDescriptionKey: description }];
+}
+
+#pragma mark - Private
+
+- (BOOL)readHeader:(BOOL *)needsData error:(NSError **)error {
+    NSUInteger available = [_buffer length] - _position;
+    const uint8_t *p = (const uint8_t *)[_buffer bytes] + _position;
+    if (available < 4) {
+        *needsData = YES;
+        return YES;
+    }
+    uint32_t signature = ReadUInt32(p);
+    if (signature == CentralDirectorySignature || signature == EndOfCentralDirSignature) {
+        _state = LOCMSZipStreamDone;
+        _complete = YES;
+        return YES;
+    }
+    if (signature != LocalFileHeaderSignature) {
+        if (error) {
+            *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:@"Invalid zip local file header"];
+        }
+        return NO;
+    }
+    if (available < LocalFileHeaderSize) {
+        *needsData = YES;
+        return YES;
+    }
+    uint32_t nameLength  = ReadUInt16(p + 26);
+    uint32_t extraLength = ReadUInt16(p + 28);
+    NSUInteger headerLength = LocalFileHeaderSize + nameLength + extraLength;
+    if (available < headerLength) {
+        *needsData = YES;
+        return YES;
+    }
+    _entryFlags  = ReadUInt16(p + 6);
+    _entryMethod = ReadUInt16(p + 8);
+    _entryCRC    = ReadUInt32(p + 14);
+    uint32_t compressedSize   = ReadUInt32(p + 18);
+    uint32_t uncompressedSize = ReadUInt32(p + 22);
+    // Sizes too large for the local header are read from the zip64 extra field, which also
+    // indicates that the entry's data descriptor has 64 bit sizes.
+    uint32_t zip64Length = 0;
+    const uint8_t *zip64 = FindExtraField(p + LocalFileHeaderSize + nameLength, extraLength, Zip64ExtraFieldID, &zip64Length);
+    _entryZip64 = (zip64 != NULL);
+    long long entrySize = compressedSize;
+    BOOL sizeUnknown = NO;
+    if (compressedSize == Zip64SizeMarker) {
+        // The zip64 field's uncompressed size precedes the compressed size, if present.
+        uint32_t sizeOffset = (uncompressedSize == Zip64SizeMarker) ? 8 : 0;
+        if (zip64 && zip64Length >= sizeOffset + 8) {
+            uint64_t size = ReadUInt64(zip64 + sizeOffset);
+            sizeUnknown = size > (uint64_t)LLONG_MAX;
+            entrySize = (long long)size;
+        }
+        else {
+            sizeUnknown = YES;
+        }
+    }
+    NSString *name = [[NSString alloc] initWithBytes:p + LocalFileHeaderSize
+                                              length:nameLength
+                                            encoding:NSUTF8StringEncoding];
+    BOOL hasDescriptor = (_entryFlags & FlagDataDescriptor) != 0;
+    NSString *unsupported = nil;
+    if (_entryFlags & FlagEncrypted) {
+        unsupported = @"Encrypted zip entries aren't supported";
+    }
+    else if (_entryMethod != MethodStored && _entryMethod != MethodDeflated) {
+        unsupported = @"Unsupported zip compression method";
+    }
+    else if (sizeUnknown && !hasDescriptor) {
+        unsupported = @"Invalid zip64 entry size";
+    }
+    else if (_entryMethod == MethodStored && hasDescriptor) {
+        // The end of the entry data can't be found without the size.
+        unsupported = @"Stored zip entries without sizes aren't supported";
+    }
+    if (unsupported) {
+        if (error) {
+            *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorUnsupported description:unsupported];
+        }
+        return NO;
+    }
+    // Reject names which would extract outside of the destination directory.
+    if (!name || [name hasPrefix:@"/"] || [[name pathComponents] containsObject:@".."]) {
+        if (error) {
+            *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:@"Invalid zip entry name"];
+        }
+        return NO;
+    }
+    _position += headerLength;
+    _entryName = name;
+    _remaining = hasDescriptor ? -1 : entrySize;
+    _crc = crc32(0L, Z_NULL, 0);
+
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSString *path = [_destinationPath stringByAppendingPathComponent:name];
+    if ([name hasSuffix:@"/"]) {
+        // Directory entry.
+        [fileManager createDirectoryAtPath:path withIntermediateDirectories:YES attributes:nil error:nil];
+    }
+    else {
+        [fileManager createDirectoryAtPath:[path stringByDeletingLastPathComponent]
+               withIntermediateDirectories:YES
+                                attributes:nil
+                                     error:nil];
+        _file = fopen([path fileSystemRepresentation], "wb");
+        if (!_file) {
+            if (error) {
+                NSString *description = [NSString stringWithFormat:@"Unable to write %@", name];
+                *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorWrite description:description];
+            }
+            return NO;
+        }
+    }
+    if (_entryMethod == MethodDeflated) {
+        memset(&_zstream, 0, sizeof(_zstream));
+        // Negative window bits indicates raw deflate data, without a zlib header.
+        if (inflateInit2(&_zstream, -MAX_WBITS) != Z_OK) {
+            if (error) {
+                *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:@"Unable to initialize inflate"];
+            }
+            return NO;
+        }
+        _inflating = YES;
+    }
+    _state = LOCMSZipStreamEntryData;
+    return YES;
+}
+
+- (BOOL)readEntryData:(BOOL *)needsData error:(NSError **)error {
+    NSUInteger available = [_buffer length] - _position;
+    const uint8_t *p = (const uint8_t *)[_buffer bytes] + _position;
+    if (_remaining >= 0 && (long long)available > _remaining) {
+        available = (NSUInteger)_remaining;
+    }
+    if (_entryMethod == MethodStored) {
+        if (available > 0 && ![self writeBytes:p length:available error:error]) {
+            return NO;
+        }
+        _position += available;
+        _remaining -= available;
+        if (_remaining > 0) {
+            *needsData = YES;
+            return YES;
+        }
+        return [self finishEntryWithCRC:_entryCRC error:error];
+    }
+    // Deflated data.
+    if (available == 0 && _remaining != 0) {
+        *needsData = YES;
+        return YES;
+    }
+    _zstream.next_in = (Bytef *)p;
+    _zstream.avail_in = (uInt)available;
+    int result = Z_OK;
+    do {
+        _zstream.next_out = _inflateBuffer;
+        _zstream.avail_out = InflateBufferSize;
+        result = inflate(&_zstream, Z_NO_FLUSH);
+        if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+            if (error) {
+                NSString *description = [NSString stringWithFormat:@"Invalid compressed data in %@", _entryName];
+                *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:description];
+            }
+            return NO;
+        }
+        size_t length = InflateBufferSize - _zstream.avail_out;
+        if (length > 0 && ![self writeBytes:_inflateBuffer length:length error:error]) {
+            return NO;
+        }
+    } while (result == Z_OK && _zstream.avail_out == 0);
+    NSUInteger consumed = available - _zstream.avail_in;
+    _position += consumed;
+    if (_remaining >= 0) {
+        _remaining -= consumed;
+    }
+    if (result != Z_STREAM_END) {
+        if (_remaining == 0) {
+            if (error) {
+                NSString *description = [NSString stringWithFormat:@"Truncated compressed data in %@", _entryName];
+                *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:description];
+            }
+            return NO;
+        }
+        *needsData = YES;
+        return YES;
+    }
+    inflateEnd(&_zstream);
+    _inflating = NO;
+    if (_entryFlags & FlagDataDescriptor) {
+        _state = LOCMSZipStreamDescriptor;
+        return YES;
+    }
+    if (_remaining > 0) {
+        // Deflate stream ended before the stated compressed size.
+        if (error) {
+            NSString *description = [NSString stringWithFormat:@"Invalid compressed data in %@", _entryName];
+            *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:description];
+        }
+        return NO;
+    }
+    return [self finishEntryWithCRC:_entryCRC error:error];
+}
+
+- (BOOL)readDescriptor:(BOOL *)needsData error:(NSError **)error {
+    NSUInteger available = [_buffer length] - _position;
+    const uint8_t *p = (const uint8_t *)[_buffer bytes] + _position;
+    // The descriptor signature is optional.
+    if (available < 4) {
+        *needsData = YES;
+        return YES;
+    }
+    BOOL hasSignature = ReadUInt32(p) == DataDescriptorSignature;
+    NSUInteger length = (hasSignature ? 4 : 0) + (_entryZip64 ? Zip64DataDescriptorSize : DataDescriptorSize);
+    // Read the signature of the following record too, to check the descriptor's length; some
+    // writers use a zip64 descriptor without a zip64 extra field.
+    if (available < length + 4) {
+        *needsData = YES;
+        return YES;
+    }
+    uint32_t next = ReadUInt32(p + length);
+    if (next != LocalFileHeaderSignature && next != CentralDirectorySignature) {
+        if (error) {
+            *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorUnsupported description:@"Unsupported zip data descriptor"];
+        }
+        return NO;
+    }
+    uint32_t crc = ReadUInt32(hasSignature ? p + 4 : p);
+    _position += length;
+    return [self finishEntryWithCRC:crc error:error];
+}
+
+- (BOOL)finishEntryWithCRC:(uint32_t)crc error:(NSError **)error {
+    BOOL isFile = (_file != NULL);
+    [self closeEntry];
+    if (isFile && (uint32_t)_crc != crc) {
+        if (error) {
+            NSString *description = [NSString stringWithFormat:@"CRC check failed for %@", _entryName];
+            *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorInvalid description:description];
+        }
+        return NO;
+    }
+    _entryCount++;
+    _boundaryOffset = _bufferOffset + _position;
+    _state = LOCMSZipStreamHeader;
+    return YES;
+}
+
+- (BOOL)writeBytes:(const uint8_t *)bytes length:(size_t)length error:(NSError **)error {
+    if (!_file) {
+        // Directory entry, or trailing data after a deflate stream.
+        return YES;
+    }
+    _crc = crc32(_crc, bytes, (uInt)length);
+    if (fwrite(bytes, 1, length, _file) != length) {
+        if (error) {
+            NSString *description = [NSString stringWithFormat:@"Unable to write %@", _entryName];
+            *error = [LOCMSZipStreamExtractor errorWithCode:LOCMSZipStreamErrorWrite description:description];
+        }
+        return NO;
+    }
+    return YES;
+}
+
+- (void)closeEntry {
+    if (_file) {
+        fclose(_file);
+        _file = NULL;
+    }
+    if (_inflating) {
+        inflateEnd(&_zstream);
+        _inflating = NO;
+    }
+}
+
+@end
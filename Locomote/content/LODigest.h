@@ -0,0 +1,28 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * Utility class providing message digests.
+ * Uses CommonCrypto on Apple platforms, and a built-in implementation elsewhere (e.g. for the
+ * headless benchmarks built with GNUstep); both give the same result.
+ */
+@interface LODigest : NSObject
+
+/// Return the hex encoded SHA1 digest of some data.
++ (NSString *)sha1HexDigestOfData:(NSData *)data;
+
+@end
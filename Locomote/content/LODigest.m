@@ -0,0 +1,120 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LODigest.h"
+#ifdef __APPLE__
+#import <CommonCrypto/CommonDigest.h>
+#endif
+
+#define SHA1DigestLength    (20)
+
+#ifndef __APPLE__
+
+/// Rotate a 32 bit value left.
+#define Rotl32(x, n)        (((x) << (n)) | ((x) >> (32 - (n))))
+
+/// Process a 64 byte block of SHA1 input.
+static void SHA1ProcessBlock(uint32_t state[5], const uint8_t block[64]) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16)
+             | ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = Rotl32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        }
+        else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        }
+        else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        }
+        else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        uint32_t t = Rotl32(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = Rotl32(b, 30);
+        b = a;
+        a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+/// Calculate the SHA1 digest of some bytes.
+static void SHA1(const uint8_t *bytes, size_t length, uint8_t digest[SHA1DigestLength]) {
+    uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    size_t offset = 0;
+    for (; offset + 64 <= length; offset += 64) {
+        SHA1ProcessBlock(state, bytes + offset);
+    }
+    // Pad the remaining bytes with a 1 bit, zeros and the message length in bits.
+    uint8_t block[128] = { 0 };
+    size_t remaining = length - offset;
+    if (remaining > 0) {
+        memcpy(block, bytes + offset, remaining);
+    }
+    block[remaining] = 0x80;
+    size_t blockLength = remaining < 56 ? 64 : 128;
+    uint64_t bitLength = (uint64_t)length * 8;
+    for (int i = 0; i < 8; i++) {
+        block[blockLength - 1 - i] = (uint8_t)(bitLength >> (i * 8));
+    }
+    SHA1ProcessBlock(state, block);
+    if (blockLength == 128) {
+        SHA1ProcessBlock(state, block + 64);
+    }
+    for (int i = 0; i < 5; i++) {
+        digest[i * 4]     = (uint8_t)(state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)state[i];
+    }
+}
+
+#endif
+
+@implementation LODigest
+
++ (NSString *)sha1HexDigestOfData:(NSData *)data {
+    uint8_t digest[SHA1DigestLength];
+#ifdef __APPLE__
+    CC_SHA1(data.bytes, (CC_LONG)data.length, digest);
+#else
+    SHA1(data.bytes, data.length, digest);
+#endif
+    NSMutableString *hex = [NSMutableString new];
+    for (NSInteger i = 0; i < SHA1DigestLength; i++) {
+        [hex appendFormat:@"%02x", digest[i]];
+    }
+    return hex;
+}
+
+@end
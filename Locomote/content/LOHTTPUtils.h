@@ -0,0 +1,24 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+/// Utility class providing functions for working with HTTP requests and responses.
+@interface LOHTTPUtils : NSObject
+
+/// Return the value of a HTTP response header; header names are matched case insensitively.
++ (NSString *)valueForHeader:(NSString *)name inResponse:(NSHTTPURLResponse *)response;
+
+@end
@@ -0,0 +1,72 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "LORequestDispatcher.h"
+
+/**
+ * A set of named runtime metrics.
+ * Three types of metric are supported:
+ * - Counters, which accumulate a total;
+ * - Gauges, which hold the most recently set value;
+ * - Histograms, which record the distribution of a series of values.
+ * Histogram values are counted in buckets whose upper bounds are successive powers of two,
+ * so percentiles are estimates; durations are recorded in milliseconds. Metrics are created
+ * the first time they are used. Recording a metric is cheap enough to do on hot paths, and
+ * all methods are thread safe.
+ */
+@interface LOMetrics : NSObject
+
+/// Whether metrics are recorded. Defaults to YES.
+@property (atomic, assign) BOOL enabled;
+
+/// Return the current time, for use as a start time with recordDurationSince:inHistogram:.
++ (NSTimeInterval)now;
+
+/// Add one to a counter.
+- (void)incrementCounter:(NSString *)name;
+/// Add an amount to a counter.
+- (void)incrementCounter:(NSString *)name by:(long long)amount;
+/// Set a gauge's value.
+- (void)setGauge:(NSString *)name value:(double)value;
+/// Record a value in a histogram.
+- (void)recordValue:(double)value inHistogram:(NSString *)name;
+/// Record the time elapsed since a start time (see now), in milliseconds, in a histogram.
+- (void)recordDurationSince:(NSTimeInterval)start inHistogram:(NSString *)name;
+/**
+ * Return a snapshot of all metrics, as a JSON compatible dictionary.
+ * The snapshot has 'counters', 'gauges' and 'histograms' properties, each keyed by metric name.
+ * Each histogram is described by its count, sum, min, max, mean, estimated p50, p90 and p99
+ * values, and the counts of its non-empty buckets keyed by bucket upper bound.
+ */
+- (NSDictionary *)snapshot;
+/// Discard all recorded metrics.
+- (void)reset;
+
+@end
+
+/**
+ * A request handler which records the time taken by another handler to respond to requests.
+ * The time is measured from when the request is passed to the handler until the response
+ * completes, so includes the time spent waiting on any download the handler makes.
+ */
+@interface LOTimedRequestHandler : NSObject <LORequestHandler>
+
+- (id)initWithHandler:(id<LORequestHandler>)handler metrics:(LOMetrics *)metrics histogram:(NSString *)histogram;
+
+/// The handler being timed.
+@property (nonatomic, strong, readonly) id<LORequestHandler> handler;
+
+@end
@@ -0,0 +1,311 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LOMetrics.h"
+#import <math.h>
+
+// The number of histogram buckets; the last bucket counts all values above the largest bound.
+#define HistogramBucketCount    (32)
+// The upper bound of the first histogram bucket; each following bound is double the last.
+#define HistogramMinBound       (0.25)
+
+/// Return the upper bound of a histogram bucket.
+static double BucketBound(NSUInteger bucket) {
+    return bucket < HistogramBucketCount - 1 ? ldexp(HistogramMinBound, (int)bucket) : INFINITY;
+}
+
+/// A histogram of recorded values.
+@interface LOMetricsHistogram : NSObject {
+@public
+    unsigned long long _counts[HistogramBucketCount];
+    unsigned long long _count;
+    double _sum;
+    double _min;
+    double _max;
+}
+
+/// Record a value.
+- (void)recordValue:(double)value;
+/// Estimate the value at a percentile, from 0 to 1.
+- (double)estimatePercentile:(double)percentile;
+/// Return a description of the histogram as a JSON compatible dictionary.
+- (NSDictionary *)summary;
+
+@end
+
+/// A content response which records the time taken to complete the response it wraps.
+@interface LOTimedContentResponse : NSObject <LOContentResponse> {
+    id<LOContentResponse> _response;
+    LOMetrics *_metrics;
+    NSString *_histogram;
+    NSTimeInterval _start;
+    BOOL _completed;
+}
+
+- (id)initWithResponse:(id<LOContentResponse>)response metrics:(LOMetrics *)metrics histogram:(NSString *)histogram;
+/// Record the response time, the first time the response completes.
+- (void)complete;
+
+@end
+
+@interface LOMetrics () {
+    NSMutableDictionary<NSString *, NSNumber *> *_counters;
+    NSMutableDictionary<NSString *, NSNumber *> *_gauges;
+    NSMutableDictionary<NSString *, LOMetricsHistogram *> *_histograms;
+}
+
+@end
+
+@implementation LOMetricsHistogram
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        _min = INFINITY;
+        _max = -INFINITY;
+    }
+    return self;
+}
+
+- (void)recordValue:(double)value {
+    NSUInteger bucket = 0;
+    if (value > HistogramMinBound) {
+        bucket = (NSUInteger)MIN(ceil(log2(value / HistogramMinBound)), HistogramBucketCount - 1);
+    }
+    _counts[bucket]++;
+    _count++;
+    _sum += value;
+    _min = MIN(_min, value);
+    _max = MAX(_max, value);
+}
+
+- (double)estimatePercentile:(double)percentile {
+    if (_count == 0) {
+        return 0;
+    }
+    // Find the bucket containing the percentile, and interpolate within the bucket's bounds.
+    double target = percentile * _count;
+    unsigned long long cumulative = 0;
+    for (NSUInteger i = 0; i < HistogramBucketCount; i++) {
+        if (_counts[i] == 0) {
+            continue;
+        }
+        if (cumulative + _counts[i] >= target) {
+            double lower = i == 0 ? 0 : BucketBound(i - 1);
+            double upper = MIN(BucketBound(i), _max);
+            double value = lower + (upper - lower) * ((target - cumulative) / _counts[i]);
+            return MAX(_min, MIN(value, _max));
+        }
+        cumulative += _counts[i];
+    }
+    return _max;
+}
+
+- (NSDictionary *)summary {
+    NSMutableDictionary *buckets = [NSMutableDictionary new];
+    for (NSUInteger i = 0; i < HistogramBucketCount; i++) {
+        if (_counts[i] > 0) {
+            NSString *bound = i < HistogramBucketCount - 1 ? [NSString stringWithFormat:@"%g", BucketBound(i)] : @"+Inf";
+            buckets[bound] = @(_counts[i]);
+        }
+    }
+    BOOL empty = _count == 0;
+    return @{
+        @"count":   @(_count),
+        @"sum":     @(_sum),
+        @"min":     @(empty ? 0 : _min),
+        @"max":     @(empty ? 0 : _max),
+        @"mean":    @(empty ? 0 : _sum / _count),
+        @"p50":     @([self estimatePercentile:0.5]),
+        @"p90":     @([self estimatePercentile:0.9]),
+        @"p99":     @([self estimatePercentile:0.99]),
+        @"buckets": buckets
+    };
+}
+
+@end
+
+@implementation LOMetrics
+
++ (NSTimeInterval)now {
+    // System uptime is monotonic, so isn't affected by changes to the clock.
+    return [[NSProcessInfo processInfo] systemUptime];
+}
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        _enabled = YES;
+        _counters = [NSMutableDictionary new];
+        _gauges = [NSMutableDictionary new];
+        _histograms = [NSMutableDictionary new];
+    }
+    return self;
+}
+
+- (void)incrementCounter:(NSString *)name {
+    [self incrementCounter:name by:1];
+}
+
+- (void)incrementCounter:(NSString *)name by:(long long)amount {
+    if (!self.enabled || !name) {
+        return;
+    }
+    @synchronized (self) {
+        _counters[name] = @([_counters[name] longLongValue] + amount);
+    }
+}
+
+- (void)setGauge:(NSString *)name value:(double)value {
+    if (!self.enabled || !name) {
+        return;
+    }
+    @synchronized (self) {
+        _gauges[name] = @(value);
+    }
+}
+
+- (void)recordValue:(double)value inHistogram:(NSString *)name {
+    if (!self.enabled || !name) {
+        return;
+    }
+    @synchronized (self) {
+        LOMetricsHistogram *histogram = _histograms[name];
+        if (!histogram) {
+            histogram = [LOMetricsHistogram new];
+            _histograms[name] = histogram;
+        }
+        [histogram recordValue:value];
+    }
+}
+
+- (void)recordDurationSince:(NSTimeInterval)start inHistogram:(NSString *)name {
+    [self recordValue:([LOMetrics now] - start) * 1000.0 inHistogram:name];
+}
+
+- (NSDictionary *)snapshot {
+    @synchronized (self) {
+        NSMutableDictionary *histograms = [NSMutableDictionary new];
+        for (NSString *name in _histograms) {
+            histograms[name] = [_histograms[name] summary];
+        }
+        return @{
+            @"counters":    [_counters copy],
+            @"gauges":      [_gauges copy],
+            @"histograms":  histograms
+        };
+    }
+}
+
+- (void)reset {
+    @synchronized (self) {
+        [_counters removeAllObjects];
+        [_gauges removeAllObjects];
+        [_histograms removeAllObjects];
+    }
+}
+
+@end
+
+@implementation LOTimedRequestHandler {
+    LOMetrics *_metrics;
+    NSString *_histogram;
+}
+
+- (id)initWithHandler:(id<LORequestHandler>)handler metrics:(LOMetrics *)metrics histogram:(NSString *)histogram {
+    self = [super init];
+    if (self) {
+        _handler = handler;
+        _metrics = metrics;
+        _histogram = histogram;
+    }
+    return self;
+}
+
+- (void)handleRequest:(id<LOContentRequest>)request response:(id<LOContentResponse>)response {
+    if (!_metrics.enabled) {
+        [_handler handleRequest:request response:response];
+        return;
+    }
+    LOTimedContentResponse *timedResponse = [[LOTimedContentResponse alloc] initWithResponse:response
+                                                                                     metrics:_metrics
+                                                                                   histogram:_histogram];
+    [_handler handleRequest:request response:timedResponse];
+}
+
+@end
+
+@implementation LOTimedContentResponse
+
+- (id)initWithResponse:(id<LOContentResponse>)response metrics:(LOMetrics *)metrics histogram:(NSString *)histogram {
+    self = [super init];
+    if (self) {
+        _response = response;
+        _metrics = metrics;
+        _histogram = histogram;
+        _start = [LOMetrics now];
+    }
+    return self;
+}
+
+- (void)complete {
+    @synchronized (self) {
+        if (_completed) {
+            return;
+        }
+        _completed = YES;
+    }
+    [_metrics recordDurationSince:_start inHistogram:_histogram];
+}
+
+- (void)respondWithData:(NSData *)data mimeType:(NSString *)mimeType cachePolicy:(NSURLCacheStoragePolicy)policy {
+    [self complete];
+    [_response respondWithData:data mimeType:mimeType cachePolicy:policy];
+}
+
+- (void)respondWithMimeType:(NSString *)mimeType cacheStoragePolicy:(NSURLCacheStoragePolicy)policy {
+    [_response respondWithMimeType:mimeType cacheStoragePolicy:policy];
+}
+
+- (void)sendData:(NSData *)data {
+    [_response sendData:data];
+}
+
+- (void)done {
+    [self complete];
+    [_response done];
+}
+
+- (void)respondWithStringData:(NSString *)data mimeType:(NSString *)mimeType cachePolicy:(NSURLCacheStoragePolicy)cachePolicy {
+    [self complete];
+    [_response respondWithStringData:data mimeType:mimeType cachePolicy:cachePolicy];
+}
+
+- (void)respondWithJSONData:(id)data cachePolicy:(NSURLCacheStoragePolicy)cachePolicy {
+    [self complete];
+    [_response respondWithJSONData:data cachePolicy:cachePolicy];
+}
+
+- (void)respondWithFileData:(NSString *)filepath mimeType:(NSString *)mimeType cachePolicy:(NSURLCacheStoragePolicy)cachePolicy {
+    [self complete];
+    [_response respondWithFileData:filepath mimeType:mimeType cachePolicy:cachePolicy];
+}
+
+- (void)respondWithError:(NSError *)error {
+    [self complete];
+    [_response respondWithError:error];
+}
+
+@end
@@ -16,6 +16,7 @@
 //
 
 #import <Foundation/Foundation.h>
+#import "LOMetrics.h"
 #import "SCService.h"
 #import "Q.h"
 
@@ -25,6 +26,18 @@
  */
 typedef QPromise *(^LOOperationBlock) (void);
 
+/// Operation priority classes. Higher priority operations are always started first.
+typedef NS_ENUM(NSInteger, LOOperationPriority) {
+    /// Deferrable housekeeping, e.g. file GC.
+    LOOperationPriorityBackground,
+    /// Routine work, e.g. content syncs.
+    LOOperationPriorityDefault,
+    /// Work which the user is waiting on.
+    LOOperationPriorityInteractive
+};
+
+@class LOOperationQueue;
+
 /// A pending command item.
 @interface LOOperationQueueItem : NSObject
 
@@ -38,25 +51,84 @@ typedef QPromise *(^LOOperationBlock) (void);
  * them.
  */
 @property (nonatomic, strong) NSNumber *runTimeID;
+/**
+ * The names of resources the operation requires exclusive access to.
+ * Resource names are hierarchical, with levels separated by a colon; a resource
+ * conflicts with itself and with any of its sub-resources, so e.g. an operation
+ * using 'fileset' conflicts with operations using 'fileset:images'.
+ * If nil (the default) then the operation requires exclusive access to the entire
+ * queue, and won't run concurrently with any other operation.
+ */
+@property (nonatomic, strong) NSSet<NSString *> *resources;
+/**
+ * The names of resources the operation requires shared access to.
+ * Operations with shared access to a resource may run concurrently with each other,
+ * but not with an operation requiring exclusive access to the same resource.
+ */
+@property (nonatomic, strong) NSSet<NSString *> *sharedResources;
+/**
+ * The IDs of operations this operation depends on.
+ * The operation won't be started whilst any operation with one of these IDs is queued
+ * ahead of it or is still executing.
+ */
+@property (nonatomic, strong) NSSet<NSString *> *dependencies;
+/**
+ * The operation's priority class. Defaults to LOOperationPriorityDefault.
+ * Follow-on operations take the priority of the operation that raised them, unless a priority
+ * was explicitly assigned to the follow-on.
+ */
+@property (nonatomic, assign) LOOperationPriority priority;
+/// The queue the operation was added to.
+@property (nonatomic, weak, readonly) LOOperationQueue *queue;
 
 /// Initialize a new item with the specified operation and identifier.
 - (id)initWithOperation:(LOOperationBlock)operation opID:(NSString *)opID;
 /// Initialize a new item with just the specified operation.
 - (id)initWithOperation:(LOOperationBlock)operation;
+/**
+ * Initialize a new item with the specified operation, identifier and resource requirements.
+ * Either resource list may be empty; passing nil exclusive resources makes the operation
+ * exclusive to the whole queue.
+ */
+- (id)initWithOperation:(LOOperationBlock)operation
+                   opID:(NSString *)opID
+              resources:(NSArray<NSString *> *)resources
+        sharedResources:(NSArray<NSString *> *)sharedResources;
+/// Test whether this item's resource requirements conflict with another item's.
+- (BOOL)conflictsWithItem:(LOOperationQueueItem *)item;
+/**
+ * Test whether the operation should yield to higher priority work.
+ * Returns YES whilst operations of a higher priority are waiting to start. Long running
+ * operations may call this at checkpoints; an operation yields by completing early with a
+ * follow-on which continues its work, so that the waiting operations are started ahead of
+ * the follow-on. Thread safe.
+ */
+- (BOOL)shouldYield;
 
 @end
 
 /**
- * A class for executing asynchronous operations sequentially on a background thread.
+ * A class for executing asynchronous operations on a background thread.
  * Allows operations to be executed with a deferred promise that resolves once the
  * operation completes. Operations may raise follow-on operations in order to complete
  * their task; when this happens then their deferred promise only resolves once all
  * follow-ons have also completed.
- * All operations added to the queue are executed sequentially, one at a time.
+ * Operations are started in queue order. Operations which declare the resources they
+ * use (see LOOperationQueueItem) and which don't conflict with any operation ahead of
+ * them on the queue may be executed concurrently, up to the queue's concurrency limit;
+ * operations which don't declare resources are executed one at a time, as before.
  * Operations added to the queue may provide an operation ID. When provided, then the
- * operation is only added to the queue if another operation with the same ID is not
- * already on the queue. This provides a mechanism for ensuring that multiple instances
- * of a potentially slow to complete operation don't fill up the queue.
+ * operation is only added to the queue if another operation with the same ID, or any of
+ * its follow-ons, has not yet completed; otherwise the request joins the outstanding
+ * operation and its promise resolves when that operation's follow-ons complete. This provides
+ * a mechanism for ensuring that multiple instances of a potentially slow to complete
+ * operation don't fill up the queue.
+ * Follow-on operations are returned by an operation's promise as an array whose items
+ * are either operation blocks (anonymous, exclusive operations) or queue items.
+ * Each operation has a priority class. Queued operations are started in priority order,
+ * and in queue order within each class; a higher priority operation may start ahead of a
+ * conflicting lower priority operation queued before it. Background operations are limited
+ * to a share of the concurrency limit, so that they never occupy every execution slot.
  */
 @interface LOOperationQueue : NSObject <SCService> {
     /**
@@ -66,20 +138,47 @@ typedef QPromise *(^LOOperationBlock) (void);
     BOOL _running;
     /// A queue of pending operations.
     NSMutableArray<LOOperationQueueItem *> *_queue;
-    /// A map of pending operation completion promises.
-    NSMutableDictionary<NSNumber *,QPromise *> *_pendingPromises;
+    /// A list of currently executing operations.
+    NSMutableArray<LOOperationQueueItem *> *_executing;
+    /// A counter used to allocate operation runtime IDs.
+    NSInteger _runTimeCounter;
 }
 
+/**
+ * The maximum number of operations which may execute concurrently.
+ * Defaults to 4; set to 1 to execute all operations sequentially.
+ */
+@property (nonatomic, assign) NSInteger maxConcurrentOperations;
+/// The maximum number of background priority operations which may execute concurrently. Defaults to 1.
+@property (nonatomic, assign) NSInteger maxConcurrentBackgroundOperations;
+/**
+ * Optional metrics to record queue activity in.
+ * The queue records the number of pending and executing operations as the 'opqueue.pending'
+ * and 'opqueue.executing' gauges, the number of identified operations with outstanding follow-ons
+ * as the 'opqueue.graphs' gauge, the number of requests which joined an outstanding operation in
+ * the 'opqueue.joined' counter, and the time taken by each operation (excluding its follow-ons)
+ * in an 'opqueue.time.<opID>' histogram. The time operations wait on the queue before starting
+ * is recorded for each priority class in the 'opqueue.wait.interactive', 'opqueue.wait.default'
+ * and 'opqueue.wait.background' histograms.
+ */
+@property (nonatomic, strong) LOMetrics *metrics;
+
 /**
  * Append a new operation to the end of the queue.
  * The operation will be appended to the end of the queue, providing another
- * operation with the same identifier doesn't already exist on the queue.
+ * operation with the same identifier, or any of its follow-ons, isn't still queued
+ * or executing.
  * The operation will be executed after all operations ahead of it on the queue
  * are executed.
  * The method returns a deferred promise which resolves once the operation, and any
  * follow on operations it generates, have completed execution.
  */
 - (QPromise *)queueOperation:(LOOperationBlock)operation opID:(NSString *)opID;
+/**
+ * Append a new operation item to the end of the queue.
+ * As queueOperation:opID: but allows the item's resource requirements to be specified.
+ */
+- (QPromise *)queueItem:(LOOperationQueueItem *)item;
 /**
  * Clear all pending operations on the queue.
  * If any operation is currently executing then it will complete, but any follow-on
@@ -87,7 +186,19 @@ typedef QPromise *(^LOOperationBlock) (void);
  * Returns a deferred promise which resolves when the queue is cleared.
  */
 - (QPromise *)clearPending;
+/**
+ * Test whether any operations with a priority higher than the specified priority are waiting
+ * to start. Thread safe.
+ */
+- (BOOL)hasWaitingOperationsAbovePriority:(LOOperationPriority)priority;
 /// Return the command dispatch queue.
 + (dispatch_queue_t)getDispatchQueue;
+/**
+ * Return the item of the operation being invoked on the current thread.
+ * Only returns the item whilst the operation block is executing synchronously; operations
+ * which need their item after returning their promise (e.g. to test shouldYield) should read
+ * it on entry.
+ */
++ (LOOperationQueueItem *)currentItem;
 
 @end
@@ -29,10 +29,135 @@ static void *operationDispatchQueueKey = "sh.locomote.OperationQueue";
 
 #define AnonymousID (@"Anonymous")
 
-@interface LOOperationQueue ()
+#define DefaultMaxConcurrentOperations  (4)
+#define DefaultMaxConcurrentBackgroundOperations    (1)
+// The number of operation priority classes.
+#define PriorityCount                   (LOOperationPriorityInteractive + 1)
+// The thread dictionary key the item of the operation being invoked is stored under.
+#define CurrentItemKey                  (@"LOOperationQueue.currentItem")
 
-/// Execute the next queued command.
+/// Return the name of a priority class, as used in metric names.
+static NSString *PriorityName(LOOperationPriority priority) {
+    switch (priority) {
+        case LOOperationPriorityInteractive:    return @"interactive";
+        case LOOperationPriorityBackground:     return @"background";
+        default:                                return @"default";
+    }
+}
+
+/**
+ * A live operation graph, i.e. an operation queued by a client together with its outstanding follow-ons.
+ * The graph completes once all of its items have completed, at which point the promises of all
+ * requests for the operation are resolved.
+ */
+@interface LOOperationGraph : NSObject
+
+- (id)initWithOpID:(NSString *)opID runTimeID:(NSNumber *)runTimeID;
+
+/// The ID of the graph's root operation.
+@property (nonatomic, strong, readonly) NSString *opID;
+/// The graph's runtime ID, shared by the root operation and all its follow-ons.
+@property (nonatomic, strong, readonly) NSNumber *runTimeID;
+/// The graph's queued and executing items.
+@property (nonatomic, strong, readonly) NSHashTable<LOOperationQueueItem *> *items;
+/// The promises of all requests for the root operation.
+@property (nonatomic, strong, readonly) NSMutableArray<QPromise *> *promises;
+
+@end
+
+@interface LOOperationQueueItem ()
+
+/// Flag indicating that any follow-ons returned by the operation should be discarded.
+@property (nonatomic, assign) BOOL discardFollowOns;
+/// The time the operation started executing; see [LOMetrics now].
+@property (nonatomic, assign) NSTimeInterval startTime;
+/// The time the operation was added to the queue; see [LOMetrics now].
+@property (nonatomic, assign) NSTimeInterval queueTime;
+/// Flag indicating that a priority was explicitly assigned to the operation.
+@property (nonatomic, assign) BOOL priorityAssigned;
+@property (nonatomic, weak, readwrite) LOOperationQueue *queue;
+/// The graph the item belongs to, whilst the item is queued or executing.
+@property (nonatomic, strong) LOOperationGraph *graph;
+
+@end
+
+@interface LOOperationQueue () {
+    /// The number of queued operations in each priority class which couldn't be started on the last dispatch.
+    NSUInteger _waitingCounts[PriorityCount];
+    /// The live graphs of identified operations, keyed by root operation ID.
+    NSMutableDictionary<NSString *, LOOperationGraph *> *_liveGraphs;
+}
+
+/// Add an item to the end of the queue.
+- (void)enqueueItem:(LOOperationQueueItem *)item;
+
+/// Start any queued operations which are able to execute.
 - (void)dispatchNext;
+/**
+ * Test whether a queued item is able to start, given the items which were considered before it
+ * but couldn't start.
+ */
+- (BOOL)canStartItem:(LOOperationQueueItem *)item ahead:(NSArray<LOOperationQueueItem *> *)ahead;
+/// Test whether an item depends on an executing item, or on an item queued before it.
+- (BOOL)isItemBlockedByDependency:(LOOperationQueueItem *)item;
+/// Execute an item.
+- (void)executeItem:(LOOperationQueueItem *)item;
+/// Complete execution of an item.
+- (void)completeItem:(LOOperationQueueItem *)item followOns:(NSArray *)followOns error:(id)error;
+/// Add an item to a graph, and then to the end of the queue.
+- (void)enqueueItem:(LOOperationQueueItem *)item inGraph:(LOOperationGraph *)graph;
+/**
+ * Remove a queued or executing item from its graph.
+ * Completes the graph if no items are left in it, or if an error is passed.
+ */
+- (void)removeItemFromGraph:(LOOperationQueueItem *)item error:(id)error;
+/// Resolve or reject the promises of a graph, and remove it from the set of live graphs.
+- (void)completeGraph:(LOOperationGraph *)graph error:(id)error;
+/// Record the queue's depth in its metrics.
+- (void)recordDepth;
+
+@end
+
+/// Test whether two resource names conflict, i.e. are the same or one contains the other.
+static BOOL ResourcesConflict(NSString *r1, NSString *r2) {
+    if ([r1 isEqualToString:r2]) {
+        return YES;
+    }
+    NSUInteger len1 = [r1 length], len2 = [r2 length];
+    if (len1 < len2) {
+        return [r2 hasPrefix:r1] && [r2 characterAtIndex:len1] == ':';
+    }
+    if (len2 < len1) {
+        return [r1 hasPrefix:r2] && [r1 characterAtIndex:len2] == ':';
+    }
+    return NO;
+}
+
+/// Test whether any resource in one set conflicts with any resource in another set.
+static BOOL ResourceSetsConflict(NSSet *s1, NSSet *s2) {
+    for (NSString *r1 in s1) {
+        for (NSString *r2 in s2) {
+            if (ResourcesConflict(r1, r2)) {
+                return YES;
+            }
+        }
+    }
+    return NO;
+}
+
+@implementation LOOperationGraph
+
+- (id)initWithOpID:(NSString *)opID runTimeID:(NSNumber *)runTimeID {
+    self = [super init];
+    if (self) {
+        _opID = opID;
+        _runTimeID = runTimeID;
+        // Items are compared by identity, as queue items compare equal by operation ID.
+        _items = [NSHashTable hashTableWithOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality];
+        _promises = [NSMutableArray new];
+    }
+    return self;
+}
 
 @end
 
@@ -41,6 +166,7 @@ static void *operationDispatchQueueKey = "sh.locomote.OperationQueue";
 - (id)initWithOperation:(LOOperationBlock)operation opID:(NSString *)opID {
     self = [super init];
     self.operation = operation;
+    _priority = LOOperationPriorityDefault;
     if (opID) {
         self.opID = opID;
     }
@@ -54,6 +180,42 @@ static void *operationDispatchQueueKey = "sh.locomote.OperationQueue";
     return [self initWithOperation:operation opID:nil];
 }
 
+- (id)initWithOperation:(LOOperationBlock)operation
+                   opID:(NSString *)opID
+              resources:(NSArray<NSString *> *)resources
+        sharedResources:(NSArray<NSString *> *)sharedResources {
+    self = [self initWithOperation:operation opID:opID];
+    if (self) {
+        if (resources) {
+            self.resources = [NSSet setWithArray:resources];
+        }
+        if (sharedResources) {
+            self.sharedResources = [NSSet setWithArray:sharedResources];
+        }
+    }
+    return self;
+}
+
+- (BOOL)conflictsWithItem:(LOOperationQueueItem *)item {
+    // Items without declared resources are exclusive to the whole queue.
+    if (_resources == nil || item.resources == nil) {
+        return YES;
+    }
+    // Exclusive resources conflict with any use of the same resource by the other item.
+    return ResourceSetsConflict(_resources, item.resources)
+        || ResourceSetsConflict(_resources, item.sharedResources)
+        || ResourceSetsConflict(_sharedResources, item.resources);
+}
+
+- (void)setPriority:(LOOperationPriority)priority {
+    _priority = priority;
+    _priorityAssigned = YES;
+}
+
+- (BOOL)shouldYield {
+    return [_queue hasWaitingOperationsAbovePriority:_priority];
+}
+
 - (BOOL)isEqual:(id)object {
     if ([_opID isEqualToString:AnonymousID]) {
         // Anonymous operations cannot be equal to each other.
@@ -88,54 +250,63 @@ static void *operationDispatchQueueKey = "sh.locomote.OperationQueue";
     if (self) {
         _running = NO;
         _queue = [NSMutableArray new];
-        _pendingPromises = [NSMutableDictionary new];
+        _executing = [NSMutableArray new];
+        _liveGraphs = [NSMutableDictionary new];
+        _runTimeCounter = 0;
+        _maxConcurrentOperations = DefaultMaxConcurrentOperations;
+        _maxConcurrentBackgroundOperations = DefaultMaxConcurrentBackgroundOperations;
     }
     return self;
 }
 
++ (LOOperationQueueItem *)currentItem {
+    return [[NSThread currentThread] threadDictionary][CurrentItemKey];
+}
+
 - (QPromise *)queueOperation:(LOOperationBlock)operation opID:(NSString *)opID {
+    LOOperationQueueItem *item = [[LOOperationQueueItem alloc] initWithOperation:operation opID:opID];
+    return [self queueItem:item];
+}
+
+- (QPromise *)queueItem:(LOOperationQueueItem *)item {
     QPromise *promise = [QPromise new];
     // Modify the operation queue on the dispatch queue.
     dispatch_async(operationDispatchQueue, ^{
-        LOOperationQueueItem *item = [[LOOperationQueueItem alloc] initWithOperation:operation opID:opID];
-        
-        // TODO: The desired behaviour here is not to add an op to the queue if it *or any of its follow-ons*
-        // has yet to complete; but this isn't what currently happens (as the op is removed from the queue as
-        // soon as it completes, i.e. before its follow-ons are executed). A separate queue of pending op IDs
-        // would be needed to get the desired behaviour.
-
-        // Test whether the same operation already exists on the queue.
-        NSInteger idx = [self->_queue indexOfObject:item];
-        if (idx == NSNotFound) {
-            // Add new operation to the queue.
-            [self->_queue addObject:item];
-            // Give the operation a runtime identity.
-            item.runTimeID = [NSNumber numberWithInteger:[item hash]];
-            // Add the operation's promise to the map of pending.
-            self->_pendingPromises[item.runTimeID] = promise;
-            // Execute if the queue was empty (if not empty then a operation is currently executing,
-            // and will eventually dispatch the new operation once the rest of the queue is executed).
-            if ([self->_queue count] == 1) {
-                [self dispatchNext];
+        // Test whether an operation with the same ID, or any of its follow-ons, has yet to complete.
+        // Anonymous operations are never matched.
+        LOOperationGraph *graph = nil;
+        if (![item.opID isEqualToString:AnonymousID]) {
+            graph = self->_liveGraphs[item.opID];
+        }
+        if (!graph) {
+            // Start a new graph for the operation, with a new runtime identity.
+            NSNumber *runTimeID = [NSNumber numberWithInteger:++self->_runTimeCounter];
+            graph = [[LOOperationGraph alloc] initWithOpID:item.opID runTimeID:runTimeID];
+            [graph.promises addObject:promise];
+            if (![item.opID isEqualToString:AnonymousID]) {
+                self->_liveGraphs[item.opID] = graph;
             }
+            // Add new operation to the queue.
+            [self enqueueItem:item inGraph:graph];
+            // Start the operation if it is able to run now.
+            [self dispatchNext];
         }
         else {
-            // So that this operation invocation's promise resolves when the matching, pending operation
-            // completes, join the current promise and the pending promise in a new promise, and replace
-            // the pending promise with the new joined promise.
-            LOOperationQueueItem *queuedItem = self->_queue[idx];
-            QPromise *pending = self->_pendingPromises[queuedItem.runTimeID];
-            QPromise *joined = [QPromise new];
-            joined.then( (id)^(id result) {
-                [pending resolve:result];
-                [promise resolve:result];
-                return nil;
-            })
-            .fail( ^(id error) {
-                [pending reject:error];
-                [promise reject:error];
-            });
-            self->_pendingPromises[queuedItem.runTimeID] = joined;
+            // Join the live graph, so that this invocation's promise resolves once the graph completes.
+            [graph.promises addObject:promise];
+            [self->_metrics incrementCounter:@"opqueue.joined"];
+            // If the new invocation has a higher priority then promote any of the graph's items which
+            // are still queued.
+            BOOL promoted = NO;
+            for (LOOperationQueueItem *graphItem in graph.items) {
+                if (item.priority > graphItem.priority && [self->_executing indexOfObjectIdenticalTo:graphItem] == NSNotFound) {
+                    graphItem.priority = item.priority;
+                    promoted = YES;
+                }
+            }
+            if (promoted) {
+                [self dispatchNext];
+            }
         }
     });
     return promise;
@@ -144,12 +315,33 @@ static void *operationDispatchQueueKey = "sh.locomote.OperationQueue";
 - (QPromise *)clearPending {
     QPromise *promise = [QPromise new];
     dispatch_async(operationDispatchQueue, ^{
+        NSArray *cleared = [self->_queue copy];
         [self->_queue removeAllObjects];
+        // Discard the follow-ons of any currently executing operations.
+        for (LOOperationQueueItem *item in self->_executing) {
+            item.discardFollowOns = YES;
+        }
+        // Resolve the promises of any graphs which no longer have anything left to execute.
+        for (LOOperationQueueItem *item in cleared) {
+            [self removeItemFromGraph:item error:nil];
+        }
+        [self recordDepth];
         [promise resolve:self];
     });
     return promise;
 }
 
+- (BOOL)hasWaitingOperationsAbovePriority:(LOOperationPriority)priority {
+    @synchronized (self) {
+        for (NSInteger p = priority + 1; p < PriorityCount; p++) {
+            if (_waitingCounts[p] > 0) {
+                return YES;
+            }
+        }
+        return NO;
+    }
+}
+
 #pragma mark - SCService
 
 - (void)startService {
@@ -165,6 +357,49 @@ static void *operationDispatchQueueKey = "sh.locomote.OperationQueue";
 
 #pragma mark - private
 
+- (void)enqueueItem:(LOOperationQueueItem *)item {
+    item.queue = self;
+    item.queueTime = [LOMetrics now];
+    [_queue addObject:item];
+}
+
+- (void)enqueueItem:(LOOperationQueueItem *)item inGraph:(LOOperationGraph *)graph {
+    item.graph = graph;
+    item.runTimeID = graph.runTimeID;
+    [graph.items addObject:item];
+    [self enqueueItem:item];
+}
+
+- (void)removeItemFromGraph:(LOOperationQueueItem *)item error:(id)error {
+    LOOperationGraph *graph = item.graph;
+    if (!graph) {
+        return;
+    }
+    [graph.items removeObject:item];
+    item.graph = nil;
+    if (error || [graph.items count] == 0) {
+        [self completeGraph:graph error:error];
+    }
+}
+
+- (void)completeGraph:(LOOperationGraph *)graph error:(id)error {
+    // Once removed from the set of live graphs, new requests for the operation start a new graph;
+    // any items remaining in a failed graph continue to execute, but nothing waits on them.
+    if (_liveGraphs[graph.opID] == graph) {
+        [_liveGraphs removeObjectForKey:graph.opID];
+    }
+    NSArray<QPromise *> *promises = [graph.promises copy];
+    [graph.promises removeAllObjects];
+    for (QPromise *promise in promises) {
+        if (error) {
+            [promise reject:error];
+        }
+        else {
+            [promise resolve:nil];
+        }
+    }
+}
+
 - (void)dispatchNext {
     if (!_running) {
         // Don't do anything if the queue isn't running.
@@ -172,68 +407,52 @@ static void *operationDispatchQueueKey = "sh.locomote.OperationQueue";
     }
     // The next step...
     void (^next)(void) = ^() {
-        // Check that there are pending commands.
-        if ([self->_queue count] > 0) {
-            // Read and execute the next pending command.
-            LOOperationQueueItem *item = self->_queue[0];
-            item.operation()
-                .then((id)^(NSArray *followOns) {
-                    dispatch_async(operationDispatchQueue, ^{
-                        // Remove the completed command from the queue.
-                        [self->_queue removeObjectAtIndex:0];
-                        // Add any follow-on commands to the end of the queue.
-                        if ([followOns count] > 0) {
-                            for (LOOperationBlock followOn in followOns) {
-                                // Note that follow-on ops are anonymous; this is to simplify the operation interface
-                                // (by not requiring operations to package follow on blocks before returning them).
-                                LOOperationQueueItem *followOnItem = [[LOOperationQueueItem alloc] initWithOperation:followOn];
-                                [self->_queue addObject:followOnItem];
-                                // Give the follow-on the same runtime ID as
-                                // its parent command.
-                                followOnItem.runTimeID = item.runTimeID;
-                            }
-                        }
-                        // If completed command has a runtime ID then check whether
-                        // a pending promise needs to be resolved.
-                        if (item.runTimeID) {
-                            QPromise *promise = self->_pendingPromises[item.runTimeID];
-                            if (promise) {
-                                // Check for pending commands with the same runtime ID.
-                                BOOL pending = NO;
-                                for (LOOperationQueueItem *pendingItem in self->_queue) {
-                                    if ([item.runTimeID isEqual:pendingItem.runTimeID]) {
-                                        pending = YES;
-                                        break;
-                                    }
-                                }
-                                // If no pending commands with the same runtime ID then
-                                // resolve the promise and remove it from the set of pending.
-                                if (!pending) {
-                                    [promise resolve:nil];
-                                    [self->_pendingPromises removeObjectForKey:item.runTimeID];
-                                }
-                            }
-                        }
-                        // Continue processing the queue.
-                        [self dispatchNext];
-                    });
-                    return nil;
-                })
-                .fail(^(id error) {
-                    [Logger error:@"Operation execution error (%@): %@", item.opID, error];
-                    // Check for a pending promise.
-                    if (item.runTimeID) {
-                        QPromise *promise = self->_pendingPromises[item.runTimeID];
-                        if (promise) {
-                            // If a pending promise found for the current runtime ID then reject with
-                            // the error and remove from the set of pending.
-                            [promise reject:error];
-                            [self->_pendingPromises removeObjectForKey:item.runTimeID];
-                        }
+        // Scan the queue for operations which can be started now, highest priority class first
+        // and in queue order within each class, whilst execution slots remain. Items which can't
+        // be started are recorded so that items considered after them don't overtake them when
+        // they conflict.
+        NSMutableArray *ahead = [NSMutableArray new];
+        NSMutableArray *startable = [NSMutableArray new];
+        NSUInteger waitingCounts[PriorityCount] = { 0 };
+        NSInteger slots = self->_maxConcurrentOperations - [self->_executing count];
+        NSInteger backgroundSlots = self->_maxConcurrentBackgroundOperations;
+        for (LOOperationQueueItem *item in self->_executing) {
+            if (item.priority == LOOperationPriorityBackground) {
+                backgroundSlots--;
+            }
+        }
+        for (NSInteger priority = PriorityCount - 1; priority >= 0; priority--) {
+            BOOL hasSlot = slots > 0 && (priority != LOOperationPriorityBackground || backgroundSlots > 0);
+            for (LOOperationQueueItem *item in self->_queue) {
+                if (item.priority != priority) {
+                    continue;
+                }
+                if (hasSlot && [self canStartItem:item ahead:ahead]) {
+                    [startable addObject:item];
+                    // Started items are treated as executing by items considered after them.
+                    [self->_executing addObject:item];
+                    slots--;
+                    if (priority == LOOperationPriorityBackground) {
+                        backgroundSlots--;
                     }
-                    [self dispatchNext];
-                });
+                    hasSlot = slots > 0 && (priority != LOOperationPriorityBackground || backgroundSlots > 0);
+                }
+                else {
+                    [ahead addObject:item];
+                    waitingCounts[priority]++;
+                }
+            }
+        }
+        @synchronized (self) {
+            memcpy(self->_waitingCounts, waitingCounts, sizeof(waitingCounts));
         }
+        for (LOOperationQueueItem *item in startable) {
+            [self->_queue removeObjectIdenticalTo:item];
+            [self->_metrics recordDurationSince:item.queueTime
+                                    inHistogram:[@"opqueue.wait." stringByAppendingString:PriorityName(item.priority)]];
+            [self executeItem:item];
+        }
+        [self recordDepth];
     };
     // If already running on the dispatch queue then run the next step; otherwise dispatch
     // the next step.
@@ -245,4 +464,111 @@ static void *operationDispatchQueueKey = "sh.locomote.OperationQueue";
     }
 }
 
+- (BOOL)canStartItem:(LOOperationQueueItem *)item ahead:(NSArray<LOOperationQueueItem *> *)ahead {
+    for (LOOperationQueueItem *other in _executing) {
+        if ([item conflictsWithItem:other]) {
+            return NO;
+        }
+    }
+    for (LOOperationQueueItem *other in ahead) {
+        if ([item conflictsWithItem:other]) {
+            return NO;
+        }
+    }
+    return ![self isItemBlockedByDependency:item];
+}
+
+- (BOOL)isItemBlockedByDependency:(LOOperationQueueItem *)item {
+    NSSet *dependencies = item.dependencies;
+    if ([dependencies count] == 0) {
+        return NO;
+    }
+    for (LOOperationQueueItem *other in _executing) {
+        if ([dependencies containsObject:other.opID]) {
+            return YES;
+        }
+    }
+    // Dependencies follow queue order, whatever the priority of the items.
+    for (LOOperationQueueItem *other in _queue) {
+        if (other == item) {
+            break;
+        }
+        if ([dependencies containsObject:other.opID]) {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+- (void)executeItem:(LOOperationQueueItem *)item {
+    item.startTime = [LOMetrics now];
+    // Operations are invoked on a background queue so that concurrently executing operations
+    // don't block each other, or the queue's own housekeeping.
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        // Make the item available to the operation whilst it's invoked; see currentItem.
+        NSMutableDictionary *threadDictionary = [[NSThread currentThread] threadDictionary];
+        threadDictionary[CurrentItemKey] = item;
+        QPromise *promise = item.operation();
+        [threadDictionary removeObjectForKey:CurrentItemKey];
+        promise.then((id)^(NSArray *followOns) {
+            dispatch_async(operationDispatchQueue, ^{
+                [self completeItem:item followOns:followOns error:nil];
+            });
+            return nil;
+        })
+        .fail(^(id error) {
+            dispatch_async(operationDispatchQueue, ^{
+                [self completeItem:item followOns:nil error:error];
+            });
+        });
+    });
+}
+
+- (void)completeItem:(LOOperationQueueItem *)item followOns:(NSArray *)followOns error:(id)error {
+    // Remove the completed command from the set of executing commands.
+    [_executing removeObjectIdenticalTo:item];
+    [_metrics recordDurationSince:item.startTime inHistogram:[@"opqueue.time." stringByAppendingString:item.opID]];
+    if (error) {
+        [Logger error:@"Operation execution error (%@): %@", item.opID, error];
+        [_metrics incrementCounter:@"opqueue.failed"];
+        // Reject the promises of the item's graph.
+        [self removeItemFromGraph:item error:error];
+    }
+    else {
+        // Add any follow-on commands to the end of the queue.
+        if ([followOns count] > 0 && !item.discardFollowOns) {
+            for (id followOn in followOns) {
+                LOOperationQueueItem *followOnItem;
+                if ([followOn isKindOfClass:[LOOperationQueueItem class]]) {
+                    followOnItem = (LOOperationQueueItem *)followOn;
+                }
+                else {
+                    // Note that follow-on blocks are anonymous; this is to simplify the operation interface
+                    // (by not requiring operations to package follow on blocks before returning them).
+                    followOnItem = [[LOOperationQueueItem alloc] initWithOperation:(LOOperationBlock)followOn];
+                }
+                // Add the follow-on to its parent's graph, so that it has the same runtime ID as its
+                // parent command and, unless one was assigned, the same priority.
+                if (!followOnItem.priorityAssigned) {
+                    followOnItem.priority = item.priority;
+                }
+                [self enqueueItem:followOnItem inGraph:item.graph];
+            }
+        }
+        // Resolve the graph's promises if nothing is left to execute.
+        [self removeItemFromGraph:item error:nil];
+    }
+    // Continue processing the queue.
+    [self dispatchNext];
+}
+
+- (void)recordDepth {
+    LOMetrics *metrics = _metrics;
+    if (metrics) {
+        [metrics setGauge:@"opqueue.pending" value:[_queue count]];
+        [metrics setGauge:@"opqueue.executing" value:[_executing count]];
+        [metrics setGauge:@"opqueue.graphs" value:[_liveGraphs count]];
+    }
+}
+
 @end
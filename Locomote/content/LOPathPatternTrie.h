@@ -0,0 +1,68 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * The result of matching a path against a path pattern trie.
+ */
+@interface LOPathPatternMatch : NSObject
+
+/// The value associated with the matching pattern.
+@property (nonatomic, strong, readonly) id value;
+/// The priority of the matching pattern.
+@property (nonatomic, assign, readonly) NSInteger priority;
+/// Parameter values extracted from the path.
+@property (nonatomic, strong, readonly) NSDictionary *parameters;
+
+@end
+
+/**
+ * A trie of compiled path patterns.
+ * Patterns are split into path segments and merged into a tree, so that a path can be matched
+ * against all patterns in a single walk of its segments, extracting any path parameters as it
+ * goes. The following pattern segments are supported:
+ *
+ *  - literal segments, e.g. file.api;
+ *  - single segment wildcards, i.e. *;
+ *  - multi-segment wildcards, i.e. **, matching zero or more segments;
+ *  - named parameters, e.g. {id}, matching any single segment;
+ *  - named parameters with a list of alternatives, e.g. {mode:content|meta};
+ *  - optional groups of whole segments, e.g. file.api/{id}(/{mode:content})?
+ *
+ * Empty segments are ignored, so leading and trailing slashes aren't significant.
+ * Each pattern is added with a priority; where a path matches more than one pattern, the
+ * match with the lowest priority value is returned.
+ */
+@interface LOPathPatternTrie : NSObject
+
+/**
+ * Add a pattern to the trie.
+ * Returns NO, and doesn't modify the trie, if the pattern uses syntax not supported by
+ * the trie (e.g. wildcards or parameters within a segment, such as *.html).
+ */
+- (BOOL)addPattern:(NSString *)pattern value:(id)value priority:(NSInteger)priority;
+/**
+ * Match a path against the patterns in the trie.
+ * Returns the match with the lowest priority value, or nil if no pattern matches.
+ */
+- (LOPathPatternMatch *)matchPath:(NSString *)path;
+/**
+ * Match a path against the patterns in the trie, ignoring matches with a priority value
+ * greater than or equal to the specified limit.
+ */
+- (LOPathPatternMatch *)matchPath:(NSString *)path priorityLimit:(NSInteger)limit;
+
+@end
@@ -0,0 +1,333 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "LOPathPatternTrie.h"
+
+/// A named parameter segment.
+@interface LOPathPatternParam : NSObject
+
+/// The parameter name.
+@property (nonatomic, strong) NSString *name;
+/// The allowed parameter values; nil if any value is allowed.
+@property (nonatomic, strong) NSSet *values;
+/// The node following the parameter.
+@property (nonatomic, strong) id node;
+
+@end
+
+/// A node in the pattern trie.
+@interface LOPathPatternNode : NSObject
+
+/// Child nodes for literal segments, keyed by segment.
+@property (nonatomic, strong) NSMutableDictionary<NSString *, LOPathPatternNode *> *literals;
+/// Parameter segments.
+@property (nonatomic, strong) NSMutableArray<LOPathPatternParam *> *params;
+/// Child node for a single segment wildcard.
+@property (nonatomic, strong) LOPathPatternNode *star;
+/// Child node for a multi-segment wildcard.
+@property (nonatomic, strong) LOPathPatternNode *doubleStar;
+/// The value of a pattern ending at this node.
+@property (nonatomic, strong) id value;
+/// The priority of a pattern ending at this node; NSIntegerMax if no pattern ends here.
+@property (nonatomic, assign) NSInteger priority;
+/// The lowest priority value of any pattern ending at or below this node.
+@property (nonatomic, assign) NSInteger minPriority;
+
+/// Return the node for a pattern segment, creating it if necessary.
+- (LOPathPatternNode *)childForSegment:(id)segment;
+
+@end
+
+/// A pattern segment type.
+typedef NS_ENUM(NSInteger, LOPathPatternSegmentType) {
+    LOPathPatternLiteral,
+    LOPathPatternStar,
+    LOPathPatternDoubleStar,
+    LOPathPatternParameter
+};
+
+@interface LOPathPatternMatch ()
+
+- (id)initWithValue:(id)value priority:(NSInteger)priority parameters:(NSDictionary *)parameters;
+
+@end
+
+@interface LOPathPatternTrie () {
+    LOPathPatternNode *_root;
+}
+
+/// Expand a pattern's optional groups into a list of patterns without optional groups.
+- (NSArray *)expandOptionalGroups:(NSString *)pattern;
+/// Parse a pattern (without optional groups) into a list of segments; returns nil if unsupported.
+- (NSArray *)parsePattern:(NSString *)pattern;
+/// Match the remaining segments of a path against a node and its descendants.
+- (void)matchNode:(LOPathPatternNode *)node
+         segments:(NSArray *)segments
+            index:(NSUInteger)idx
+       parameters:(NSMutableDictionary *)parameters
+             best:(LOPathPatternMatch **)best
+            limit:(NSInteger)limit;
+
+@end
+
+/// Split a path into its non-empty segments.
+static NSArray *SplitPath(NSString *path) {
+    NSMutableArray *segments = [NSMutableArray new];
+    for (NSString *segment in [path componentsSeparatedByString:@"/"]) {
+        if ([segment length] > 0) {
+            [segments addObject:segment];
+        }
+    }
+    return segments;
+}
+
+@implementation LOPathPatternParam
+@end
+
+@implementation LOPathPatternNode
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        _literals = [NSMutableDictionary new];
+        _params = [NSMutableArray new];
+        _priority = NSIntegerMax;
+        _minPriority = NSIntegerMax;
+    }
+    return self;
+}
+
+- (LOPathPatternNode *)childForSegment:(id)segment {
+    LOPathPatternNode *child = nil;
+    if ([segment isKindOfClass:[NSString class]]) {
+        child = _literals[segment];
+        if (!child) {
+            child = [LOPathPatternNode new];
+            _literals[segment] = child;
+        }
+    }
+    else if ([segment isKindOfClass:[LOPathPatternParam class]]) {
+        LOPathPatternParam *param = (LOPathPatternParam *)segment;
+        for (LOPathPatternParam *existing in _params) {
+            BOOL sameValues = (existing.values == param.values) || [existing.values isEqualToSet:param.values];
+            if ([existing.name isEqualToString:param.name] && sameValues) {
+                return existing.node;
+            }
+        }
+        child = [LOPathPatternNode new];
+        param.node = child;
+        [_params addObject:param];
+    }
+    else if ([segment integerValue] == LOPathPatternStar) {
+        if (!_star) {
+            _star = [LOPathPatternNode new];
+        }
+        child = _star;
+    }
+    else {
+        if (!_doubleStar) {
+            _doubleStar = [LOPathPatternNode new];
+        }
+        child = _doubleStar;
+    }
+    return child;
+}
+
+@end
+
+@implementation LOPathPatternMatch
+
+- (id)initWithValue:(id)value priority:(NSInteger)priority parameters:(NSDictionary *)parameters {
+    self = [super init];
+    if (self) {
+        _value = value;
+        _priority = priority;
+        _parameters = parameters;
+    }
+    return self;
+}
+
+@end
+
+@implementation LOPathPatternTrie
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        _root = [LOPathPatternNode new];
+    }
+    return self;
+}
+
+- (BOOL)addPattern:(NSString *)pattern value:(id)value priority:(NSInteger)priority {
+    NSArray *expanded = [self expandOptionalGroups:pattern];
+    if (!expanded) {
+        return NO;
+    }
+    // Parse all pattern variants before modifying the trie.
+    NSMutableArray *variants = [NSMutableArray new];
+    for (NSString *variant in expanded) {
+        NSArray *segments = [self parsePattern:variant];
+        if (!segments) {
+            return NO;
+        }
+        [variants addObject:segments];
+    }
+    for (NSArray *segments in variants) {
+        LOPathPatternNode *node = _root;
+        node.minPriority = MIN(node.minPriority, priority);
+        for (id segment in segments) {
+            node = [node childForSegment:segment];
+            node.minPriority = MIN(node.minPriority, priority);
+        }
+        if (priority < node.priority) {
+            node.priority = priority;
+            node.value = value;
+        }
+    }
+    return YES;
+}
+
+- (LOPathPatternMatch *)matchPath:(NSString *)path {
+    return [self matchPath:path priorityLimit:NSIntegerMax];
+}
+
+- (LOPathPatternMatch *)matchPath:(NSString *)path priorityLimit:(NSInteger)limit {
+    LOPathPatternMatch *best = nil;
+    [self matchNode:_root
+           segments:SplitPath(path)
+              index:0
+         parameters:[NSMutableDictionary new]
+               best:&best
+              limit:limit];
+    return best;
+}
+
+#pragma mark - Private
+
+- (NSArray *)expandOptionalGroups:(NSString *)pattern {
+    NSRange open = [pattern rangeOfString:@"(" options:NSBackwardsSearch];
+    if (open.location == NSNotFound) {
+        return [pattern rangeOfString:@")"].location == NSNotFound ? @[ pattern ] : nil;
+    }
+    // Expand the innermost group; the last open bracket always starts an innermost group.
+    NSUInteger start = open.location + 1;
+    NSRange close = [pattern rangeOfString:@")?" options:0 range:NSMakeRange(start, [pattern length] - start)];
+    if (close.location == NSNotFound) {
+        // Not an optional group.
+        return nil;
+    }
+    NSString *group = [pattern substringWithRange:NSMakeRange(start, close.location - start)];
+    if ([group rangeOfString:@")"].location != NSNotFound) {
+        return nil;
+    }
+    NSString *head = [pattern substringToIndex:open.location];
+    NSString *tail = [pattern substringFromIndex:NSMaxRange(close)];
+    NSArray *with = [self expandOptionalGroups:[NSString stringWithFormat:@"%@%@%@", head, group, tail]];
+    NSArray *without = [self expandOptionalGroups:[NSString stringWithFormat:@"%@%@", head, tail]];
+    return (with && without) ? [with arrayByAddingObjectsFromArray:without] : nil;
+}
+
+- (NSArray *)parsePattern:(NSString *)pattern {
+    static NSRegularExpression *paramRE;
+    static NSCharacterSet *specialChars, *alternativeChars;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        paramRE = [NSRegularExpression regularExpressionWithPattern:@"^\\{(\\w+)(?::([^{}]*))?\\}$" options:0 error:nil];
+        specialChars = [NSCharacterSet characterSetWithCharactersInString:@"*?{}()[]|\\"];
+        alternativeChars = [NSCharacterSet characterSetWithCharactersInString:@"*?{}()[].+^$\\"];
+    });
+    NSMutableArray *segments = [NSMutableArray new];
+    for (NSString *segment in SplitPath(pattern)) {
+        if ([segment isEqualToString:@"**"]) {
+            [segments addObject:@(LOPathPatternDoubleStar)];
+            continue;
+        }
+        if ([segment isEqualToString:@"*"]) {
+            [segments addObject:@(LOPathPatternStar)];
+            continue;
+        }
+        NSTextCheckingResult *match = [paramRE firstMatchInString:segment options:0 range:NSMakeRange(0, [segment length])];
+        if (match) {
+            LOPathPatternParam *param = [LOPathPatternParam new];
+            param.name = [segment substringWithRange:[match rangeAtIndex:1]];
+            NSRange valuesRange = [match rangeAtIndex:2];
+            if (valuesRange.location != NSNotFound) {
+                NSString *values = [segment substringWithRange:valuesRange];
+                if ([values rangeOfCharacterFromSet:alternativeChars].location != NSNotFound) {
+                    // Parameter value is a regex, rather than a list of alternatives.
+                    return nil;
+                }
+                param.values = [NSSet setWithArray:[values componentsSeparatedByString:@"|"]];
+            }
+            [segments addObject:param];
+            continue;
+        }
+        if ([segment rangeOfCharacterFromSet:specialChars].location != NSNotFound) {
+            // Wildcard or parameter within a segment.
+            return nil;
+        }
+        [segments addObject:segment];
+    }
+    return segments;
+}
+
+- (void)matchNode:(LOPathPatternNode *)node
+         segments:(NSArray *)segments
+            index:(NSUInteger)idx
+       parameters:(NSMutableDictionary *)parameters
+             best:(LOPathPatternMatch **)best
+            limit:(NSInteger)limit {
+    // Prune branches which can't improve on the best match found so far.
+    NSInteger bound = *best ? (*best).priority : limit;
+    if (node.minPriority >= bound) {
+        return;
+    }
+    if (idx == [segments count]) {
+        if (node.priority < bound) {
+            *best = [[LOPathPatternMatch alloc] initWithValue:node.value
+                                                     priority:node.priority
+                                                   parameters:[parameters copy]];
+        }
+        // A trailing multi-segment wildcard can match zero segments.
+        if (node.doubleStar) {
+            [self matchNode:node.doubleStar segments:segments index:idx parameters:parameters best:best limit:limit];
+        }
+        return;
+    }
+    NSString *segment = segments[idx];
+    LOPathPatternNode *literal = node.literals[segment];
+    if (literal) {
+        [self matchNode:literal segments:segments index:idx + 1 parameters:parameters best:best limit:limit];
+    }
+    for (LOPathPatternParam *param in node.params) {
+        if (param.values == nil || [param.values containsObject:segment]) {
+            id previous = parameters[param.name];
+            parameters[param.name] = segment;
+            [self matchNode:param.node segments:segments index:idx + 1 parameters:parameters best:best limit:limit];
+            parameters[param.name] = previous;
+        }
+    }
+    if (node.star) {
+        [self matchNode:node.star segments:segments index:idx + 1 parameters:parameters best:best limit:limit];
+    }
+    if (node.doubleStar) {
+        for (NSUInteger next = idx; next <= [segments count]; next++) {
+            [self matchNode:node.doubleStar segments:segments index:next parameters:parameters best:best limit:limit];
+        }
+    }
+}
+
+@end
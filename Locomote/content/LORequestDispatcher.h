@@ -58,7 +58,11 @@
 /**
  * A class for dispatching content URL requests to an appropriate handler.
  * Handlers are identified by mappings which map a request path or pattern to a
- * handler instance.
+ * handler instance. Where a request path matches more than one mapping, the first
+ * matching mapping in the host's list is used.
+ * Mapping patterns are compiled into a trie the first time a request is dispatched, and
+ * recompiled whenever the host's list of mappings is replaced; patterns not supported by
+ * the trie are matched individually using IFFilePathPattern.
  */
 @interface LORequestDispatcher : NSObject {
     id<LORequestDispatcherHost> _host;
@@ -68,5 +72,11 @@
 - (id)initWithHost:(id<LORequestDispatcherHost>)host;
 /// Dispatch a request.
 - (void)dispatchRequest:(id<LOContentRequest>)request response:(id<LOContentResponse>)response;
+/**
+ * Find the request handler mapping for a path.
+ * Returns nil if no mapping matches the path. If the parameters pointer is provided then
+ * it is set to the path parameters extracted from the path by the mapping's pattern.
+ */
+- (LORequestHandlerMapping *)mappingForPath:(NSString *)path parameters:(NSDictionary **)parameters;
 
 @end
@@ -18,9 +18,24 @@
 
 #import "LORequestDispatcher.h"
 #import "LOContentAuthority.h"
+#import "LOPathPatternTrie.h"
 #import "IFFilePathPattern.h"
 #import "NSDictionary+SC.h"
 
+@interface LORequestDispatcher () {
+    /// The list of mappings that the trie was compiled from.
+    NSArray<LORequestHandlerMapping *> *_compiledMappings;
+    /// Compiled mapping patterns; each pattern's priority is its mapping's index.
+    LOPathPatternTrie *_trie;
+    /// Indexes of mappings whose patterns couldn't be compiled.
+    NSArray<NSNumber *> *_uncompiledIndexes;
+}
+
+/// Compile the host's mappings, if not already compiled.
+- (void)compileMappings:(NSArray<LORequestHandlerMapping *> *)mappings;
+
+@end
+
 @implementation LORequestHandlerMapping
 
 - (id)initWithPath:(NSString *)path handler:(id<LORequestHandler>)handler {
@@ -43,20 +58,72 @@
 }
 
 - (void)dispatchRequest:(id<LOContentRequest>)request response:(id<LOContentResponse>)response {
+    NSDictionary *matches = nil;
+    LORequestHandlerMapping *mapping = [self mappingForPath:request.path parameters:&matches];
+    if (mapping) {
+        // Match found, update the path parameters and dispatch the request.
+        request.pathParameters = [request.pathParameters extendWith:matches];
+        [mapping.handler handleRequest:request response:response];
+        return;
+    }
+    // No mapping found, return with path not found error.
+    [response respondWithError:makePathNotFoundResponseError(request.path)];
+}
+
+- (LORequestHandlerMapping *)mappingForPath:(NSString *)path parameters:(NSDictionary **)parameters {
     NSArray<LORequestHandlerMapping *> *mappings = _host.requestHandlers;
-    // Iterate over the request handler mappings.
-    for (LORequestHandlerMapping *mapping in mappings) {
-        // Test the mapping path against the current path.
-        NSDictionary *matches = [IFFilePathPattern matchPath:request.path usingPattern:mapping.path];
+    LOPathPatternTrie *trie;
+    NSArray<NSNumber *> *uncompiledIndexes;
+    @synchronized (self) {
+        [self compileMappings:mappings];
+        trie = _trie;
+        uncompiledIndexes = _uncompiledIndexes;
+    }
+    LOPathPatternMatch *match = [trie matchPath:path];
+    NSInteger limit = match ? match.priority : NSIntegerMax;
+    // Test any uncompiled patterns which precede the compiled match.
+    for (NSNumber *index in uncompiledIndexes) {
+        NSInteger idx = [index integerValue];
+        if (idx >= limit) {
+            break;
+        }
+        LORequestHandlerMapping *mapping = mappings[idx];
+        NSDictionary *matches = [IFFilePathPattern matchPath:path usingPattern:mapping.path];
         if (matches) {
-            // Match found, update the path parameters and dispatch the request.
-            request.pathParameters = [request.pathParameters extendWith:matches];
-            [mapping.handler handleRequest:request response:response];
-            return;
+            if (parameters) {
+                *parameters = matches;
+            }
+            return mapping;
         }
     }
-    // No mapping found, return with path not found error.
-    [response respondWithError:makePathNotFoundResponseError(request.path)];
+    if (match) {
+        if (parameters) {
+            *parameters = match.parameters;
+        }
+        return match.value;
+    }
+    return nil;
+}
+
+#pragma mark - Private
+
+- (void)compileMappings:(NSArray<LORequestHandlerMapping *> *)mappings {
+    if (_trie && mappings == _compiledMappings) {
+        return;
+    }
+    LOPathPatternTrie *trie = [LOPathPatternTrie new];
+    NSMutableArray *uncompiledIndexes = [NSMutableArray new];
+    NSInteger idx = 0;
+    for (LORequestHandlerMapping *mapping in mappings) {
+        // Mapping index is used as the pattern priority, so that the first matching mapping is used.
+        if (![trie addPattern:mapping.path value:mapping priority:idx]) {
+            [uncompiledIndexes addObject:@(idx)];
+        }
+        idx++;
+    }
+    _trie = trie;
+    _uncompiledIndexes = uncompiledIndexes;
+    _compiledMappings = mappings;
 }
 
 @end
@@ -0,0 +1,496 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Measures file DB write throughput and request handler latency against a synthetic repository.
+// Usage: LOFileDBBenchmark [-files N,N,...] [-samples N]
+// For each file count, generates a repository of pages (with HTML content and meta rows), images
+// and assets in a new file DB, and measures:
+// - upsertValues:intoTable: and upsertValueBatch:intoTable: throughput;
+// - pruneRelatedValues, after an update which drops meta rows;
+// - readFileRecordByPath: latency, with and without the record cache;
+// - file.api list latency per relation, and fileset.api latency;
+// - search.api latency per search mode;
+// - renderPageContent: latency, using a page template from the templates fileset.
+// Latencies are reported in milliseconds as percentiles; results are printed as JSON.
+
+#import <Foundation/Foundation.h>
+#import "LOCMSRepository.h"
+#import "LOCMSFileHandler.h"
+#import "LOCMSFileListHandler.h"
+#import "LOCMSSearchHandler.h"
+
+#define DefaultFileCounts   (@"1000,10000")
+#define DefaultSamples      (1000)
+// The number of records written per upsertValueBatch:intoTable: call, as when applying an updates feed.
+#define UpsertBatchSize     (200)
+// The fraction of files which are pages; the remainder are split between images and assets.
+#define PageFraction        (0.6)
+#define ImageFraction       (0.3)
+
+#define PageTemplate        (@"<html><head><title>{{title}}</title></head><body><article><h1>{{title}}</h1>" \
+                              "<img src=\"{{image}}\">{{{content}}}</article></body></html>")
+
+// Exposes the file handler's page renderer to the benchmark.
+@interface LOCMSFileHandler (Benchmark)
+
+- (NSString *)renderPageContent:(NSDictionary *)record;
+
+@end
+
+/// A content request with fixed properties.
+@interface LOBenchmarkRequest : NSObject <LOContentRequest>
+
+- (id)initWithPath:(NSString *)path parameters:(NSDictionary *)parameters pathParameters:(NSDictionary *)pathParameters;
+
+@end
+
+/// A content response which records whether it completed successfully.
+@interface LOBenchmarkResponse : NSObject <LOContentResponse>
+
+@property (nonatomic, assign) BOOL completed;
+@property (nonatomic, strong) NSError *error;
+
+@end
+
+@implementation LOBenchmarkRequest
+
+@synthesize authority=_authority, path=_path, parameters=_parameters, pathParameters=_pathParameters;
+
+- (id)initWithPath:(NSString *)path parameters:(NSDictionary *)parameters pathParameters:(NSDictionary *)pathParameters {
+    self = [super init];
+    if (self) {
+        _path = path;
+        _parameters = parameters ?: @{};
+        _pathParameters = pathParameters ?: @{};
+    }
+    return self;
+}
+
+@end
+
+@implementation LOBenchmarkResponse
+
+- (void)respondWithData:(NSData *)data mimeType:(NSString *)mimeType cachePolicy:(NSURLCacheStoragePolicy)policy {
+    _completed = YES;
+}
+
+- (void)respondWithMimeType:(NSString *)mimeType cacheStoragePolicy:(NSURLCacheStoragePolicy)policy {}
+
+- (void)sendData:(NSData *)data {}
+
+- (void)done {
+    _completed = YES;
+}
+
+- (void)respondWithStringData:(NSString *)data mimeType:(NSString *)mimeType cachePolicy:(NSURLCacheStoragePolicy)cachePolicy {
+    _completed = YES;
+}
+
+- (void)respondWithJSONData:(id)data cachePolicy:(NSURLCacheStoragePolicy)cachePolicy {
+    // Serialize the data, as a real response would.
+    [NSJSONSerialization dataWithJSONObject:data options:0 error:nil];
+    _completed = YES;
+}
+
+- (void)respondWithFileData:(NSString *)filepath mimeType:(NSString *)mimeType cachePolicy:(NSURLCacheStoragePolicy)cachePolicy {
+    _completed = YES;
+}
+
+- (void)respondWithError:(NSError *)error {
+    _error = error;
+    _completed = YES;
+}
+
+@end
+
+/// Return the current time, in seconds.
+static NSTimeInterval Now(void) {
+    return [[NSProcessInfo processInfo] systemUptime];
+}
+
+/// Summarize a list of latency samples, in milliseconds.
+static NSDictionary *Summarize(NSMutableArray<NSNumber *> *samples) {
+    NSUInteger count = [samples count];
+    if (count == 0) {
+        return @{ @"count": @0 };
+    }
+    [samples sortUsingSelector:@selector(compare:)];
+    double sum = 0;
+    for (NSNumber *sample in samples) {
+        sum += [sample doubleValue];
+    }
+    NSNumber *(^percentile)(double) = ^(double p) {
+        return samples[MIN((NSUInteger)(p * count), count - 1)];
+    };
+    return @{
+        @"count":   @(count),
+        @"mean":    @(sum / count),
+        @"min":     samples[0],
+        @"p50":     percentile(0.5),
+        @"p90":     percentile(0.9),
+        @"p99":     percentile(0.99),
+        @"max":     samples[count - 1]
+    };
+}
+
+/// Time a block a number of times, passing the iteration index, and summarize the latencies.
+static NSDictionary *Measure(NSUInteger samples, BOOL (^block)(NSUInteger i)) {
+    NSMutableArray *latencies = [NSMutableArray new];
+    NSUInteger failures = 0;
+    for (NSUInteger i = 0; i < samples; i++) {
+        @autoreleasepool {
+            NSTimeInterval start = Now();
+            BOOL ok = block(i);
+            [latencies addObject:@((Now() - start) * 1000.0)];
+            if (!ok) {
+                failures++;
+            }
+        }
+    }
+    NSMutableDictionary *summary = [Summarize(latencies) mutableCopy];
+    summary[@"failures"] = @(failures);
+    return summary;
+}
+
+/// Dispatch a request to a handler, and test that it completed without error.
+static BOOL Dispatch(id<LORequestHandler> handler, LOBenchmarkRequest *request) {
+    LOBenchmarkResponse *response = [LOBenchmarkResponse new];
+    [handler handleRequest:request response:response];
+    return response.completed && !response.error;
+}
+
+/// A synthetic repository's content.
+@interface LOBenchmarkContent : NSObject
+
+@property (nonatomic, strong) NSMutableArray<NSDictionary *> *files;
+@property (nonatomic, strong) NSMutableArray<NSDictionary *> *pages;
+@property (nonatomic, strong) NSMutableArray<NSDictionary *> *meta;
+@property (nonatomic, strong) NSMutableArray<NSString *> *pageIDs;
+@property (nonatomic, strong) NSArray<NSString *> *words;
+
+@end
+
+@implementation LOBenchmarkContent
+@end
+
+/// Generate a synthetic repository of the specified number of files.
+static LOBenchmarkContent *GenerateContent(NSUInteger fileCount) {
+    LOBenchmarkContent *content = [LOBenchmarkContent new];
+    content.files = [NSMutableArray new];
+    content.pages = [NSMutableArray new];
+    content.meta = [NSMutableArray new];
+    content.pageIDs = [NSMutableArray new];
+    // A vocabulary of words; word frequency is skewed towards the start of the list, so that
+    // searches for common words match many pages and searches for rare words match few.
+    NSMutableArray *words = [NSMutableArray new];
+    NSArray *stems = @[ @"content", @"mobile", @"update", @"release", @"design", @"server", @"network",
+                        @"archive", @"journal", @"feature", @"report", @"summary", @"history", @"market" ];
+    for (NSUInteger i = 0; i < 2000; i++) {
+        [words addObject:[NSString stringWithFormat:@"%@%lu", stems[i % [stems count]], (unsigned long)(i / [stems count])]];
+    }
+    content.words = words;
+    srand(1);
+    NSString *(^word)(void) = ^() {
+        double r = (double)rand() / RAND_MAX;
+        return words[(NSUInteger)(r * r * r * [words count]) % [words count]];
+    };
+    NSString *(^sentence)(NSUInteger) = ^(NSUInteger length) {
+        NSMutableArray *parts = [NSMutableArray new];
+        for (NSUInteger i = 0; i < length; i++) {
+            [parts addObject:word()];
+        }
+        return [parts componentsJoinedByString:@" "];
+    };
+
+    NSUInteger pageCount = (NSUInteger)(fileCount * PageFraction);
+    NSUInteger imageCount = (NSUInteger)(fileCount * ImageFraction);
+    NSArray *pageTypes = @[ @"article", @"news", @"event" ];
+    for (NSUInteger i = 0; i < fileCount; i++) {
+        NSString *fileID = [NSString stringWithFormat:@"f%06lu", (unsigned long)i];
+        NSString *category, *path;
+        if (i < pageCount) {
+            // Pages are spread over a two level directory hierarchy.
+            category = @"pages";
+            path = [NSString stringWithFormat:@"/section-%02lu/topic-%03lu/page-%06lu.html",
+                    (unsigned long)(i % 20), (unsigned long)(i % 400), (unsigned long)i];
+        }
+        else if (i < pageCount + imageCount) {
+            category = @"images";
+            path = [NSString stringWithFormat:@"/images/%02lu/image-%06lu.jpg", (unsigned long)(i % 50), (unsigned long)i];
+        }
+        else {
+            category = @"assets";
+            path = [NSString stringWithFormat:@"/assets/asset-%06lu.css", (unsigned long)i];
+        }
+        [content.files addObject:@{
+            @"id":          fileID,
+            @"path":        path,
+            @"category":    category,
+            @"status":      @"published",
+            @"version":     @"c1"
+        }];
+        if (![@"pages" isEqualToString:category]) {
+            continue;
+        }
+        [content.pageIDs addObject:fileID];
+        // Page HTML of a few KB, with headings, paragraphs, links and images.
+        NSMutableString *html = [NSMutableString new];
+        NSUInteger sections = 3 + i % 4;
+        for (NSUInteger s = 0; s < sections; s++) {
+            [html appendFormat:@"<h2>%@</h2>", sentence(4)];
+            [html appendFormat:@"<p>%@ <a href=\"../topic-%03lu/page-%06lu.html\">%@</a> %@.</p>",
+             sentence(40), (unsigned long)((i + s) % 400), (unsigned long)((i + s * 7) % MAX(pageCount, 1)), sentence(3), sentence(30)];
+            [html appendFormat:@"<p><img src=\"/images/%02lu/image-%06lu.jpg\" alt=\"%@\"></p>",
+             (unsigned long)((i + s) % 50), (unsigned long)(pageCount + (i + s) % MAX(imageCount, 1)), sentence(5)];
+        }
+        [content.pages addObject:@{
+            @"id":          fileID,
+            @"type":        pageTypes[i % [pageTypes count]],
+            @"title":       sentence(6),
+            @"sort":        [NSString stringWithFormat:@"%06lu", (unsigned long)i],
+            @"content":     html,
+            @"image":       [NSString stringWithFormat:@"/images/%02lu/image-%06lu.jpg", (unsigned long)(i % 50), (unsigned long)(pageCount + i % MAX(imageCount, 1))],
+            @"version":     @"c1"
+        }];
+        for (NSString *key in @[ @"author", @"tags", @"summary" ]) {
+            [content.meta addObject:@{
+                @"id":          [NSString stringWithFormat:@"%@:%@", fileID, key],
+                @"fileid":      fileID,
+                @"key":         key,
+                @"value":       sentence([@"summary" isEqualToString:key] ? 20 : 2),
+                @"version":     @"c1"
+            }];
+        }
+    }
+    return content;
+}
+
+/// Write records to a table with upsertValueBatch:intoTable:, and return the throughput.
+static NSDictionary *MeasureBatchUpsert(LOCMSFileDB *fileDB, NSArray *records, NSString *table) {
+    NSTimeInterval start = Now();
+    NSUInteger count = [records count];
+    [fileDB performTransaction:^BOOL {
+        for (NSUInteger i = 0; i < count; i += UpsertBatchSize) {
+            @autoreleasepool {
+                NSArray *batch = [records subarrayWithRange:NSMakeRange(i, MIN(UpsertBatchSize, count - i))];
+                [fileDB upsertValueBatch:batch intoTable:table];
+            }
+        }
+        return YES;
+    }];
+    double seconds = Now() - start;
+    return @{ @"rows": @(count), @"seconds": @(seconds), @"rowsPerSec": @(count / MAX(seconds, 1e-9)) };
+}
+
+/// Write records to a table one at a time with upsertValues:intoTable:, and return the throughput.
+static NSDictionary *MeasureUpsert(LOCMSFileDB *fileDB, NSArray *records, NSString *table) {
+    NSTimeInterval start = Now();
+    [fileDB performTransaction:^BOOL {
+        for (NSDictionary *record in records) {
+            @autoreleasepool {
+                [fileDB upsertValues:record intoTable:table];
+            }
+        }
+        return YES;
+    }];
+    double seconds = Now() - start;
+    NSUInteger count = [records count];
+    return @{ @"rows": @(count), @"seconds": @(seconds), @"rowsPerSec": @(count / MAX(seconds, 1e-9)) };
+}
+
+/// Run all benchmarks against a new repository of the specified size.
+static NSDictionary *RunBenchmarks(NSUInteger fileCount, NSUInteger samples, NSString *workPath) {
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSString *runPath = [workPath stringByAppendingPathComponent:[NSString stringWithFormat:@"%lu", (unsigned long)fileCount]];
+
+    LOCMSRepository *repository = [LOCMSRepository new];
+    LOLocalCachePaths *cachePaths = [LOLocalCachePaths new];
+    cachePaths.stagingPath = [runPath stringByAppendingPathComponent:@"staging"];
+    cachePaths.appCachePath = [runPath stringByAppendingPathComponent:@"app"];
+    cachePaths.contentCachePath = [runPath stringByAppendingPathComponent:@"content"];
+    cachePaths.packagedContentPath = [runPath stringByAppendingPathComponent:@"packaged"];
+    repository.localCachePaths = cachePaths;
+    LOCMSFileDB *fileDB = repository.fileDB;
+    fileDB.name = [NSString stringWithFormat:@"LOFileDBBenchmark-%d-%lu", getpid(), (unsigned long)fileCount];
+    [fileDB startService];
+
+    LOBenchmarkContent *content = GenerateContent(fileCount);
+    NSMutableDictionary *results = [NSMutableDictionary new];
+
+    // Write throughput. Files are written one at a time, as by the generic SCDB path; pages and
+    // meta are written in batches, as when applying an updates feed.
+    results[@"upsertValues.files"] = MeasureUpsert(fileDB, content.files, @"files");
+    results[@"upsertValueBatch.pages"] = MeasureBatchUpsert(fileDB, content.pages, @"pages");
+    results[@"upsertValueBatch.meta"] = MeasureBatchUpsert(fileDB, content.meta, @"meta");
+    // Rewrite the files in batches, to compare with the single record path.
+    results[@"upsertValueBatch.files"] = MeasureBatchUpsert(fileDB, content.files, @"files");
+    [fileDB upsertValues:@{ @"id": @"c1", @"date": @"2018-01-01T00:00:00Z", @"subject": @"Benchmark" } intoTable:@"commits"];
+
+    // Prune: update a tenth of the pages to a new version without their meta rows, so that the
+    // prune removes the old meta rows.
+    NSMutableArray *updated = [NSMutableArray new];
+    for (NSUInteger i = 0; i < [content.pageIDs count]; i += 10) {
+        NSMutableDictionary *file = [content.files[i] mutableCopy];
+        file[@"version"] = @"c2";
+        [updated addObject:file];
+    }
+    __block double pruneSeconds = 0;
+    [fileDB performTransaction:^BOOL {
+        [fileDB upsertValueBatch:updated intoTable:@"files"];
+        NSTimeInterval start = Now();
+        [fileDB pruneRelatedValues];
+        pruneSeconds = Now() - start;
+        return YES;
+    }];
+    [fileDB incrementGeneration];
+    results[@"pruneRelatedValues"] = @{ @"updatedFiles": @([updated count]), @"seconds": @(pruneSeconds) };
+
+    // The page template.
+    NSString *templatePath = @"templates/page.html";
+    NSString *templateCachePath = [fileDB cacheLocationForFile:templatePath inFileset:@"templates"];
+    [fileManager createDirectoryAtPath:[templateCachePath stringByDeletingLastPathComponent]
+           withIntermediateDirectories:YES
+                            attributes:nil
+                                 error:nil];
+    [PageTemplate writeToFile:templateCachePath atomically:YES encoding:NSUTF8StringEncoding error:nil];
+    [fileDB upsertValues:@{ @"id": @"t1", @"path": templatePath, @"category": @"templates",
+                            @"status": @"published", @"version": @"c1" } intoTable:@"files"];
+    [fileDB incrementGeneration];
+
+    LOCMSFileHandler *fileHandler = [[LOCMSFileHandler alloc] initWithRepository:repository];
+    LOCMSFileListHandler *fileListHandler = [[LOCMSFileListHandler alloc] initWithRepository:repository];
+    LOCMSSearchHandler *searchHandler = [[LOCMSSearchHandler alloc] initWithRepository:repository];
+    NSArray *files = content.files;
+    NSArray *pageIDs = content.pageIDs;
+    NSUInteger fileSamples = MIN(samples, fileCount);
+
+    // Record reads; a stride through the files so that successive reads aren't adjacent rows.
+    NSUInteger stride = 7919;
+    LOCMSFileRecordCache *recordCache = fileHandler.recordCache;
+    fileHandler.recordCache = nil;
+    results[@"readFileRecordByPath.uncached"] = Measure(fileSamples, ^BOOL(NSUInteger i) {
+        return [fileHandler readFileRecordByPath:files[(i * stride) % fileCount][@"path"]] != nil;
+    });
+    fileHandler.recordCache = recordCache;
+    // Warm the cache, then measure.
+    for (NSUInteger i = 0; i < fileSamples; i++) {
+        [fileHandler readFileRecordByPath:files[(i * stride) % fileCount][@"path"]];
+    }
+    results[@"readFileRecordByPath.cached"] = Measure(fileSamples, ^BOOL(NSUInteger i) {
+        return [fileHandler readFileRecordByPath:files[(i * stride) % fileCount][@"path"]] != nil;
+    });
+
+    // File lists. Listing the whole repository is slow at large sizes, so fewer samples are taken.
+    NSUInteger pageCount = [pageIDs count];
+    NSUInteger listSamples = MIN(samples, 200);
+    for (NSString *relation in @[ @"siblings", @"children", @"descendents" ]) {
+        NSString *key = [@"file.api." stringByAppendingString:relation];
+        results[key] = Measure(listSamples, ^BOOL(NSUInteger i) {
+            NSString *fileID = pageIDs[(i * stride) % pageCount];
+            LOBenchmarkRequest *request = [[LOBenchmarkRequest alloc] initWithPath:@"file.api"
+                                                                        parameters:@{ @"_limit": @"50" }
+                                                                    pathParameters:@{ @"id": fileID, @"relation": relation }];
+            return Dispatch(fileListHandler, request);
+        });
+    }
+    results[@"file.api.all"] = Measure(MIN(samples, 20), ^BOOL(NSUInteger i) {
+        LOBenchmarkRequest *request = [[LOBenchmarkRequest alloc] initWithPath:@"file.api"
+                                                                    parameters:@{ @"_limit": @"50", @"_offset": [@(i * 50) stringValue] }
+                                                                pathParameters:nil];
+        return Dispatch(fileListHandler, request);
+    });
+    results[@"fileset.api.pages"] = Measure(MIN(samples, 20), ^BOOL(NSUInteger i) {
+        LOBenchmarkRequest *request = [[LOBenchmarkRequest alloc] initWithPath:@"fileset.api/pages"
+                                                                    parameters:@{ @"_limit": @"50", @"_offset": [@(i * 50) stringValue] }
+                                                                pathParameters:@{ @"category": @"pages" }];
+        return Dispatch(fileListHandler, request);
+    });
+
+    // Searches, for two words drawn from the whole vocabulary.
+    NSArray *words = content.words;
+    NSUInteger searchSamples = MIN(samples, 200);
+    for (NSString *mode in @[ @"exact", @"any", @"all" ]) {
+        NSString *key = [@"search.api." stringByAppendingString:mode];
+        results[key] = Measure(searchSamples, ^BOOL(NSUInteger i) {
+            NSString *text = [NSString stringWithFormat:@"%@ %@", words[(i * 31) % [words count]], words[(i * 17) % 50]];
+            LOBenchmarkRequest *request = [[LOBenchmarkRequest alloc] initWithPath:@"search.api"
+                                                                        parameters:@{ @"text": text, @"mode": mode }
+                                                                    pathParameters:nil];
+            return Dispatch(searchHandler, request);
+        });
+    }
+
+    // Page rendering; records are read first, so that only the render is timed.
+    NSUInteger renderSamples = MIN(samples, pageCount);
+    NSMutableArray *records = [NSMutableArray new];
+    for (NSUInteger i = 0; i < renderSamples; i++) {
+        NSDictionary *record = [fileHandler readFileRecordByID:pageIDs[(i * stride) % pageCount] inCategory:@"pages"];
+        if (record) {
+            [records addObject:record];
+        }
+    }
+    results[@"renderPageContent"] = Measure([records count], ^BOOL(NSUInteger i) {
+        return [fileHandler renderPageContent:records[i]] != nil;
+    });
+
+    // Remove the database file and cached content.
+    NSArray *rs = [fileDB performQuery:@"PRAGMA database_list" withParams:@[]];
+    for (NSDictionary *record in rs) {
+        if ([@"main" isEqualToString:record[@"name"]] && [record[@"file"] length] > 0) {
+            [fileManager removeItemAtPath:record[@"file"] error:nil];
+        }
+    }
+    [fileManager removeItemAtPath:runPath error:nil];
+
+    return @{
+        @"files":   @(fileCount),
+        @"pages":   @(pageCount),
+        @"meta":    @([content.meta count]),
+        @"results": results
+    };
+}
+
+int main(int argc, const char *argv[]) {
+    @autoreleasepool {
+        NSUserDefaults *args = [NSUserDefaults standardUserDefaults];
+        NSString *fileCounts = [args stringForKey:@"files"] ?: DefaultFileCounts;
+        NSUInteger samples   = [args integerForKey:@"samples"] ?: DefaultSamples;
+
+        NSString *workPath = [NSTemporaryDirectory() stringByAppendingPathComponent:
+                              [NSString stringWithFormat:@"LOFileDBBenchmark-%d", getpid()]];
+        NSMutableArray *runs = [NSMutableArray new];
+        for (NSString *value in [fileCounts componentsSeparatedByString:@","]) {
+            NSUInteger fileCount = (NSUInteger)[value integerValue];
+            if (fileCount == 0) {
+                fprintf(stderr, "Invalid file count: %s\n", [value UTF8String]);
+                return 1;
+            }
+            @autoreleasepool {
+                [runs addObject:RunBenchmarks(fileCount, samples, workPath)];
+            }
+        }
+        [[NSFileManager defaultManager] removeItemAtPath:workPath error:nil];
+
+        NSDictionary *report = @{
+            @"benchmark":   @"filedb",
+            @"samples":     @(samples),
+            @"runs":        runs
+        };
+        NSData *json = [NSJSONSerialization dataWithJSONObject:report options:NSJSONWritingPrettyPrinted error:nil];
+        fwrite([json bytes], 1, [json length], stdout);
+        fputc('\n', stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,283 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Measures content sync against the mock Locomote server in test/mockserver.
+// Usage: LOSyncBenchmark [-ref URL] [-cycles N] [-churn F] [-resets N] [-idle N] [-notify N] [-prefetch YES]
+// Start the mock server first, e.g.: ../mockserver/mockserver.py --files 100000
+// The benchmark syncs a new, empty repository from the server, and then runs a number of
+// refresh cycles; before each refresh, a commit changing a proportion (the churn) of the
+// server's files is added. Reset cycles change the server's ACM group, so that the refresh
+// receives a group mismatch response and resets the repository. Idle cycles follow the refresh
+// cycles, and refresh without any change on the server, so exercise conditional updates requests.
+// Notify cycles then start the repository's refresh scheduler, long-polling the server for change
+// notifications, and measure the time from a commit until it's applied. For each cycle, reports the
+// end-to-end time until the sync and all its follow-on operations complete, together with the
+// records and bytes served by the server during the cycle and the resulting throughput. After
+// the last cycle, the files in the local file DB are compared with the server's. Results are
+// printed as JSON.
+
+#import <Foundation/Foundation.h>
+#import "LOCMSRepository.h"
+#import "LOCMSSettings.h"
+
+#define DefaultRef          (@"http://localhost:8765/cms/0.2/bench/site")
+#define DefaultCycles       (10)
+#define DefaultChurn        (0.01)
+#define DefaultResets       (1)
+#define DefaultIdle         (3)
+#define DefaultNotify       (3)
+// The maximum time to wait for a sync to complete, in seconds.
+#define SyncTimeout         (3600)
+
+/// Return the current time, in seconds.
+static NSTimeInterval Now(void) {
+    return [[NSProcessInfo processInfo] systemUptime];
+}
+
+/// Make a request to one of the mock server's control endpoints, and return the JSON result.
+static NSDictionary *Control(NSURL *controlURL, NSString *command, NSDictionary *params) {
+    NSURLComponents *components = [NSURLComponents componentsWithURL:[controlURL URLByAppendingPathComponent:command]
+                                             resolvingAgainstBaseURL:NO];
+    NSMutableArray *items = [NSMutableArray new];
+    for (NSString *name in params) {
+        [items addObject:[NSURLQueryItem queryItemWithName:name value:[params[name] description]]];
+    }
+    components.queryItems = items;
+    __block NSDictionary *result = nil;
+    dispatch_semaphore_t done = dispatch_semaphore_create(0);
+    NSURLSessionDataTask *task = [[NSURLSession sharedSession] dataTaskWithURL:components.URL
+                                                             completionHandler:^(NSData *data, NSURLResponse *response, NSError *error) {
+        if (data) {
+            result = [NSJSONSerialization JSONObjectWithData:data options:0 error:nil];
+        }
+        dispatch_semaphore_signal(done);
+    }];
+    [task resume];
+    dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+    if (![result isKindOfClass:[NSDictionary class]]) {
+        fprintf(stderr, "Mock server request failed: %s\n", [[components.URL absoluteString] UTF8String]);
+        exit(1);
+    }
+    return result;
+}
+
+/// Run the main run loop until a condition is met, or the timeout passes; returns whether the condition was met.
+static BOOL WaitFor(BOOL (^condition)(void), NSTimeInterval timeout) {
+    // Promises may be resolved on the main thread, so run the main run loop whilst waiting.
+    NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:timeout];
+    while (!condition() && [deadline timeIntervalSinceNow] > 0) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+    }
+    return condition();
+}
+
+/// Sync a repository's content, and wait for the sync and all its follow-on operations to complete.
+static BOOL Sync(LOCMSRepository *repository) {
+    __block BOOL done = NO;
+    __block id failure = nil;
+    [repository syncContent]
+    .then((id)^(id result) {
+        done = YES;
+        return nil;
+    })
+    .fail(^(id error) {
+        failure = error;
+        done = YES;
+    });
+    WaitFor(^BOOL { return done; }, SyncTimeout);
+    if (failure || !done) {
+        fprintf(stderr, "Sync failed: %s\n", [[failure description] ?: @"timeout" UTF8String]);
+        return NO;
+    }
+    return YES;
+}
+
+/// Summarize a list of cycle times, in seconds.
+static NSDictionary *Summarize(NSMutableArray<NSNumber *> *samples) {
+    NSUInteger count = [samples count];
+    if (count == 0) {
+        return @{ @"count": @0 };
+    }
+    [samples sortUsingSelector:@selector(compare:)];
+    double sum = 0;
+    for (NSNumber *sample in samples) {
+        sum += [sample doubleValue];
+    }
+    return @{
+        @"count":   @(count),
+        @"mean":    @(sum / count),
+        @"p50":     samples[MIN((NSUInteger)(0.5 * count), count - 1)],
+        @"p90":     samples[MIN((NSUInteger)(0.9 * count), count - 1)],
+        @"max":     samples[count - 1]
+    };
+}
+
+int main(int argc, const char *argv[]) {
+    @autoreleasepool {
+        NSUserDefaults *args = [NSUserDefaults standardUserDefaults];
+        NSString *ref    = [args stringForKey:@"ref"] ?: DefaultRef;
+        NSInteger cycles = [args integerForKey:@"cycles"] ?: DefaultCycles;
+        double churn     = [args objectForKey:@"churn"] ? [args doubleForKey:@"churn"] : DefaultChurn;
+        NSInteger resets = [args objectForKey:@"resets"] ? [args integerForKey:@"resets"] : DefaultResets;
+        NSInteger idle   = [args objectForKey:@"idle"] ? [args integerForKey:@"idle"] : DefaultIdle;
+        NSInteger notify = [args objectForKey:@"notify"] ? [args integerForKey:@"notify"] : DefaultNotify;
+        BOOL prefetch    = [args boolForKey:@"prefetch"];
+
+        NSURL *refURL = [NSURL URLWithString:ref];
+        NSURL *controlURL = [[NSURL URLWithString:@"/_mock/" relativeToURL:refURL] absoluteURL];
+        NSDictionary *status = Control(controlURL, @"status", @{});
+
+        // Create a repository with an empty file DB and cache, in a temporary location.
+        NSString *workPath = [NSTemporaryDirectory() stringByAppendingPathComponent:
+                              [NSString stringWithFormat:@"LOSyncBenchmark-%d", getpid()]];
+        LOCMSSettings *settings = [[LOCMSSettings alloc] initWithRef:ref];
+        LOCMSRepository *repository = [[LOCMSRepository alloc] initWithSettings:settings];
+        LOLocalCachePaths *cachePaths = [LOLocalCachePaths new];
+        cachePaths.stagingPath = [workPath stringByAppendingPathComponent:@"staging"];
+        cachePaths.appCachePath = [workPath stringByAppendingPathComponent:@"app"];
+        cachePaths.contentCachePath = [workPath stringByAppendingPathComponent:@"content"];
+        cachePaths.packagedContentPath = [workPath stringByAppendingPathComponent:@"packaged"];
+        repository.localCachePaths = cachePaths;
+        LOCMSFileDB *fileDB = repository.fileDB;
+        fileDB.name = [NSString stringWithFormat:@"LOSyncBenchmark-%d", getpid()];
+        fileDB.initialCopyPath = [workPath stringByAppendingPathComponent:@"none.sqlite"];
+        [repository completeSetup];
+        repository.ops.prefetcher.enabled = prefetch;
+        [repository start];
+
+        // Spread reset cycles evenly over the refresh cycles.
+        NSInteger resetInterval = resets > 0 ? MAX(cycles / (resets + 1), 1) : 0;
+        NSMutableArray *results = [NSMutableArray new];
+        NSMutableDictionary *times = [NSMutableDictionary new];
+        unsigned long long totalRows = 0, totalBytes = 0;
+        double totalSeconds = 0;
+        BOOL ok = YES;
+        for (NSInteger cycle = 0; cycle <= cycles + idle + notify && ok; cycle++) {
+            NSString *type;
+            if (cycle == 0) {
+                type = @"initial";
+            }
+            else if (cycle > cycles + idle) {
+                type = @"notify";
+                if (!repository.refreshScheduler.running) {
+                    // Only notifications trigger refreshes during the notify cycles.
+                    LOCMSRefreshScheduler *scheduler = repository.refreshScheduler;
+                    scheduler.minInterval = SyncTimeout;
+                    scheduler.maxInterval = SyncTimeout;
+                    scheduler.notificationURL = settings.notificationsURL;
+                    [scheduler start];
+                }
+            }
+            else if (cycle > cycles) {
+                type = @"idle";
+            }
+            else if (resetInterval > 0 && cycle % resetInterval == 0 && cycle / resetInterval <= resets) {
+                type = @"reset";
+                Control(controlURL, @"group", @{});
+            }
+            else {
+                type = @"refresh";
+                Control(controlURL, @"commit", @{ @"churn": @(churn) });
+            }
+            Control(controlURL, @"stats", @{ @"reset": @1 });
+            NSTimeInterval start = Now();
+            if ([@"notify" isEqualToString:type]) {
+                // Wait for the scheduler to be notified of a new commit, and apply it.
+                NSString *head = Control(controlURL, @"commit", @{ @"churn": @(churn) })[@"head"];
+                ok = WaitFor(^BOOL { return [head isEqualToString:[repository.ops latestCommit]]; }, SyncTimeout);
+                if (!ok) {
+                    fprintf(stderr, "Commit %s wasn't notified\n", [head UTF8String]);
+                }
+            }
+            else {
+                ok = Sync(repository);
+            }
+            double seconds = Now() - start;
+            NSDictionary *stats = Control(controlURL, @"stats", @{});
+            unsigned long long rows = [stats[@"rows"] unsignedLongLongValue];
+            unsigned long long bytes = [stats[@"bytes"] unsignedLongLongValue];
+            totalRows += rows;
+            totalBytes += bytes;
+            totalSeconds += seconds;
+            if (!times[type]) {
+                times[type] = [NSMutableArray new];
+            }
+            [times[type] addObject:@(seconds)];
+            [results addObject:@{
+                @"cycle":       @(cycle),
+                @"type":        type,
+                @"ok":          @(ok),
+                @"seconds":     @(seconds),
+                @"rows":        @(rows),
+                @"bytes":       @(bytes),
+                @"rowsPerSec":  @(rows / MAX(seconds, 1e-9)),
+                @"bytesPerSec": @(bytes / MAX(seconds, 1e-9)),
+                @"requests":    stats[@"requests"] ?: @{},
+                @"statusCodes": stats[@"statusCodes"] ?: @{}
+            }];
+        }
+
+        [repository.refreshScheduler stop];
+        // Let any follow-ons of the last notified refresh complete.
+        ok = ok && Sync(repository);
+
+        // Check that the file DB matches the server.
+        status = Control(controlURL, @"status", @{});
+        NSArray *rs = [fileDB performQuery:@"SELECT count(*) AS count FROM files WHERE status != 'deleted'" withParams:@[]];
+        NSInteger localFiles = [[rs firstObject][@"count"] integerValue];
+        NSInteger serverFiles = [status[@"files"] integerValue];
+
+        NSMutableDictionary *summaries = [NSMutableDictionary new];
+        for (NSString *type in times) {
+            summaries[type] = Summarize(times[type]);
+        }
+        NSDictionary *report = @{
+            @"benchmark":   @"sync",
+            @"ref":         ref,
+            @"cycles":      @(cycles),
+            @"churn":       @(churn),
+            @"resets":      @(resets),
+            @"idle":        @(idle),
+            @"notify":      @(notify),
+            @"server":      status,
+            @"consistent":  @(ok && localFiles == serverFiles),
+            @"localFiles":  @(localFiles),
+            @"totals": @{
+                @"seconds":     @(totalSeconds),
+                @"rows":        @(totalRows),
+                @"bytes":       @(totalBytes),
+                @"rowsPerSec":  @(totalRows / MAX(totalSeconds, 1e-9)),
+                @"bytesPerSec": @(totalBytes / MAX(totalSeconds, 1e-9))
+            },
+            @"latency":     summaries,
+            @"results":     results,
+            @"metrics":     [repository.metrics snapshot]
+        };
+
+        // Remove the database file and cached content.
+        rs = [fileDB performQuery:@"PRAGMA database_list" withParams:@[]];
+        for (NSDictionary *record in rs) {
+            if ([@"main" isEqualToString:record[@"name"]] && [record[@"file"] length] > 0) {
+                [[NSFileManager defaultManager] removeItemAtPath:record[@"file"] error:nil];
+            }
+        }
+        [[NSFileManager defaultManager] removeItemAtPath:workPath error:nil];
+
+        NSData *json = [NSJSONSerialization dataWithJSONObject:report options:NSJSONWritingPrettyPrinted error:nil];
+        fwrite([json bytes], 1, [json length], stdout);
+        fputc('\n', stdout);
+        return ok ? 0 : 1;
+    }
+}
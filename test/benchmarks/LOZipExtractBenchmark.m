@@ -0,0 +1,195 @@
+// Copyright 2018 InnerFunction Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Measures fileset zip extraction throughput as the number of extraction workers increases.
+// Usage: LOZipExtractBenchmark [-files N] [-size BYTES] [-runs N]
+// Generates a synthetic archive of N small files, then extracts it with 1, 2, 4 ... workers up to
+// the number of active processors, and prints the results as JSON.
+
+#import <Foundation/Foundation.h>
+#import <zlib.h>
+#import "LOCMSZipArchiveExtractor.h"
+
+#define DefaultFileCount    (10000)
+#define DefaultFileSize     (8 * 1024)
+#define DefaultRuns         (3)
+
+/// Append a little-endian 16 bit value.
+static void AppendUInt16(NSMutableData *data, uint32_t value) {
+    uint8_t bytes[2] = { value & 0xFF, (value >> 8) & 0xFF };
+    [data appendBytes:bytes length:2];
+}
+
+/// Append a little-endian 32 bit value.
+static void AppendUInt32(NSMutableData *data, uint32_t value) {
+    uint8_t bytes[4] = { value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, (value >> 24) & 0xFF };
+    [data appendBytes:bytes length:4];
+}
+
+/// Generate file content which compresses roughly like an image fileset; part repetitive, part random.
+static NSData *MakeContent(NSUInteger size, unsigned int seed) {
+    NSMutableData *content = [NSMutableData dataWithLength:size];
+    uint8_t *p = [content mutableBytes];
+    srand(seed);
+    for (NSUInteger i = 0; i < size; i++) {
+        p[i] = (i % 4 == 0) ? (uint8_t)rand() : (uint8_t)(i / 64);
+    }
+    return content;
+}
+
+/// Write a zip archive of deflated files, and return the total uncompressed size.
+static unsigned long long WriteArchive(NSString *path, NSUInteger fileCount, NSUInteger fileSize) {
+    NSMutableData *archive = [NSMutableData new];
+    NSMutableData *directory = [NSMutableData new];
+    unsigned long long totalSize = 0;
+    for (NSUInteger i = 0; i < fileCount; i++) {
+        // Spread files over directories, as in a typical images fileset.
+        NSString *name = [NSString stringWithFormat:@"images/%02lu/%03lu/image-%06lu.jpg",
+                          (unsigned long)(i % 16), (unsigned long)(i % 200), (unsigned long)i];
+        NSData *nameData = [name dataUsingEncoding:NSUTF8StringEncoding];
+        NSData *content = MakeContent(fileSize, (unsigned int)i);
+        uLong crc = crc32(crc32(0L, Z_NULL, 0), [content bytes], (uInt)[content length]);
+        // Raw deflate the content.
+        uLong bound = compressBound((uLong)[content length]);
+        NSMutableData *compressed = [NSMutableData dataWithLength:bound];
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+        zs.next_in = (Bytef *)[content bytes];
+        zs.avail_in = (uInt)[content length];
+        zs.next_out = [compressed mutableBytes];
+        zs.avail_out = (uInt)bound;
+        deflate(&zs, Z_FINISH);
+        [compressed setLength:zs.total_out];
+        deflateEnd(&zs);
+
+        uint32_t offset = (uint32_t)[archive length];
+        AppendUInt32(archive, 0x04034b50);
+        AppendUInt16(archive, 20);
+        AppendUInt16(archive, 0);
+        AppendUInt16(archive, 8);
+        AppendUInt32(archive, 0);
+        AppendUInt32(archive, (uint32_t)crc);
+        AppendUInt32(archive, (uint32_t)[compressed length]);
+        AppendUInt32(archive, (uint32_t)[content length]);
+        AppendUInt16(archive, (uint32_t)[nameData length]);
+        AppendUInt16(archive, 0);
+        [archive appendData:nameData];
+        [archive appendData:compressed];
+
+        AppendUInt32(directory, 0x02014b50);
+        AppendUInt16(directory, 20);
+        AppendUInt16(directory, 20);
+        AppendUInt16(directory, 0);
+        AppendUInt16(directory, 8);
+        AppendUInt32(directory, 0);
+        AppendUInt32(directory, (uint32_t)crc);
+        AppendUInt32(directory, (uint32_t)[compressed length]);
+        AppendUInt32(directory, (uint32_t)[content length]);
+        AppendUInt16(directory, (uint32_t)[nameData length]);
+        AppendUInt16(directory, 0);
+        AppendUInt16(directory, 0);
+        AppendUInt16(directory, 0);
+        AppendUInt16(directory, 0);
+        AppendUInt32(directory, 0);
+        AppendUInt32(directory, offset);
+        [directory appendData:nameData];
+        totalSize += [content length];
+    }
+    uint32_t directoryOffset = (uint32_t)[archive length];
+    [archive appendData:directory];
+    AppendUInt32(archive, 0x06054b50);
+    AppendUInt16(archive, 0);
+    AppendUInt16(archive, 0);
+    AppendUInt16(archive, (uint32_t)fileCount);
+    AppendUInt16(archive, (uint32_t)fileCount);
+    AppendUInt32(archive, (uint32_t)[directory length]);
+    AppendUInt32(archive, directoryOffset);
+    AppendUInt16(archive, 0);
+    [archive writeToFile:path atomically:NO];
+    return totalSize;
+}
+
+int main(int argc, const char *argv[]) {
+    @autoreleasepool {
+        NSUserDefaults *args = [NSUserDefaults standardUserDefaults];
+        NSUInteger fileCount = [args integerForKey:@"files"] ?: DefaultFileCount;
+        NSUInteger fileSize  = [args integerForKey:@"size"] ?: DefaultFileSize;
+        NSUInteger runs      = [args integerForKey:@"runs"] ?: DefaultRuns;
+        if (fileCount > 0xFFFF) {
+            fprintf(stderr, "File count must be less than 65536\n");
+            return 1;
+        }
+
+        NSFileManager *fileManager = [NSFileManager defaultManager];
+        NSString *workPath = [NSTemporaryDirectory() stringByAppendingPathComponent:
+                              [NSString stringWithFormat:@"LOZipExtractBenchmark-%d", getpid()]];
+        [fileManager createDirectoryAtPath:workPath withIntermediateDirectories:YES attributes:nil error:nil];
+        NSString *archivePath = [workPath stringByAppendingPathComponent:@"fileset.zip"];
+        unsigned long long totalSize = WriteArchive(archivePath, fileCount, fileSize);
+
+        NSUInteger processors = [[NSProcessInfo processInfo] activeProcessorCount];
+        NSMutableArray *workerCounts = [NSMutableArray new];
+        for (NSUInteger workers = 1; workers < processors; workers *= 2) {
+            [workerCounts addObject:@(workers)];
+        }
+        [workerCounts addObject:@(processors)];
+
+        NSMutableArray *results = [NSMutableArray new];
+        double baseline = 0;
+        for (NSNumber *workers in workerCounts) {
+            double best = 0;
+            for (NSUInteger run = 0; run < runs; run++) {
+                NSString *outputPath = [workPath stringByAppendingPathComponent:@"output"];
+                [fileManager removeItemAtPath:outputPath error:nil];
+                LOCMSZipArchiveExtractor *extractor = [[LOCMSZipArchiveExtractor alloc] initWithArchivePath:archivePath];
+                extractor.maxConcurrency = [workers unsignedIntegerValue];
+                NSError *error = nil;
+                NSDate *start = [NSDate date];
+                if (![extractor extractToPath:outputPath error:&error]) {
+                    fprintf(stderr, "Extraction failed: %s\n", [[error description] UTF8String]);
+                    return 1;
+                }
+                double seconds = -[start timeIntervalSinceNow];
+                best = (best == 0) ? seconds : MIN(best, seconds);
+            }
+            if (baseline == 0) {
+                baseline = best;
+            }
+            [results addObject:@{
+                @"workers":     workers,
+                @"seconds":     @(best),
+                @"filesPerSec": @(fileCount / best),
+                @"mbPerSec":    @(totalSize / best / (1024.0 * 1024.0)),
+                @"speedup":     @(baseline / best)
+            }];
+        }
+        [fileManager removeItemAtPath:workPath error:nil];
+
+        NSDictionary *report = @{
+            @"benchmark":   @"zip-extract",
+            @"files":       @(fileCount),
+            @"fileSize":    @(fileSize),
+            @"totalBytes":  @(totalSize),
+            @"processors":  @(processors),
+            @"runs":        @(runs),
+            @"results":     results
+        };
+        NSData *json = [NSJSONSerialization dataWithJSONObject:report options:NSJSONWritingPrettyPrinted error:nil];
+        fwrite([json bytes], 1, [json length], stdout);
+        fputc('\n', stdout);
+    }
+    return 0;
+}
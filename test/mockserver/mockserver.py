@@ -0,0 +1,716 @@
+#!/usr/bin/env python3
+# Copyright 2018 InnerFunction Ltd.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+"""
+A local stand-in for the Locomote CMS server, for exercising the SDK's sync protocol offline.
+
+Usage: mockserver.py [--port 8765] [--files 10000] [--commits 0] [--churn 0.01] ...
+
+The server generates a synthetic repository of pages, images, assets and templates, and serves
+the parts of the CMS API used by LOCMSOperationProtocol under a repository base path (by default
+/cms/0.2/bench/site, i.e. an SDK ref of http://localhost:8765/cms/0.2/bench/site):
+
+- GET  {base}/updates.api                   The updates feed; supports 'since', 'group' and If-None-Match.
+- POST {base}/updates.api                   A reset feed, for a client visible set ('cvs').
+- GET  {base}/filesets.api/{category}       A fileset zip; supports 'since' and Range requests.
+- POST {base}/filesets.api/{category}       A fileset reset zip, for a client visible set.
+- GET  {base}/notifications.api             Long-poll for a commit after 'since' or a change of 'group'.
+- GET  {base}/{path}                        A file download; supports If-None-Match.
+
+A refresh which sends an ACM group different from the server's current group receives a 205
+response, which causes the client to reset; all API requests receive a 401 response whilst the
+server requires credentials the request doesn't have. Client visible sets are accepted in both
+the compact (cvsformat=lcv1) and JSON formats. Updates feeds are JSON encoded, or msgpack encoded
+if the client accepts it and the msgpack module is installed. Each feed has an entity tag, and a
+conditional request for an unchanged feed receives a 304 response. A notification request is held
+open until the server's latest commit differs from 'since' or its ACM group differs from 'group',
+when it receives a 200 response with the latest commit; or until 'timeout' seconds have passed,
+when it receives a 204 response.
+
+The repository and server behaviour are controlled through endpoints under /_mock:
+
+- /_mock/status                             Describe the repository.
+- /_mock/commit?churn=0.01&count=1          Add commits which modify, add and delete files.
+- /_mock/group?name=g2                      Change the current ACM group.
+- /_mock/auth?username=u&password=p         Require credentials; pass no username to clear.
+- /_mock/stats?reset=1                      Return request, row and byte counts; optionally reset them.
+
+File content is generated from each file's ID and version, so only file metadata is held for each
+file. The full updates feed is built at startup (for 100k files, this takes around 30s) and the
+most recently requested feeds are kept in memory; fileset zips are built on demand and kept in a
+cache directory, so that repeated and resumed downloads are served from disk.
+"""
+
+import argparse
+import base64
+import collections
+import datetime
+import gzip
+import hashlib
+import json
+import os
+import random
+import shutil
+import sys
+import tempfile
+import threading
+import time
+import urllib.parse
+import zipfile
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+try:
+    import msgpack
+except ImportError:
+    msgpack = None
+
+# The proportion of generated files in each fileset category.
+CATEGORY_WEIGHTS = (('pages', 0.6), ('images', 0.3), ('assets', 0.1))
+# The proportion of churned files which are modified, added and deleted.
+CHURN_MIX = (('modify', 0.7), ('add', 0.15), ('delete', 0.15))
+# The number of encoded updates feeds kept in memory.
+FEED_CACHE_SIZE = 4
+# The longest time a notification request is held open for, in seconds.
+MAX_NOTIFICATION_TIMEOUT = 300
+# The fingerprint of each fileset definition; fixed, as fileset definitions don't change.
+FILESET_FINGERPRINT = 'fs1'
+# Page types, each with a page template.
+PAGE_TYPES = ('article', 'news', 'event')
+# A vocabulary for generated text; frequency is skewed towards the start of the list.
+STEMS = ('content', 'mobile', 'update', 'release', 'design', 'server', 'network',
+         'archive', 'journal', 'feature', 'report', 'summary', 'history', 'market')
+WORDS = ['%s%d' % (STEMS[i % len(STEMS)], i // len(STEMS)) for i in range(2000)]
+
+PAGE_TEMPLATE = ('<html><head><title>{{title}}</title></head><body><article><h1>{{title}}</h1>'
+                 '<img src="{{image}}">{{{content}}}</article></body></html>')
+
+
+def commit_id(index):
+    return 'c%06d' % index
+
+
+def read_varint(data, offset):
+    """Read an unsigned LEB128 value; returns the value and the offset following it."""
+    value = shift = 0
+    while True:
+        b = data[offset]
+        offset += 1
+        value |= (b & 0x7f) << shift
+        if not b & 0x80:
+            return value, offset
+        shift += 7
+
+
+def decode_compact_cvs(encoded):
+    """Decode a compact client visible set (see LOCMSClientVisibleSet.h) to a map of file IDs to versions."""
+    data = zlib.decompress(base64.b64decode(encoded))
+    if data[:4] != b'LCV1':
+        raise ValueError('Bad compact CVS header')
+    cvs, versions, file_id, offset = {}, [], b'', 4
+    while offset < len(data):
+        shared, offset = read_varint(data, offset)
+        length, offset = read_varint(data, offset)
+        file_id = file_id[:shared] + data[offset:offset + length]
+        offset += length
+        ref, offset = read_varint(data, offset)
+        if ref == 0:
+            length, offset = read_varint(data, offset)
+            versions.append(data[offset:offset + length].decode('utf-8'))
+            offset += length
+            version = versions[-1]
+        else:
+            version = versions[ref - 1]
+        cvs[file_id.decode('utf-8')] = version
+    return cvs
+
+
+class File(object):
+    """A file's metadata. The file's content is generated from its ID and version."""
+
+    __slots__ = ('id', 'path', 'category', 'status', 'version')
+
+    def __init__(self, file_id, path, category, version):
+        self.id = file_id
+        self.path = path
+        self.category = category
+        self.status = 'published'
+        self.version = version
+
+    @property
+    def live(self):
+        return self.status != 'deleted'
+
+    def rng(self):
+        return random.Random('%s:%d' % (self.id, self.version))
+
+
+class Repository(object):
+    """A synthetic content repository, with a history of commits."""
+
+    def __init__(self, seed=1, image_size=8192, asset_size=2048, group='g1'):
+        self.lock = threading.RLock()
+        self.random = random.Random(seed)
+        self.image_size = image_size
+        self.asset_size = asset_size
+        self.group = group
+        self.files = {}
+        self.paths = {}
+        self.commits = []
+        self.counts = {}
+        self.next_file = 0
+        # The index of the latest commit to change each category.
+        self.category_heads = {}
+
+    @property
+    def head(self):
+        return len(self.commits)
+
+    def add_commit(self, subject):
+        date = datetime.datetime(2018, 1, 1) + datetime.timedelta(minutes=len(self.commits))
+        self.commits.append({'id': commit_id(len(self.commits) + 1), 'date': date.isoformat() + 'Z', 'subject': subject})
+        return self.head
+
+    def choose(self, weights):
+        r = self.random.random()
+        for name, weight in weights:
+            r -= weight
+            if r < 0:
+                return name
+        return weights[-1][0]
+
+    def new_file(self, category, version):
+        i = self.next_file
+        self.next_file += 1
+        file_id = 'f%07d' % i
+        if category == 'pages':
+            path = 'section-%02d/topic-%03d/page-%07d.html' % (i % 20, i % 400, i)
+        elif category == 'images':
+            path = 'images/%02d/image-%07d.jpg' % (i % 50, i)
+        else:
+            path = 'assets/asset-%07d.css' % i
+        return self.put_file(File(file_id, path, category, version))
+
+    def put_file(self, f):
+        self.files[f.id] = f
+        self.paths[f.path] = f
+        self.counts[f.category] = self.counts.get(f.category, 0) + 1
+        self.category_heads[f.category] = f.version
+        return f
+
+    def generate(self, file_count):
+        """Generate the repository's initial content, as a single commit."""
+        with self.lock:
+            version = self.add_commit('Initial content')
+            self.put_file(File('t0000000', 'templates/page.html', 'templates', version))
+            for n, page_type in enumerate(PAGE_TYPES):
+                self.put_file(File('t%07d' % (n + 1), 'templates/page-%s.html' % page_type, 'templates', version))
+            for _ in range(file_count):
+                self.new_file(self.choose(CATEGORY_WEIGHTS), version)
+
+    def commit(self, churn):
+        """Add a commit which modifies, adds and deletes a proportion of the repository's files."""
+        with self.lock:
+            version = self.add_commit('Update %d' % (self.head + 1))
+            live = [f for f in self.files.values() if f.live and f.category != 'templates']
+            changes = {'modify': 0, 'add': 0, 'delete': 0}
+            for _ in range(max(1, int(round(churn * len(live))))):
+                change = self.choose(CHURN_MIX)
+                if change == 'add' or not live:
+                    self.new_file(self.choose(CATEGORY_WEIGHTS), version)
+                    change = 'add'
+                else:
+                    f = live.pop(self.random.randrange(len(live)))
+                    f.version = version
+                    if change == 'delete':
+                        f.status = 'deleted'
+                    self.category_heads[f.category] = version
+                changes[change] += 1
+            return changes
+
+    def commit_index(self, since):
+        """Return the index of a commit ID; unknown IDs (e.g. from a different server) index 0."""
+        if since and since.startswith('c'):
+            try:
+                index = int(since[1:])
+                if 0 < index <= self.head:
+                    return index
+            except ValueError:
+                pass
+        return 0
+
+    # Content generation.
+
+    def text(self, rng, length):
+        return ' '.join(WORDS[int(rng.random() ** 3 * len(WORDS))] for _ in range(length))
+
+    def image_path(self, rng):
+        image_count = max(self.counts.get('images', 0), 1)
+        i = rng.randrange(image_count * 2)
+        return 'images/%02d/image-%07d.jpg' % (i % 50, i)
+
+    def page_row(self, f):
+        rng = f.rng()
+        sections = []
+        for _ in range(3 + rng.randrange(4)):
+            sections.append('<h2>%s</h2><p>%s <a href="page-%07d.html">%s</a> %s.</p><p><img src="/%s" alt="%s"></p>' % (
+                self.text(rng, 4), self.text(rng, 40), rng.randrange(self.next_file), self.text(rng, 3),
+                self.text(rng, 30), self.image_path(rng), self.text(rng, 5)))
+        return {
+            'id':       f.id,
+            'type':     PAGE_TYPES[int(f.id[1:]) % len(PAGE_TYPES)],
+            'title':    self.text(rng, 6),
+            'sort':     f.id,
+            'content':  ''.join(sections),
+            'image':    '/' + self.image_path(rng),
+            'version':  commit_id(f.version)
+        }
+
+    def meta_rows(self, f):
+        if f.category == 'pages':
+            keys = (('author', 2), ('tags', 3), ('summary', 20))
+        elif f.category == 'images':
+            keys = (('caption', 8), ('credit', 2))
+        else:
+            return []
+        rng = f.rng()
+        return [{'fileid': f.id, 'key': key, 'value': self.text(rng, length), 'version': commit_id(f.version)}
+                for key, length in keys]
+
+    def file_content(self, f):
+        if f.category == 'templates':
+            return PAGE_TEMPLATE.encode('utf-8')
+        rng = f.rng()
+        if f.category == 'assets':
+            rules = []
+            while sum(len(r) for r in rules) < self.asset_size:
+                rules.append('.%s { margin: %dpx; color: #%06x; }\n' % (self.text(rng, 1), rng.randrange(32), rng.randrange(1 << 24)))
+            return ''.join(rules).encode('utf-8')
+        if f.category == 'images':
+            size = max(64, int(self.image_size * (0.5 + rng.random())))
+            return rng.randbytes(size)
+        return ('<html>%s</html>' % self.page_row(f)['content']).encode('utf-8')
+
+    # Feeds.
+
+    def feed_for_files(self, files, commits):
+        """Return an updates feed document for a list of files, and its row count."""
+        db = {'files': [], 'pages': [], 'meta': []}
+        for f in sorted(files, key=lambda f: f.id):
+            db['files'].append({'id': f.id, 'path': f.path, 'category': f.category,
+                                'status': f.status, 'version': commit_id(f.version)})
+            if f.live:
+                if f.category == 'pages':
+                    db['pages'].append(self.page_row(f))
+                db['meta'].extend(self.meta_rows(f))
+        db['commits'] = commits
+        db['fingerprints'] = [{'category': category, 'fingerprint': FILESET_FINGERPRINT, 'latest': commit_id(head)}
+                              for category, head in sorted(self.category_heads.items())]
+        db['fingerprints'].append({'category': '$group', 'current': self.group})
+        rows = sum(len(table) for table in db.values())
+        return {'db': db}, rows
+
+    def updates_since(self, since):
+        """Return the updates feed for a client at a commit; or the full feed if since is 0."""
+        with self.lock:
+            if since == 0:
+                files = [f for f in self.files.values() if f.live]
+            else:
+                files = [f for f in self.files.values() if f.version > since]
+            return self.feed_for_files(files, self.commits[since:])
+
+    def updates_for_cvs(self, cvs):
+        """Return the feed needed to bring a client with a client visible set up to date."""
+        with self.lock:
+            files = [f for f in self.files.values()
+                     if (f.live and cvs.get(f.id) != commit_id(f.version)) or (not f.live and f.id in cvs)]
+            return self.feed_for_files(files, self.commits)
+
+    def fileset_since(self, category, since):
+        with self.lock:
+            return [f for f in self.files.values() if f.category == category and f.live and f.version > since]
+
+    def fileset_for_cvs(self, category, cvs):
+        with self.lock:
+            return [f for f in self.files.values()
+                    if f.category == category and f.live and cvs.get(f.id) != commit_id(f.version)]
+
+    def write_zip(self, files, path):
+        with zipfile.ZipFile(path, 'w') as z:
+            for f in sorted(files, key=lambda f: f.path):
+                # Images are already compressed, so are stored; other files are deflated.
+                compression = zipfile.ZIP_STORED if f.category == 'images' else zipfile.ZIP_DEFLATED
+                z.writestr(zipfile.ZipInfo(f.path, date_time=(2018, 1, 1, 0, 0, 0)), self.file_content(f), compression)
+
+    def status(self):
+        with self.lock:
+            live = [f for f in self.files.values() if f.live]
+            categories = {}
+            for f in live:
+                categories[f.category] = categories.get(f.category, 0) + 1
+            return {'files': len(live), 'deleted': len(self.files) - len(live), 'categories': categories,
+                    'commits': self.head, 'head': commit_id(self.head), 'group': self.group}
+
+
+class Stats(object):
+    """Counts of requests, and of the rows and bytes served."""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.reset()
+
+    def reset(self):
+        self.values = {'requests': {}, 'statusCodes': {}, 'rows': 0, 'bytes': 0}
+
+    def record(self, kind, status, rows=0, size=0):
+        with self.lock:
+            requests, codes = self.values['requests'], self.values['statusCodes']
+            requests[kind] = requests.get(kind, 0) + 1
+            codes[str(status)] = codes.get(str(status), 0) + 1
+            self.values['rows'] += rows
+            self.values['bytes'] += size
+
+    def snapshot(self, reset=False):
+        with self.lock:
+            values = json.loads(json.dumps(self.values))
+            if reset:
+                self.reset()
+            return values
+
+
+class MockServer(ThreadingHTTPServer):
+
+    daemon_threads = True
+
+    def __init__(self, address, repository, options):
+        ThreadingHTTPServer.__init__(self, address, RequestHandler)
+        self.repository = repository
+        self.options = options
+        self.stats = Stats()
+        self.base_path = '/' + options.base_path.strip('/') + '/'
+        self.credentials = None
+        if options.username:
+            self.set_credentials(options.username, options.password)
+        self.zip_cache = options.cache_dir or tempfile.mkdtemp(prefix='locomote-mock-')
+        os.makedirs(self.zip_cache, exist_ok=True)
+        self.zip_lock = threading.Lock()
+        self.feed_cache = collections.OrderedDict()
+        self.feed_lock = threading.Lock()
+        # Notified when a commit is added or the ACM group changes.
+        self.changed = threading.Condition()
+
+    def notify_changed(self):
+        with self.changed:
+            self.changed.notify_all()
+
+    def set_credentials(self, username, password):
+        if username:
+            token = base64.b64encode(('%s:%s' % (username, password or '')).encode('utf-8')).decode('ascii')
+            self.credentials = 'Basic ' + token
+        else:
+            self.credentials = None
+
+    def encode_feed(self, feed, use_msgpack, use_gzip):
+        if use_msgpack:
+            data, mime_type = msgpack.packb(feed, use_bin_type=True), 'application/msgpack'
+        else:
+            data, mime_type = json.dumps(feed, separators=(',', ':')).encode('utf-8'), 'application/json'
+        if use_gzip:
+            data = gzip.compress(data, 6)
+        return data, mime_type
+
+    def cached_updates_feed(self, since, use_msgpack, use_gzip):
+        """Return the encoded updates feed since a commit, its MIME type, row count and entity tag."""
+        repository = self.repository
+        with self.feed_lock:
+            key = (since, repository.head, repository.group, use_msgpack, use_gzip)
+            if key in self.feed_cache:
+                self.feed_cache.move_to_end(key)
+            else:
+                feed, rows = repository.updates_since(since)
+                etag = '"%s"' % hashlib.md5(repr(key).encode('utf-8')).hexdigest()
+                self.feed_cache[key] = self.encode_feed(feed, use_msgpack, use_gzip) + (rows, etag)
+                while len(self.feed_cache) > FEED_CACHE_SIZE:
+                    self.feed_cache.popitem(last=False)
+            return self.feed_cache[key]
+
+    def cached_fileset_zip(self, category, since):
+        """Return the path of the zip of a category's changes since a commit, building it if necessary."""
+        repository = self.repository
+        with self.zip_lock:
+            head = repository.category_heads.get(category, 0)
+            path = os.path.join(self.zip_cache, '%s-%d-%d.zip' % (category, since, head))
+            if not os.path.exists(path):
+                files = repository.fileset_since(category, since)
+                if not files:
+                    return None
+                repository.write_zip(files, path + '.tmp')
+                os.rename(path + '.tmp', path)
+            return path
+
+
+class RequestHandler(BaseHTTPRequestHandler):
+
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, format, *args):
+        if self.server.options.verbose:
+            BaseHTTPRequestHandler.log_message(self, format, *args)
+
+    def do_GET(self):
+        self.handle_request()
+
+    def do_POST(self):
+        self.handle_request()
+
+    def handle_request(self):
+        url = urllib.parse.urlsplit(self.path)
+        params = dict(urllib.parse.parse_qsl(url.query))
+        length = int(self.headers.get('Content-Length') or 0)
+        if length:
+            body = self.rfile.read(length).decode('utf-8')
+            if 'json' in (self.headers.get('Content-Type') or ''):
+                params.update(json.loads(body))
+            else:
+                params.update(urllib.parse.parse_qsl(body))
+        path = urllib.parse.unquote(url.path)
+        if path.startswith('/_mock/'):
+            return self.handle_control(path[len('/_mock/'):], params)
+        if self.server.options.latency:
+            time.sleep(self.server.options.latency / 1000.0)
+        base_path = self.server.base_path
+        if not path.startswith(base_path):
+            return self.respond('other', 404)
+        path = path[len(base_path):]
+        credentials = self.server.credentials
+        if credentials and self.headers.get('Authorization') != credentials:
+            realm = 'Locomote' + base_path
+            return self.respond('unauthorized', 401, headers={'WWW-Authenticate': 'Basic realm="%s"' % realm})
+        if path == 'updates.api':
+            return self.handle_updates(params)
+        if path == 'notifications.api':
+            return self.handle_notifications(params)
+        if path.startswith('filesets.api/'):
+            return self.handle_fileset(path[len('filesets.api/'):], params)
+        return self.handle_file(path)
+
+    def handle_updates(self, params):
+        repository = self.server.repository
+        if self.command == 'POST':
+            cvs = self.read_cvs(params)
+            if cvs is None:
+                return self.respond('reset', 400)
+            feed, rows = repository.updates_for_cvs(cvs)
+            data, mime_type = self.server.encode_feed(feed, self.accepts_msgpack(), self.accepts_gzip())
+            return self.respond_with_feed('reset', data, mime_type, rows)
+        group = params.get('group')
+        if group and group != repository.group:
+            # ACM group mismatch; the client should reset.
+            return self.respond('updates', 205)
+        since = repository.commit_index(params.get('since'))
+        data, mime_type, rows, etag = self.server.cached_updates_feed(since, self.accepts_msgpack(), self.accepts_gzip())
+        if self.headers.get('If-None-Match') == etag:
+            return self.respond('updates', 304, headers={'ETag': etag})
+        return self.respond_with_feed('updates', data, mime_type, rows, etag)
+
+    def handle_notifications(self, params):
+        repository, server = self.server.repository, self.server
+        since, group = params.get('since'), params.get('group')
+        try:
+            timeout = min(max(float(params.get('timeout', 30)), 0), MAX_NOTIFICATION_TIMEOUT)
+        except ValueError:
+            return self.respond('notifications', 400)
+        latest = lambda: commit_id(repository.head)
+        is_changed = lambda: latest() != since or (group is not None and group != repository.group)
+        with server.changed:
+            changed = server.changed.wait_for(is_changed, timeout)
+        if not changed:
+            return self.respond('notifications', 204)
+        data = json.dumps({'commit': latest(), 'group': repository.group}).encode('utf-8')
+        return self.respond('notifications', 200, data, 'application/json')
+
+    def handle_fileset(self, category, params):
+        repository = self.server.repository
+        if category not in repository.category_heads:
+            return self.respond('fileset', 404)
+        if self.command == 'POST':
+            cvs = self.read_cvs(params)
+            if cvs is None:
+                return self.respond('filesetReset', 400)
+            files = repository.fileset_for_cvs(category, cvs)
+            if not files:
+                return self.respond('filesetReset', 204)
+            handle, path = tempfile.mkstemp(suffix='.zip', dir=self.server.zip_cache)
+            os.close(handle)
+            try:
+                repository.write_zip(files, path)
+                return self.respond_with_file('filesetReset', path, 'application/zip')
+            finally:
+                os.unlink(path)
+        path = self.server.cached_fileset_zip(category, repository.commit_index(params.get('since')))
+        if not path:
+            return self.respond('fileset', 204)
+        return self.respond_with_file('fileset', path, 'application/zip', ranges=True)
+
+    def handle_file(self, path):
+        f = self.server.repository.paths.get(path)
+        if not f or not f.live:
+            return self.respond('file', 404)
+        # File content is generated from the file's ID and version, so these also identify the content.
+        etag = '"%s"' % hashlib.md5(('%s:%s' % (f.id, f.version)).encode('utf-8')).hexdigest()
+        if self.headers.get('If-None-Match') == etag:
+            return self.respond('file', 304, headers={'ETag': etag})
+        content = self.server.repository.file_content(f)
+        mime_type = {'pages': 'text/html', 'images': 'image/jpeg', 'assets': 'text/css', 'templates': 'text/html'}
+        return self.respond('file', 200, content, mime_type[f.category], headers={'ETag': etag})
+
+    def handle_control(self, command, params):
+        repository, server = self.server.repository, self.server
+        if command == 'status':
+            result = repository.status()
+        elif command == 'commit':
+            churn = float(params.get('churn', server.options.churn))
+            changes = {'modify': 0, 'add': 0, 'delete': 0}
+            for _ in range(int(params.get('count', 1))):
+                for change, count in repository.commit(churn).items():
+                    changes[change] += count
+            server.notify_changed()
+            result = dict(repository.status(), changes=changes)
+        elif command == 'group':
+            with repository.lock:
+                repository.group = params.get('name') or 'g%d' % (repository.head + 1)
+            server.notify_changed()
+            result = repository.status()
+        elif command == 'auth':
+            server.set_credentials(params.get('username'), params.get('password'))
+            result = {'required': server.credentials is not None}
+        elif command == 'stats':
+            result = server.stats.snapshot(reset=params.get('reset') in ('1', 'true'))
+        else:
+            return self.respond('control', 404)
+        data = json.dumps(result).encode('utf-8')
+        self.send_response(200)
+        self.send_header('Content-Type', 'application/json')
+        self.send_header('Content-Length', str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def read_cvs(self, params):
+        cvs = params.get('cvs')
+        if cvs is None:
+            return None
+        try:
+            if params.get('cvsformat') == 'lcv1':
+                return decode_compact_cvs(cvs)
+            return json.loads(cvs)
+        except (ValueError, IndexError, zlib.error):
+            return None
+
+    def accepts_msgpack(self):
+        return msgpack is not None and 'application/msgpack' in (self.headers.get('Accept') or '')
+
+    def accepts_gzip(self):
+        return not self.server.options.no_gzip and 'gzip' in (self.headers.get('Accept-Encoding') or '')
+
+    def respond_with_feed(self, kind, data, mime_type, rows, etag=None):
+        headers = {'Content-Encoding': 'gzip'} if self.accepts_gzip() else {}
+        if etag:
+            headers['ETag'] = etag
+        self.respond(kind, 200, data, mime_type, headers=headers, rows=rows)
+
+    def respond_with_file(self, kind, path, mime_type, ranges=False):
+        size = os.path.getsize(path)
+        etag = '"%s"' % hashlib.md5(os.path.basename(path).encode('utf-8')).hexdigest()
+        start, status, headers = 0, 200, {'ETag': etag}
+        if ranges:
+            headers['Accept-Ranges'] = 'bytes'
+            range_header = self.headers.get('Range') or ''
+            if_range = self.headers.get('If-Range')
+            if range_header.startswith('bytes=') and (if_range is None or if_range == etag):
+                first = range_header[len('bytes='):].split('-')[0]
+                if first.isdigit():
+                    start = int(first)
+                    if start >= size:
+                        headers['Content-Range'] = 'bytes */%d' % size
+                        return self.respond(kind, 416, headers=headers)
+                    status = 206
+                    headers['Content-Range'] = 'bytes %d-%d/%d' % (start, size - 1, size)
+        self.send_response(status)
+        self.send_header('Content-Type', mime_type)
+        self.send_header('Content-Length', str(size - start))
+        for name, value in headers.items():
+            self.send_header(name, value)
+        self.end_headers()
+        with open(path, 'rb') as f:
+            f.seek(start)
+            shutil.copyfileobj(f, self.wfile)
+        self.server.stats.record(kind, status, size=size - start)
+
+    def respond(self, kind, status, data=b'', mime_type='text/plain', headers=None, rows=0):
+        self.send_response(status)
+        if data:
+            self.send_header('Content-Type', mime_type)
+        self.send_header('Content-Length', str(len(data)))
+        for name, value in (headers or {}).items():
+            self.send_header(name, value)
+        self.end_headers()
+        if data:
+            self.wfile.write(data)
+        self.server.stats.record(kind, status, rows=rows, size=len(data))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='A local mock Locomote CMS server.')
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=8765)
+    parser.add_argument('--base-path', default='/cms/0.2/bench/site', help='The repository base path.')
+    parser.add_argument('--files', type=int, default=10000, help='The number of files to generate.')
+    parser.add_argument('--commits', type=int, default=0, help='The number of commits to add after the initial content.')
+    parser.add_argument('--churn', type=float, default=0.01, help='The proportion of files changed by each commit.')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--image-size', type=int, default=8192, help='The average size of image files, in bytes.')
+    parser.add_argument('--asset-size', type=int, default=2048, help='The size of asset files, in bytes.')
+    parser.add_argument('--group', default='g1', help='The initial ACM group.')
+    parser.add_argument('--username', help='Require requests to authenticate with this username.')
+    parser.add_argument('--password', default='')
+    parser.add_argument('--latency', type=float, default=0, help='Delay added to each API request, in ms.')
+    parser.add_argument('--no-gzip', action='store_true', help="Don't gzip updates feeds.")
+    parser.add_argument('--cache-dir', help='The directory fileset zips are cached in.')
+    parser.add_argument('--verbose', action='store_true', help='Log requests.')
+    options = parser.parse_args()
+
+    start = time.time()
+    repository = Repository(options.seed, options.image_size, options.asset_size, options.group)
+    repository.generate(options.files)
+    for _ in range(options.commits):
+        repository.commit(options.churn)
+    server = MockServer((options.host, options.port), repository, options)
+    # Build the full updates feed, as requested by the SDK's first sync, so that generating it
+    # isn't included in the sync time.
+    server.cached_updates_feed(0, msgpack is not None, not options.no_gzip)
+    sys.stderr.write('Generated %d files in %.1fs; serving http://%s:%d%s\n' % (
+        options.files, time.time() - start, options.host, options.port, server.base_path))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if not options.cache_dir:
+            shutil.rmtree(server.zip_cache, ignore_errors=True)
+
+
+if __name__ == '__main__':
+    main()